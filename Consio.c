@@ -11,127 +11,249 @@
 #include <windows.h>
 #include <conio.h>
 #include <string.h>
+#include <math.h>
 #include "Consio.h"
+#include "ConsioDecls.h"
+#include "ConsioWidth.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CONSIO_SSE2
+#endif
 
 static HANDLE hStdin;
 static HANDLE hStdout;
 
+/* Session recording and replay state */
+
+static Tcl_Channel recChannel = NULL;
+static DWORD recStart;
+static Tcl_Obj *replayObj = NULL;
+static int replayPos;
+static int replayFast;
+static DWORD replayStart;
+
+/* Line editor history and kill buffer */
+
+static Tcl_Obj *historyObj = NULL;
+static int historyLimit = HISTORY_DEFAULT_LIMIT;
+static Tcl_Obj *killObj = NULL;
+
+/* Pager command counter and memory mapping granularity */
+
+static int pagerCounter = 0;
+static DWORD mapGranularity = 0;
+
+/* Table command counter */
+
+static int tableCounter = 0;
+
+/* Shared-memory screen export */
+
+static HANDLE exportFile = NULL;
+static HANDLE exportMapping = NULL;
+static ExportHeader *exportView = NULL;
+static CHAR_INFO *exportBuffer = NULL;
+static int exportPending = 0;
+
+/* Terminal capabilities, determined on first use */
+
+static Tcl_Obj *capsObj = NULL;
+
+/* Paste buffer and bracketed paste mode */
+
+static Tcl_UniChar *pasteText = NULL;
+static int pasteLen = 0;
+static int pasteCap = 0;
+static int pasteBracketed = 0;
+
+/* Pasted text still to be returned key by key by Consio_ReadKey */
+
+static Tcl_UniChar *keyText = NULL;
+static int keyLen = 0;
+static int keyPos = 0;
+static int keyCap = 0;
+
+/* Default console palette and nearest color table used by Consio::image */
+
+static const unsigned char imagePalette[16][3] = {
+    {  0,   0,   0}, {  0,   0, 128}, {  0, 128,   0}, {  0, 128, 128},
+    {128,   0,   0}, {128,   0, 128}, {128, 128,   0}, {192, 192, 192},
+    {128, 128, 128}, {  0,   0, 255}, {  0, 255,   0}, {  0, 255, 255},
+    {255,   0,   0}, {255,   0, 255}, {255, 255,   0}, {255, 255, 255}
+};
+static unsigned char *imageNearest = NULL;
+
+/* Canvas command counter */
+
+static int canvasCounter = 0;
+
+/* Scrollback store */
+
+static ScrollBlock **scrollBlocks = NULL;
+static int scrollBlockCount = 0;
+static int scrollBlockCap = 0;
+static int scrollSkip = 0;
+static int scrollLines = 0;
+static int scrollLimit = SCROLL_DEFAULT_LIMIT;
+static WORD scrollStyles[SCROLL_STYLES_MAX];
+static int scrollStyleCount = 0;
+static unsigned char *scrollCache = NULL;
+static int scrollCacheSize = 0;
+static ScrollBlock *scrollCacheBlock = NULL;
+
+/* Screen buffers, screens[0] being the standard output buffer */
+
+static HANDLE screens[SCREEN_MAX];
+static int screenActive = 0;
+static int screenTarget = 0;
+
+/* Escape sequence encoder */
+
+static Encoder *encoder = NULL;
+
+/* Set when Consio writes to the console, for Consio::waitfor */
+
+static int findDirty = 0;
+
+/* Terminals opened with Consio::open, and the state of the console while
+   one of them is current */
+
+static Terminal *terminal = NULL;
+static Terminal terminalConsole;
+static int terminalCounter = 0;
+
+/* Template command counter */
+
+static int templateCounter = 0;
+
+/* Handler of Consio::onresize, and the window size it last reported and
+   last saw */
+
+static Tcl_Obj *resizeScript = NULL;
+static Tcl_Interp *resizeInterp = NULL;
+static Tcl_TimerToken resizePoll = NULL;
+static Tcl_TimerToken resizeDebounce = NULL;
+static SMALL_RECT resizeWindow;
+static int resizeSeenWidth = 0;
+static int resizeSeenHeight = 0;
+
+#ifdef CONSIO_NRE
+
+/* Coroutines waiting for input, and the thread watching the input */
+
+static InputWaiter *inputWaiters = NULL;
+static HANDLE inputArm = NULL;
+static Tcl_ThreadId inputThread;
+static DWORD inputMode;
+static int inputModeSaved = 0;
+
+/* Terminal commands running, innermost first */
+
+static TerminalFrame *terminalFrames = NULL;
+
+#endif /*CONSIO_NRE*/
+
 /*****************************************************************************
- * Consio_Init
+ * console_clear
  *
  * Description:
  *
- *   This function initializes all commands provided by Consio package.
+ *   Fills the whole console buffer with spaces using the currently active
+ *   text attributes and moves the cursor to the upper left corner. This is
+ *   shared by Consio::clrscr and the session replay.
  *
  * Parameters:
  *
- *   None.
+ *   handle - console output handle
  *
  * Results:
  *
- *   TCL_OK    - initialization was successful
- *   TCL_ERROR - an error message if the initialization procedure was not able
- *               to get console input and output handles
+ *   None.
  *
  * Side effects:
- *   Creates a set of new commands for Tcl interpreter under Consio namespace.
+ *
+ *   Clears the console buffer.
  *****************************************************************************/
 
-int Consio_Init(Tcl_Interp *interp) {
-    Tcl_Obj *obj_str;
-    char *error_message_text = "Can't get standard input or output handle.";
-
-#ifdef USE_TCL_STUBS
-    if (Tcl_InitStubs(interp, TCLVERSION, 0) == NULL) {
-        return TCL_ERROR;
-    }
-#endif /*USE_TCL_STUBS*/
-
-    Tcl_CreateObjCommand(interp, "Consio::about", cmd_about, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::clrscr", cmd_clrscr, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::gotoxy", cmd_gotoxy, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::wherex", cmd_wherex, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::wherey", cmd_wherey, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::bufferwidth", cmd_bufferwidth, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::bufferheight", cmd_bufferheight, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::getch", cmd_getch, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::getche", cmd_getche, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::putch", cmd_putch, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::kbhit", cmd_kbhit, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::textattr", cmd_textattr, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::cputs", cmd_cputs, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::cgets", cmd_cgets, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::cgetse", cmd_cgetse, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::getchex", cmd_getchex, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::getkeystate", cmd_getkeystate, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "Consio::getch2", cmd_getch2, NULL, NULL);
-
-    hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
-
-    if (hStdin == INVALID_HANDLE_VALUE || hStdout == INVALID_HANDLE_VALUE) {
-        obj_str = Tcl_NewStringObj(error_message_text,
-                                   strlen(error_message_text));
-        Tcl_SetObjResult(interp, obj_str);
-        return TCL_ERROR;
-    }
+static void console_clear(HANDLE handle) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    COORD home = {0, 0};
+    DWORD bufsize;
+    DWORD num;
 
-    return TCL_OK;
+    GetConsoleScreenBufferInfo(handle, &info);
+    bufsize = info.dwSize.X * info.dwSize.Y;
+    FillConsoleOutputCharacter(handle, (TCHAR) ' ', bufsize, home, &num);
+    GetConsoleScreenBufferInfo(handle, &info);
+    FillConsoleOutputAttribute(handle, info.wAttributes, bufsize, home, &num);
+    SetConsoleCursorPosition(handle, home);
 }
 
 /*****************************************************************************
- * Consio::about
+ * record_event
  *
  * Description:
  *
- *   Returns information about the author and the library version.
- *
- * This command calls the following Windows API functions:
- *
- *   None.
+ *   Appends a single event to the session recording, if a recording is
+ *   active. Output events (the upper case record types) also schedule an
+ *   update of the shared-memory screen export. Each record consists of a
+ *   32-bit timestamp (milliseconds since the recording was started), a
+ *   record type byte, a 32-bit payload length and the payload itself. All
+ *   integers are stored in little-endian byte order. The records are
+ *   written through a Tcl channel with full buffering, so recording does
+ *   not cause a system call per event.
  *
  * Parameters:
  *
- *   None.
+ *   type - record type (one of the REC_* constants)
+ *   data - payload
+ *   len  - payload length in bytes
  *
  * Results:
  *
- *   Returns a string of information.
+ *   None.
  *
  * Side effects:
  *
- *   None.
+ *   Writes to the recording channel.
  *****************************************************************************/
 
-static int cmd_about(ClientData clientData,
-                     Tcl_Interp *interp,
-                     int objc,
-                     Tcl_Obj * CONST objv[]) {
-    Tcl_Obj *obj_str;
+static void record_event(int type, const void *data, int len) {
+    unsigned char header[REC_HEADER_LEN];
+    DWORD t;
 
-    obj_str = Tcl_NewStringObj(ABOUT_STRING, strlen(ABOUT_STRING));
-    Tcl_SetObjResult(interp, obj_str);
+    if (type >= 'A' && type <= 'Z') export_touch();
+    if (recChannel == NULL) return;
 
-    return TCL_OK;
+    t = GetTickCount() - recStart;
+    header[0] = (unsigned char) (t & 0xFF);
+    header[1] = (unsigned char) ((t >> 8) & 0xFF);
+    header[2] = (unsigned char) ((t >> 16) & 0xFF);
+    header[3] = (unsigned char) ((t >> 24) & 0xFF);
+    header[4] = (unsigned char) type;
+    header[5] = (unsigned char) (len & 0xFF);
+    header[6] = (unsigned char) ((len >> 8) & 0xFF);
+    header[7] = (unsigned char) ((len >> 16) & 0xFF);
+    header[8] = (unsigned char) ((len >> 24) & 0xFF);
+
+    Tcl_Write(recChannel, (const char *) header, REC_HEADER_LEN);
+    if (len > 0) Tcl_Write(recChannel, (const char *) data, len);
 }
 
 /*****************************************************************************
- * Consio::clrscr
+ * record_int
  *
  * Description:
  *
- *   Clears the console using the currently active text attributes.
- *
- * This command calls the following Windows API functions:
- *
- *   - GetConsoleScreenBufferInfo
- *   - FillConsoleOutputCharacter
- *   - FillConsoleOutputAttribute
- *   - SetConsoleCursorPosition
+ *   Appends an event with a single 32-bit integer payload to the session
+ *   recording, or only updates the screen export (see record_event) if
+ *   no recording is active.
  *
  * Parameters:
  *
- *   None.
+ *   type  - record type (one of the REC_* constants)
+ *   value - integer payload
  *
  * Results:
  *
@@ -139,46 +261,32 @@ static int cmd_about(ClientData clientData,
  *
  * Side effects:
  *
- *   Clears screen i.e. fills console buffer with space character (' ') using
- *   currently selected text attributes (for more information about attributes,
- *   see cmd_textattr function).
+ *   Writes to the recording channel.
  *****************************************************************************/
 
-static int cmd_clrscr(ClientData clientData,
-                      Tcl_Interp *interp,
-                      int objc,
-                      Tcl_Obj * CONST objv[]) {
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    COORD home = {0, 0};
-    DWORD bufsize;
-    DWORD num;
-
-    GetConsoleScreenBufferInfo(hStdout, &info);
-    bufsize = info.dwSize.X * info.dwSize.Y;
-    FillConsoleOutputCharacter(hStdout, (TCHAR) ' ', bufsize, home, &num);
-    GetConsoleScreenBufferInfo(hStdout, &info);
-    FillConsoleOutputAttribute(hStdout, info.wAttributes, bufsize, home, &num);
-    SetConsoleCursorPosition(hStdout, home);
+static void record_int(int type, int value) {
+    unsigned char data[4];
 
-    return TCL_OK;
+    data[0] = (unsigned char) (value & 0xFF);
+    data[1] = (unsigned char) ((value >> 8) & 0xFF);
+    data[2] = (unsigned char) ((value >> 16) & 0xFF);
+    data[3] = (unsigned char) ((value >> 24) & 0xFF);
+    record_event(type, data, 4);
 }
 
 /*****************************************************************************
- * Consio::gotoxy
+ * record_goto
  *
  * Description:
  *
- *    Moves cursor to a new location. The location is given as two separate
- *    integer arguments: x and y. 0 0 is the upper left corner of the buffer.
- *
- * This command calls the following Windows API functions:
- *
- *   - SetConsoleCursorPosition
+ *   Appends a cursor movement to the session recording. The coordinates are
+ *   stored as two 16-bit little-endian integers. Without a recording,
+ *   only the screen export is updated (see record_event).
  *
  * Parameters:
  *
- *   x - X coordinate for cursor
- *   y - Y coordinate for cursor
+ *   x - X coordinate of the cursor
+ *   y - Y coordinate of the cursor
  *
  * Results:
  *
@@ -186,186 +294,9123 @@ static int cmd_clrscr(ClientData clientData,
  *
  * Side effects:
  *
- *   Moves the cursor to new location (x;y).
+ *   Writes to the recording channel.
  *****************************************************************************/
 
-static int cmd_gotoxy(ClientData clientData,
-                      Tcl_Interp *interp,
-                      int objc,
-                      Tcl_Obj * CONST objv[]) {
-    COORD coord;
-    int x, y;
-
-    if (objc < 3) {
-        Tcl_WrongNumArgs(interp, 1, objv, "x y");
-        return TCL_ERROR;
-    }
-
-    if (Tcl_GetIntFromObj(interp, objv[1], &x) == TCL_OK &&
-        Tcl_GetIntFromObj(interp, objv[2], &y) == TCL_OK) {
-        coord.X = x;
-        coord.Y = y;
-        SetConsoleCursorPosition(hStdout, coord);
-    }
-    else {
-        return TCL_ERROR;
-    }
+static void record_goto(int x, int y) {
+    unsigned char data[4];
 
-    return TCL_OK;
+    data[0] = (unsigned char) (x & 0xFF);
+    data[1] = (unsigned char) ((x >> 8) & 0xFF);
+    data[2] = (unsigned char) (y & 0xFF);
+    data[3] = (unsigned char) ((y >> 8) & 0xFF);
+    record_event(REC_OUT_GOTO, data, 4);
 }
 
 /*****************************************************************************
- * Consio::wherex
+ * get_u32
  *
  * Description:
  *
- *   This command returns the current cursor X coordinate in the console
- *   buffer. This means that the coordinate does not represent the position
- *   of the cursor in the visible area of the console.
- *
- * This command calls the following Windows API functions:
- *
- *   - GetConsoleScreenBufferInfo
+ *   Decodes a 32-bit little-endian integer from a recording.
  *
  * Parameters:
  *
- *   None.
+ *   p - pointer to the first byte of the integer
  *
  * Results:
  *
- * Returns the current cursor X coordinate as an integer.
+ *   Returns the decoded integer.
  *
  * Side effects:
  *
  *   None.
  *****************************************************************************/
 
-static int cmd_wherex(ClientData clientData,
-                      Tcl_Interp *interp,
-                      int objc,
-                      Tcl_Obj * CONST objv[]) {
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    Tcl_Obj *obj_int;
-
-    GetConsoleScreenBufferInfo(hStdout, &info);
-    obj_int = Tcl_NewIntObj(info.dwCursorPosition.X);
-    Tcl_SetObjResult(interp, obj_int);
-
-    return TCL_OK;
+static DWORD get_u32(const unsigned char *p) {
+    return (DWORD) p[0] | ((DWORD) p[1] << 8) |
+           ((DWORD) p[2] << 16) | ((DWORD) p[3] << 24);
 }
 
 /*****************************************************************************
- * Consio::wherey
+ * replay_load
  *
  * Description:
  *
- *   This command returns the current cursor Y coordinate in the console
- *   buffer. This means that the coordinate does not represent the position
- *   of the cursor in the visible area of the console.
- *
- * This command calls the following Windows API functions:
- *
- *   - GetConsoleScreenBufferInfo
+ *   Reads a session recording into memory and checks the file header.
  *
  * Parameters:
  *
- *   None.
+ *   interp   - Tcl interpreter used for error messages
+ *   filename - name of the recording file
  *
  * Results:
  *
- * Returns the current cursor Y coordinate as an integer.
+ *   Returns a byte array object holding the whole recording, or NULL if the
+ *   file could not be read or is not a Consio recording. The caller owns a
+ *   reference to the returned object.
  *
  * Side effects:
  *
  *   None.
  *****************************************************************************/
 
-static int cmd_wherey(ClientData clientData,
-                      Tcl_Interp *interp,
-                      int objc,
-                      Tcl_Obj * CONST objv[]) {
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    Tcl_Obj *obj_int;
+static Tcl_Obj *replay_load(Tcl_Interp *interp, Tcl_Obj *filename) {
+    Tcl_Channel channel;
+    Tcl_Obj *data;
+    unsigned char *bytes;
+    int len;
 
-    GetConsoleScreenBufferInfo(hStdout, &info);
-    obj_int = Tcl_NewIntObj(info.dwCursorPosition.Y);
-    Tcl_SetObjResult(interp, obj_int);
+    channel = Tcl_FSOpenFileChannel(interp, filename, "r", 0);
+    if (channel == NULL) return NULL;
 
-    return TCL_OK;
+    Tcl_SetChannelOption(interp, channel, "-translation", "binary");
+    data = Tcl_NewObj();
+    Tcl_IncrRefCount(data);
+    if (Tcl_ReadChars(channel, data, -1, 0) < 0) {
+        Tcl_Close(interp, channel);
+        Tcl_DecrRefCount(data);
+        return NULL;
+    }
+    Tcl_Close(interp, channel);
+
+    bytes = Tcl_GetByteArrayFromObj(data, &len);
+    if (len < REC_MAGIC_LEN ||
+        memcmp(bytes, REC_MAGIC, REC_MAGIC_LEN) != 0) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("not a Consio recording", -1));
+        Tcl_DecrRefCount(data);
+        return NULL;
+    }
+
+    return data;
 }
 
 /*****************************************************************************
- * Consio::bufferwidth
+ * replay_next_input
  *
  * Description:
  *
- *   Returns the width of the console buffer. This is not the width of the
- *   console window.
- *
- * This command calls the following Windows API functions:
- *
- *   - GetConsoleScreenBufferInfo
+ *   Finds the next input record in the active input replay. Output records
+ *   are skipped, because the application will produce its own output while
+ *   being replayed.
  *
  * Parameters:
  *
- *   None.
+ *   pos - receives the offset of the input record
  *
  * Results:
  *
- *   Returns buffer width as an integer.
+ *   1 - if an input record was found
+ *   0 - if the replay is not active or has run out of input
  *
  * Side effects:
  *
  *   None.
  *****************************************************************************/
 
-static int cmd_bufferwidth(ClientData clientData,
-                           Tcl_Interp *interp,
-                           int objc,
-                           Tcl_Obj * CONST objv[]) {
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    Tcl_Obj *obj_int;
+static int replay_next_input(int *pos) {
+    unsigned char *data;
+    int len, p;
+    DWORD n;
 
-    GetConsoleScreenBufferInfo(hStdout, &info);
-    obj_int = Tcl_NewIntObj(info.dwSize.X);
-    Tcl_SetObjResult(interp, obj_int);
+    if (replayObj == NULL) return 0;
 
-    return TCL_OK;
+    data = Tcl_GetByteArrayFromObj(replayObj, &len);
+    p = replayPos;
+    while (p + REC_HEADER_LEN <= len) {
+        n = get_u32(data + p + 5);
+        if (n > (DWORD) (len - p - REC_HEADER_LEN)) break;
+        switch (data[p + 4]) {
+            case REC_IN_CHAR:
+            case REC_IN_KEY:
+            case REC_IN_KEY2:
+            case REC_IN_LINE:
+            case REC_IN_EVENT:
+                *pos = p;
+                return 1;
+        }
+        p += REC_HEADER_LEN + n;
+    }
+
+    return 0;
 }
 
 /*****************************************************************************
- * Consio::bufferheight
+ * replay_input
  *
  * Description:
  *
- *   Returns the height of the console buffer. This is not the height of the
- *   console window.
- *
- * This command calls the following Windows API functions:
- *
- *   - GetConsoleScreenBufferInfo
+ *   Serves an input command from the active input replay instead of the
+ *   console. Unless the replay was started with -fast, the call will wait
+ *   until the moment the input was originally received. When the recording
+ *   runs out of input, the replay ends and the commands go back to reading
+ *   the console.
  *
  * Parameters:
  *
- *   None.
+ *   interp - Tcl interpreter used for error messages, or NULL
+ *   type   - expected record type (REC_IN_CHAR, REC_IN_KEY, REC_IN_KEY2,
+ *            REC_IN_LINE or REC_IN_EVENT)
+ *   result - receives the recorded input as a new Tcl object
  *
  * Results:
  *
- *   Returns buffer height as an integer.
+ *    1 - the input was taken from the recording
+ *    0 - no input replay is active; the caller should read the console
+ *   -1 - the recording doesn't match the input command (an error message
+ *        is left in the interpreter)
  *
  * Side effects:
  *
- *   None.
+ *   May sleep. Advances the replay position.
  *****************************************************************************/
 
-static int cmd_bufferheight(ClientData clientData,
-                            Tcl_Interp *interp,
-                            int objc,
-                            Tcl_Obj * CONST objv[]) {
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    Tcl_Obj *obj_int;
+static int replay_input(Tcl_Interp *interp, int type, Tcl_Obj **result) {
+    unsigned char *data;
+    int len, pos;
+    DWORD t, now, n;
 
-    GetConsoleScreenBufferInfo(hStdout, &info);
+    if (replay_next_input(&pos) == 0) {
+        if (replayObj != NULL) {
+            Tcl_DecrRefCount(replayObj);
+            replayObj = NULL;
+        }
+        return 0;
+    }
+
+    data = Tcl_GetByteArrayFromObj(replayObj, &len);
+    if (data[pos + 4] != type) {
+        if (interp != NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "replay out of sync: recorded input type '%c' at offset %d",
+                data[pos + 4], pos));
+        }
+        return -1;
+    }
+
+    t = get_u32(data + pos);
+    n = get_u32(data + pos + 5);
+    if (!replayFast) {
+        now = GetTickCount() - replayStart;
+        if (t > now) Sleep(t - now);
+    }
+
+    if (type == REC_IN_KEY || type == REC_IN_KEY2) {
+        *result = Tcl_NewIntObj((int) get_u32(data + pos + REC_HEADER_LEN));
+    }
+    else {
+        *result = Tcl_NewStringObj((char *) data + pos + REC_HEADER_LEN, n);
+    }
+    replayPos = pos + REC_HEADER_LEN + n;
+
+    return 1;
+}
+
+/*****************************************************************************
+ * console_write_unicode
+ *
+ * Description:
+ *
+ *   Writes a string of Unicode characters to the console. Unlike the
+ *   WriteConsole calls used by cputs and putch, this doesn't depend on the
+ *   console code page.
+ *
+ * Parameters:
+ *
+ *   handle - console output handle
+ *   str    - characters to be written
+ *   len    - number of characters
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console and moves the cursor.
+ *****************************************************************************/
+
+static void console_write_unicode(HANDLE handle,
+                                  const Tcl_UniChar *str,
+                                  int len) {
+    DWORD num;
+
+    if (len > 0) WriteConsoleW(handle, (const WCHAR *) str, len, &num, NULL);
+}
+
+/*****************************************************************************
+ * editor_reserve
+ *
+ * Description:
+ *
+ *   Makes sure that a line editor buffer can hold the given number of
+ *   characters. The buffer grows geometrically, so typing a long line
+ *   doesn't reallocate on every keystroke.
+ *
+ * Parameters:
+ *
+ *   buffer - pointer to the buffer
+ *   cap    - pointer to the allocated size of the buffer
+ *   need   - required number of characters
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   May reallocate the buffer.
+ *****************************************************************************/
+
+static void editor_reserve(Tcl_UniChar **buffer, int *cap, int need) {
+    int size;
+
+    if (need <= *cap) return;
+
+    size = *cap < 64 ? 64 : *cap * 2;
+    if (size < need) size = need;
+    *buffer = (Tcl_UniChar *) ckrealloc((char *) *buffer,
+                                        size * sizeof(Tcl_UniChar));
+    *cap = size;
+}
+
+/*****************************************************************************
+ * editor_insert
+ *
+ * Description:
+ *
+ *   Inserts characters at the cursor position and moves the cursor after
+ *   the inserted text.
+ *
+ * Parameters:
+ *
+ *   ed  - line editor
+ *   str - characters to be inserted
+ *   len - number of characters
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Modifies the edited text. Nothing is drawn until editor_refresh.
+ *****************************************************************************/
+
+static void editor_insert(LineEditor *ed, const Tcl_UniChar *str, int len) {
+    if (len <= 0) return;
+
+    editor_reserve(&ed->line, &ed->cap, ed->len + len);
+    memmove(ed->line + ed->pos + len, ed->line + ed->pos,
+            (ed->len - ed->pos) * sizeof(Tcl_UniChar));
+    memcpy(ed->line + ed->pos, str, len * sizeof(Tcl_UniChar));
+    ed->len += len;
+    ed->pos += len;
+}
+
+/*****************************************************************************
+ * editor_delete
+ *
+ * Description:
+ *
+ *   Removes a range of characters from the edited text. Killed text is
+ *   saved to the kill buffer, from where it can be yanked back with
+ *   Ctrl-Y.
+ *
+ * Parameters:
+ *
+ *   ed   - line editor
+ *   from - index of the first character to be removed
+ *   to   - index after the last character to be removed
+ *   kill - non-zero if the text should be saved to the kill buffer
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Modifies the edited text and possibly the kill buffer.
+ *****************************************************************************/
+
+static void editor_delete(LineEditor *ed, int from, int to, int kill) {
+    if (from < 0) from = 0;
+    if (to > ed->len) to = ed->len;
+    if (from >= to) return;
+
+    if (kill) {
+        if (killObj != NULL) Tcl_DecrRefCount(killObj);
+        killObj = Tcl_NewUnicodeObj(ed->line + from, to - from);
+        Tcl_IncrRefCount(killObj);
+    }
+
+    memmove(ed->line + from, ed->line + to,
+            (ed->len - to) * sizeof(Tcl_UniChar));
+    ed->len -= to - from;
+
+    if (ed->pos >= to) {
+        ed->pos -= to - from;
+    }
+    else if (ed->pos > from) {
+        ed->pos = from;
+    }
+}
+
+/*****************************************************************************
+ * editor_set
+ *
+ * Description:
+ *
+ *   Replaces the whole edited text, e.g. with a history entry. The cursor
+ *   is moved to the end of the text.
+ *
+ * Parameters:
+ *
+ *   ed   - line editor
+ *   text - new text
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Modifies the edited text.
+ *****************************************************************************/
+
+static void editor_set(LineEditor *ed, Tcl_Obj *text) {
+    Tcl_UniChar *str;
+    int len;
+
+    str = Tcl_GetUnicodeFromObj(text, &len);
+    editor_reserve(&ed->line, &ed->cap, len);
+    memcpy(ed->line, str, len * sizeof(Tcl_UniChar));
+    ed->len = len;
+    ed->pos = len;
+}
+
+/*****************************************************************************
+ * editor_offset
+ *
+ * Description:
+ *
+ *   Computes the console cell, counted from the start of the row where
+ *   the edited text starts, at which a character of the text is shown.
+ *   The text is measured one grapheme cluster at a time like the pager
+ *   does, so wide characters take two cells and combining marks none. A
+ *   wide character that does not fit at the end of a row is moved to the
+ *   next row by the console, which is accounted for too.
+ *
+ * Parameters:
+ *
+ *   ed    - line editor
+ *   text  - edited or shown text
+ *   index - character index
+ *
+ * Results:
+ *
+ *   Returns the cell offset of the character.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int editor_offset(LineEditor *ed, const Tcl_UniChar *text, int index) {
+    Tcl_DString ds;
+    const unsigned char *p, *end;
+    int offset = ed->x0;
+    int w;
+
+    Tcl_DStringInit(&ds);
+    Tcl_UniCharToUtfDString(text, index, &ds);
+    p = (const unsigned char *) Tcl_DStringValue(&ds);
+    end = p + Tcl_DStringLength(&ds);
+    while (p < end) {
+        p = grapheme_next(p, end, &w);
+        if (w == 2 && offset % ed->width == ed->width - 1) offset++;
+        offset += w;
+    }
+    Tcl_DStringFree(&ds);
+
+    return offset;
+}
+
+/*****************************************************************************
+ * editor_cluster
+ *
+ * Description:
+ *
+ *   Finds the grapheme clusters before and after a position of the edited
+ *   text, segmenting it like editor_offset. The cursor moves and deletes
+ *   by whole clusters, so it never ends up inside a surrogate pair, before
+ *   a combining mark or within a flag or an emoji sequence.
+ *
+ * Parameters:
+ *
+ *   ed    - line editor
+ *   index - character index
+ *   prev  - receives the start of the cluster before the index, or 0
+ *   next  - receives the end of the cluster at the index, or the length
+ *           of the text
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void editor_cluster(LineEditor *ed, int index, int *prev, int *next) {
+    Tcl_DString ds;
+    const unsigned char *p, *q, *end;
+    int start = 0;
+    int stop, w;
+
+    *prev = 0;
+    *next = ed->len;
+
+    Tcl_DStringInit(&ds);
+    Tcl_UniCharToUtfDString(ed->line, ed->len, &ds);
+    p = (const unsigned char *) Tcl_DStringValue(&ds);
+    end = p + Tcl_DStringLength(&ds);
+    while (p < end) {
+        q = grapheme_next(p, end, &w);
+
+        /* Every lead byte is one character, except that 4-byte sequences
+           are surrogate pairs when Tcl_UniChar is 16 bits */
+
+        for (stop = start; p < q; p++) {
+            if ((*p & 0xC0) == 0x80) continue;
+            stop += *p >= 0xF0 && sizeof(Tcl_UniChar) == 2 ? 2 : 1;
+        }
+        if (start < index) *prev = start;
+        if (stop > index) {
+            *next = stop;
+            break;
+        }
+        start = stop;
+    }
+    Tcl_DStringFree(&ds);
+}
+
+/*****************************************************************************
+ * editor_goto
+ *
+ * Description:
+ *
+ *   Moves the console cursor to the cell showing the given character of
+ *   the edited text. Long lines wrap at the edge of the console buffer.
+ *
+ * Parameters:
+ *
+ *   ed    - line editor
+ *   index - character index
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Moves the cursor.
+ *****************************************************************************/
+
+static void editor_goto(LineEditor *ed, int index) {
+    COORD coord;
+    int offset;
+
+    offset = editor_offset(ed, ed->line, index);
+    coord.X = (SHORT) (offset % ed->width);
+    coord.Y = (SHORT) (ed->y0 + offset / ed->width);
+    SetConsoleCursorPosition(hStdout, coord);
+}
+
+/*****************************************************************************
+ * editor_start
+ *
+ * Description:
+ *
+ *   Takes the current cursor location as the start of the edited text.
+ *   This is called after the prompt has been written. The console is
+ *   considered to show nothing of the edited text yet.
+ *
+ * Parameters:
+ *
+ *   ed - line editor
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void editor_start(LineEditor *ed) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    ed->x0 = info.dwCursorPosition.X;
+    ed->y0 = info.dwCursorPosition.Y;
+    ed->width = info.dwSize.X > 0 ? info.dwSize.X : 80;
+    ed->shownLen = 0;
+}
+
+/*****************************************************************************
+ * editor_refresh
+ *
+ * Description:
+ *
+ *   Brings the console up to date with the edited text. Only the part of
+ *   the line after the first changed character is written again, and if
+ *   the line got shorter, the leftover cells are blanked. The prompt and
+ *   the unchanged beginning of the line are never redrawn, which keeps
+ *   typing responsive over slow remote connections.
+ *
+ * Parameters:
+ *
+ *   ed - line editor
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console and moves the cursor. If writing the line
+ *   scrolled the console buffer, the start of the line is adjusted.
+ *****************************************************************************/
+
+static void editor_refresh(LineEditor *ed) {
+    static const Tcl_UniChar spaces[16] = {
+        ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+        ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    int diff, common, end, shownEnd, blank, expected;
+
+    common = ed->len < ed->shownLen ? ed->len : ed->shownLen;
+    for (diff = 0; diff < common; diff++) {
+        if (ed->line[diff] != ed->shown[diff]) break;
+    }
+
+    /* Redraw whole clusters, as a combining mark can't be drawn alone */
+
+    while (diff > 0 && diff < ed->len &&
+           (width_class(ed->line[diff]) == WIDTH_ZERO ||
+            (ed->line[diff] & 0xFC00) == 0xDC00)) {
+        diff--;
+    }
+
+    if (diff < ed->len || diff < ed->shownLen) {
+        end = editor_offset(ed, ed->line, ed->len);
+        shownEnd = editor_offset(ed, ed->shown, ed->shownLen);
+
+        editor_goto(ed, diff);
+        console_write_unicode(hStdout, ed->line + diff, ed->len - diff);
+
+        for (blank = shownEnd - end; blank > 0; blank -= 16) {
+            console_write_unicode(hStdout, spaces, blank < 16 ? blank : 16);
+        }
+
+        if (shownEnd > end) end = shownEnd;
+        expected = ed->y0 + end / ed->width;
+        GetConsoleScreenBufferInfo(hStdout, &info);
+        if (expected > info.dwCursorPosition.Y) {
+            ed->y0 -= expected - info.dwCursorPosition.Y;
+        }
+
+        editor_reserve(&ed->shown, &ed->shownCap, ed->len);
+        memcpy(ed->shown + diff, ed->line + diff,
+               (ed->len - diff) * sizeof(Tcl_UniChar));
+        ed->shownLen = ed->len;
+    }
+
+    editor_goto(ed, ed->pos);
+}
+
+/*****************************************************************************
+ * editor_complete
+ *
+ * Description:
+ *
+ *   Completes the word before the cursor. The completion command is called
+ *   with the word as an extra argument and it should return a list of
+ *   possible completions. A single match replaces the word. If there are
+ *   several matches, the word is extended to their longest common prefix,
+ *   or if that's not possible, the matches are listed below the line and
+ *   the prompt is drawn again.
+ *
+ * Parameters:
+ *
+ *   interp  - Tcl interpreter
+ *   ed      - line editor
+ *   command - completion command prefix
+ *
+ * Results:
+ *
+ *   TCL_OK    - completion was successful
+ *   TCL_ERROR - the completion command failed
+ *
+ * Side effects:
+ *
+ *   Evaluates the completion command. Modifies the edited text.
+ *****************************************************************************/
+
+static int editor_complete(Tcl_Interp *interp,
+                           LineEditor *ed,
+                           Tcl_Obj *command) {
+    static const Tcl_UniChar separator[2] = {' ', ' '};
+    static const Tcl_UniChar crlf[2] = {'\r', '\n'};
+    Tcl_Obj *cmd, *result;
+    Tcl_Obj **matches;
+    Tcl_UniChar *first, *other;
+    int start, count, prefix, len, i, j, code;
+
+    start = ed->pos;
+    while (start > 0 && ed->line[start - 1] != ' ') start--;
+
+    cmd = Tcl_DuplicateObj(command);
+    Tcl_IncrRefCount(cmd);
+    code = Tcl_ListObjAppendElement(interp, cmd,
+        Tcl_NewUnicodeObj(ed->line + start, ed->pos - start));
+    if (code == TCL_OK) code = Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(cmd);
+    if (code != TCL_OK) return TCL_ERROR;
+
+    result = Tcl_GetObjResult(interp);
+    Tcl_IncrRefCount(result);
+    if (Tcl_ListObjGetElements(interp, result, &count, &matches) != TCL_OK) {
+        Tcl_DecrRefCount(result);
+        return TCL_ERROR;
+    }
+
+    if (count > 0) {
+        first = Tcl_GetUnicodeFromObj(matches[0], &prefix);
+        for (i = 1; i < count; i++) {
+            other = Tcl_GetUnicodeFromObj(matches[i], &len);
+            for (j = 0; j < prefix && j < len; j++) {
+                if (first[j] != other[j]) break;
+            }
+            prefix = j;
+        }
+
+        if (count == 1 || prefix > ed->pos - start) {
+            editor_delete(ed, start, ed->pos, 0);
+            editor_insert(ed, first, prefix);
+        }
+        else {
+            editor_goto(ed, ed->len);
+            console_write_unicode(hStdout, crlf, 2);
+            for (i = 0; i < count; i++) {
+                other = Tcl_GetUnicodeFromObj(matches[i], &len);
+                console_write_unicode(hStdout, other, len);
+                console_write_unicode(hStdout, separator, 2);
+            }
+            console_write_unicode(hStdout, crlf, 2);
+            console_write_unicode(hStdout, ed->prompt, ed->promptLen);
+            editor_start(ed);
+        }
+    }
+
+    Tcl_DecrRefCount(result);
+    Tcl_ResetResult(interp);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * history_add
+ *
+ * Description:
+ *
+ *   Appends a line to the line editor history. Empty lines and lines equal
+ *   to the previous entry are not stored. The oldest entries are dropped
+ *   when the history grows over its limit.
+ *
+ * Parameters:
+ *
+ *   line - line to be added
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Modifies the history.
+ *****************************************************************************/
+
+static void history_add(Tcl_Obj *line) {
+    Tcl_Obj *last;
+    int count;
+
+    if (Tcl_GetCharLength(line) == 0) return;
+
+    if (historyObj == NULL) {
+        historyObj = Tcl_NewObj();
+        Tcl_IncrRefCount(historyObj);
+    }
+    else if (Tcl_IsShared(historyObj)) {
+        last = Tcl_DuplicateObj(historyObj);
+        Tcl_IncrRefCount(last);
+        Tcl_DecrRefCount(historyObj);
+        historyObj = last;
+    }
+
+    Tcl_ListObjLength(NULL, historyObj, &count);
+    if (count > 0) {
+        Tcl_ListObjIndex(NULL, historyObj, count - 1, &last);
+        if (strcmp(Tcl_GetString(last), Tcl_GetString(line)) == 0) return;
+    }
+
+    Tcl_ListObjAppendElement(NULL, historyObj, line);
+    count++;
+    if (count > historyLimit) {
+        Tcl_ListObjReplace(NULL, historyObj, 0, count - historyLimit, 0, NULL);
+    }
+}
+
+/*****************************************************************************
+ * console_read_cells
+ *
+ * Description:
+ *
+ *   Reads a rectangular block of character cells from the console. Large
+ *   reads fail on some versions of Windows, so the block is read in bands
+ *   of at most CONSOLE_READ_MAX bytes.
+ *
+ * Parameters:
+ *
+ *   handle - console output handle
+ *   cells  - receives width * height cells, row by row
+ *   x, y   - upper left corner of the block on the console
+ *   width  - width of the block
+ *   height - height of the block
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void console_read_cells(HANDLE handle,
+                               CHAR_INFO *cells,
+                               int x, int y,
+                               int width, int height) {
+    COORD size;
+    COORD origin = {0, 0};
+    SMALL_RECT rect;
+    int band, row;
+
+    if (width <= 0 || height <= 0) return;
+
+    band = CONSOLE_READ_MAX / (width * sizeof(CHAR_INFO));
+    if (band < 1) band = 1;
+    for (row = 0; row < height; row += band) {
+        if (row + band > height) band = height - row;
+        size.X = (SHORT) width;
+        size.Y = (SHORT) band;
+        rect.Left = (SHORT) x;
+        rect.Top = (SHORT) (y + row);
+        rect.Right = (SHORT) (x + width - 1);
+        rect.Bottom = (SHORT) (y + row + band - 1);
+        ReadConsoleOutputW(handle, cells + row * width, size, origin, &rect);
+    }
+}
+
+/*****************************************************************************
+ * console_write_cells
+ *
+ * Description:
+ *
+ *   Writes a rectangular block of character cells to the console with a
+ *   single WriteConsoleOutputW call. This is used by the commands that
+ *   render whole regions at once, so they don't have to move the cursor
+ *   and write one row at a time.
+ *
+ * Parameters:
+ *
+ *   handle - console output handle
+ *   cells  - width * height cells, row by row
+ *   x, y   - upper left corner of the block on the console
+ *   width  - width of the block
+ *   height - height of the block
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console. The cursor is not moved. The block is appended
+ *   to the session recording with record_cells.
+ *****************************************************************************/
+
+static void console_write_cells(HANDLE handle,
+                                CHAR_INFO *cells,
+                                int x, int y,
+                                int width, int height) {
+    COORD size;
+    COORD origin = {0, 0};
+    SMALL_RECT rect;
+
+    if (width <= 0 || height <= 0) return;
+
+    size.X = (SHORT) width;
+    size.Y = (SHORT) height;
+    rect.Left = (SHORT) x;
+    rect.Top = (SHORT) y;
+    rect.Right = (SHORT) (x + width - 1);
+    rect.Bottom = (SHORT) (y + height - 1);
+    WriteConsoleOutputW(handle, cells, size, origin, &rect);
+    export_touch();
+    record_cells(cells, x, y, width, height);
+}
+
+/*****************************************************************************
+ * record_cells
+ *
+ * Description:
+ *
+ *   Appends a block of cells to the session recording, if a recording is
+ *   active. The block is stored as 16-bit x, y, width and height followed
+ *   by the cells (16-bit character and 16-bit attributes each).
+ *
+ * Parameters:
+ *
+ *   cells  - width * height cells, row by row
+ *   x, y   - upper left corner of the block on the console
+ *   width  - width of the block
+ *   height - height of the block
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the recording channel.
+ *****************************************************************************/
+
+static void record_cells(const CHAR_INFO *cells,
+                         int x, int y,
+                         int width, int height) {
+    unsigned char *data;
+    int len;
+
+    if (recChannel == NULL) return;
+
+    len = 8 + width * height * sizeof(CHAR_INFO);
+    data = (unsigned char *) ckalloc(len);
+    data[0] = (unsigned char) (x & 0xFF);
+    data[1] = (unsigned char) ((x >> 8) & 0xFF);
+    data[2] = (unsigned char) (y & 0xFF);
+    data[3] = (unsigned char) ((y >> 8) & 0xFF);
+    data[4] = (unsigned char) (width & 0xFF);
+    data[5] = (unsigned char) ((width >> 8) & 0xFF);
+    data[6] = (unsigned char) (height & 0xFF);
+    data[7] = (unsigned char) ((height >> 8) & 0xFF);
+    memcpy(data + 8, cells, width * height * sizeof(CHAR_INFO));
+    record_event(REC_OUT_CELLS, data, len);
+    ckfree((char *) data);
+}
+
+/*****************************************************************************
+ * console_scroll
+ *
+ * Description:
+ *
+ *   Scrolls the contents of a rectangular region of the console. The
+ *   console moves the cells itself, so only the rows exposed by the
+ *   scrolling have to be drawn again.
+ *
+ * Parameters:
+ *
+ *   handle - console output handle
+ *   x, y   - upper left corner of the region
+ *   width  - width of the region
+ *   height - height of the region
+ *   dy     - number of rows to scroll; positive values move the contents
+ *            up, negative values down
+ *   attr   - attributes for the exposed cells
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Modifies the console. Exposed cells are filled with spaces. The scroll
+ *   is appended to the session recording as 16-bit x, y, width, height, dy
+ *   and attributes.
+ *****************************************************************************/
+
+static void console_scroll(HANDLE handle,
+                           int x, int y,
+                           int width, int height,
+                           int dy, WORD attr) {
+    SMALL_RECT source, clip;
+    COORD dest;
+    CHAR_INFO fill;
+    unsigned char data[12];
+    int i, values[6];
+
+    if (dy == 0 || width <= 0 || height <= 0) return;
+
+    clip.Left = (SHORT) x;
+    clip.Top = (SHORT) y;
+    clip.Right = (SHORT) (x + width - 1);
+    clip.Bottom = (SHORT) (y + height - 1);
+    source = clip;
+    dest.X = (SHORT) x;
+
+    if (dy > 0) {
+        source.Top = (SHORT) (y + dy);
+        dest.Y = (SHORT) y;
+    }
+    else {
+        source.Bottom = (SHORT) (y + height - 1 + dy);
+        dest.Y = (SHORT) (y - dy);
+    }
+
+    fill.Char.UnicodeChar = ' ';
+    fill.Attributes = attr;
+    ScrollConsoleScreenBufferW(handle, &source, &clip, dest, &fill);
+    export_touch();
+
+    if (recChannel != NULL) {
+        values[0] = x;
+        values[1] = y;
+        values[2] = width;
+        values[3] = height;
+        values[4] = dy;
+        values[5] = attr;
+        for (i = 0; i < 6; i++) {
+            data[i * 2] = (unsigned char) (values[i] & 0xFF);
+            data[i * 2 + 1] = (unsigned char) ((values[i] >> 8) & 0xFF);
+        }
+        record_event(REC_OUT_SCROLL, data, 12);
+    }
+}
+
+/*****************************************************************************
+ * cells_from_utf8
+ *
+ * Description:
+ *
+ *   Converts a row of UTF-8 text to console cells. Tabs are expanded,
+ *   carriage returns are dropped and other control characters are shown as
+ *   question marks. Wide characters take two cells, marked as the leading
+ *   and trailing half like the console itself does, and zero-width
+ *   characters are dropped because a cell can hold only one character.
+ *   The text is clipped to the given width and the rest of the row is
+ *   filled with spaces.
+ *
+ * Parameters:
+ *
+ *   cells - row of cells to be filled
+ *   width - number of cells in the row
+ *   str   - UTF-8 text
+ *   len   - length of the text in bytes
+ *   attr  - attributes for all cells
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void cells_from_utf8(CHAR_INFO *cells,
+                            int width,
+                            const char *str,
+                            int len,
+                            WORD attr) {
+    const unsigned char *p = (const unsigned char *) str;
+    const unsigned char *end = p + len;
+    int col = 0;
+    int ch, w;
+
+    while (p < end && col < width) {
+        utf8_next(p, end, &ch);
+        p = grapheme_next(p, end, &w);
+
+        if (ch == '\t') {
+            do {
+                cells[col].Char.UnicodeChar = ' ';
+                cells[col].Attributes = attr;
+                col++;
+            } while (col < width && col % PAGER_TAB_WIDTH != 0);
+            continue;
+        }
+        if (ch == '\r') continue;
+        if (ch < 32 || ch == 127) {
+            ch = '?';
+            w = 1;
+        }
+        if (w == 0) continue;
+        if (ch > 0xFFFF) ch = 0xFFFD;
+
+        if (w == 2 && col + 1 < width) {
+            cells[col].Char.UnicodeChar = (WCHAR) ch;
+            cells[col].Attributes = attr | COMMON_LVB_LEADING_BYTE;
+            cells[col + 1].Char.UnicodeChar = (WCHAR) ch;
+            cells[col + 1].Attributes = attr | COMMON_LVB_TRAILING_BYTE;
+            col += 2;
+        }
+        else {
+            cells[col].Char.UnicodeChar = w == 2 ? ' ' : (WCHAR) ch;
+            cells[col].Attributes = attr;
+            col++;
+        }
+    }
+
+    for (; col < width; col++) {
+        cells[col].Char.UnicodeChar = ' ';
+        cells[col].Attributes = attr;
+    }
+}
+
+/*****************************************************************************
+ * width_class
+ *
+ * Description:
+ *
+ *   Looks up the display width class of a code point from the two-level
+ *   table in ConsioWidth.h.
+ *
+ * Parameters:
+ *
+ *   cp - Unicode code point
+ *
+ * Results:
+ *
+ *   Returns WIDTH_ZERO, WIDTH_NARROW, WIDTH_WIDE or WIDTH_CONTROL.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int width_class(int cp) {
+    if (cp < 0x40000) {
+        return (widthStage2[widthStage1[cp >> 8]][(cp & 0xFF) >> 2] >>
+                ((cp & 3) * 2)) & 3;
+    }
+    if (cp >= 0xE0000 && cp <= 0xE0FFF) return WIDTH_ZERO;
+
+    return WIDTH_NARROW;
+}
+
+/*****************************************************************************
+ * utf8_next
+ *
+ * Description:
+ *
+ *   Decodes one character of a Tcl UTF-8 string. Besides standard UTF-8
+ *   this accepts the modified forms used by Tcl: the two-byte encoding of
+ *   NUL and characters outside of the BMP encoded as surrogate pairs.
+ *   Invalid bytes are decoded as single Latin-1 characters, like Tcl does.
+ *
+ * Parameters:
+ *
+ *   p   - pointer to the first byte of the character
+ *   end - end of the string
+ *   cp  - receives the code point
+ *
+ * Results:
+ *
+ *   Returns a pointer to the next character.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static const unsigned char *utf8_next(const unsigned char *p,
+                                      const unsigned char *end,
+                                      int *cp) {
+    int c = p[0];
+    int low;
+
+    if (c < 0x80) {
+        *cp = c;
+        return p + 1;
+    }
+
+    if ((c & 0xE0) == 0xC0 && end - p >= 2 && (p[1] & 0xC0) == 0x80) {
+        *cp = ((c & 0x1F) << 6) | (p[1] & 0x3F);
+        return p + 2;
+    }
+
+    if ((c & 0xF0) == 0xE0 && end - p >= 3 &&
+        (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+        *cp = ((c & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+        if (*cp >= 0xD800 && *cp <= 0xDBFF && end - p >= 6 &&
+            p[3] == 0xED && (p[4] & 0xF0) == 0xB0 && (p[5] & 0xC0) == 0x80) {
+            low = 0xD000 | ((p[4] & 0x3F) << 6) | (p[5] & 0x3F);
+            *cp = 0x10000 + ((*cp - 0xD800) << 10) + (low - 0xDC00);
+            return p + 6;
+        }
+        return p + 3;
+    }
+
+    if ((c & 0xF8) == 0xF0 && end - p >= 4 && (p[1] & 0xC0) == 0x80 &&
+        (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80) {
+        *cp = ((c & 0x07) << 18) | ((p[1] & 0x3F) << 12) |
+              ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+        return p + 4;
+    }
+
+    *cp = c;
+
+    return p + 1;
+}
+
+/*****************************************************************************
+ * ascii_run
+ *
+ * Description:
+ *
+ *   Counts printable ASCII characters at the beginning of a string. These
+ *   are always one column wide, so long ASCII runs can be measured without
+ *   decoding. With SSE2 the string is checked 16 bytes at a time.
+ *
+ * Parameters:
+ *
+ *   p   - start of the string
+ *   end - end of the string
+ *
+ * Results:
+ *
+ *   Returns the number of printable ASCII characters.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int ascii_run(const unsigned char *p, const unsigned char *end) {
+    const unsigned char *start = p;
+#ifdef CONSIO_SSE2
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    __m128i chunk;
+
+    /* Bytes >= 0x80 are negative as signed chars, so the less-than test
+       catches them together with the control characters. */
+    while (end - p >= 16) {
+        chunk = _mm_loadu_si128((const __m128i *) p);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(chunk, space),
+                                           _mm_cmpeq_epi8(chunk, del)))) {
+            break;
+        }
+        p += 16;
+    }
+#endif
+
+    while (p < end && *p >= 0x20 && *p < 0x7F) p++;
+
+    return (int) (p - start);
+}
+
+/*****************************************************************************
+ * grapheme_next
+ *
+ * Description:
+ *
+ *   Finds the end of a grapheme cluster, i.e. the characters shown
+ *   together in a single position, and returns its display width. A
+ *   cluster is a base character followed by combining marks and other
+ *   zero-width characters, emoji modifiers and variation selectors, and
+ *   characters joined with a zero width joiner. A pair of regional
+ *   indicators (a flag) is also a single cluster. The variation selector
+ *   U+FE0F makes a narrow base character wide (emoji presentation).
+ *
+ * Parameters:
+ *
+ *   p     - start of the cluster
+ *   end   - end of the string
+ *   width - receives the display width of the cluster
+ *
+ * Results:
+ *
+ *   Returns a pointer to the next cluster.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static const unsigned char *grapheme_next(const unsigned char *p,
+                                          const unsigned char *end,
+                                          int *width) {
+    const unsigned char *next;
+    int cp, cls;
+
+    if (*p >= 0x20 && *p < 0x7F && (end - p == 1 || p[1] < 0x80)) {
+        *width = 1;
+        return p + 1;
+    }
+
+    p = utf8_next(p, end, &cp);
+    cls = width_class(cp);
+    if (cls == WIDTH_CONTROL) {
+        *width = 0;
+        return p;
+    }
+    *width = cls;
+
+    if (cp >= 0x1F1E6 && cp <= 0x1F1FF && p < end) {
+        next = utf8_next(p, end, &cp);
+        if (cp >= 0x1F1E6 && cp <= 0x1F1FF) {
+            *width = 2;
+            p = next;
+        }
+    }
+
+    while (p < end) {
+        next = utf8_next(p, end, &cp);
+        if (cp == 0x200D) {
+            p = next;
+            if (p < end) p = utf8_next(p, end, &cp);
+        }
+        else if (cp == 0xFE0F) {
+            if (*width == 1) *width = 2;
+            p = next;
+        }
+        else if ((cp >= 0x1F3FB && cp <= 0x1F3FF) ||
+                 width_class(cp) == WIDTH_ZERO) {
+            p = next;
+        }
+        else {
+            break;
+        }
+    }
+
+    return p;
+}
+
+/*****************************************************************************
+ * text_width
+ *
+ * Description:
+ *
+ *   Computes the display width of a UTF-8 string in console columns.
+ *   Printable ASCII runs are measured with ascii_run, everything else one
+ *   grapheme cluster at a time. The last ASCII character of a run is left
+ *   to the cluster code, because it may be the base of a cluster.
+ *
+ * Parameters:
+ *
+ *   p   - UTF-8 string
+ *   len - length of the string in bytes
+ *
+ * Results:
+ *
+ *   Returns the width in columns. Control characters have no width.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int text_width(const unsigned char *p, int len) {
+    const unsigned char *end = p + len;
+    int total = 0;
+    int n, w;
+
+    while (p < end) {
+        n = ascii_run(p, end);
+        if (p + n < end && n > 0) n--;
+        total += n;
+        p += n;
+        if (p < end) {
+            p = grapheme_next(p, end, &w);
+            total += w;
+        }
+    }
+
+    return total;
+}
+
+/*****************************************************************************
+ * pager_map
+ *
+ * Description:
+ *
+ *   Returns a pointer to the given offset of a paged file. Only a window of
+ *   PAGER_VIEW_SIZE bytes is mapped at a time, so even multi-gigabyte files
+ *   can be browsed with 32-bit Tcl and the memory use stays constant. The
+ *   window is moved when an offset outside of it is requested.
+ *
+ * Parameters:
+ *
+ *   p      - pager
+ *   offset - file offset
+ *   avail  - receives the number of bytes available at the returned
+ *            pointer
+ *
+ * Results:
+ *
+ *   Returns a pointer to the mapped byte, or NULL if the offset is past the
+ *   end of the file or the mapping failed.
+ *
+ * Side effects:
+ *
+ *   May unmap the previous window and map a new one.
+ *****************************************************************************/
+
+static unsigned char *pager_map(Pager *p,
+                                Tcl_WideInt offset,
+                                Tcl_WideInt *avail) {
+    SYSTEM_INFO sysinfo;
+    Tcl_WideInt base, len;
+
+    *avail = 0;
+    if (offset < 0 || offset >= p->size || p->mapping == NULL) return NULL;
+
+    if (p->view == NULL || offset < p->viewOffset ||
+        offset >= p->viewOffset + p->viewLen) {
+        if (mapGranularity == 0) {
+            GetSystemInfo(&sysinfo);
+            mapGranularity = sysinfo.dwAllocationGranularity;
+        }
+        if (p->view != NULL) {
+            UnmapViewOfFile(p->view);
+            p->view = NULL;
+        }
+
+        base = offset - offset % mapGranularity;
+        len = p->size - base;
+        if (len > PAGER_VIEW_SIZE) len = PAGER_VIEW_SIZE;
+
+        p->view = (unsigned char *) MapViewOfFile(p->mapping, FILE_MAP_READ,
+                                                  (DWORD) (base >> 32),
+                                                  (DWORD) (base & 0xFFFFFFFF),
+                                                  (SIZE_T) len);
+        if (p->view == NULL) return NULL;
+        p->viewOffset = base;
+        p->viewLen = len;
+    }
+
+    *avail = p->viewOffset + p->viewLen - offset;
+
+    return p->view + (offset - p->viewOffset);
+}
+
+/*****************************************************************************
+ * pager_next_line
+ *
+ * Description:
+ *
+ *   Finds the start of the line following the given offset.
+ *
+ * Parameters:
+ *
+ *   p      - pager
+ *   offset - file offset within a line
+ *
+ * Results:
+ *
+ *   Returns the offset of the next line, or the file size if there are no
+ *   more lines.
+ *
+ * Side effects:
+ *
+ *   May move the mapped window.
+ *****************************************************************************/
+
+static Tcl_WideInt pager_next_line(Pager *p, Tcl_WideInt offset) {
+    unsigned char *ptr, *nl;
+    Tcl_WideInt avail;
+
+    while (offset < p->size) {
+        ptr = pager_map(p, offset, &avail);
+        if (ptr == NULL) break;
+        nl = (unsigned char *) memchr(ptr, '\n', (size_t) avail);
+        if (nl != NULL) return offset + (nl - ptr) + 1;
+        offset += avail;
+    }
+
+    return p->size;
+}
+
+/*****************************************************************************
+ * pager_index_next
+ *
+ * Description:
+ *
+ *   Extends the line index by one line. The index is sparse: only the
+ *   offset of every PAGER_CHECKPOINT:th line is stored, and only as far as
+ *   the file has been browsed, so opening a large file is instant.
+ *
+ * Parameters:
+ *
+ *   p - pager
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Updates the index. Sets the line count when the end of the file is
+ *   reached.
+ *****************************************************************************/
+
+static void pager_index_next(Pager *p) {
+    Tcl_WideInt next;
+
+    if (p->lineCount >= 0) return;
+
+    next = pager_next_line(p, p->indexedOffset);
+    if (next >= p->size) {
+        p->lineCount = p->indexedLine + 1;
+        return;
+    }
+
+    p->indexedLine++;
+    p->indexedOffset = next;
+
+    if (p->indexedLine % PAGER_CHECKPOINT == 0) {
+        if (p->numCheckpoints == p->maxCheckpoints) {
+            p->maxCheckpoints *= 2;
+            p->checkpoints = (Tcl_WideInt *) ckrealloc(
+                (char *) p->checkpoints,
+                p->maxCheckpoints * sizeof(Tcl_WideInt));
+        }
+        p->checkpoints[p->numCheckpoints++] = next;
+    }
+}
+
+/*****************************************************************************
+ * pager_line_offset
+ *
+ * Description:
+ *
+ *   Finds the file offset of a line. The search starts from the nearest
+ *   checkpoint, so at most PAGER_CHECKPOINT lines have to be scanned once
+ *   the index covers the line.
+ *
+ * Parameters:
+ *
+ *   p      - pager
+ *   line   - line number, 0 is the first line
+ *   offset - receives the offset of the line
+ *
+ * Results:
+ *
+ *   1 - if the line exists
+ *   0 - if the line is past the end of the file
+ *
+ * Side effects:
+ *
+ *   May extend the line index.
+ *****************************************************************************/
+
+static int pager_line_offset(Pager *p, Tcl_WideInt line, Tcl_WideInt *offset) {
+    Tcl_WideInt off, i;
+
+    if (line < 0 || p->lineCount == 0) return 0;
+
+    while (line > p->indexedLine && p->lineCount < 0) pager_index_next(p);
+    if (line > p->indexedLine) return 0;
+
+    if (line == p->indexedLine) {
+        *offset = p->indexedOffset;
+        return 1;
+    }
+
+    off = p->checkpoints[line / PAGER_CHECKPOINT];
+    for (i = 0; i < line % PAGER_CHECKPOINT; i++) {
+        off = pager_next_line(p, off);
+    }
+    *offset = off;
+
+    return 1;
+}
+
+/*****************************************************************************
+ * pager_line_of_offset
+ *
+ * Description:
+ *
+ *   Finds the number of the line containing the given file offset.
+ *
+ * Parameters:
+ *
+ *   p      - pager
+ *   offset - file offset
+ *
+ * Results:
+ *
+ *   Returns the line number, 0 is the first line.
+ *
+ * Side effects:
+ *
+ *   May extend the line index.
+ *****************************************************************************/
+
+static Tcl_WideInt pager_line_of_offset(Pager *p, Tcl_WideInt offset) {
+    Tcl_WideInt line, off, next;
+    int lo, hi, mid;
+
+    while (p->lineCount < 0 && p->indexedOffset <= offset) {
+        pager_index_next(p);
+    }
+
+    lo = 0;
+    hi = p->numCheckpoints - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (p->checkpoints[mid] <= offset) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+
+    line = (Tcl_WideInt) lo * PAGER_CHECKPOINT;
+    off = p->checkpoints[lo];
+    for (;;) {
+        next = pager_next_line(p, off);
+        if (next > offset || next >= p->size) break;
+        line++;
+        off = next;
+    }
+
+    return line;
+}
+
+/*****************************************************************************
+ * pager_read_line
+ *
+ * Description:
+ *
+ *   Copies the beginning of a line to a buffer. Lines longer than the
+ *   buffer are truncated, because only the beginning of a line can be
+ *   visible in the viewport anyway.
+ *
+ * Parameters:
+ *
+ *   p      - pager
+ *   offset - offset of the line
+ *   buffer - destination buffer
+ *   size   - size of the buffer
+ *   next   - receives the offset of the next line
+ *
+ * Results:
+ *
+ *   Returns the number of bytes copied. The buffer is NUL-terminated.
+ *
+ * Side effects:
+ *
+ *   May move the mapped window.
+ *****************************************************************************/
+
+static int pager_read_line(Pager *p,
+                           Tcl_WideInt offset,
+                           char *buffer,
+                           int size,
+                           Tcl_WideInt *next) {
+    unsigned char *ptr, *nl;
+    Tcl_WideInt avail;
+    int len = 0;
+    int n;
+
+    while (offset < p->size) {
+        ptr = pager_map(p, offset, &avail);
+        if (ptr == NULL) break;
+        nl = (unsigned char *) memchr(ptr, '\n', (size_t) avail);
+        n = (int) (nl != NULL ? nl - ptr : (avail < size ? avail : size));
+        if (n > size - 1 - len) n = size - 1 - len;
+        memcpy(buffer + len, ptr, n);
+        len += n;
+        if (nl != NULL) {
+            *next = offset + (nl - ptr) + 1;
+            buffer[len] = '\0';
+            return len;
+        }
+        if (len == size - 1) break;
+        offset += avail;
+    }
+
+    buffer[len] = '\0';
+    *next = pager_next_line(p, offset);
+
+    return len;
+}
+
+/*****************************************************************************
+ * pager_render_rows
+ *
+ * Description:
+ *
+ *   Draws rows of the viewport. Only the given rows are read from the file
+ *   and they are written to the console as a single block.
+ *
+ * Parameters:
+ *
+ *   p     - pager
+ *   first - first row of the viewport to be drawn
+ *   count - number of rows
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console using the current text attributes.
+ *****************************************************************************/
+
+static void pager_render_rows(Pager *p, int first, int count) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    CHAR_INFO *cells;
+    char buffer[PAGER_LINE_MAX];
+    Tcl_WideInt offset;
+    int row, len, have;
+
+    if (count <= 0 || p->width <= 0) return;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    cells = (CHAR_INFO *) ckalloc(p->width * count * sizeof(CHAR_INFO));
+
+    have = pager_line_offset(p, p->top + first, &offset);
+    for (row = 0; row < count; row++) {
+        if (have) {
+            len = pager_read_line(p, offset, buffer, PAGER_LINE_MAX, &offset);
+            have = offset < p->size;
+        }
+        else {
+            buffer[0] = '\0';
+            len = 0;
+        }
+        cells_from_utf8(cells + row * p->width, p->width, buffer, len,
+                        info.wAttributes);
+    }
+
+    console_write_cells(hStdout, cells, p->x, p->y + first, p->width, count);
+    ckfree((char *) cells);
+}
+
+/*****************************************************************************
+ * pager_scroll
+ *
+ * Description:
+ *
+ *   Scrolls the viewport. The scrolling stops when the last line of the
+ *   file reaches the bottom of the viewport. Small scrolls move the
+ *   existing rows with the console and only draw the exposed rows.
+ *
+ * Parameters:
+ *
+ *   p     - pager
+ *   lines - number of lines to scroll, negative values scroll up
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+static void pager_scroll(Pager *p, Tcl_WideInt lines) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Tcl_WideInt top, offset, delta;
+
+    top = p->top + lines;
+    if (lines > 0 && !pager_line_offset(p, top + p->height - 1, &offset)) {
+        top = p->lineCount - p->height;
+    }
+    if (top < 0) top = 0;
+
+    delta = top - p->top;
+    if (delta == 0) return;
+    p->top = top;
+
+    if (delta >= p->height || -delta >= p->height) {
+        pager_render_rows(p, 0, p->height);
+        return;
+    }
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    console_scroll(hStdout, p->x, p->y, p->width, p->height, (int) delta,
+                   info.wAttributes);
+
+    if (delta > 0) {
+        pager_render_rows(p, p->height - (int) delta, (int) delta);
+    }
+    else {
+        pager_render_rows(p, 0, (int) -delta);
+    }
+}
+
+/*****************************************************************************
+ * pager_search
+ *
+ * Description:
+ *
+ *   Searches the file for a literal string. The search goes through the
+ *   mapped windows with memchr and memcmp, so the file is never copied.
+ *   Near the end of a window, a window starting at the search position is
+ *   mapped, so matches across window boundaries are found too.
+ *
+ * Parameters:
+ *
+ *   p       - pager
+ *   pattern - bytes to be searched for
+ *   len     - length of the pattern
+ *   from    - first offset where a match may start
+ *   to      - offset after the last position where a match may start
+ *   last    - non-zero to find the last match instead of the first one
+ *
+ * Results:
+ *
+ *   Returns the offset of the match, or -1 if there is no match.
+ *
+ * Side effects:
+ *
+ *   May move the mapped window.
+ *****************************************************************************/
+
+static Tcl_WideInt pager_search(Pager *p,
+                                const char *pattern,
+                                int len,
+                                Tcl_WideInt from,
+                                Tcl_WideInt to,
+                                int last) {
+    unsigned char *ptr, *hit, *end;
+    Tcl_WideInt avail, pos, lo, hi, found, match;
+
+    if (len <= 0) return -1;
+
+    if (last) {
+        for (hi = to; hi > from; hi = lo) {
+            lo = hi - PAGER_VIEW_SIZE / 2;
+            if (lo < from) lo = from;
+            found = -1;
+            pos = lo;
+            while ((match = pager_search(p, pattern, len, pos, hi, 0)) >= 0) {
+                found = match;
+                pos = match + 1;
+            }
+            if (found >= 0) return found;
+        }
+        return -1;
+    }
+
+    pos = from;
+    while (pos < to && pos + len <= p->size) {
+        ptr = pager_map(p, pos, &avail);
+
+        /* A match may straddle the end of the view, so map a view that
+           starts at pos instead of stopping */
+
+        if (ptr != NULL && avail < len &&
+            p->viewOffset + p->viewLen < p->size) {
+            UnmapViewOfFile(p->view);
+            p->view = NULL;
+            ptr = pager_map(p, pos, &avail);
+        }
+        if (ptr == NULL || avail < len) break;
+
+        end = ptr + (avail - len + 1);
+        if (end > ptr + (to - pos)) end = ptr + (to - pos);
+
+        for (hit = ptr; hit < end; hit++) {
+            hit = (unsigned char *) memchr(hit, pattern[0], end - hit);
+            if (hit == NULL) break;
+            if (memcmp(hit, pattern, len) == 0) return pos + (hit - ptr);
+        }
+
+        pos += end - ptr;
+    }
+
+    return -1;
+}
+
+/*****************************************************************************
+ * pager_free
+ *
+ * Description:
+ *
+ *   Releases a pager when its command is deleted.
+ *
+ * Parameters:
+ *
+ *   clientData - pager
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Unmaps and closes the file.
+ *****************************************************************************/
+
+static void pager_free(ClientData clientData) {
+    Pager *p = (Pager *) clientData;
+
+    if (p->view != NULL) UnmapViewOfFile(p->view);
+    if (p->mapping != NULL) CloseHandle(p->mapping);
+    CloseHandle(p->file);
+    ckfree((char *) p->checkpoints);
+    ckfree((char *) p);
+}
+
+/*****************************************************************************
+ * table_get_row
+ *
+ * Description:
+ *
+ *   Returns the data of a table row. If the table gets its rows from a
+ *   fetch command, the command is called for a window of rows around the
+ *   requested one (TABLE_FETCH_PAGES times the visible height), and the
+ *   result is kept until a row outside of the window is needed.
+ *
+ * Parameters:
+ *
+ *   t     - table
+ *   index - row index
+ *   row   - receives the row as a list object, or NULL if there is no such
+ *           row
+ *
+ * Results:
+ *
+ *   TCL_OK    - the row was found or doesn't exist
+ *   TCL_ERROR - the fetch command failed, or deleted the table or changed
+ *               its columns or rows. The caller must not use the table
+ *               after an error.
+ *
+ * Side effects:
+ *
+ *   May call the fetch command.
+ *****************************************************************************/
+
+static int table_get_row(Table *t, int index, Tcl_Obj **row) {
+    Tcl_Obj *cmd;
+    int len, first, body, code, changes;
+
+    *row = NULL;
+    if (index < 0 || index >= t->rowCount) return TCL_OK;
+
+    if (t->rows != NULL) {
+        return Tcl_ListObjIndex(t->interp, t->rows, index, row);
+    }
+
+    if (t->fetch == NULL) return TCL_OK;
+
+    if (t->cache != NULL) {
+        if (Tcl_ListObjLength(t->interp, t->cache, &len) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (index >= t->cacheFirst && index < t->cacheFirst + len) {
+            return Tcl_ListObjIndex(t->interp, t->cache,
+                                    index - t->cacheFirst, row);
+        }
+    }
+
+    body = t->height > 1 ? t->height - 1 : 1;
+    first = index - body;
+    if (first < 0) first = 0;
+
+    cmd = Tcl_DuplicateObj(t->fetch);
+    Tcl_IncrRefCount(cmd);
+    code = Tcl_ListObjAppendElement(t->interp, cmd, Tcl_NewIntObj(first));
+    if (code == TCL_OK) {
+        code = Tcl_ListObjAppendElement(t->interp, cmd,
+                   Tcl_NewIntObj(body * TABLE_FETCH_PAGES));
+    }
+
+    /* The fetch command may delete or change the table */
+
+    changes = t->changes;
+    Tcl_Preserve((ClientData) t);
+    if (code == TCL_OK) code = Tcl_EvalObjEx(t->interp, cmd, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(cmd);
+    if (code == TCL_OK && (t->deleted || t->changes != changes)) {
+        Tcl_SetObjResult(t->interp, Tcl_NewStringObj(t->deleted ?
+            "table deleted by its fetch command" :
+            "table changed by its fetch command", -1));
+        code = TCL_ERROR;
+    }
+    Tcl_Release((ClientData) t);
+    if (code != TCL_OK) return TCL_ERROR;
+
+    if (t->cache != NULL) Tcl_DecrRefCount(t->cache);
+    t->cache = Tcl_GetObjResult(t->interp);
+    Tcl_IncrRefCount(t->cache);
+    t->cacheFirst = first;
+    Tcl_ResetResult(t->interp);
+
+    if (Tcl_ListObjLength(t->interp, t->cache, &len) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (index - first < len) {
+        return Tcl_ListObjIndex(t->interp, t->cache, index - first, row);
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * table_layout
+ *
+ * Description:
+ *
+ *   Computes the widths of the table columns. Columns with an automatic
+ *   width are as wide as their widest cell or title. With a row list all
+ *   rows are measured; with a fetch command only the visible rows are.
+ *   The widths are computed once and reused until the columns or the rows
+ *   are replaced, so scrolling and redrawing never measure cells again.
+ *
+ * Parameters:
+ *
+ *   t - table
+ *
+ * Results:
+ *
+ *   TCL_OK    - the layout is up to date
+ *   TCL_ERROR - the row data was not a valid list or fetching rows failed
+ *
+ * Side effects:
+ *
+ *   Updates the column widths.
+ *****************************************************************************/
+
+static int table_layout(Table *t) {
+    Tcl_Obj *row, *cell;
+    char *str;
+    int c, i, first, last, len, w, automatic;
+
+    if (t->widthsValid) return TCL_OK;
+
+    automatic = 0;
+    for (c = 0; c < t->numColumns; c++) {
+        if (t->fixed[c] > 0) {
+            t->widths[c] = t->fixed[c];
+        }
+        else {
+            str = Tcl_GetStringFromObj(t->titles[c], &len);
+            t->widths[c] = text_width((unsigned char *) str, len);
+            automatic = 1;
+        }
+    }
+
+    if (automatic) {
+        first = t->rows != NULL ? 0 : t->top;
+        last = t->rows != NULL ? t->rowCount : t->top + t->height - 1;
+        if (last > t->rowCount) last = t->rowCount;
+
+        for (i = first; i < last; i++) {
+            if (table_get_row(t, i, &row) != TCL_OK) return TCL_ERROR;
+            if (row == NULL) continue;
+            for (c = 0; c < t->numColumns; c++) {
+                if (t->fixed[c] > 0) continue;
+                if (Tcl_ListObjIndex(t->interp, row, c, &cell) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (cell == NULL) continue;
+                str = Tcl_GetStringFromObj(cell, &len);
+                w = text_width((unsigned char *) str, len);
+                if (w > t->widths[c]) t->widths[c] = w;
+            }
+        }
+    }
+
+    for (c = 0; c < t->numColumns; c++) {
+        if (t->widths[c] > t->width) t->widths[c] = t->width;
+    }
+    t->widthsValid = 1;
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * table_fill_row
+ *
+ * Description:
+ *
+ *   Converts a table row, or the header row, to console cells. Columns are
+ *   separated by a single space, cells are truncated to the column width
+ *   and right-aligned columns are padded on the left.
+ *
+ * Parameters:
+ *
+ *   t     - table
+ *   index - row index, or -1 for the header
+ *   cells - row of t->width cells to be filled
+ *
+ * Results:
+ *
+ *   TCL_OK    - the row was converted
+ *   TCL_ERROR - the row data was not a valid list or fetching rows failed
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int table_fill_row(Table *t, int index, CHAR_INFO *cells) {
+    Tcl_Obj *row, *cell;
+    WORD attr, cellAttr;
+    char *str;
+    int c, i, col, w, pad, len;
+
+    if (index < 0) {
+        attr = t->attrHeader;
+        row = NULL;
+    }
+    else {
+        attr = index == t->selected ? t->attrSelected : t->attrBody;
+        if (table_get_row(t, index, &row) != TCL_OK) return TCL_ERROR;
+    }
+
+    for (i = 0; i < t->width; i++) {
+        cells[i].Char.UnicodeChar = ' ';
+        cells[i].Attributes = attr;
+    }
+    if (index >= 0 && row == NULL) return TCL_OK;
+
+    col = 0;
+    for (c = 0; c < t->numColumns && col < t->width; c++) {
+        w = t->widths[c];
+        if (w > t->width - col) w = t->width - col;
+
+        if (index < 0) {
+            cell = t->titles[c];
+        }
+        else if (Tcl_ListObjIndex(t->interp, row, c, &cell) != TCL_OK) {
+            return TCL_ERROR;
+        }
+
+        cellAttr = attr;
+        if (c == t->sortColumn) {
+            if (index < 0) {
+                cellAttr = (t->attrHeader & 0xF0) | (t->attrSort & 0x0F);
+            }
+            else if (index != t->selected) {
+                cellAttr = t->attrSort;
+            }
+        }
+
+        str = "";
+        len = 0;
+        if (cell != NULL) str = Tcl_GetStringFromObj(cell, &len);
+
+        pad = 0;
+        if (t->right[c]) {
+            pad = w - text_width((unsigned char *) str, len);
+            if (pad < 0) pad = 0;
+        }
+        for (i = 0; i < pad; i++) cells[col + i].Attributes = cellAttr;
+        cells_from_utf8(cells + col + pad, w - pad, str, len, cellAttr);
+
+        col += t->widths[c] + 1;
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * table_render_rows
+ *
+ * Description:
+ *
+ *   Draws visible rows of the table body as a single block.
+ *
+ * Parameters:
+ *
+ *   t     - table
+ *   first - first row to be drawn, relative to the first visible row
+ *   count - number of rows
+ *
+ * Results:
+ *
+ *   TCL_OK    - the rows were drawn
+ *   TCL_ERROR - the row data was not a valid list or fetching rows failed
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+static int table_render_rows(Table *t, int first, int count) {
+    CHAR_INFO *cells;
+    int body, i;
+
+    body = t->height - 1;
+    if (first < 0) {
+        count += first;
+        first = 0;
+    }
+    if (first + count > body) count = body - first;
+    if (count <= 0 || t->width <= 0) return TCL_OK;
+
+    if (table_layout(t) != TCL_OK) return TCL_ERROR;
+
+    cells = (CHAR_INFO *) ckalloc(t->width * count * sizeof(CHAR_INFO));
+    for (i = 0; i < count; i++) {
+        if (table_fill_row(t, t->top + first + i,
+                           cells + i * t->width) != TCL_OK) {
+            ckfree((char *) cells);
+            return TCL_ERROR;
+        }
+    }
+
+    console_write_cells(hStdout, cells, t->x, t->y + 1 + first,
+                        t->width, count);
+    ckfree((char *) cells);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * table_render_header
+ *
+ * Description:
+ *
+ *   Draws the header row of the table.
+ *
+ * Parameters:
+ *
+ *   t - table
+ *
+ * Results:
+ *
+ *   TCL_OK    - the header was drawn
+ *   TCL_ERROR - computing the column widths failed
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+static int table_render_header(Table *t) {
+    CHAR_INFO *cells;
+
+    if (t->height < 1 || t->width <= 0) return TCL_OK;
+    if (table_layout(t) != TCL_OK) return TCL_ERROR;
+
+    cells = (CHAR_INFO *) ckalloc(t->width * sizeof(CHAR_INFO));
+    table_fill_row(t, -1, cells);
+    console_write_cells(hStdout, cells, t->x, t->y, t->width, 1);
+    ckfree((char *) cells);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * table_scroll
+ *
+ * Description:
+ *
+ *   Scrolls the table body. The visible rows are moved with the console
+ *   and only the exposed rows are drawn, so scrolling one row writes one
+ *   row of cells no matter how large the table is.
+ *
+ * Parameters:
+ *
+ *   t    - table
+ *   rows - number of rows to scroll, negative values scroll up
+ *
+ * Results:
+ *
+ *   TCL_OK    - the table was scrolled
+ *   TCL_ERROR - fetching rows failed
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+static int table_scroll(Table *t, int rows) {
+    int body, top, maxTop, delta;
+
+    body = t->height - 1;
+    if (body <= 0) return TCL_OK;
+
+    maxTop = t->rowCount - body;
+    if (maxTop < 0) maxTop = 0;
+    top = t->top + rows;
+    if (top > maxTop) top = maxTop;
+    if (top < 0) top = 0;
+
+    delta = top - t->top;
+    if (delta == 0) return TCL_OK;
+    t->top = top;
+
+    if (delta >= body || -delta >= body) {
+        return table_render_rows(t, 0, body);
+    }
+
+    console_scroll(hStdout, t->x, t->y + 1, t->width, body, delta,
+                   t->attrBody);
+
+    if (delta > 0) return table_render_rows(t, body - delta, delta);
+
+    return table_render_rows(t, 0, -delta);
+}
+
+/*****************************************************************************
+ * table_clear_columns
+ *
+ * Description:
+ *
+ *   Releases the column definitions of a table.
+ *
+ * Parameters:
+ *
+ *   t - table
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Frees memory.
+ *****************************************************************************/
+
+static void table_clear_columns(Table *t) {
+    int c;
+
+    for (c = 0; c < t->numColumns; c++) Tcl_DecrRefCount(t->titles[c]);
+    if (t->titles != NULL) ckfree((char *) t->titles);
+    if (t->fixed != NULL) ckfree((char *) t->fixed);
+    if (t->right != NULL) ckfree((char *) t->right);
+    if (t->widths != NULL) ckfree((char *) t->widths);
+    t->titles = NULL;
+    t->fixed = NULL;
+    t->right = NULL;
+    t->widths = NULL;
+    t->numColumns = 0;
+    t->widthsValid = 0;
+}
+
+/*****************************************************************************
+ * table_free, table_release
+ *
+ * Description:
+ *
+ *   Releases a table when its command is deleted. The memory is released
+ *   by table_release once no fetch command is running for the table.
+ *
+ * Parameters:
+ *
+ *   clientData - table
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Frees memory.
+ *****************************************************************************/
+
+static void table_free(ClientData clientData) {
+    Table *t = (Table *) clientData;
+
+    table_clear_columns(t);
+    if (t->rows != NULL) Tcl_DecrRefCount(t->rows);
+    if (t->fetch != NULL) Tcl_DecrRefCount(t->fetch);
+    if (t->cache != NULL) Tcl_DecrRefCount(t->cache);
+    t->rows = t->fetch = t->cache = NULL;
+    t->rowCount = 0;
+    t->deleted = 1;
+
+    Tcl_EventuallyFree(clientData, table_release);
+}
+
+static void table_release(char *clientData) {
+    ckfree(clientData);
+}
+
+/*****************************************************************************
+ * export_touch
+ *
+ * Description:
+ *
+ *   Notes that the console has been written to. If a screen export is
+ *   active, an update of the shared memory is scheduled to run when the
+ *   event loop is next idle, so a burst of output results in a single
+ *   update. A frame of the escape sequence encoder is scheduled the same
+ *   way.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Schedules an idle callback.
+ *****************************************************************************/
+
+static void export_touch(void) {
+    encoder_touch();
+    find_touch();
+
+    if (exportView == NULL || exportPending) return;
+
+    exportPending = 1;
+    Tcl_DoWhenIdle(export_idle, NULL);
+}
+
+/*****************************************************************************
+ * export_idle
+ *
+ * Description:
+ *
+ *   Idle callback scheduled by export_touch.
+ *
+ * Parameters:
+ *
+ *   clientData - not used
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Updates the shared memory.
+ *****************************************************************************/
+
+static void export_idle(ClientData clientData) {
+    exportPending = 0;
+    export_sync();
+}
+
+/*****************************************************************************
+ * export_sync
+ *
+ * Description:
+ *
+ *   Copies the visible console window to the shared memory. The window is
+ *   read into a private buffer and compared with the exported cells row by
+ *   row; only the rows that differ are written, and their entries in the
+ *   row array are set to the new frame number. Nothing is written at all if
+ *   neither the cells nor the cursor have changed.
+ *
+ *   The update is bracketed by two increments of the sequence counter, so
+ *   the counter is odd while the update is in progress. A reader copies
+ *   what it needs between two reads of the counter and retries if the
+ *   values differ or are odd.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns the number of rows written.
+ *
+ * Side effects:
+ *
+ *   Writes to the shared memory.
+ *****************************************************************************/
+
+static int export_sync(void) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    CONSOLE_CURSOR_INFO cursor;
+    ExportHeader *h = exportView;
+    CHAR_INFO *cells;
+    DWORD *rows;
+    DWORD width, height, cursorX, cursorY, visible, frame;
+    int x, y, count, resized;
+    size_t rowBytes;
+
+    if (h == NULL) return 0;
+
+    GetConsoleScreenBufferInfo(screens[screenActive], &info);
+    GetConsoleCursorInfo(screens[screenActive], &cursor);
+
+    width = info.srWindow.Right - info.srWindow.Left + 1;
+    height = info.srWindow.Bottom - info.srWindow.Top + 1;
+    if (width > h->maxWidth) width = h->maxWidth;
+    if (height > h->maxHeight) height = h->maxHeight;
+    visible = cursor.bVisible ? 1 : 0;
+
+    /* A cursor scrolled out of the window is reported as hidden at the
+       nearest cell, as the header fields are unsigned */
+
+    x = info.dwCursorPosition.X - info.srWindow.Left;
+    y = info.dwCursorPosition.Y - info.srWindow.Top;
+    if (x < 0 || y < 0 || x >= (int) width || y >= (int) height) {
+        visible = 0;
+        if (x < 0) x = 0;
+        if (y < 0) y = 0;
+        if (x >= (int) width) x = width - 1;
+        if (y >= (int) height) y = height - 1;
+    }
+    cursorX = x;
+    cursorY = y;
+    rowBytes = width * sizeof(CHAR_INFO);
+
+    console_read_cells(screens[screenActive], exportBuffer,
+                       info.srWindow.Left, info.srWindow.Top, width, height);
+
+    cells = (CHAR_INFO *) ((char *) h + h->cellsOffset);
+    rows = (DWORD *) ((char *) h + h->rowsOffset);
+    resized = (width != h->width || height != h->height);
+
+    count = 0;
+    for (y = 0; y < (int) height; y++) {
+        if (resized || memcmp(cells + y * h->maxWidth,
+                              exportBuffer + y * width, rowBytes) != 0) {
+            count++;
+        }
+    }
+
+    if (count == 0 && cursorX == h->cursorX && cursorY == h->cursorY &&
+        visible == h->cursorVisible && info.wAttributes == h->attributes) {
+        return 0;
+    }
+
+    frame = h->frame + 1;
+    InterlockedIncrement(&h->sequence);
+
+    for (y = 0; y < (int) height; y++) {
+        if (resized || memcmp(cells + y * h->maxWidth,
+                              exportBuffer + y * width, rowBytes) != 0) {
+            memcpy(cells + y * h->maxWidth, exportBuffer + y * width,
+                   rowBytes);
+            rows[y] = frame;
+        }
+    }
+    h->width = width;
+    h->height = height;
+    h->cursorX = cursorX;
+    h->cursorY = cursorY;
+    h->cursorVisible = visible;
+    h->attributes = info.wAttributes;
+    h->frame = frame;
+
+    InterlockedIncrement(&h->sequence);
+
+    return count;
+}
+
+/*****************************************************************************
+ * export_close
+ *
+ * Description:
+ *
+ *   Stops the screen export. The file is left in place, so observers
+ *   still see the last frame.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Unmaps and closes the export file.
+ *****************************************************************************/
+
+static void export_close(void) {
+    if (exportPending) {
+        Tcl_CancelIdleCall(export_idle, NULL);
+        exportPending = 0;
+    }
+    if (exportView != NULL) UnmapViewOfFile(exportView);
+    if (exportMapping != NULL) CloseHandle(exportMapping);
+    if (exportFile != NULL) CloseHandle(exportFile);
+    if (exportBuffer != NULL) ckfree((char *) exportBuffer);
+    exportView = NULL;
+    exportMapping = NULL;
+    exportFile = NULL;
+    exportBuffer = NULL;
+}
+
+/*****************************************************************************
+ * caps_build
+ *
+ * Description:
+ *
+ *   Returns the build number of Windows. GetVersionEx reports the version
+ *   the application was manifested for, so RtlGetVersion is used when it
+ *   is available.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Windows build number, or 0 if it is not known.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int caps_build(void) {
+    typedef LONG (WINAPI *RtlGetVersionProc)(OSVERSIONINFOW *);
+    RtlGetVersionProc proc;
+    OSVERSIONINFOW version;
+    HANDLE ntdll;
+
+    ntdll = GetModuleHandle("ntdll.dll");
+    if (ntdll == NULL) return 0;
+    proc = (RtlGetVersionProc) GetProcAddress(ntdll, "RtlGetVersion");
+    if (proc == NULL) return 0;
+
+    memset(&version, 0, sizeof(version));
+    version.dwOSVersionInfoSize = sizeof(version);
+    if (proc(&version) != 0) return 0;
+
+    return version.dwBuildNumber;
+}
+
+/*****************************************************************************
+ * caps_identity
+ *
+ * Description:
+ *
+ *   Builds the key under which the capabilities of the current terminal
+ *   are cached. The key consists of the environment variables identifying
+ *   the terminal emulator and the Windows build, which determines the
+ *   version of the console host.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter whose env array is used
+ *
+ * Results:
+ *
+ *   New string object.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static Tcl_Obj *caps_identity(Tcl_Interp *interp) {
+    CONST char *names[] = {"TERM", "TERM_PROGRAM", "TERM_PROGRAM_VERSION",
+                           "COLORTERM", "ConEmuANSI", NULL};
+    CONST char *value;
+    Tcl_Obj *key;
+    int i;
+
+    key = Tcl_NewObj();
+    for (i = 0; names[i] != NULL; i++) {
+        value = Tcl_GetVar2(interp, "env", names[i], TCL_GLOBAL_ONLY);
+        Tcl_AppendPrintfToObj(key, "%s=%s;", names[i],
+                              value != NULL ? value : "");
+    }
+
+    /* The session id changes every time, only its presence matters */
+
+    value = Tcl_GetVar2(interp, "env", "WT_SESSION", TCL_GLOBAL_ONLY);
+    Tcl_AppendPrintfToObj(key, "WT=%d;build=%d", value != NULL,
+                          caps_build());
+
+    return key;
+}
+
+/*****************************************************************************
+ * caps_cache_path
+ *
+ * Description:
+ *
+ *   Returns the name of the capability cache file. The file is
+ *   %LOCALAPPDATA%\Consio\caps.cache unless the CONSIO_CAPS_CACHE
+ *   environment variable names another file.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter whose env array is used
+ *
+ * Results:
+ *
+ *   New path object, or NULL if there is nowhere to keep the cache.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static Tcl_Obj *caps_cache_path(Tcl_Interp *interp) {
+    CONST char *value;
+
+    value = Tcl_GetVar2(interp, "env", "CONSIO_CAPS_CACHE", TCL_GLOBAL_ONLY);
+    if (value != NULL) return Tcl_NewStringObj(value, -1);
+
+    value = Tcl_GetVar2(interp, "env", "LOCALAPPDATA", TCL_GLOBAL_ONLY);
+    if (value == NULL) return NULL;
+
+    return Tcl_ObjPrintf("%s/Consio/%s", value, CAPS_CACHE_NAME);
+}
+
+/*****************************************************************************
+ * caps_load
+ *
+ * Description:
+ *
+ *   Reads the capability cache file. The first line of the file is
+ *   CAPS_MAGIC and every other line holds a terminal identity and a
+ *   capability dictionary separated by a tab.
+ *
+ * Parameters:
+ *
+ *   path - cache file
+ *
+ * Results:
+ *
+ *   New dictionary mapping identities to capabilities. The dictionary is
+ *   empty if the file is missing or has an unknown format.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static Tcl_Obj *caps_load(Tcl_Obj *path) {
+    Tcl_Channel channel;
+    Tcl_Obj *entries, *line;
+    char *str, *tab;
+    int len, size;
+
+    entries = Tcl_NewDictObj();
+    channel = Tcl_FSOpenFileChannel(NULL, path, "r", 0);
+    if (channel == NULL) return entries;
+
+    line = Tcl_NewObj();
+    Tcl_IncrRefCount(line);
+    if (Tcl_GetsObj(channel, line) >= 0 &&
+        strcmp(Tcl_GetString(line), CAPS_MAGIC) == 0) {
+        for (;;) {
+            Tcl_SetObjLength(line, 0);
+            if (Tcl_GetsObj(channel, line) < 0) break;
+            str = Tcl_GetStringFromObj(line, &len);
+            tab = strchr(str, '\t');
+            if (tab == NULL) continue;
+            size = tab - str;
+            Tcl_DictObjPut(NULL, entries, Tcl_NewStringObj(str, size),
+                           Tcl_NewStringObj(tab + 1, len - size - 1));
+        }
+    }
+    Tcl_DecrRefCount(line);
+    Tcl_Close(NULL, channel);
+
+    return entries;
+}
+
+/*****************************************************************************
+ * caps_store
+ *
+ * Description:
+ *
+ *   Adds or replaces the capabilities of one terminal in the cache file.
+ *   Failures are ignored; without a cache the capabilities are probed
+ *   again next time.
+ *
+ * Parameters:
+ *
+ *   path - cache file
+ *   key  - terminal identity
+ *   caps - capability dictionary
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Rewrites the cache file, creating its directory if needed.
+ *****************************************************************************/
+
+static void caps_store(Tcl_Obj *path, Tcl_Obj *key, Tcl_Obj *caps) {
+    Tcl_Channel channel;
+    Tcl_DictSearch search;
+    Tcl_Obj *entries, *parts, *dir, *k, *v;
+    int count, done;
+
+    entries = caps_load(path);
+    Tcl_IncrRefCount(entries);
+    Tcl_DictObjPut(NULL, entries, key, caps);
+
+    parts = Tcl_FSSplitPath(path, &count);
+    Tcl_IncrRefCount(parts);
+    if (count > 1) {
+        dir = Tcl_FSJoinPath(parts, count - 1);
+        Tcl_IncrRefCount(dir);
+        Tcl_FSCreateDirectory(dir);
+        Tcl_DecrRefCount(dir);
+    }
+    Tcl_DecrRefCount(parts);
+
+    channel = Tcl_FSOpenFileChannel(NULL, path, "w", 0666);
+    if (channel != NULL) {
+        Tcl_WriteChars(channel, CAPS_MAGIC "\n", -1);
+        Tcl_DictObjFirst(NULL, entries, &search, &k, &v, &done);
+        for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+            Tcl_WriteObj(channel, k);
+            Tcl_WriteChars(channel, "\t", 1);
+            Tcl_WriteObj(channel, v);
+            Tcl_WriteChars(channel, "\n", 1);
+        }
+        Tcl_DictObjDone(&search);
+        Tcl_Close(NULL, channel);
+    }
+
+    Tcl_DecrRefCount(entries);
+}
+
+/*****************************************************************************
+ * caps_query
+ *
+ * Description:
+ *
+ *   Sends capability queries to the terminal and collects the replies,
+ *   which arrive as console input when virtual terminal input is enabled.
+ *   The queries ask for the terminal version (XTVERSION), the synchronized
+ *   output and bracketed paste modes (DECRQM) and finally the primary
+ *   device attributes (DA1). Every terminal answers DA1, so its reply ends
+ *   the wait early; CAPS_TIMEOUT limits the wait for terminals that do not
+ *   answer at all. All keys typed during the wait are put back into the
+ *   input buffer, CAPS_KEEP_CHUNK events at a time.
+ *
+ * Parameters:
+ *
+ *   reply - buffer for the replies
+ *   size  - size of the buffer
+ *
+ * Results:
+ *
+ *   Length of the replies in bytes.
+ *
+ * Side effects:
+ *
+ *   Writes to the console and reads from the console input.
+ *****************************************************************************/
+
+static int caps_query(char *reply, int size) {
+    static const char query[] = "\033[>0q\033[?2026$p\033[?2004$p\033[c";
+    INPUT_RECORD record;
+    INPUT_RECORD *kept = NULL;
+    DWORD inMode, num, elapsed, start;
+    int len = 0, numKept = 0, capKept = 0, inReply = 0, done = 0;
+    int c, i;
+
+    GetConsoleMode(hStdin, &inMode);
+    if (!SetConsoleMode(hStdin, ENABLE_VIRTUAL_TERMINAL_INPUT)) return 0;
+    WriteConsole(hStdout, query, sizeof(query) - 1, &num, NULL);
+
+    start = GetTickCount();
+    while (!done) {
+        elapsed = GetTickCount() - start;
+        if (elapsed >= CAPS_TIMEOUT ||
+            WaitForSingleObject(hStdin, CAPS_TIMEOUT - elapsed) !=
+            WAIT_OBJECT_0) {
+            break;
+        }
+        ReadConsoleInputW(hStdin, &record, 1, &num);
+        if (num == 0) continue;
+
+        if (record.EventType == KEY_EVENT) {
+            c = record.Event.KeyEvent.uChar.UnicodeChar;
+            if (c == 27) inReply = 1;
+            if (inReply) {
+                if (record.Event.KeyEvent.bKeyDown && len < size - 1) {
+                    reply[len++] = (char) c;
+                    reply[len] = '\0';
+
+                    /* The DA1 reply is ESC [ ? digits and semicolons c */
+
+                    if (c == 'c') {
+                        i = len - 2;
+                        while (i >= 0 && ((reply[i] >= '0' &&
+                                           reply[i] <= '9') ||
+                                          reply[i] == ';')) {
+                            i--;
+                        }
+                        done = i >= 2 && reply[i] == '?' &&
+                               reply[i - 1] == '[' && reply[i - 2] == 27;
+                    }
+                }
+                continue;
+            }
+        }
+        if (numKept == capKept) {
+            capKept += CAPS_KEEP_CHUNK;
+            kept = (INPUT_RECORD *) ckrealloc((char *) kept,
+                                              capKept * sizeof(INPUT_RECORD));
+        }
+        kept[numKept++] = record;
+    }
+
+    SetConsoleMode(hStdin, inMode);
+    for (i = 0; i < numKept; i += CAPS_KEEP_CHUNK) {
+        WriteConsoleInputW(hStdin, kept + i, numKept - i < CAPS_KEEP_CHUNK ?
+                           numKept - i : CAPS_KEEP_CHUNK, &num);
+    }
+    if (kept != NULL) ckfree((char *) kept);
+
+    return len;
+}
+
+/*****************************************************************************
+ * caps_mode
+ *
+ * Description:
+ *
+ *   Looks for the DECRQM reply ESC [ ? mode ; value $ y of the given mode
+ *   in the replies collected by caps_query.
+ *
+ * Parameters:
+ *
+ *   reply - replies
+ *   mode  - private mode number
+ *
+ * Results:
+ *
+ *   1 if the terminal recognizes the mode, 0 otherwise.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int caps_mode(const char *reply, int mode) {
+    char prefix[16];
+    const char *p;
+
+    sprintf(prefix, "\033[?%d;", mode);
+    p = strstr(reply, prefix);
+    if (p == NULL) return 0;
+    p += strlen(prefix);
+
+    /* 0 means unknown, 1 to 4 set, reset, permanently set or reset */
+
+    return p[0] >= '1' && p[0] <= '4' && p[1] == '$' && p[2] == 'y';
+}
+
+/*****************************************************************************
+ * caps_probe
+ *
+ * Description:
+ *
+ *   Detects the capabilities of the console. Virtual terminal processing
+ *   is detected by trying to enable it. If it is available, the terminal
+ *   is queried for the rest with caps_query.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter whose env array is used
+ *
+ * Results:
+ *
+ *   New capability dictionary.
+ *
+ * Side effects:
+ *
+ *   See caps_query. The output mode is restored.
+ *****************************************************************************/
+
+static Tcl_Obj *caps_probe(Tcl_Interp *interp) {
+    char reply[CAPS_REPLY_MAX];
+    CONST char *colorterm, *wt;
+    Tcl_Obj *caps;
+    DWORD outMode, buttons;
+    char *start, *end;
+    int vt, build, truecolor, mouse;
+
+    reply[0] = '\0';
+    build = caps_build();
+
+    vt = GetConsoleMode(hStdout, &outMode) &&
+         SetConsoleMode(hStdout, outMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    if (vt) {
+        caps_query(reply, sizeof(reply));
+        SetConsoleMode(hStdout, outMode);
+    }
+
+    /* 24-bit colors came to the console host in build 14931 */
+
+    colorterm = Tcl_GetVar2(interp, "env", "COLORTERM", TCL_GLOBAL_ONLY);
+    wt = Tcl_GetVar2(interp, "env", "WT_SESSION", TCL_GLOBAL_ONLY);
+    truecolor = vt && (build >= 14931 || wt != NULL ||
+                       (colorterm != NULL &&
+                        (strcmp(colorterm, "truecolor") == 0 ||
+                         strcmp(colorterm, "24bit") == 0)));
+
+    /* The console reports mouse input if it has a mouse with buttons */
+
+    mouse = GetNumberOfConsoleMouseButtons(&buttons) && buttons > 0;
+
+    caps = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, caps, Tcl_NewStringObj("vt", -1),
+                   Tcl_NewBooleanObj(vt));
+    Tcl_DictObjPut(NULL, caps, Tcl_NewStringObj("colors", -1),
+                   Tcl_NewIntObj(truecolor ? 16777216 : vt ? 256 : 16));
+    Tcl_DictObjPut(NULL, caps, Tcl_NewStringObj("truecolor", -1),
+                   Tcl_NewBooleanObj(truecolor));
+    Tcl_DictObjPut(NULL, caps, Tcl_NewStringObj("mouse", -1),
+                   Tcl_NewBooleanObj(mouse));
+    Tcl_DictObjPut(NULL, caps, Tcl_NewStringObj("bracketedpaste", -1),
+                   Tcl_NewBooleanObj(caps_mode(reply, 2004)));
+    Tcl_DictObjPut(NULL, caps, Tcl_NewStringObj("syncoutput", -1),
+                   Tcl_NewBooleanObj(caps_mode(reply, 2026)));
+
+    /* XTVERSION reply is DCS > | name version ST */
+
+    start = strstr(reply, "\033P>|");
+    end = start != NULL ? strstr(start, "\033\\") : NULL;
+    Tcl_DictObjPut(NULL, caps, Tcl_NewStringObj("terminal", -1),
+                   end != NULL ? Tcl_NewStringObj(start + 4, end - start - 4)
+                               : Tcl_NewObj());
+    Tcl_DictObjPut(NULL, caps, Tcl_NewStringObj("build", -1),
+                   Tcl_NewIntObj(build));
+
+    return caps;
+}
+
+/*****************************************************************************
+ * caps_get
+ *
+ * Description:
+ *
+ *   Returns the capabilities of the console. They are determined on the
+ *   first call only: the cache file is consulted first and the terminal is
+ *   probed only if it has no entry for the current terminal identity.
+ *
+ * Parameters:
+ *
+ *   interp  - interpreter whose env array is used
+ *   refresh - non-zero to ignore the cache and probe again
+ *
+ * Results:
+ *
+ *   Capability dictionary, owned by the library.
+ *
+ * Side effects:
+ *
+ *   May probe the terminal and write the cache file.
+ *****************************************************************************/
+
+static Tcl_Obj *caps_get(Tcl_Interp *interp, int refresh) {
+    Tcl_Obj *path, *key, *entries, *caps;
+    int size;
+
+    if (capsObj != NULL && !refresh) return capsObj;
+
+    key = caps_identity(interp);
+    Tcl_IncrRefCount(key);
+    path = caps_cache_path(interp);
+    if (path != NULL) Tcl_IncrRefCount(path);
+
+    caps = NULL;
+    if (path != NULL && !refresh) {
+        entries = caps_load(path);
+        Tcl_IncrRefCount(entries);
+        if (Tcl_DictObjGet(NULL, entries, key, &caps) != TCL_OK ||
+            (caps != NULL && Tcl_DictObjSize(NULL, caps, &size) != TCL_OK)) {
+            caps = NULL;
+        }
+        if (caps != NULL) Tcl_IncrRefCount(caps);
+        Tcl_DecrRefCount(entries);
+    }
+
+    if (caps == NULL) {
+        caps = caps_probe(interp);
+        Tcl_IncrRefCount(caps);
+        if (path != NULL) caps_store(path, key, caps);
+    }
+
+    if (capsObj != NULL) Tcl_DecrRefCount(capsObj);
+    capsObj = caps;
+
+    if (path != NULL) Tcl_DecrRefCount(path);
+    Tcl_DecrRefCount(key);
+
+    return capsObj;
+}
+
+/*****************************************************************************
+ * paste_append
+ *
+ * Description:
+ *
+ *   Appends a character to the paste buffer. Carriage returns, which is
+ *   what the console delivers for pasted line breaks, are stored as
+ *   newlines.
+ *
+ * Parameters:
+ *
+ *   ch - character
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   May grow the paste buffer.
+ *****************************************************************************/
+
+static void paste_append(int ch) {
+    editor_reserve(&pasteText, &pasteCap, pasteLen + 1);
+    pasteText[pasteLen++] = (Tcl_UniChar) (ch == '\r' ? '\n' : ch);
+}
+
+/*****************************************************************************
+ * paste_gather
+ *
+ * Description:
+ *
+ *   Collects the rest of a paste into the paste buffer. The console input
+ *   is examined PASTE_BATCH events at a time and the events belonging to
+ *   the paste are removed with a single read, so even a large paste takes
+ *   only a few calls.
+ *
+ *   A bracketed paste ends with the ESC [ 201 ~ marker; the wait for it is
+ *   limited to PASTE_WAIT milliseconds at a time. A burst ends when no
+ *   more input arrives within PASTE_GAP milliseconds or at a key which
+ *   doesn't produce a character (other than the shift, control and alt keys
+ *   the console generates for pasted text). That key is left in the
+ *   input buffer.
+ *
+ * Parameters:
+ *
+ *   bracketed - non-zero for a bracketed paste
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Reads from the console input.
+ *****************************************************************************/
+
+static void paste_gather(int bracketed) {
+    static const Tcl_UniChar end[6] = {27, '[', '2', '0', '1', '~'};
+    INPUT_RECORD records[PASTE_BATCH];
+    KEY_EVENT_RECORD *key;
+    DWORD num, used;
+    int done = 0;
+
+    while (!done) {
+        if (!PeekConsoleInputW(hStdin, records, PASTE_BATCH, &num) ||
+            num == 0) {
+            if (WaitForSingleObject(hStdin, bracketed ? PASTE_WAIT :
+                                    PASTE_GAP) != WAIT_OBJECT_0) {
+                break;
+            }
+            continue;
+        }
+
+        for (used = 0; used < num && !done; used++) {
+            key = &records[used].Event.KeyEvent;
+            if (records[used].EventType != KEY_EVENT || !key->bKeyDown) {
+                continue;
+            }
+            if (key->uChar.UnicodeChar == 0) {
+                if (!bracketed && key->wVirtualKeyCode != VK_SHIFT &&
+                    key->wVirtualKeyCode != VK_CONTROL &&
+                    key->wVirtualKeyCode != VK_MENU) {
+                    done = 1;
+                    break;
+                }
+                continue;
+            }
+            paste_append(key->uChar.UnicodeChar);
+            if (bracketed && pasteLen >= 6 &&
+                memcmp(pasteText + pasteLen - 6, end, sizeof(end)) == 0) {
+                pasteLen -= 6;
+                done = 1;
+            }
+        }
+
+        if (used > 0) ReadConsoleInputW(hStdin, records, used, &num);
+    }
+}
+
+/*****************************************************************************
+ * input_mode
+ *
+ * Description:
+ *
+ *   Returns the console input mode used while reading with input_next.
+ *   The console passes the bracketed paste markers on only with virtual
+ *   terminal input enabled, so it is enabled while bracketed paste is.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Console input mode.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static DWORD input_mode(void) {
+    return pasteBracketed ? ENABLE_VIRTUAL_TERMINAL_INPUT : 0;
+}
+
+/*****************************************************************************
+ * input_vt_key
+ *
+ * Description:
+ *
+ *   Fills in the virtual key code of a character read with virtual
+ *   terminal input enabled, which the console leaves out, the same way as
+ *   for the keys of a terminal. DEL, which the Backspace key sends, is
+ *   turned into a backspace.
+ *
+ * Parameters:
+ *
+ *   rec - key event
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void input_vt_key(INPUT_RECORD *rec) {
+    KEY_EVENT_RECORD *key = &rec->Event.KeyEvent;
+    WCHAR ch = key->uChar.UnicodeChar;
+    SHORT scan;
+
+    if (key->wVirtualKeyCode != 0 && ch != 0x7F) return;
+
+    switch (ch) {
+        case 0:
+            return;
+        case 0x1B:
+            key->wVirtualKeyCode = VK_ESCAPE;
+            break;
+        case '\r':
+            key->wVirtualKeyCode = VK_RETURN;
+            break;
+        case '\t':
+            key->wVirtualKeyCode = VK_TAB;
+            break;
+        case 0x08:
+        case 0x7F:
+            key->wVirtualKeyCode = VK_BACK;
+            key->uChar.UnicodeChar = 0x08;
+            break;
+        default:
+            if (ch < 0x20) {
+                key->wVirtualKeyCode = (WORD) ('A' + ch - 1);
+            }
+            else {
+                scan = VkKeyScanW(ch);
+                key->wVirtualKeyCode = (WORD) (scan == -1 ? 0 : scan & 0xFF);
+            }
+            break;
+    }
+}
+
+/*****************************************************************************
+ * input_next
+ *
+ * Description:
+ *
+ *   Reads the next key press from the console, telling pasted text apart
+ *   from typing. A paste is recognized either by the bracketed paste
+ *   marker ESC [ 200 ~ sent by terminals when bracketed paste is enabled,
+ *   or, on consoles that deliver pasted text as ordinary key events, by a
+ *   burst of at least PASTE_BURST_CHARS characters waiting in the input
+ *   buffer, which typing never produces. The pasted text is collected into
+ *   the paste buffer (pasteText, pasteLen) instead of being returned key by
+ *   key.
+ *
+ *   The caller sets the console input mode with input_mode. While
+ *   bracketed paste is enabled, that includes virtual terminal input, and
+ *   the escape sequences of the keys are turned back into key events.
+ *
+ * Parameters:
+ *
+ *   rec     - receives the key event
+ *   timeout - maximum time to wait in milliseconds, or -1 to wait forever
+ *
+ * Results:
+ *
+ *   INPUT_KEY   - a key was pressed, rec holds the event
+ *   INPUT_PASTE - text was pasted, it is in the paste buffer
+ *   INPUT_NONE  - the time ran out
+ *
+ * Side effects:
+ *
+ *   Reads from the console input.
+ *****************************************************************************/
+
+static int input_next(INPUT_RECORD *rec, int timeout) {
+    static const char mark[] = "[200~";
+    INPUT_RECORD peek[PASTE_BATCH];
+    DWORD num, start, elapsed, wait;
+    int seq[PASTE_MARK_PEEK], end[PASTE_MARK_PEEK];
+    int i, n, j, param, mods, ch;
+    WORD vk;
+
+    start = GetTickCount();
+    for (;;) {
+        wait = INFINITE;
+        if (timeout >= 0) {
+            elapsed = GetTickCount() - start;
+            if (elapsed >= (DWORD) timeout) return INPUT_NONE;
+            wait = timeout - elapsed;
+        }
+        if (WaitForSingleObject(hStdin, wait) != WAIT_OBJECT_0) {
+            return INPUT_NONE;
+        }
+
+        ReadConsoleInputW(hStdin, rec, 1, &num);
+        if (num == 1 && rec->EventType == WINDOW_BUFFER_SIZE_EVENT) {
+            resize_note();
+        }
+        if (num == 0 || rec->EventType != KEY_EVENT ||
+            rec->Event.KeyEvent.bKeyDown == FALSE) {
+            continue;
+        }
+        ch = rec->Event.KeyEvent.uChar.UnicodeChar;
+
+        if (ch == 27) {
+
+            /* The characters following ESC, which the console puts into
+               the input buffer together */
+
+            PeekConsoleInputW(hStdin, peek, PASTE_MARK_PEEK, &num);
+            for (i = 0, n = 0; i < (int) num && n < PASTE_MARK_PEEK; i++) {
+                if (peek[i].EventType == KEY_EVENT &&
+                    peek[i].Event.KeyEvent.bKeyDown) {
+                    seq[n] = peek[i].Event.KeyEvent.uChar.UnicodeChar;
+                    end[n++] = i + 1;
+                }
+            }
+            for (i = 0; i < 5 && i < n && seq[i] == mark[i]; i++);
+            if (i == 5) {
+                ReadConsoleInputW(hStdin, peek, end[4], &num);
+                pasteLen = 0;
+                paste_gather(1);
+                return INPUT_PASTE;
+            }
+
+            /* With virtual terminal input the cursor, editing and function
+               keys arrive as escape sequences too */
+
+            if (pasteBracketed && n >= 2 && (seq[0] == '[' || seq[0] == 'O')) {
+                param = mods = 0;
+                for (j = 1; j < n && seq[j] >= '0' && seq[j] <= '9'; j++) {
+                    param = param * 10 + seq[j] - '0';
+                }
+                if (j < n && seq[j] == ';') {
+                    for (j++; j < n && seq[j] >= '0' && seq[j] <= '9'; j++) {
+                        mods = mods * 10 + seq[j] - '0';
+                    }
+                }
+                while (j < n && seq[j] >= 0x20 && seq[j] < 0x40) j++;
+                vk = j < n ? terminal_csi_key(seq[j], param) : 0;
+                if (vk != 0) {
+                    ReadConsoleInputW(hStdin, peek, end[j], &num);
+
+                    /* The modifier parameter is 1 plus shift 1, alt 2 and
+                       control 4 */
+
+                    mods = mods > 1 ? mods - 1 : 0;
+                    rec->Event.KeyEvent.dwControlKeyState =
+                        (mods & 1 ? SHIFT_PRESSED : 0) |
+                        (mods & 2 ? LEFT_ALT_PRESSED : 0) |
+                        (mods & 4 ? LEFT_CTRL_PRESSED : 0);
+                    rec->Event.KeyEvent.wVirtualKeyCode = vk;
+                    rec->Event.KeyEvent.uChar.UnicodeChar =
+                        (WCHAR) (vk == VK_TAB ? '\t' : 0);
+                    return INPUT_KEY;
+                }
+            }
+        }
+        else if (ch != 0) {
+
+            /* Count the characters only, as every key also gives a key up
+               event and autorepeat or some typeahead must not look like a
+               paste */
+
+            PeekConsoleInputW(hStdin, peek, PASTE_BATCH, &num);
+            for (i = 0, n = 0; i < (int) num; i++) {
+                if (peek[i].EventType == KEY_EVENT &&
+                    peek[i].Event.KeyEvent.bKeyDown &&
+                    peek[i].Event.KeyEvent.uChar.UnicodeChar != 0) {
+                    n++;
+                }
+            }
+            if (n >= PASTE_BURST_CHARS) {
+                pasteLen = 0;
+                paste_append(ch);
+                paste_gather(0);
+                if (pasteLen > 1) return INPUT_PASTE;
+            }
+        }
+
+        if (pasteBracketed) input_vt_key(rec);
+
+        return INPUT_KEY;
+    }
+}
+
+/*****************************************************************************
+ * input_event_obj
+ *
+ * Description:
+ *
+ *   Turns the result of input_next into the event form returned by
+ *   Consio::getevent and recorded by the input recording.
+ *
+ * Parameters:
+ *
+ *   type - result of input_next
+ *   rec  - key event for INPUT_KEY
+ *
+ * Results:
+ *
+ *   {key code char}, {paste text} with the text of the paste buffer, or
+ *   an empty list for INPUT_NONE, as a new Tcl object.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static Tcl_Obj *input_event_obj(int type, INPUT_RECORD *rec) {
+    Tcl_Obj *event = Tcl_NewObj();
+    Tcl_UniChar ch;
+
+    if (type == INPUT_KEY) {
+        ch = rec->Event.KeyEvent.uChar.UnicodeChar;
+        Tcl_ListObjAppendElement(NULL, event, Tcl_NewStringObj("key", -1));
+        Tcl_ListObjAppendElement(NULL, event,
+            Tcl_NewIntObj(rec->Event.KeyEvent.wVirtualKeyCode));
+        Tcl_ListObjAppendElement(NULL, event,
+                                 Tcl_NewUnicodeObj(&ch, ch != 0 ? 1 : 0));
+    }
+    else if (type == INPUT_PASTE) {
+        Tcl_ListObjAppendElement(NULL, event, Tcl_NewStringObj("paste", -1));
+        Tcl_ListObjAppendElement(NULL, event,
+                                 Tcl_NewUnicodeObj(pasteText, pasteLen));
+    }
+
+    return event;
+}
+
+/*****************************************************************************
+ * input_event_rec
+ *
+ * Description:
+ *
+ *   Turns an event in the form made by input_event_obj, as returned by
+ *   input_source for REC_IN_EVENT, back into the result of input_next.
+ *   The modifier keys are not part of the event and are left out.
+ *
+ * Parameters:
+ *
+ *   event - event object; a new object is freed
+ *   rec   - receives the key event
+ *
+ * Results:
+ *
+ *   INPUT_KEY, INPUT_PASTE with the text in the paste buffer, or
+ *   INPUT_NONE for an empty or unknown event.
+ *
+ * Side effects:
+ *
+ *   May grow the paste buffer.
+ *****************************************************************************/
+
+static int input_event_rec(Tcl_Obj *event, INPUT_RECORD *rec) {
+    KEY_EVENT_RECORD *key = &rec->Event.KeyEvent;
+    Tcl_Obj **elem;
+    Tcl_UniChar *text;
+    char *kind;
+    int type = INPUT_NONE;
+    int num, code, len;
+
+    Tcl_IncrRefCount(event);
+    if (Tcl_ListObjGetElements(NULL, event, &num, &elem) == TCL_OK &&
+        num >= 2) {
+        kind = Tcl_GetString(elem[0]);
+        if (num == 3 && strcmp(kind, "key") == 0 &&
+            Tcl_GetIntFromObj(NULL, elem[1], &code) == TCL_OK) {
+            memset(rec, 0, sizeof(*rec));
+            rec->EventType = KEY_EVENT;
+            key->bKeyDown = TRUE;
+            key->wRepeatCount = 1;
+            key->wVirtualKeyCode = (WORD) code;
+            key->uChar.UnicodeChar = (WCHAR)
+                (Tcl_GetCharLength(elem[2]) > 0 ? Tcl_GetUniChar(elem[2], 0)
+                                                : 0);
+            type = INPUT_KEY;
+        }
+        else if (num == 2 && strcmp(kind, "paste") == 0) {
+            text = Tcl_GetUnicodeFromObj(elem[1], &len);
+            editor_reserve(&pasteText, &pasteCap, len);
+            memcpy(pasteText, text, len * sizeof(Tcl_UniChar));
+            pasteLen = len;
+            type = INPUT_PASTE;
+        }
+    }
+    Tcl_DecrRefCount(event);
+
+    return type;
+}
+
+/*****************************************************************************
+ * image_accumulate
+ *
+ * Description:
+ *
+ *   Adds a row of 8-bit samples to a row of 32-bit sums. This is the inner
+ *   loop of the image downscaling; with SSE2 it handles 16 samples at a
+ *   time.
+ *
+ * Parameters:
+ *
+ *   sum - sums
+ *   row - samples
+ *   n   - number of samples
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Updates the sums.
+ *****************************************************************************/
+
+static void image_accumulate(int *sum, const unsigned char *row, int n) {
+    int i = 0;
+#ifdef CONSIO_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i bytes, lo, hi;
+
+    for (; i + 16 <= n; i += 16) {
+        bytes = _mm_loadu_si128((const __m128i *) (row + i));
+        lo = _mm_unpacklo_epi8(bytes, zero);
+        hi = _mm_unpackhi_epi8(bytes, zero);
+        _mm_storeu_si128((__m128i *) (sum + i), _mm_add_epi32(
+            _mm_loadu_si128((const __m128i *) (sum + i)),
+            _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128((__m128i *) (sum + i + 4), _mm_add_epi32(
+            _mm_loadu_si128((const __m128i *) (sum + i + 4)),
+            _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128((__m128i *) (sum + i + 8), _mm_add_epi32(
+            _mm_loadu_si128((const __m128i *) (sum + i + 8)),
+            _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128((__m128i *) (sum + i + 12), _mm_add_epi32(
+            _mm_loadu_si128((const __m128i *) (sum + i + 12)),
+            _mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+
+    for (; i < n; i++) sum[i] += row[i];
+}
+
+/*****************************************************************************
+ * image_scale
+ *
+ * Description:
+ *
+ *   Scales an RGB or RGBA image to the given size by averaging the source
+ *   pixels covered by each target pixel (or by picking the nearest pixel
+ *   when enlarging). The source rows of each target row are first summed
+ *   column by column and the column sums are then summed for each target
+ *   pixel. RGBA pixels are blended over the given background color. The
+ *   rows are summed IMAGE_SUM_ROWS at a time into 32-bit sums, which are
+ *   then added to 64-bit ones, so large downscales cannot overflow.
+ *
+ * Parameters:
+ *
+ *   data     - source pixels, row by row
+ *   sw, sh   - size of the source image
+ *   channels - 3 for RGB, 4 for RGBA
+ *   dw, dh   - size of the target image
+ *   bg       - background color for RGBA images
+ *   out      - dw * dh * 3 target samples
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void image_scale(const unsigned char *data,
+                        int sw, int sh, int channels,
+                        int dw, int dh,
+                        const unsigned char *bg,
+                        int *out) {
+    const unsigned char *src;
+    unsigned char *blend = NULL;
+    int *sum;
+    Tcl_WideInt *wide;
+    int tx, ty, sx, sy, x0, x1, y0, y1, c, a, i, next;
+    Tcl_WideInt acc[3], count;
+
+    sum = (int *) ckalloc(sw * 3 * sizeof(int));
+    wide = (Tcl_WideInt *) ckalloc(sw * 3 * sizeof(Tcl_WideInt));
+    if (channels == 4) blend = (unsigned char *) ckalloc(sw * 3);
+
+    for (ty = 0; ty < dh; ty++) {
+        y0 = (int) ((Tcl_WideInt) ty * sh / dh);
+        y1 = (int) ((Tcl_WideInt) (ty + 1) * sh / dh);
+        if (y1 <= y0) y1 = y0 + 1;
+
+        memset(wide, 0, sw * 3 * sizeof(Tcl_WideInt));
+        for (next = y0; next < y1; ) {
+            memset(sum, 0, sw * 3 * sizeof(int));
+            for (sy = next; sy < y1 && sy - next < IMAGE_SUM_ROWS; sy++) {
+                src = data + (size_t) sy * sw * channels;
+                if (channels == 4) {
+                    for (sx = 0; sx < sw; sx++) {
+                        a = src[sx * 4 + 3];
+                        for (c = 0; c < 3; c++) {
+                            blend[sx * 3 + c] = (unsigned char)
+                                ((src[sx * 4 + c] * a +
+                                  bg[c] * (255 - a)) / 255);
+                        }
+                    }
+                    src = blend;
+                }
+                image_accumulate(sum, src, sw * 3);
+            }
+            next = sy;
+            for (i = 0; i < sw * 3; i++) wide[i] += sum[i];
+        }
+
+        for (tx = 0; tx < dw; tx++) {
+            x0 = (int) ((Tcl_WideInt) tx * sw / dw);
+            x1 = (int) ((Tcl_WideInt) (tx + 1) * sw / dw);
+            if (x1 <= x0) x1 = x0 + 1;
+
+            acc[0] = acc[1] = acc[2] = 0;
+            for (sx = x0; sx < x1; sx++) {
+                acc[0] += wide[sx * 3];
+                acc[1] += wide[sx * 3 + 1];
+                acc[2] += wide[sx * 3 + 2];
+            }
+            count = (Tcl_WideInt) (x1 - x0) * (y1 - y0);
+            for (c = 0; c < 3; c++) {
+                out[(ty * dw + tx) * 3 + c] = (int) (acc[c] / count);
+            }
+        }
+    }
+
+    if (blend != NULL) ckfree((char *) blend);
+    ckfree((char *) wide);
+    ckfree((char *) sum);
+}
+
+/*****************************************************************************
+ * image_nearest
+ *
+ * Description:
+ *
+ *   Returns the console color closest to an RGB color. The answer comes
+ *   from a table indexed by the five high bits of each component, which is
+ *   built on first use.
+ *
+ * Parameters:
+ *
+ *   r, g, b - color components, clamped to 0 - 255
+ *
+ * Results:
+ *
+ *   Color number (BLACK - WHITE).
+ *
+ * Side effects:
+ *
+ *   Builds the table on the first call.
+ *****************************************************************************/
+
+static int image_nearest(int r, int g, int b) {
+    int i, c, best, dist, bestDist, dr, dg, db;
+
+    if (imageNearest == NULL) {
+        imageNearest = (unsigned char *) ckalloc(32 * 32 * 32);
+        for (i = 0; i < 32 * 32 * 32; i++) {
+            best = 0;
+            bestDist = 0x7FFFFFFF;
+            for (c = 0; c < 16; c++) {
+                dr = ((i >> 10) << 3) + 4 - imagePalette[c][0];
+                dg = (((i >> 5) & 31) << 3) + 4 - imagePalette[c][1];
+                db = ((i & 31) << 3) + 4 - imagePalette[c][2];
+                dist = 3 * dr * dr + 4 * dg * dg + 2 * db * db;
+                if (dist < bestDist) {
+                    bestDist = dist;
+                    best = c;
+                }
+            }
+            imageNearest[i] = (unsigned char) best;
+        }
+    }
+
+    if (r < 0) r = 0;
+    if (r > 255) r = 255;
+    if (g < 0) g = 0;
+    if (g > 255) g = 255;
+    if (b < 0) b = 0;
+    if (b > 255) b = 255;
+
+    return imageNearest[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
+}
+
+/*****************************************************************************
+ * image_quantize
+ *
+ * Description:
+ *
+ *   Maps the pixels of an image to the 16 console colors, optionally with
+ *   Floyd-Steinberg dithering, which spreads the error of each pixel to
+ *   its unprocessed neighbours.
+ *
+ * Parameters:
+ *
+ *   pixels - w * h * 3 samples; modified when dithering
+ *   w, h   - size of the image
+ *   dither - non-zero for dithering
+ *   colors - receives w * h color numbers
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void image_quantize(int *pixels, int w, int h, int dither,
+                           unsigned char *colors) {
+    int x, y, c, i, e, color;
+    int *p;
+
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            p = pixels + (y * w + x) * 3;
+            color = image_nearest(p[0], p[1], p[2]);
+            colors[y * w + x] = (unsigned char) color;
+            if (!dither) continue;
+
+            for (c = 0; c < 3; c++) {
+                e = p[c] - imagePalette[color][c];
+                if (x + 1 < w) p[3 + c] += e * 7 / 16;
+                if (y + 1 < h) {
+                    i = 3 * w + c;
+                    if (x > 0) p[i - 3] += e * 3 / 16;
+                    p[i] += e * 5 / 16;
+                    if (x + 1 < w) p[i + 3] += e / 16;
+                }
+            }
+        }
+    }
+}
+
+/*****************************************************************************
+ * image_write_truecolor
+ *
+ * Description:
+ *
+ *   Draws a scaled image with 24-bit color escape sequences. The whole
+ *   image is built into one buffer and written with a single call. Color
+ *   sequences are only emitted when the color changes from the previous
+ *   cell. Virtual terminal sequences address the visible window, so the
+ *   part of the image outside the window is clipped.
+ *
+ * Parameters:
+ *
+ *   pixels - cols * rows * 2 pixels, 3 samples each
+ *   x, y   - upper left corner on the console
+ *   cols   - width in cells
+ *   rows   - height in cells
+ *
+ * Results:
+ *
+ *   1 if the image was drawn, 0 if virtual terminal sequences are not
+ *   available.
+ *
+ * Side effects:
+ *
+ *   Writes to the console. The cursor position and text attributes are
+ *   restored afterwards.
+ *****************************************************************************/
+
+static int image_write_truecolor(const int *pixels,
+                                 int x, int y,
+                                 int cols, int rows) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Tcl_DString out, wide;
+    DWORD mode;
+    const int *top, *bottom;
+    char seq[64];
+    int row, col, first, last, fg, bg, lastFg, lastBg;
+
+    if (!GetConsoleMode(hStdout, &mode) ||
+        !SetConsoleMode(hStdout, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING)) {
+        return 0;
+    }
+    GetConsoleScreenBufferInfo(hStdout, &info);
+
+    first = info.srWindow.Left - x;
+    if (first < 0) first = 0;
+    last = info.srWindow.Right - x + 1;
+    if (last > cols) last = cols;
+
+    Tcl_DStringInit(&out);
+    for (row = 0; row < rows; row++) {
+        if (y + row < info.srWindow.Top || y + row > info.srWindow.Bottom ||
+            first >= last) {
+            continue;
+        }
+        sprintf(seq, "\033[%d;%dH", y + row - info.srWindow.Top + 1,
+                x + first - info.srWindow.Left + 1);
+        Tcl_DStringAppend(&out, seq, -1);
+
+        lastFg = lastBg = -1;
+        for (col = first; col < last; col++) {
+            top = pixels + (row * 2 * cols + col) * 3;
+            bottom = top + cols * 3;
+            fg = (top[0] << 16) | (top[1] << 8) | top[2];
+            bg = (bottom[0] << 16) | (bottom[1] << 8) | bottom[2];
+            if (fg != lastFg) {
+                sprintf(seq, "\033[38;2;%d;%d;%dm", top[0], top[1], top[2]);
+                Tcl_DStringAppend(&out, seq, -1);
+                lastFg = fg;
+            }
+            if (bg != lastBg) {
+                sprintf(seq, "\033[48;2;%d;%d;%dm", bottom[0], bottom[1],
+                        bottom[2]);
+                Tcl_DStringAppend(&out, seq, -1);
+                lastBg = bg;
+            }
+            Tcl_DStringAppend(&out, "\xE2\x96\x80", 3);
+        }
+    }
+    Tcl_DStringAppend(&out, "\033[0m", -1);
+
+    Tcl_DStringInit(&wide);
+    Tcl_UtfToUniCharDString(Tcl_DStringValue(&out), Tcl_DStringLength(&out),
+                            &wide);
+    console_write_unicode(hStdout, (Tcl_UniChar *) Tcl_DStringValue(&wide),
+                          Tcl_DStringLength(&wide) / sizeof(Tcl_UniChar));
+    Tcl_DStringFree(&wide);
+    Tcl_DStringFree(&out);
+
+    SetConsoleMode(hStdout, mode);
+    SetConsoleTextAttribute(hStdout, info.wAttributes);
+    SetConsoleCursorPosition(hStdout, info.dwCursorPosition);
+    export_touch();
+
+    return 1;
+}
+
+/*****************************************************************************
+ * canvas_set
+ *
+ * Description:
+ *
+ *   Sets a dot of a canvas. Dots outside the canvas are ignored. The cell
+ *   containing the dot takes the current color of the canvas.
+ *
+ * Parameters:
+ *
+ *   c      - canvas
+ *   px, py - dot, (0, 0) being the upper left dot
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Marks the row of the cell dirty.
+ *****************************************************************************/
+
+static void canvas_set(Canvas *c, int px, int py) {
+    static const unsigned char bits[4][2] = {
+        {0x01, 0x08}, {0x02, 0x10}, {0x04, 0x20}, {0x40, 0x80}
+    };
+    int cell, row;
+
+    if (px < 0 || py < 0 || px >= c->cols * 2 || py >= c->rows * 4) return;
+
+    row = py >> 2;
+    cell = row * c->cols + (px >> 1);
+    c->dots[cell] |= bits[py & 3][px & 1];
+    c->attrs[cell] = c->attr;
+    if (row < c->dirtyTop) c->dirtyTop = row;
+    if (row > c->dirtyBottom) c->dirtyBottom = row;
+}
+
+/*****************************************************************************
+ * canvas_line
+ *
+ * Description:
+ *
+ *   Draws a line between two dots with Bresenham's algorithm. Lines lying
+ *   entirely on one side outside the canvas are skipped without
+ *   rasterizing them.
+ *
+ * Parameters:
+ *
+ *   c      - canvas
+ *   x0, y0 - first dot
+ *   x1, y1 - second dot
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Sets dots of the canvas.
+ *****************************************************************************/
+
+static void canvas_line(Canvas *c, int x0, int y0, int x1, int y1) {
+    int dx, dy, sx, sy, err, e2;
+    int w = c->cols * 2;
+    int h = c->rows * 4;
+
+    if ((x0 < 0 && x1 < 0) || (y0 < 0 && y1 < 0) ||
+        (x0 >= w && x1 >= w) || (y0 >= h && y1 >= h)) {
+        return;
+    }
+
+    dx = x1 > x0 ? x1 - x0 : x0 - x1;
+    dy = y1 > y0 ? y0 - y1 : y1 - y0;
+    sx = x0 < x1 ? 1 : -1;
+    sy = y0 < y1 ? 1 : -1;
+    err = dx + dy;
+
+    for (;;) {
+        canvas_set(c, x0, y0);
+        if (x0 == x1 && y0 == y1) break;
+        e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+/*****************************************************************************
+ * canvas_finite
+ *
+ * Description:
+ *
+ *   Checks that a number is neither infinite nor NaN. Such values can come
+ *   from a byte array of doubles or from a coordinate range with infinite
+ *   limits, and cannot be converted to a dot position.
+ *
+ * Parameters:
+ *
+ *   value - number
+ *
+ * Results:
+ *
+ *   Non-zero if the number is finite.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int canvas_finite(double value) {
+    return value == value && value - value == 0.0;
+}
+
+/*****************************************************************************
+ * canvas_map
+ *
+ * Description:
+ *
+ *   Converts a coordinate from the coordinate system of a canvas (see the
+ *   range subcommand) to a dot position. The y axis points up, so vertical
+ *   coordinates are flipped. The result is clamped to a range well outside
+ *   the canvas so that lines to far away points keep their direction
+ *   without overflowing, and a position that is not a number is put
+ *   outside the canvas.
+ *
+ * Parameters:
+ *
+ *   value - coordinate
+ *   min   - coordinate of the first dot
+ *   max   - coordinate of the last dot
+ *   dots  - number of dots
+ *   flip  - non-zero for vertical coordinates
+ *
+ * Results:
+ *
+ *   Dot position.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int canvas_map(double value, double min, double max, int dots,
+                      int flip) {
+    double pos;
+
+    pos = max != min ? (value - min) * (dots - 1) / (max - min) : 0.0;
+    if (pos != pos) pos = -CANVAS_CLAMP;
+    if (flip) pos = dots - 1 - pos;
+    if (pos < -CANVAS_CLAMP) pos = -CANVAS_CLAMP;
+    if (pos > CANVAS_CLAMP) pos = CANVAS_CLAMP;
+
+    return (int) (pos < 0 ? pos - 0.5 : pos + 0.5);
+}
+
+/*****************************************************************************
+ * canvas_values
+ *
+ * Description:
+ *
+ *   Gets an array of numbers from a Tcl list or from a byte array of
+ *   native doubles.
+ *
+ * Parameters:
+ *
+ *   interp  - interpreter for error messages
+ *   obj     - list or byte array
+ *   doubles - non-zero if obj is a byte array of doubles
+ *   values  - receives a new array, to be freed with ckfree
+ *   count   - receives the number of values
+ *
+ * Results:
+ *
+ *   TCL_OK or TCL_ERROR.
+ *
+ * Side effects:
+ *
+ *   Allocates memory.
+ *****************************************************************************/
+
+static int canvas_values(Tcl_Interp *interp, Tcl_Obj *obj, int doubles,
+                         double **values, int *count) {
+    Tcl_Obj **items;
+    unsigned char *bytes;
+    int i, n;
+
+    if (doubles) {
+        bytes = Tcl_GetByteArrayFromObj(obj, &n);
+        n /= sizeof(double);
+        *values = (double *) ckalloc((n + 1) * sizeof(double));
+        memcpy(*values, bytes, n * sizeof(double));
+        *count = n;
+        return TCL_OK;
+    }
+
+    if (Tcl_ListObjGetElements(interp, obj, &n, &items) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    *values = (double *) ckalloc((n + 1) * sizeof(double));
+    for (i = 0; i < n; i++) {
+        if (Tcl_GetDoubleFromObj(interp, items[i], &(*values)[i]) != TCL_OK) {
+            ckfree((char *) *values);
+            return TCL_ERROR;
+        }
+    }
+    *count = n;
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * canvas_series
+ *
+ * Description:
+ *
+ *   Plots a series of values across the whole width of a canvas as a
+ *   connected line. When there are more values than dot columns, the
+ *   values falling into each column are reduced to their minimum and
+ *   maximum and the column is drawn as a single vertical span reaching
+ *   the last value of the previous column, so the cost depends on the
+ *   number of values and the size of the canvas, not on how long the
+ *   connecting lines are.
+ *   Values that are not finite are gaps: nothing is drawn for them and
+ *   the line is not connected across them.
+ *
+ * Parameters:
+ *
+ *   c      - canvas
+ *   values - values
+ *   n      - number of values
+ *   min    - value at the bottom of the canvas
+ *   max    - value at the top of the canvas
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Sets dots of the canvas.
+ *****************************************************************************/
+
+static void canvas_series(Canvas *c, const double *values, int n,
+                          double min, double max) {
+    int w = c->cols * 2;
+    int h = c->rows * 4;
+    int i, x, y, px, lo, hi, prev, have, seen;
+
+    if (n <= 0 || w <= 0) return;
+
+    have = 0;
+    px = prev = 0;
+
+    if (n <= w) {
+        for (i = 0; i < n; i++) {
+            if (!canvas_finite(values[i])) {
+                have = 0;
+                continue;
+            }
+            x = n > 1 ? (int) ((Tcl_WideInt) i * (w - 1) / (n - 1)) : 0;
+            y = canvas_map(values[i], min, max, h, 1);
+            if (have) canvas_line(c, px, prev, x, y);
+            else canvas_set(c, x, y);
+            px = x;
+            prev = y;
+            have = 1;
+        }
+        return;
+    }
+
+    i = 0;
+    for (x = 0; x < w; x++) {
+        seen = 0;
+        lo = hi = 0;
+        for (; i < n && (Tcl_WideInt) i * w / n == x; i++) {
+            if (!canvas_finite(values[i])) {
+                have = 0;
+                continue;
+            }
+            y = canvas_map(values[i], min, max, h, 1);
+            if (!seen) {
+                lo = hi = have ? prev : y;
+                seen = 1;
+            }
+            if (y < lo) lo = y;
+            if (y > hi) hi = y;
+            prev = y;
+            have = 1;
+        }
+        if (!seen) continue;
+        if (lo < 0) lo = 0;
+        if (hi >= h) hi = h - 1;
+        for (y = lo; y <= hi; y++) canvas_set(c, x, y);
+    }
+}
+
+/*****************************************************************************
+ * canvas_flush
+ *
+ * Description:
+ *
+ *   Draws the rows of a canvas changed since the last flush to the console
+ *   as a single block of braille characters.
+ *
+ * Parameters:
+ *
+ *   c - canvas
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+static void canvas_flush(Canvas *c) {
+    CHAR_INFO *cells;
+    int i, first, count;
+
+    if (c->dirtyTop > c->dirtyBottom) return;
+
+    first = c->dirtyTop * c->cols;
+    count = (c->dirtyBottom - c->dirtyTop + 1) * c->cols;
+    cells = (CHAR_INFO *) ckalloc(count * sizeof(CHAR_INFO));
+    for (i = 0; i < count; i++) {
+        cells[i].Char.UnicodeChar = c->dots[first + i] != 0 ?
+            (WCHAR) (0x2800 + c->dots[first + i]) : ' ';
+        cells[i].Attributes = c->attrs[first + i];
+    }
+    console_write_cells(hStdout, cells, c->x, c->y + c->dirtyTop, c->cols,
+                        c->dirtyBottom - c->dirtyTop + 1);
+    ckfree((char *) cells);
+
+    c->dirtyTop = c->rows;
+    c->dirtyBottom = -1;
+}
+
+/*****************************************************************************
+ * canvas_clear
+ *
+ * Description:
+ *
+ *   Clears all dots of a canvas and fills it with the current color.
+ *
+ * Parameters:
+ *
+ *   c - canvas
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Marks the whole canvas dirty.
+ *****************************************************************************/
+
+static void canvas_clear(Canvas *c) {
+    int i;
+
+    memset(c->dots, 0, c->cols * c->rows);
+    for (i = 0; i < c->cols * c->rows; i++) c->attrs[i] = c->attr;
+    c->dirtyTop = 0;
+    c->dirtyBottom = c->rows - 1;
+}
+
+/*****************************************************************************
+ * canvas_free
+ *
+ * Description:
+ *
+ *   Releases a canvas when its command is deleted.
+ *
+ * Parameters:
+ *
+ *   clientData - canvas
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Frees memory.
+ *****************************************************************************/
+
+static void canvas_free(ClientData clientData) {
+    Canvas *c = (Canvas *) clientData;
+
+    ckfree((char *) c->dots);
+    ckfree((char *) c->attrs);
+    ckfree((char *) c);
+}
+
+/*****************************************************************************
+ * scroll_style
+ *
+ * Description:
+ *
+ *   Interns a text attribute into the style table of the scrollback store.
+ *   Lines refer to styles by a one byte index. When the table is full, an
+ *   existing style with the same colors is used instead.
+ *
+ * Parameters:
+ *
+ *   attr - text attribute
+ *
+ * Results:
+ *
+ *   Returns the index of the style.
+ *
+ * Side effects:
+ *
+ *   May add a style to the table.
+ *****************************************************************************/
+
+static int scroll_style(WORD attr) {
+    static int last = 0;
+    int i;
+
+    if (last < scrollStyleCount && scrollStyles[last] == attr) return last;
+
+    for (i = 0; i < scrollStyleCount; i++) {
+        if (scrollStyles[i] == attr) return last = i;
+    }
+
+    if (scrollStyleCount < SCROLL_STYLES_MAX) {
+        scrollStyles[scrollStyleCount] = attr;
+        return last = scrollStyleCount++;
+    }
+
+    for (i = 0; i < scrollStyleCount; i++) {
+        if ((scrollStyles[i] & 0xFF) == (attr & 0xFF)) return last = i;
+    }
+
+    return last = 0;
+}
+
+/*****************************************************************************
+ * scroll_put_varint, scroll_get_varint
+ *
+ * Description:
+ *
+ *   Writes and reads a non-negative integer in 7-bit groups, the lowest
+ *   group first. Values below 128 take a single byte.
+ *
+ * Parameters:
+ *
+ *   p     - output or input position
+ *   value - value to write
+ *
+ * Results:
+ *
+ *   Returns the position after the value. scroll_get_varint stores the
+ *   value into *value.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static unsigned char *scroll_put_varint(unsigned char *p, int value) {
+    while (value >= 0x80) {
+        *p++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char) value;
+
+    return p;
+}
+
+static const unsigned char *scroll_get_varint(const unsigned char *p,
+                                              int *value) {
+    int shift = 0;
+
+    *value = 0;
+    while (*p & 0x80) {
+        *value |= (*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    *value |= *p++ << shift;
+
+    return p;
+}
+
+/*****************************************************************************
+ * scroll_encode
+ *
+ * Description:
+ *
+ *   Encodes a line of cells for the scrollback store. The encoded line is
+ *
+ *     flags      - 1 if the text is stored as UTF-16, 0 if as ASCII
+ *     width      - number of cells (varint)
+ *     length     - number of characters stored (varint)
+ *     runs       - number of attribute runs (varint)
+ *     runs times - run length (varint) and style index (1 byte)
+ *     text       - length characters, 1 or 2 bytes each
+ *
+ *   Trailing spaces are not stored; the attribute runs still cover the
+ *   whole line.
+ *
+ * Parameters:
+ *
+ *   cells - cells of the line
+ *   width - number of cells
+ *   out   - output buffer, at least SCROLL_LINE_MAX(width) bytes
+ *
+ * Results:
+ *
+ *   Returns the length of the encoded line.
+ *
+ * Side effects:
+ *
+ *   May add styles to the style table.
+ *****************************************************************************/
+
+static int scroll_encode(const CHAR_INFO *cells,
+                         int width,
+                         unsigned char *out) {
+    unsigned char *p, *runs;
+    int length, wide, count, style, run, i;
+
+    length = width;
+    while (length > 0 && cells[length - 1].Char.UnicodeChar == ' ') length--;
+
+    wide = 0;
+    for (i = 0; i < length; i++) {
+        if (cells[i].Char.UnicodeChar >= 0x80) {
+            wide = 1;
+            break;
+        }
+    }
+
+    /* The run count is only known at the end, so leave room for it */
+
+    out[0] = (unsigned char) wide;
+    p = scroll_put_varint(out + 1, width);
+    p = scroll_put_varint(p, length);
+    runs = p;
+    p += SCROLL_VARINT_MAX;
+
+    count = 0;
+    for (i = 0; i < width; i += run) {
+        style = scroll_style(cells[i].Attributes);
+        for (run = 1; i + run < width; run++) {
+            if (cells[i + run].Attributes != cells[i].Attributes) break;
+        }
+        p = scroll_put_varint(p, run);
+        *p++ = (unsigned char) style;
+        count++;
+    }
+
+    /* Close the gap left for the run count */
+
+    i = (int) (scroll_put_varint(runs, count) - runs);
+    memmove(runs + i, runs + SCROLL_VARINT_MAX,
+            p - (runs + SCROLL_VARINT_MAX));
+    p -= SCROLL_VARINT_MAX - i;
+
+    for (i = 0; i < length; i++) {
+        *p++ = (unsigned char) (cells[i].Char.UnicodeChar & 0xFF);
+        if (wide) *p++ = (unsigned char) (cells[i].Char.UnicodeChar >> 8);
+    }
+
+    return (int) (p - out);
+}
+
+/*****************************************************************************
+ * scroll_decode
+ *
+ * Description:
+ *
+ *   Decodes a line of the scrollback store into cells or characters.
+ *
+ * Parameters:
+ *
+ *   p      - encoded line
+ *   cells  - output cells, or NULL
+ *   width  - number of cells to produce; the line is cut or padded with
+ *            spaces in its last style
+ *   text   - output characters, or NULL; receives the stored characters
+ *            without the trailing spaces
+ *   length - receives the number of characters in text, or NULL
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void scroll_decode(const unsigned char *p,
+                          CHAR_INFO *cells,
+                          int width,
+                          Tcl_UniChar *text,
+                          int *length) {
+    const unsigned char *chars;
+    WORD attr = 0;
+    int wide, lineWidth, stored, count, run, i, j, x;
+
+    wide = *p++;
+    p = scroll_get_varint(p, &lineWidth);
+    p = scroll_get_varint(p, &stored);
+    p = scroll_get_varint(p, &count);
+
+    /* The text follows the runs, so skip over them first */
+
+    chars = p;
+    for (i = 0; i < count; i++) {
+        chars = scroll_get_varint(chars, &run) + 1;
+    }
+
+    if (cells != NULL) {
+        x = 0;
+        for (i = 0; i < count && x < width; i++) {
+            p = scroll_get_varint(p, &run);
+            attr = scrollStyles[*p++];
+            for (j = 0; j < run && x < width; j++, x++) {
+                cells[x].Char.UnicodeChar = x < stored ?
+                    (wide ? chars[x * 2] | (chars[x * 2 + 1] << 8) :
+                     chars[x]) : ' ';
+                cells[x].Attributes = attr;
+            }
+        }
+        for (; x < width; x++) {
+            cells[x].Char.UnicodeChar = ' ';
+            cells[x].Attributes = attr;
+        }
+    }
+
+    if (text != NULL) {
+        for (x = 0; x < stored; x++) {
+            text[x] = (Tcl_UniChar) (wide ?
+                chars[x * 2] | (chars[x * 2 + 1] << 8) : chars[x]);
+        }
+    }
+
+    if (length != NULL) *length = stored;
+}
+
+/*****************************************************************************
+ * scroll_pack
+ *
+ * Description:
+ *
+ *   Compresses a block of the scrollback store. The format is a sequence
+ *   of literal runs and back references: a token byte holding the literal
+ *   length in the upper and the match length minus SCROLL_MIN_MATCH in the
+ *   lower four bits, extra length bytes when a length is 15 or more, the
+ *   literals, and a two byte offset of the match. The last sequence has
+ *   literals only.
+ *
+ * Parameters:
+ *
+ *   src - data to compress
+ *   n   - length of the data
+ *   dst - output buffer, at least n bytes
+ *
+ * Results:
+ *
+ *   Returns the compressed length, or 0 if the data does not compress
+ *   into fewer than n bytes.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int scroll_pack(const unsigned char *src,
+                       int n,
+                       unsigned char *dst) {
+    int table[SCROLL_HASH_SIZE];
+    int i, anchor, out, hash, ref, len;
+
+    for (i = 0; i < SCROLL_HASH_SIZE; i++) table[i] = -1;
+
+    i = anchor = out = 0;
+    while (i + SCROLL_MIN_MATCH <= n) {
+        hash = ((src[i] | (src[i + 1] << 8) | (src[i + 2] << 16) |
+                 ((unsigned int) src[i + 3] << 24)) * 2654435761U) >>
+               (32 - SCROLL_HASH_BITS);
+        ref = table[hash];
+        table[hash] = i;
+        if (ref < 0 || i - ref > 0xFFFF ||
+            memcmp(src + ref, src + i, SCROLL_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        len = SCROLL_MIN_MATCH;
+        while (i + len < n && src[ref + len] == src[i + len]) len++;
+        out = scroll_pack_sequence(dst, out, n - 1, src + anchor, i - anchor,
+                                   i - ref, len);
+        if (out < 0) return 0;
+        i += len;
+        anchor = i;
+    }
+
+    out = scroll_pack_sequence(dst, out, n - 1, src + anchor, n - anchor, 0, 0);
+
+    return out < 0 ? 0 : out;
+}
+
+/*****************************************************************************
+ * scroll_pack_sequence
+ *
+ * Description:
+ *
+ *   Writes one sequence of the compressed format, see scroll_pack.
+ *
+ * Parameters:
+ *
+ *   dst      - output buffer
+ *   out      - current length of the output
+ *   max      - maximum length of the output
+ *   literals - literal bytes
+ *   count    - number of literal bytes
+ *   offset   - distance of the match
+ *   match    - length of the match, 0 for the last sequence
+ *
+ * Results:
+ *
+ *   Returns the new length of the output, or -1 if it would exceed max.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int scroll_pack_sequence(unsigned char *dst,
+                                int out,
+                                int max,
+                                const unsigned char *literals,
+                                int count,
+                                int offset,
+                                int match) {
+    int extra = match > 0 ? match - SCROLL_MIN_MATCH : 0;
+    int n;
+
+    if (out + 1 + count / 255 + 1 + count +
+        (match > 0 ? 2 + extra / 255 + 1 : 0) > max) {
+        return -1;
+    }
+
+    dst[out++] = (unsigned char) (((count < 15 ? count : 15) << 4) |
+                                  (extra < 15 ? extra : 15));
+    if (count >= 15) {
+        for (n = count - 15; n >= 255; n -= 255) dst[out++] = 255;
+        dst[out++] = (unsigned char) n;
+    }
+    memcpy(dst + out, literals, count);
+    out += count;
+
+    if (match > 0) {
+        dst[out++] = (unsigned char) (offset & 0xFF);
+        dst[out++] = (unsigned char) (offset >> 8);
+        if (extra >= 15) {
+            for (n = extra - 15; n >= 255; n -= 255) dst[out++] = 255;
+            dst[out++] = (unsigned char) n;
+        }
+    }
+
+    return out;
+}
+
+/*****************************************************************************
+ * scroll_unpack
+ *
+ * Description:
+ *
+ *   Decompresses a block compressed by scroll_pack.
+ *
+ * Parameters:
+ *
+ *   src  - compressed data
+ *   n    - length of the compressed data
+ *   dst  - output buffer
+ *   size - length of the uncompressed data
+ *
+ * Results:
+ *
+ *   Returns 1 on success, 0 if the data is corrupt.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int scroll_unpack(const unsigned char *src,
+                         int n,
+                         unsigned char *dst,
+                         int size) {
+    int ip = 0, op = 0;
+    int token, len, offset, b;
+
+    while (ip < n) {
+        token = src[ip++];
+
+        len = token >> 4;
+        if (len == 15) {
+            do {
+                if (ip >= n) return 0;
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+        }
+        if (ip + len > n || op + len > size) return 0;
+        memcpy(dst + op, src + ip, len);
+        ip += len;
+        op += len;
+        if (ip >= n) break;
+
+        if (ip + 2 > n) return 0;
+        offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip >= n) return 0;
+                b = src[ip++];
+                len += b;
+            } while (b == 255);
+        }
+        len += SCROLL_MIN_MATCH;
+        if (offset == 0 || offset > op || op + len > size) return 0;
+
+        /* The match may overlap the output, so copy byte by byte */
+
+        for (b = 0; b < len; b++, op++) dst[op] = dst[op - offset];
+    }
+
+    return op == size;
+}
+
+/*****************************************************************************
+ * scroll_line
+ *
+ * Description:
+ *
+ *   Finds a line of the scrollback store. Lines of compressed blocks are
+ *   decompressed into a cache holding the most recently used block, so
+ *   scrolling through neighbouring lines decompresses each block once.
+ *
+ * Parameters:
+ *
+ *   index - line number, 0 being the oldest line
+ *
+ * Results:
+ *
+ *   Returns the encoded line, or NULL if the index is out of range or the
+ *   block cannot be decompressed.
+ *
+ * Side effects:
+ *
+ *   May replace the contents of the cache.
+ *****************************************************************************/
+
+static const unsigned char *scroll_line(int index) {
+    ScrollBlock *block;
+    int line;
+
+    if (index < 0 || index >= scrollLines) return NULL;
+
+    line = index + scrollSkip;
+    block = scrollBlocks[line / SCROLL_BLOCK_LINES];
+    line %= SCROLL_BLOCK_LINES;
+
+    if (block->packed == 0) return block->data + block->offsets[line];
+
+    if (scrollCacheBlock != block) {
+        if (block->size > scrollCacheSize) {
+            scrollCache = (unsigned char *) ckrealloc((char *) scrollCache,
+                                                      block->size);
+            scrollCacheSize = block->size;
+        }
+        scrollCacheBlock = NULL;
+        if (!scroll_unpack(block->data, block->packed, scrollCache,
+                           block->size)) {
+            return NULL;
+        }
+        scrollCacheBlock = block;
+    }
+
+    return scrollCache + block->offsets[line];
+}
+
+/*****************************************************************************
+ * scroll_append
+ *
+ * Description:
+ *
+ *   Appends a line to the scrollback store. When a block fills up, the
+ *   block that falls out of the SCROLL_HOT_BLOCKS newest blocks is
+ *   compressed. Lines over the limit are dropped from the start, whole
+ *   blocks at a time.
+ *
+ * Parameters:
+ *
+ *   cells - cells of the line
+ *   width - number of cells
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Allocates and frees blocks.
+ *****************************************************************************/
+
+static void scroll_append(const CHAR_INFO *cells, int width) {
+    ScrollBlock *block = NULL;
+    unsigned char *packed;
+    int len, size;
+
+    if (scrollBlockCount > 0) block = scrollBlocks[scrollBlockCount - 1];
+
+    if (block == NULL || block->count == SCROLL_BLOCK_LINES) {
+        if (scrollBlockCount == scrollBlockCap) {
+            scrollBlockCap = scrollBlockCap ? scrollBlockCap * 2 : 16;
+            scrollBlocks = (ScrollBlock **) ckrealloc((char *) scrollBlocks,
+                scrollBlockCap * sizeof(ScrollBlock *));
+        }
+        block = (ScrollBlock *) ckalloc(sizeof(ScrollBlock));
+        memset(block, 0, sizeof(ScrollBlock));
+        scrollBlocks[scrollBlockCount++] = block;
+
+        /* Compress the block leaving the hot end of the store */
+
+        if (scrollBlockCount > SCROLL_HOT_BLOCKS) {
+            block = scrollBlocks[scrollBlockCount - 1 - SCROLL_HOT_BLOCKS];
+            if (block->packed == 0 && block->size > 0) {
+                packed = (unsigned char *) ckalloc(block->size);
+                size = scroll_pack(block->data, block->size, packed);
+                if (size > 0) {
+                    ckfree((char *) block->data);
+                    block->data = (unsigned char *) ckrealloc((char *) packed,
+                                                              size);
+                    block->packed = size;
+                    block->capacity = size;
+                }
+                else {
+                    ckfree((char *) packed);
+                }
+            }
+            block = scrollBlocks[scrollBlockCount - 1];
+        }
+    }
+
+    if (block->size + SCROLL_LINE_MAX(width) > block->capacity) {
+        block->capacity = (block->size + SCROLL_LINE_MAX(width)) * 2;
+        block->data = (unsigned char *) ckrealloc((char *) block->data,
+                                                  block->capacity);
+    }
+    len = scroll_encode(cells, width, block->data + block->size);
+    block->offsets[block->count++] = block->size;
+    block->size += len;
+    block->cells += width;
+    scrollLines++;
+
+    scroll_trim();
+}
+
+/*****************************************************************************
+ * scroll_trim
+ *
+ * Description:
+ *
+ *   Drops the oldest lines of the scrollback store until it holds at most
+ *   scrollLimit lines. Blocks are freed once all of their lines have been
+ *   dropped.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Frees blocks.
+ *****************************************************************************/
+
+static void scroll_trim(void) {
+    ScrollBlock *block;
+    int drop = 0;
+
+    if (scrollLines > scrollLimit) {
+        scrollSkip += scrollLines - scrollLimit;
+        scrollLines = scrollLimit;
+    }
+
+    while (scrollBlockCount > drop &&
+           scrollSkip >= SCROLL_BLOCK_LINES) {
+        block = scrollBlocks[drop++];
+        scrollSkip -= SCROLL_BLOCK_LINES;
+        if (scrollCacheBlock == block) scrollCacheBlock = NULL;
+        ckfree((char *) block->data);
+        ckfree((char *) block);
+    }
+
+    if (drop > 0) {
+        scrollBlockCount -= drop;
+        memmove(scrollBlocks, scrollBlocks + drop,
+                scrollBlockCount * sizeof(ScrollBlock *));
+    }
+}
+
+/*****************************************************************************
+ * scroll_clear
+ *
+ * Description:
+ *
+ *   Removes all lines and styles from the scrollback store.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Frees the blocks and the cache.
+ *****************************************************************************/
+
+static void scroll_clear(void) {
+    int i;
+
+    for (i = 0; i < scrollBlockCount; i++) {
+        ckfree((char *) scrollBlocks[i]->data);
+        ckfree((char *) scrollBlocks[i]);
+    }
+    if (scrollBlocks != NULL) ckfree((char *) scrollBlocks);
+    if (scrollCache != NULL) ckfree((char *) scrollCache);
+
+    scrollBlocks = NULL;
+    scrollBlockCount = scrollBlockCap = 0;
+    scrollSkip = scrollLines = 0;
+    scrollCache = NULL;
+    scrollCacheSize = 0;
+    scrollCacheBlock = NULL;
+    scrollStyleCount = 0;
+}
+
+/*****************************************************************************
+ * screen_get
+ *
+ * Description:
+ *
+ *   Finds a screen buffer by its name, screenN.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter for the error message
+ *   obj    - name of the screen
+ *   index  - receives the index of the screen
+ *
+ * Results:
+ *
+ *   TCL_OK, or TCL_ERROR if there is no such screen.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int screen_get(Tcl_Interp *interp, Tcl_Obj *obj, int *index) {
+    const char *name = Tcl_GetString(obj);
+    char *end;
+    long n;
+
+    if (strncmp(name, "screen", 6) == 0 && name[6] != '\0') {
+        n = strtol(name + 6, &end, 10);
+        if (*end == '\0' && n >= 0 && n < SCREEN_MAX &&
+            screens[n] != NULL) {
+            *index = (int) n;
+            return TCL_OK;
+        }
+    }
+
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("no such screen \"%s\"", name));
+    return TCL_ERROR;
+}
+
+/*****************************************************************************
+ * screen_name
+ *
+ * Description:
+ *
+ *   Returns the name of a screen buffer.
+ *
+ * Parameters:
+ *
+ *   index - index of the screen
+ *
+ * Results:
+ *
+ *   A new string object.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static Tcl_Obj *screen_name(int index) {
+    char name[32];
+
+    sprintf(name, "screen%d", index);
+
+    return Tcl_NewStringObj(name, -1);
+}
+
+/*****************************************************************************
+ * screen_copy
+ *
+ * Description:
+ *
+ *   Copies the visible window of one screen buffer to the same place in
+ *   another.
+ *
+ * Parameters:
+ *
+ *   from - source screen buffer
+ *   to   - destination screen buffer
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Overwrites the window of the destination.
+ *****************************************************************************/
+
+static void screen_copy(HANDLE from, HANDLE to) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    CHAR_INFO *cells;
+    SMALL_RECT rect;
+    COORD size;
+    COORD origin = {0, 0};
+
+    GetConsoleScreenBufferInfo(from, &info);
+    rect = info.srWindow;
+    size.X = rect.Right - rect.Left + 1;
+    size.Y = rect.Bottom - rect.Top + 1;
+
+    cells = (CHAR_INFO *) ckalloc(size.X * size.Y * sizeof(CHAR_INFO));
+    console_read_cells(from, cells, rect.Left, rect.Top, size.X, size.Y);
+    WriteConsoleOutputW(to, cells, size, origin, &rect);
+    ckfree((char *) cells);
+}
+
+#ifdef CONSIO_NRE
+
+/*****************************************************************************
+ * input_watch
+ *
+ * Description:
+ *
+ *   Thread that wakes up the main thread when console input arrives while
+ *   coroutines are waiting for it. The thread waits until it is armed and
+ *   the input handle is signaled, then queues an event for the main thread.
+ *   It is armed again only after the main thread has read the input, so
+ *   the event is queued once per arrival of input.
+ *
+ * Parameters:
+ *
+ *   clientData - not used
+ *
+ * Results:
+ *
+ *   None. The thread runs until the process exits.
+ *
+ * Side effects:
+ *
+ *   Queues events to the main thread.
+ *****************************************************************************/
+
+static Tcl_ThreadCreateType input_watch(ClientData clientData) {
+    Tcl_Event *event;
+
+    for (;;) {
+        WaitForSingleObject(inputArm, INFINITE);
+        WaitForSingleObject(hStdin, INFINITE);
+        event = (Tcl_Event *) ckalloc(sizeof(Tcl_Event));
+        event->proc = input_event;
+        Tcl_ThreadQueueEvent(inputThread, event, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(inputThread);
+    }
+
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*****************************************************************************
+ * input_event
+ *
+ * Description:
+ *
+ *   Event handler run in the main thread when the watcher thread has seen
+ *   console input. Passes the input to the waiting coroutines.
+ *
+ * Parameters:
+ *
+ *   event - the event
+ *   flags - event loop flags
+ *
+ * Results:
+ *
+ *   1 if the event was handled, 0 if file events are not being serviced.
+ *
+ * Side effects:
+ *
+ *   Resumes coroutines.
+ *****************************************************************************/
+
+static int input_event(Tcl_Event *event, int flags) {
+    if (!(flags & TCL_FILE_EVENTS)) return 0;
+
+    input_dispatch();
+
+    return 1;
+}
+
+/*****************************************************************************
+ * input_dispatch
+ *
+ * Description:
+ *
+ *   Reads the pending console input and offers it to the waiting
+ *   coroutines in the order they started waiting. A coroutine is resumed
+ *   as soon as it has got what it waits for; the next input goes to the
+ *   next coroutine. Input nobody waits for stays in the console buffer.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Resumes coroutines, which may run any script. Rearms the watcher
+ *   thread while coroutines are waiting and restores the console mode
+ *   when none are.
+ *****************************************************************************/
+
+static void input_dispatch(void) {
+    InputWaiter *w;
+    INPUT_RECORD record;
+    DWORD pending, num;
+
+    while (inputWaiters != NULL &&
+           GetNumberOfConsoleInputEvents(hStdin, &pending) && pending > 0) {
+        ReadConsoleInput(hStdin, &record, 1, &num);
+        if (num == 0) break;
+
+        w = inputWaiters;
+        if (!input_offer(w, &record)) continue;
+
+        inputWaiters = w->next;
+        input_wake(w);
+    }
+
+    if (inputWaiters != NULL) {
+        SetEvent(inputArm);
+    }
+    else if (inputModeSaved) {
+        SetConsoleMode(hStdin, inputMode);
+        inputModeSaved = 0;
+    }
+}
+
+/*****************************************************************************
+ * input_offer
+ *
+ * Description:
+ *
+ *   Offers an input record to a waiting coroutine. Key waiters take the
+ *   first key press, character waiters the first key press producing a
+ *   character. Line waiters collect characters until Enter, handling
+ *   backspace and echoing the line if asked to.
+ *
+ * Parameters:
+ *
+ *   w      - the waiter
+ *   record - the input record
+ *
+ * Results:
+ *
+ *   1 if the waiter has got what it waits for, 0 otherwise.
+ *
+ * Side effects:
+ *
+ *   May echo characters.
+ *****************************************************************************/
+
+static int input_offer(InputWaiter *w, INPUT_RECORD *record) {
+    DWORD num;
+    char ch;
+    int len;
+
+    if (record->EventType != KEY_EVENT ||
+        record->Event.KeyEvent.bKeyDown == FALSE) {
+        return 0;
+    }
+    ch = record->Event.KeyEvent.uChar.AsciiChar;
+
+    switch (w->kind) {
+        case INPUT_WAIT_KEY:
+            w->record = *record;
+            return 1;
+
+        case INPUT_WAIT_CHAR:
+        case INPUT_WAIT_CHAR_ECHO:
+            if (ch == 0) return 0;
+            w->record = *record;
+            return 1;
+
+        case INPUT_WAIT_LINE:
+        case INPUT_WAIT_LINE_ECHO:
+            if (ch == '\r' ||
+                record->Event.KeyEvent.wVirtualKeyCode == VK_RETURN) {
+                if (w->kind == INPUT_WAIT_LINE_ECHO) {
+                    WriteConsole(hStdout, "\r\n", 2, &num, NULL);
+                }
+                return 1;
+            }
+            len = Tcl_DStringLength(&w->line);
+            if (ch == '\b') {
+                if (len > 0) {
+                    Tcl_DStringSetLength(&w->line, len - 1);
+                    if (w->kind == INPUT_WAIT_LINE_ECHO) {
+                        WriteConsole(hStdout, "\b \b", 3, &num, NULL);
+                        export_touch();
+                    }
+                }
+            }
+            else if ((unsigned char) ch >= ' ' && len < INPUT_LINE_MAX) {
+                Tcl_DStringAppend(&w->line, &ch, 1);
+                if (w->kind == INPUT_WAIT_LINE_ECHO) {
+                    WriteConsole(hStdout, &ch, 1, &num, NULL);
+                    export_touch();
+                }
+            }
+            return 0;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************
+ * input_nr
+ *
+ * Description:
+ *
+ *   NRE implementation of Consio::getch, getche, getchex, cgets and
+ *   cgetse. Called from a coroutine, the command queues the coroutine as
+ *   a waiter and yields; the coroutine is resumed from the event loop when
+ *   its input has arrived, and the command then returns like its blocking
+ *   version. Outside a coroutine, or while replaying input, the blocking
+ *   version is called.
+ *
+ *   When a terminal opened with Consio::open is current, the coroutine
+ *   waits in the queue of that terminal and is resumed by
+ *   terminal_dispatch once the key presses received from the terminal
+ *   are enough for the blocking version to return without waiting. Each
+ *   terminal serves its waiters in order, independently of the others.
+ *
+ * Parameters:
+ *
+ *   clientData - what to wait for, one of the INPUT_WAIT_ constants
+ *
+ * Results:
+ *
+ *   See the blocking commands.
+ *
+ * Side effects:
+ *
+ *   Sets the console input mode to raw while coroutines wait for the
+ *   console. Starts the watcher thread the first time it is needed.
+ *****************************************************************************/
+
+static int input_nr(ClientData clientData,
+                    Tcl_Interp *interp,
+                    int objc,
+                    Tcl_Obj * CONST objv[]) {
+    int kind = (int) (size_t) clientData;
+    InputWaiter *w, **tail;
+    Tcl_Obj *coroutine;
+    Tcl_ThreadId id;
+
+    if (replayObj == NULL &&
+        (terminal == NULL || !terminal_ready(terminal, kind)) &&
+        Tcl_EvalEx(interp, "::info coroutine", -1, 0) == TCL_OK) {
+        coroutine = Tcl_GetObjResult(interp);
+    }
+    else {
+        coroutine = NULL;
+    }
+    if (coroutine == NULL || Tcl_GetCharLength(coroutine) == 0) {
+        Tcl_ResetResult(interp);
+        return input_blocking(kind, interp, objc, objv);
+    }
+
+    if (inputArm == NULL && terminal == NULL) {
+        inputArm = CreateEvent(NULL, FALSE, FALSE, NULL);
+        inputThread = Tcl_GetCurrentThread();
+        if (inputArm == NULL ||
+            Tcl_CreateThread(&id, input_watch, NULL,
+                             TCL_THREAD_STACK_DEFAULT,
+                             TCL_THREAD_NOFLAGS) != TCL_OK) {
+            if (inputArm != NULL) CloseHandle(inputArm);
+            inputArm = NULL;
+            Tcl_SetObjResult(interp,
+                Tcl_NewStringObj("can't start input thread", -1));
+            return TCL_ERROR;
+        }
+    }
+
+    w = (InputWaiter *) ckalloc(sizeof(InputWaiter));
+    memset(w, 0, sizeof(InputWaiter));
+    w->kind = kind;
+    w->interp = interp;
+    w->coroutine = coroutine;
+    Tcl_IncrRefCount(coroutine);
+    Tcl_DStringInit(&w->line);
+    Tcl_ResetResult(interp);
+
+    if (terminal != NULL) {
+        w->terminal = terminal;
+        Tcl_Preserve((ClientData) terminal);
+        if (terminalFrames != NULL && terminalFrames->terminal == terminal) {
+            w->frame = terminalFrames;
+        }
+        for (tail = &terminal->waiters; *tail != NULL;
+             tail = &(*tail)->next);
+        *tail = w;
+        input_park(w);
+    }
+    else {
+        for (tail = &inputWaiters; *tail != NULL; tail = &(*tail)->next);
+        *tail = w;
+
+        if (!inputModeSaved) {
+            GetConsoleMode(hStdin, &inputMode);
+            SetConsoleMode(hStdin, 0);
+            inputModeSaved = 1;
+        }
+        SetEvent(inputArm);
+    }
+
+    Tcl_NRAddCallback(interp, input_resume, w, (ClientData) (size_t) objc,
+                      (ClientData) objv, NULL);
+    return Tcl_NREvalObj(interp, Tcl_NewStringObj("::yield", -1), 0);
+}
+
+/*****************************************************************************
+ * input_resume
+ *
+ * Description:
+ *
+ *   Continues a command of input_nr after its coroutine has been resumed.
+ *   If the coroutine was resumed by something else than arriving input,
+ *   it yields again. A terminal waiter runs the blocking command, which
+ *   finds its input already queued.
+ *
+ * Parameters:
+ *
+ *   data   - data[0] is the waiter, data[1] and data[2] the arguments of
+ *            the command
+ *   interp - interpreter
+ *   result - result of the yield
+ *
+ * Results:
+ *
+ *   See the blocking commands.
+ *
+ * Side effects:
+ *
+ *   Records the input and frees the waiter. Makes the terminal of the
+ *   waiter current while the coroutine runs.
+ *****************************************************************************/
+
+static int input_resume(ClientData data[], Tcl_Interp *interp, int result) {
+    InputWaiter *w = (InputWaiter *) data[0];
+    int objc = (int) (size_t) data[1];
+    Tcl_Obj * CONST *objv = (Tcl_Obj * CONST *) data[2];
+    InputWaiter **p;
+    Tcl_Obj *obj;
+    DWORD num;
+    WORD code;
+    char ch;
+
+    input_unpark(w);
+
+    if (result == TCL_OK && !w->done) {
+        input_park(w);
+        Tcl_ResetResult(interp);
+        Tcl_NRAddCallback(interp, input_resume, w, data[1], data[2], NULL);
+        return Tcl_NREvalObj(interp, Tcl_NewStringObj("::yield", -1), 0);
+    }
+
+    /* A deleted coroutine leaves its waiter in the queue */
+
+    p = w->terminal != NULL ? &w->terminal->waiters : &inputWaiters;
+    for (; *p != NULL; p = &(*p)->next) {
+        if (*p == w) {
+            *p = w->next;
+            break;
+        }
+    }
+    if (inputWaiters == NULL && inputModeSaved) {
+        SetConsoleMode(hStdin, inputMode);
+        inputModeSaved = 0;
+    }
+
+    if (result == TCL_OK && w->terminal != NULL) {
+        if (w->terminal->closed) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "terminal \"%s\" has closed", w->terminal->name));
+            result = TCL_ERROR;
+        }
+        else {
+            result = input_blocking(w->kind, interp, objc, objv);
+        }
+    }
+    else if (result == TCL_OK) {
+        switch (w->kind) {
+            case INPUT_WAIT_CHAR:
+            case INPUT_WAIT_CHAR_ECHO:
+                ch = w->record.Event.KeyEvent.uChar.AsciiChar;
+                record_event(REC_IN_CHAR, &ch, 1);
+                if (w->kind == INPUT_WAIT_CHAR_ECHO) {
+                    WriteConsole(hStdout, &ch, 1, &num, NULL);
+                    record_event(REC_OUT_TEXT, &ch, 1);
+                }
+                obj = Tcl_NewStringObj(&ch, 1);
+                break;
+            case INPUT_WAIT_KEY:
+                code = w->record.Event.KeyEvent.wVirtualKeyCode;
+                record_int(REC_IN_KEY, code);
+                obj = Tcl_NewIntObj(code);
+                break;
+            default:
+                record_event(REC_IN_LINE, Tcl_DStringValue(&w->line),
+                             Tcl_DStringLength(&w->line));
+                if (w->kind == INPUT_WAIT_LINE_ECHO) {
+                    record_event(REC_OUT_TEXT, Tcl_DStringValue(&w->line),
+                                 Tcl_DStringLength(&w->line));
+                    record_event(REC_OUT_TEXT, "\r\n", 2);
+                }
+                obj = Tcl_NewStringObj(Tcl_DStringValue(&w->line),
+                                       Tcl_DStringLength(&w->line));
+                break;
+        }
+        Tcl_SetObjResult(interp, obj);
+    }
+
+    if (w->resumed && w->resumer != NULL) {
+        Tcl_Release((ClientData) w->resumer);
+    }
+    if (w->terminal != NULL) Tcl_Release((ClientData) w->terminal);
+    Tcl_DecrRefCount(w->coroutine);
+    Tcl_DStringFree(&w->line);
+    ckfree((char *) w);
+
+    return result;
+}
+
+/*****************************************************************************
+ * input_wake
+ *
+ * Description:
+ *
+ *   Resumes the coroutine of a waiter taken off its queue.
+ *
+ * Parameters:
+ *
+ *   w - the waiter
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Runs the coroutine, which may run any script and frees the waiter.
+ *   Errors are reported as background errors.
+ *****************************************************************************/
+
+static void input_wake(InputWaiter *w) {
+    Tcl_Interp *interp = w->interp;
+    Tcl_Obj *coroutine = w->coroutine;
+
+    w->next = NULL;
+    w->done = 1;
+
+    /* The waiter is freed by the coroutine, so hold on to its name */
+
+    Tcl_Preserve((ClientData) interp);
+    Tcl_IncrRefCount(coroutine);
+    if (Tcl_EvalObjEx(interp, coroutine, TCL_EVAL_GLOBAL) != TCL_OK) {
+        Tcl_BackgroundError(interp);
+    }
+    Tcl_DecrRefCount(coroutine);
+    Tcl_Release((ClientData) interp);
+}
+
+/*****************************************************************************
+ * input_blocking
+ *
+ * Description:
+ *
+ *   Runs the blocking version of an input command of input_nr.
+ *
+ * Parameters:
+ *
+ *   kind   - what to wait for, one of the INPUT_WAIT_ constants
+ *   interp - interpreter
+ *   objc   - number of arguments
+ *   objv   - arguments
+ *
+ * Results:
+ *
+ *   See the blocking commands.
+ *
+ * Side effects:
+ *
+ *   See the blocking commands.
+ *****************************************************************************/
+
+static int input_blocking(int kind,
+                          Tcl_Interp *interp,
+                          int objc,
+                          Tcl_Obj * CONST objv[]) {
+    switch (kind) {
+        case INPUT_WAIT_CHAR:
+            return cmd_getch(NULL, interp, objc, objv);
+        case INPUT_WAIT_CHAR_ECHO:
+            return cmd_getche(NULL, interp, objc, objv);
+        case INPUT_WAIT_KEY:
+            return cmd_getchex(NULL, interp, objc, objv);
+        case INPUT_WAIT_LINE:
+            return cmd_cgets(NULL, interp, objc, objv);
+        default:
+            return cmd_cgetse(NULL, interp, objc, objv);
+    }
+}
+
+/*****************************************************************************
+ * input_park, input_unpark
+ *
+ * Description:
+ *
+ *   Keep the current terminal right around the yields of a coroutine
+ *   waiting for a terminal. When the coroutine yields, the terminal that
+ *   was current before it is made current again, and the terminal
+ *   command it waits in is taken off the stack of running terminal
+ *   commands. When it is resumed, its terminal is made current again and
+ *   the terminal command, if any, returns to the terminal current at
+ *   that time.
+ *
+ * Parameters:
+ *
+ *   w - the waiter
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Changes the current terminal.
+ *****************************************************************************/
+
+static void input_park(InputWaiter *w) {
+    TerminalFrame **p;
+
+    if (w->terminal == NULL) return;
+
+    if (w->frame != NULL) {
+        for (p = &terminalFrames; *p != NULL; p = &(*p)->prev) {
+            if (*p == w->frame) {
+                *p = w->frame->prev;
+                break;
+            }
+        }
+        terminal_select(w->frame->saved);
+    }
+    else if (w->resumed) {
+        terminal_select(w->resumer);
+        if (w->resumer != NULL) Tcl_Release((ClientData) w->resumer);
+        w->resumed = 0;
+    }
+}
+
+static void input_unpark(InputWaiter *w) {
+    Terminal *resumer = terminal;
+
+    if (w->terminal == NULL) return;
+
+    if (resumer != NULL) Tcl_Preserve((ClientData) resumer);
+    if (w->frame != NULL) {
+        if (w->frame->saved != NULL) {
+            Tcl_Release((ClientData) w->frame->saved);
+        }
+        w->frame->saved = resumer;
+        w->frame->prev = terminalFrames;
+        terminalFrames = w->frame;
+    }
+    else {
+        if (w->resumed && w->resumer != NULL) {
+            Tcl_Release((ClientData) w->resumer);
+        }
+        w->resumer = resumer;
+        w->resumed = 1;
+    }
+    terminal_select(w->terminal);
+}
+
+/*****************************************************************************
+ * terminal_ready
+ *
+ * Description:
+ *
+ *   Checks whether the blocking version of an input command would return
+ *   without waiting on a terminal: the key presses it needs have been
+ *   received, or the terminal has ended.
+ *
+ * Parameters:
+ *
+ *   t    - terminal
+ *   kind - what to wait for, one of the INPUT_WAIT_ constants
+ *
+ * Results:
+ *
+ *   1 if the command would not wait, 0 otherwise.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int terminal_ready(Terminal *t, int kind) {
+    KEY_EVENT_RECORD *key;
+    int i;
+
+    if (t->eof || t->closed) return 1;
+
+    for (i = t->keyFirst; i < t->keyCount; i++) {
+        key = &t->keys[i].Event.KeyEvent;
+        switch (kind) {
+            case INPUT_WAIT_KEY:
+                return 1;
+            case INPUT_WAIT_CHAR:
+            case INPUT_WAIT_CHAR_ECHO:
+                if (key->uChar.UnicodeChar != 0) return 1;
+                break;
+            default:
+                if (key->wVirtualKeyCode == VK_RETURN) return 1;
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/*****************************************************************************
+ * terminal_dispatch, terminal_wake
+ *
+ * Description:
+ *
+ *   Resume the coroutines waiting for the input of a terminal, in the
+ *   order they started waiting, as long as the first one has got what it
+ *   waits for. terminal_wake does it from an idle callback for a terminal
+ *   that has been closed.
+ *
+ * Parameters:
+ *
+ *   t          - terminal
+ *   clientData - terminal, preserved by the caller of Tcl_DoWhenIdle
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Resumes coroutines, which may run any script. The current terminal
+ *   is restored afterwards.
+ *****************************************************************************/
+
+static void terminal_dispatch(Terminal *t) {
+    Terminal *saved = terminal;
+    InputWaiter *w;
+
+    if (t->waiters == NULL) return;
+
+    Tcl_Preserve((ClientData) t);
+    if (saved != NULL) Tcl_Preserve((ClientData) saved);
+    while ((w = t->waiters) != NULL && terminal_ready(t, w->kind)) {
+        t->waiters = w->next;
+        input_wake(w);
+    }
+    terminal_select(saved);
+    if (saved != NULL) Tcl_Release((ClientData) saved);
+    Tcl_Release((ClientData) t);
+}
+
+static void terminal_wake(ClientData clientData) {
+    terminal_dispatch((Terminal *) clientData);
+    Tcl_Release(clientData);
+}
+
+#endif /*CONSIO_NRE*/
+
+/*****************************************************************************
+ * encoder_touch, encoder_idle
+ *
+ * Description:
+ *
+ *   Schedules a frame of the escape sequence encoder to be sent when the
+ *   event loop is next idle, so a burst of output results in one frame.
+ *   The frame is sent from the terminal that was current when scheduled.
+ *
+ * Parameters:
+ *
+ *   clientData - terminal, or NULL for the console
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Schedules an idle callback, which sends the frame.
+ *****************************************************************************/
+
+static void encoder_touch(void) {
+    if (encoder == NULL || encoder->pending) return;
+
+    encoder->pending = 1;
+    Tcl_DoWhenIdle(encoder_idle, (ClientData) terminal);
+}
+
+static void encoder_idle(ClientData clientData) {
+    Terminal *saved = terminal;
+
+    terminal_select((Terminal *) clientData);
+    if (encoder != NULL) {
+        encoder->pending = 0;
+        encoder_frame();
+    }
+    terminal_select(saved);
+}
+
+/*****************************************************************************
+ * encoder_same
+ *
+ * Description:
+ *
+ *   Compares two cells as the remote terminal shows them. Blanks only
+ *   differ by their background, as the foreground color of a blank cell
+ *   cannot be seen.
+ *
+ * Parameters:
+ *
+ *   a, b - cells
+ *
+ * Results:
+ *
+ *   Non-zero if the cells look the same.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int encoder_same(const CHAR_INFO *a, const CHAR_INFO *b) {
+    WORD mask = ENCODER_ATTR_MASK;
+
+    if (a->Char.UnicodeChar != b->Char.UnicodeChar) return 0;
+
+    if (a->Char.UnicodeChar == ' ' &&
+        !(a->Attributes & ENCODER_ATTR_FLAGS) &&
+        !(b->Attributes & ENCODER_ATTR_FLAGS)) {
+        mask = 0xF0;
+    }
+
+    return (a->Attributes & mask) == (b->Attributes & mask);
+}
+
+/*****************************************************************************
+ * encoder_attr
+ *
+ * Description:
+ *
+ *   Sets the text attributes of the remote terminal. Only the parts that
+ *   differ from the attributes known to be in effect are sent.
+ *
+ * Parameters:
+ *
+ *   e    - encoder
+ *   attr - console text attributes
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Appends an SGR sequence to the frame.
+ *****************************************************************************/
+
+static void encoder_attr(Encoder *e, WORD attr) {
+    static const int ansi[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+    char seq[48];
+    char *p = seq + 2;
+    WORD old, changed;
+    int fg, bg;
+
+    attr &= ENCODER_ATTR_MASK;
+    if (e->attrValid && attr == e->attr) return;
+
+    if (e->attrValid) {
+        old = e->attr;
+        changed = old ^ attr;
+    }
+    else {
+        p += sprintf(p, "0;");
+        old = 0;
+        changed = 0xFFFF;
+    }
+
+    fg = attr & 0x0F;
+    bg = (attr >> 4) & 0x0F;
+    if (changed & 0x0F) {
+        p += sprintf(p, "%d;", (fg & 8 ? 90 : 30) + ansi[fg & 7]);
+    }
+    if (changed & 0xF0) {
+        p += sprintf(p, "%d;", (bg & 8 ? 100 : 40) + ansi[bg & 7]);
+    }
+    if ((changed & COMMON_LVB_UNDERSCORE) &&
+        (attr & COMMON_LVB_UNDERSCORE || e->attrValid)) {
+        p += sprintf(p, attr & COMMON_LVB_UNDERSCORE ? "4;" : "24;");
+    }
+    if ((changed & COMMON_LVB_REVERSE_VIDEO) &&
+        (attr & COMMON_LVB_REVERSE_VIDEO || e->attrValid)) {
+        p += sprintf(p, attr & COMMON_LVB_REVERSE_VIDEO ? "7;" : "27;");
+    }
+
+    seq[0] = '\033';
+    seq[1] = '[';
+    p[-1] = 'm';
+    Tcl_DStringAppend(&e->out, seq, (int) (p - seq));
+
+    e->attr = attr;
+    e->attrValid = 1;
+}
+
+/*****************************************************************************
+ * encoder_csi
+ *
+ * Description:
+ *
+ *   Formats a control sequence with a count, leaving out a count of 1.
+ *
+ * Parameters:
+ *
+ *   buf   - output buffer of at least 16 bytes
+ *   n     - count
+ *   final - final character of the sequence
+ *
+ * Results:
+ *
+ *   Returns the length of the sequence.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int encoder_csi(char *buf, int n, char final) {
+    if (n == 1) return sprintf(buf, "\033[%c", final);
+
+    return sprintf(buf, "\033[%d%c", n, final);
+}
+
+/*****************************************************************************
+ * encoder_move
+ *
+ * Description:
+ *
+ *   Moves the remote cursor with the shortest of an absolute position,
+ *   relative moves, carriage return and line feed, or by rewriting the
+ *   few cells in between.
+ *
+ * Parameters:
+ *
+ *   e    - encoder
+ *   x, y - new cursor position within the window
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Appends a cursor movement to the frame.
+ *****************************************************************************/
+
+static void encoder_move(Encoder *e, int x, int y) {
+    char best[64], seq[64], part[16], cr[16];
+    const CHAR_INFO *c;
+    int len, n, i, k;
+
+    if (e->cursorX == x && e->cursorY == y) return;
+
+    if (x == 0 && y == 0) len = sprintf(best, "\033[H");
+    else if (x == 0) len = sprintf(best, "\033[%dH", y + 1);
+    else len = sprintf(best, "\033[%d;%dH", y + 1, x + 1);
+
+    if (e->cursorX >= 0) {
+
+        /* Vertical move, then a relative move or CR and a move right */
+
+        n = 0;
+        if (y > e->cursorY) n = encoder_csi(seq, y - e->cursorY, 'B');
+        else if (y < e->cursorY) n = encoder_csi(seq, e->cursorY - y, 'A');
+        i = 0;
+        if (x > e->cursorX) {
+            i = encoder_csi(part, x - e->cursorX, 'C');
+        }
+        else if (x < e->cursorX) {
+            i = encoder_csi(part, e->cursorX - x, 'D');
+            cr[0] = '\r';
+            k = x > 0 ? 1 + encoder_csi(cr + 1, x, 'C') : 1;
+            if (k < i) {
+                memcpy(part, cr, k);
+                i = k;
+            }
+        }
+        memcpy(seq + n, part, i);
+        n += i;
+        if (n < len) {
+            memcpy(best, seq, n);
+            len = n;
+        }
+
+        if (y == e->cursorY + 1 && x == 0 && len > 2) {
+            memcpy(best, "\r\n", 2);
+            len = 2;
+        }
+
+        /* Short forward moves can rewrite plain cells in between */
+
+        n = x - e->cursorX;
+        if (y == e->cursorY && n > 0 && n < len && e->attrValid) {
+            c = e->screen + y * e->width + e->cursorX;
+            for (i = 0; i < n; i++) {
+                if (c[i].Char.UnicodeChar < ' ' ||
+                    c[i].Char.UnicodeChar > '~' ||
+                    (c[i].Attributes & ENCODER_ATTR_MASK) != e->attr) {
+                    break;
+                }
+                seq[i] = (char) c[i].Char.UnicodeChar;
+            }
+            if (i == n) {
+                memcpy(best, seq, n);
+                len = n;
+            }
+        }
+    }
+
+    Tcl_DStringAppend(&e->out, best, len);
+    e->cursorX = x;
+    e->cursorY = y;
+}
+
+/*****************************************************************************
+ * encoder_span
+ *
+ * Description:
+ *
+ *   Sends cells of a row of the frame. Runs of equal cells are sent with
+ *   the cheapest of plain characters, REP (repeat the previous character),
+ *   ECH (erase characters) or EL (erase to the end of the line).
+ *
+ * Parameters:
+ *
+ *   e     - encoder
+ *   y     - row
+ *   start - first cell to send
+ *   end   - cell after the last one to send
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Appends to the frame and updates the remote screen state.
+ *****************************************************************************/
+
+static void encoder_span(Encoder *e, int y, int start, int end) {
+    CHAR_INFO *want = e->frame + y * e->width;
+    CHAR_INFO *have = e->screen + y * e->width;
+    char utf[TCL_UTF_MAX + 1], seq[32], move[16];
+    int x, n, run, len, ch, cost, ech, rep, i;
+
+    encoder_move(e, start, y);
+
+    for (x = start; x < end; x += n) {
+        n = 1;
+        if (want[x].Attributes & COMMON_LVB_TRAILING_BYTE) {
+
+            /* Covered by the wide character in the previous cell */
+
+            have[x] = want[x];
+            e->cursorX++;
+            continue;
+        }
+
+        encoder_attr(e, want[x].Attributes);
+        ch = want[x].Char.UnicodeChar;
+        if (ch < ' ' || ch == 0x7F) ch = '?';
+        len = Tcl_UniCharToUtf(ch, utf);
+
+        for (run = 1; x + run < e->width; run++) {
+            if (want[x + run].Char.UnicodeChar != want[x].Char.UnicodeChar ||
+                want[x + run].Attributes != want[x].Attributes) {
+                break;
+            }
+        }
+
+        /* Blanks up to the end of the line are erased with EL */
+
+        if (ch == ' ' && x + run == e->width &&
+            !(want[x].Attributes & ENCODER_ATTR_FLAGS) && run > 3) {
+            Tcl_DStringAppend(&e->out, "\033[K", 3);
+            for (i = x; i < e->width; i++) have[i] = want[i];
+            e->cells += e->width - x;
+            n = end - x;
+            continue;
+        }
+
+        if (run > end - x) run = end - x;
+        n = run;
+        cost = run * len;
+        ech = rep = 0;
+        if (ch == ' ' && run > 1) {
+            ech = encoder_csi(seq, run, 'X');
+            if (x + run < end) ech += encoder_csi(move, run, 'C');
+            if (ech < cost) cost = ech;
+            else ech = 0;
+        }
+        if (e->rep && run > 2 && !(want[x].Attributes & COMMON_LVB_LEADING_BYTE)) {
+            rep = len + encoder_csi(seq, run - 1, 'b');
+            if (rep < cost) ech = 0;
+            else rep = 0;
+        }
+
+        if (ech) {
+            Tcl_DStringAppend(&e->out, seq, encoder_csi(seq, run, 'X'));
+            if (x + run < end) {
+                Tcl_DStringAppend(&e->out, move, encoder_csi(move, run, 'C'));
+                e->cursorX = x + run;
+            }
+            else {
+                e->cursorX = x;
+            }
+        }
+        else {
+            Tcl_DStringAppend(&e->out, utf, len);
+            if (rep) {
+                Tcl_DStringAppend(&e->out, seq,
+                                  encoder_csi(seq, run - 1, 'b'));
+            }
+            else {
+                for (i = 1; i < run; i++) Tcl_DStringAppend(&e->out, utf, len);
+            }
+            e->cursorX = x + run;
+        }
+
+        for (i = x; i < x + run; i++) have[i] = want[i];
+        e->cells += run;
+
+        /* Writing the last column leaves the cursor in a pending wrap */
+
+        if (e->cursorX >= e->width) e->cursorX = -1;
+    }
+}
+
+/*****************************************************************************
+ * encoder_scroll
+ *
+ * Description:
+ *
+ *   Finds out whether the frame equals the remote screen scrolled up by a
+ *   few lines, and if so, scrolls the remote screen with SU so that only
+ *   the new lines need to be sent.
+ *
+ * Parameters:
+ *
+ *   e - encoder
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   May append a scroll to the frame and update the remote screen state.
+ *****************************************************************************/
+
+static void encoder_scroll(Encoder *e) {
+    CHAR_INFO blank;
+    char seq[16];
+    int w = e->width, h = e->height;
+    int best = 0, bestRows, rows, k, x, y;
+
+    bestRows = 0;
+    for (y = 0; y < h; y++) {
+        bestRows += encoder_row_same(e->frame + y * w, e->screen + y * w, w);
+    }
+    if (bestRows == h) return;
+
+    for (k = 1; k <= h / 2; k++) {
+        rows = 0;
+        for (y = 0; y + k < h; y++) {
+            rows += encoder_row_same(e->frame + y * w,
+                                     e->screen + (y + k) * w, w);
+        }
+        if (rows > bestRows + ENCODER_SCROLL_GAIN) {
+            best = k;
+            bestRows = rows;
+        }
+    }
+    if (best == 0) return;
+
+    /* New lines get the background in effect, so set it first */
+
+    blank = e->frame[w * h - 1];
+    blank.Char.UnicodeChar = ' ';
+    blank.Attributes &= ENCODER_ATTR_MASK & ~ENCODER_ATTR_FLAGS;
+    encoder_attr(e, blank.Attributes);
+    Tcl_DStringAppend(&e->out, seq, encoder_csi(seq, best, 'S'));
+
+    memmove(e->screen, e->screen + best * w,
+            (h - best) * w * sizeof(CHAR_INFO));
+    for (x = (h - best) * w; x < h * w; x++) e->screen[x] = blank;
+}
+
+/*****************************************************************************
+ * encoder_row_same
+ *
+ * Description:
+ *
+ *   Compares two rows as the remote terminal shows them.
+ *
+ * Parameters:
+ *
+ *   a, b  - rows
+ *   width - number of cells
+ *
+ * Results:
+ *
+ *   1 if the rows look the same, 0 otherwise.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int encoder_row_same(const CHAR_INFO *a, const CHAR_INFO *b,
+                            int width) {
+    int x;
+
+    for (x = 0; x < width; x++) {
+        if (!encoder_same(a + x, b + x)) return 0;
+    }
+
+    return 1;
+}
+
+/*****************************************************************************
+ * encoder_resize
+ *
+ * Description:
+ *
+ *   Adapts the remote screen state to a new window size instead of
+ *   repainting the whole screen. The cells both sizes share are kept, and
+ *   only the columns and rows that were dropped or exposed are cleared on
+ *   the remote terminal, so a window being resized costs a few sequences
+ *   per frame plus whatever the new cells need.
+ *
+ * Parameters:
+ *
+ *   e      - encoder
+ *   width  - new width
+ *   height - new height
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Appends the clearing sequences to the frame. Expects e->frame to hold
+ *   the new window.
+ *****************************************************************************/
+
+static void encoder_resize(Encoder *e, int width, int height) {
+    CHAR_INFO *screen;
+    CHAR_INFO blank;
+    int w, h, x, y;
+
+    w = width < e->width ? width : e->width;
+    h = height < e->height ? height : e->height;
+
+    blank = e->frame[width * height - 1];
+    blank.Char.UnicodeChar = ' ';
+    blank.Attributes &= ENCODER_ATTR_MASK & ~ENCODER_ATTR_FLAGS;
+
+    screen = (CHAR_INFO *) ckalloc(width * height * sizeof(CHAR_INFO));
+    for (x = 0; x < width * height; x++) screen[x] = blank;
+
+    if (e->valid) {
+        encoder_attr(e, blank.Attributes);
+        if (width != e->width) {
+            for (y = 0; y < h; y++) {
+                encoder_move(e, w, y);
+                Tcl_DStringAppend(&e->out, "\033[K", -1);
+            }
+        }
+        if (height != e->height) {
+            encoder_move(e, 0, h);
+            Tcl_DStringAppend(&e->out, "\033[J", -1);
+        }
+        for (y = 0; y < h; y++) {
+            memcpy(screen + y * width, e->screen + y * e->width,
+                   w * sizeof(CHAR_INFO));
+        }
+    }
+
+    if (e->screen != NULL) ckfree((char *) e->screen);
+    e->screen = screen;
+    e->width = width;
+    e->height = height;
+}
+
+/*****************************************************************************
+ * encoder_frame
+ *
+ * Description:
+ *
+ *   Sends the changes of the visible console window since the last frame
+ *   to the channel of the escape sequence encoder. Changed cells of a row
+ *   are grouped into spans, joining spans separated by at most
+ *   ENCODER_GAP unchanged cells.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns the number of bytes sent.
+ *
+ * Side effects:
+ *
+ *   Writes to the channel.
+ *****************************************************************************/
+
+static int encoder_frame(void) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    CONSOLE_CURSOR_INFO cursor;
+    Encoder *e = encoder;
+    CHAR_INFO *want, *have;
+    CHAR_INFO blank;
+    int width, height, x, y, start, end, gap, visible, len;
+
+    if (e == NULL) return 0;
+
+    GetConsoleScreenBufferInfo(screens[screenActive], &info);
+    GetConsoleCursorInfo(screens[screenActive], &cursor);
+    width = info.srWindow.Right - info.srWindow.Left + 1;
+    height = info.srWindow.Bottom - info.srWindow.Top + 1;
+
+    if (width != e->width || height != e->height) {
+        e->frame = (CHAR_INFO *) ckrealloc((char *) e->frame,
+                                           width * height * sizeof(CHAR_INFO));
+    }
+    console_read_cells(screens[screenActive], e->frame, info.srWindow.Left,
+                       info.srWindow.Top, width, height);
+    Tcl_DStringSetLength(&e->out, 0);
+
+    if (width != e->width || height != e->height) {
+        encoder_resize(e, width, height);
+    }
+
+    if (!e->valid) {
+
+        /* Start from a screen cleared to the most likely background */
+
+        blank = e->frame[width * height - 1];
+        blank.Char.UnicodeChar = ' ';
+        blank.Attributes &= ENCODER_ATTR_MASK & ~ENCODER_ATTR_FLAGS;
+        e->attrValid = 0;
+        encoder_attr(e, blank.Attributes);
+        Tcl_DStringAppend(&e->out, "\033[H\033[2J", -1);
+        for (x = 0; x < width * height; x++) e->screen[x] = blank;
+        e->cursorX = e->cursorY = 0;
+        e->cursorVisible = -1;
+        e->valid = 1;
+    }
+    else {
+        encoder_scroll(e);
+    }
+
+    for (y = 0; y < height; y++) {
+        want = e->frame + y * width;
+        have = e->screen + y * width;
+        for (x = 0; x < width; x = end) {
+            if (encoder_same(want + x, have + x)) {
+                end = x + 1;
+                continue;
+            }
+            start = x;
+            end = x + 1;
+            for (gap = 0, x++; x < width && gap <= ENCODER_GAP; x++) {
+                if (encoder_same(want + x, have + x)) {
+                    gap++;
+                }
+                else {
+                    end = x + 1;
+                    gap = 0;
+                }
+            }
+            if (start > 0 && (want[start].Attributes &
+                              COMMON_LVB_TRAILING_BYTE)) {
+                start--;
+            }
+            encoder_span(e, y, start, end);
+        }
+    }
+
+    x = info.dwCursorPosition.X - info.srWindow.Left;
+    y = info.dwCursorPosition.Y - info.srWindow.Top;
+    visible = cursor.bVisible && x >= 0 && x < width && y >= 0 && y < height;
+    if (visible) encoder_move(e, x, y);
+    if (visible != e->cursorVisible) {
+        Tcl_DStringAppend(&e->out, visible ? "\033[?25h" : "\033[?25l", -1);
+        e->cursorVisible = visible;
+    }
+
+    len = Tcl_DStringLength(&e->out);
+    if (len > 0) {
+        Tcl_Write(e->channel, Tcl_DStringValue(&e->out), len);
+        Tcl_Flush(e->channel);
+        e->frames++;
+        e->bytes += len;
+        e->lastBytes = len;
+    }
+
+    return len;
+}
+
+/*****************************************************************************
+ * encoder_open
+ *
+ * Description:
+ *
+ *   Starts the escape sequence encoder of the current terminal, replacing
+ *   a running one. The first frame repaints the whole screen.
+ *
+ * Parameters:
+ *
+ *   interp  - interpreter
+ *   channel - channel to send to
+ *   rep     - 1 to use REP for repeated characters
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Sets the channel to binary translation and keeps it open until the
+ *   encoder is closed.
+ *****************************************************************************/
+
+static void encoder_open(Tcl_Interp *interp, Tcl_Channel channel, int rep) {
+    Encoder *e;
+
+    encoder_close();
+    Tcl_RegisterChannel(NULL, channel);
+    Tcl_SetChannelOption(interp, channel, "-translation", "binary");
+
+    e = (Encoder *) ckalloc(sizeof(Encoder));
+    memset(e, 0, sizeof(Encoder));
+    e->channel = channel;
+    e->rep = rep;
+    e->cursorX = -1;
+    Tcl_DStringInit(&e->out);
+    encoder = e;
+    encoder_touch();
+}
+
+/*****************************************************************************
+ * encoder_close
+ *
+ * Description:
+ *
+ *   Stops the escape sequence encoder.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Releases the channel, which is closed if the script has closed it.
+ *****************************************************************************/
+
+static void encoder_close(void) {
+    Encoder *e = encoder;
+
+    if (e == NULL) return;
+
+    if (e->pending) Tcl_CancelIdleCall(encoder_idle, (ClientData) terminal);
+    Tcl_UnregisterChannel(NULL, e->channel);
+    Tcl_DStringFree(&e->out);
+    if (e->screen != NULL) ckfree((char *) e->screen);
+    if (e->frame != NULL) ckfree((char *) e->frame);
+    ckfree((char *) e);
+    encoder = NULL;
+}
+
+/*****************************************************************************
+ * find_touch
+ *
+ * Description:
+ *
+ *   Notes that Consio has written to the console, so a waiting
+ *   Consio::waitfor checks the screen again without waiting for its next
+ *   poll.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Sets findDirty.
+ *****************************************************************************/
+
+static void find_touch(void) {
+    findDirty = 1;
+}
+
+/*****************************************************************************
+ * find_wake
+ *
+ * Description:
+ *
+ *   Timer handler of Consio::waitfor, ending one wait of the event loop.
+ *
+ * Parameters:
+ *
+ *   clientData - pointer to the flag to set
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Sets the flag.
+ *****************************************************************************/
+
+static void find_wake(ClientData clientData) {
+    *(int *) clientData = 1;
+}
+
+/*****************************************************************************
+ * find_parse
+ *
+ * Description:
+ *
+ *   Parses the arguments of Consio::find and Consio::waitfor:
+ *
+ *     ?-regexp? ?-nocase? ?-all? ?-timeout ms? ?--? pattern ?x y w h?
+ *
+ *   The rectangle defaults to the visible window of the active screen.
+ *
+ * Parameters:
+ *
+ *   interp  - interpreter
+ *   objc    - number of arguments
+ *   objv    - arguments
+ *   spec    - receives the search
+ *   all     - receives -all, or NULL if the option is not allowed
+ *   timeout - receives -timeout, or NULL if the option is not allowed
+ *
+ * Results:
+ *
+ *   TCL_OK or TCL_ERROR.
+ *
+ * Side effects:
+ *
+ *   Whether or not it succeeds, spec holds memory to be freed with
+ *   find_free.
+ *****************************************************************************/
+
+static int find_parse(Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[],
+                      FindSpec *spec,
+                      int *all,
+                      int *timeout) {
+    CONST char *options[] = {"-all", "-nocase", "-regexp", "-timeout",
+                             (char *) NULL};
+    enum {FIND_ALL, FIND_NOCASE, FIND_REGEXP, FIND_TIMEOUT};
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Tcl_UniChar *pattern;
+    int regexp = 0, rect[4];
+    int i, index, len;
+
+    memset(spec, 0, sizeof(FindSpec));
+    if (all != NULL) *all = 0;
+    if (timeout != NULL) *timeout = -1;
+
+    for (i = 1; i < objc - 1; i++) {
+        if (Tcl_GetString(objv[i])[0] != '-') break;
+        if (strcmp(Tcl_GetString(objv[i]), "--") == 0) {
+            i++;
+            break;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0,
+                                &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if ((index == FIND_ALL && all == NULL) ||
+            (index == FIND_TIMEOUT && timeout == NULL)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad option \"%s\"",
+                                                   Tcl_GetString(objv[i])));
+            return TCL_ERROR;
+        }
+        switch (index) {
+            case FIND_ALL:
+                *all = 1;
+                break;
+            case FIND_NOCASE:
+                spec->nocase = 1;
+                break;
+            case FIND_REGEXP:
+                regexp = 1;
+                break;
+            case FIND_TIMEOUT:
+                if (++i >= objc - 1 ||
+                    Tcl_GetIntFromObj(interp, objv[i], timeout) != TCL_OK) {
+                    if (i >= objc - 1) {
+                        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                            "-timeout needs a value", -1));
+                    }
+                    return TCL_ERROR;
+                }
+                break;
+        }
+    }
+
+    if (objc - i != 1 && objc - i != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, timeout != NULL ?
+            "?-regexp? ?-nocase? ?-timeout ms? pattern ?x y width height?" :
+            "?-regexp? ?-nocase? ?-all? pattern ?x y width height?");
+        return TCL_ERROR;
+    }
+
+    GetConsoleScreenBufferInfo(screens[screenActive], &info);
+    rect[0] = info.srWindow.Left;
+    rect[1] = info.srWindow.Top;
+    rect[2] = info.srWindow.Right - info.srWindow.Left + 1;
+    rect[3] = info.srWindow.Bottom - info.srWindow.Top + 1;
+    for (index = 0; index < 4 && i + 1 + index < objc; index++) {
+        if (Tcl_GetIntFromObj(interp, objv[i + 1 + index],
+                              &rect[index]) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+    if (rect[0] < 0) rect[0] = 0;
+    if (rect[1] < 0) rect[1] = 0;
+    if (rect[0] + rect[2] > info.dwSize.X) rect[2] = info.dwSize.X - rect[0];
+    if (rect[1] + rect[3] > info.dwSize.Y) rect[3] = info.dwSize.Y - rect[1];
+    spec->x = rect[0];
+    spec->y = rect[1];
+    spec->width = rect[2] > 0 ? rect[2] : 0;
+    spec->height = rect[3] > 0 ? rect[3] : 0;
+
+    if (regexp) {
+
+        /*
+         * The compiled expression lives in the internal representation of
+         * the object it was compiled from. The pattern argument may be a
+         * shared literal which an event handler could convert to another
+         * type while Consio::waitfor waits, so it is compiled from a copy
+         * kept until find_free.
+         */
+
+        spec->pattern = Tcl_DuplicateObj(objv[i]);
+        Tcl_IncrRefCount(spec->pattern);
+        spec->regexp = Tcl_GetRegExpFromObj(interp, spec->pattern,
+            TCL_REG_ADVANCED | (spec->nocase ? TCL_REG_NOCASE : 0));
+        if (spec->regexp == NULL) return TCL_ERROR;
+    }
+    else {
+        pattern = Tcl_GetUnicodeFromObj(objv[i], &len);
+        if (len == 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("empty pattern", -1));
+            return TCL_ERROR;
+        }
+        spec->literal = (Tcl_UniChar *) ckalloc(len * sizeof(Tcl_UniChar));
+        for (index = 0; index < len; index++) {
+            spec->literal[index] = spec->nocase ?
+                Tcl_UniCharToLower(pattern[index]) : pattern[index];
+        }
+        spec->literalLen = len;
+    }
+
+    spec->text = (Tcl_UniChar *) ckalloc((spec->width + 1) *
+                                         sizeof(Tcl_UniChar));
+    spec->cols = (int *) ckalloc((spec->width + 1) * sizeof(int));
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * find_free
+ *
+ * Description:
+ *
+ *   Frees the memory of a search parsed by find_parse, including the
+ *   compiled regular expression.
+ *
+ * Parameters:
+ *
+ *   spec - search
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void find_free(FindSpec *spec) {
+    if (spec->literal != NULL) ckfree((char *) spec->literal);
+    if (spec->text != NULL) ckfree((char *) spec->text);
+    if (spec->cols != NULL) ckfree((char *) spec->cols);
+    if (spec->pattern != NULL) Tcl_DecrRefCount(spec->pattern);
+}
+
+/*****************************************************************************
+ * find_char
+ *
+ * Description:
+ *
+ *   Finds the next occurrence of a character in a text, eight characters
+ *   at a time with SSE2.
+ *
+ * Parameters:
+ *
+ *   text  - text
+ *   start - index to start from
+ *   len   - length of the text
+ *   ch    - character
+ *
+ * Results:
+ *
+ *   Returns the index of the character, or -1 if not found.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int find_char(const Tcl_UniChar *text, int start, int len,
+                     Tcl_UniChar ch) {
+    int i = start;
+#ifdef CONSIO_SSE2
+    __m128i needle, chunk;
+    int mask;
+
+    if (sizeof(Tcl_UniChar) == 2) {
+        needle = _mm_set1_epi16((short) ch);
+        for (; i + 8 <= len; i += 8) {
+            chunk = _mm_loadu_si128((const __m128i *) (text + i));
+            mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chunk, needle));
+            if (mask != 0) {
+                for (; text[i] != ch; i++);
+                return i;
+            }
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (text[i] == ch) return i;
+    }
+
+    return -1;
+}
+
+/*****************************************************************************
+ * find_row
+ *
+ * Description:
+ *
+ *   Searches a row of cells. The trailing halves of wide characters are
+ *   skipped, so matches are reported at the cell of their first character.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter for regular expression errors
+ *   spec   - search
+ *   cells  - cells of the row, spec->width of them
+ *   start  - cell to start from
+ *   col    - receives the cell of the match
+ *
+ * Results:
+ *
+ *   1 if found, 0 if not, -1 on a regular expression error.
+ *
+ * Side effects:
+ *
+ *   Uses the text buffer of spec.
+ *****************************************************************************/
+
+static int find_row(Tcl_Interp *interp,
+                    FindSpec *spec,
+                    const CHAR_INFO *cells,
+                    int start,
+                    int *col) {
+    Tcl_RegExpInfo info;
+    Tcl_Obj *obj;
+    int len = 0, first = -1, x, i, rc;
+
+    for (x = 0; x < spec->width; x++) {
+        if (cells[x].Attributes & COMMON_LVB_TRAILING_BYTE) continue;
+        if (x >= start && first < 0) first = len;
+        spec->text[len] = spec->nocase && spec->regexp == NULL ?
+            Tcl_UniCharToLower(cells[x].Char.UnicodeChar) :
+            cells[x].Char.UnicodeChar;
+        spec->cols[len++] = x;
+    }
+    if (first < 0) return 0;
+
+    if (spec->regexp != NULL) {
+        obj = Tcl_NewUnicodeObj(spec->text, len);
+        Tcl_IncrRefCount(obj);
+        rc = Tcl_RegExpExecObj(interp, spec->regexp, obj, first, 1,
+                               first > 0 ? TCL_REG_NOTBOL : 0);
+        Tcl_DecrRefCount(obj);
+        if (rc <= 0) return rc;
+        Tcl_RegExpGetInfo(spec->regexp, &info);
+        *col = spec->cols[first + info.matches[0].start];
+        return 1;
+    }
+
+    for (i = first; i + spec->literalLen <= len; i++) {
+        i = find_char(spec->text, i, len - spec->literalLen + 1,
+                      spec->literal[0]);
+        if (i < 0) break;
+        if (memcmp(spec->text + i, spec->literal,
+                   spec->literalLen * sizeof(Tcl_UniChar)) == 0) {
+            *col = spec->cols[i];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*****************************************************************************
+ * find_scan
+ *
+ * Description:
+ *
+ *   Searches a row of cells read from the console and appends the
+ *   positions of the matches to a list.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter for regular expression errors
+ *   spec   - search
+ *   cells  - cells of the searched rectangle
+ *   row    - row of the rectangle to search
+ *   all    - 1 to find all matches, 0 to stop at the first one
+ *   list   - list to append {x y} positions to, in buffer coordinates
+ *
+ * Results:
+ *
+ *   Number of matches found, or -1 on a regular expression error.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int find_scan(Tcl_Interp *interp,
+                     FindSpec *spec,
+                     const CHAR_INFO *cells,
+                     int row,
+                     int all,
+                     Tcl_Obj *list) {
+    Tcl_Obj *point[2];
+    int start = 0, found = 0, col, rc;
+
+    while ((rc = find_row(interp, spec, cells + row * spec->width, start,
+                          &col)) == 1) {
+        point[0] = Tcl_NewIntObj(spec->x + col);
+        point[1] = Tcl_NewIntObj(spec->y + row);
+        Tcl_ListObjAppendElement(NULL, list, Tcl_NewListObj(2, point));
+        found++;
+        if (!all) break;
+        start = col + 1;
+    }
+
+    return rc < 0 ? -1 : found;
+}
+
+/*****************************************************************************
+ * terminal_select
+ *
+ * Description:
+ *
+ *   Makes a terminal the current one, so the commands write to its screen
+ *   buffers and read its input. The console state kept in the global
+ *   variables is saved to the previous terminal and loaded from the new
+ *   one.
+ *
+ * Parameters:
+ *
+ *   t - terminal, or NULL for the console of the process
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Changes hStdout, screens, screenActive, screenTarget and encoder.
+ *****************************************************************************/
+
+static void terminal_select(Terminal *t) {
+    Terminal *save = terminal != NULL ? terminal : &terminalConsole;
+    Terminal *load;
+
+    if (t != NULL && t->closed) t = NULL;
+    load = t != NULL ? t : &terminalConsole;
+    if (load == save) return;
+
+    save->hStdout = hStdout;
+    memcpy(save->screens, screens, sizeof(screens));
+    save->screenActive = screenActive;
+    save->screenTarget = screenTarget;
+    save->encoder = encoder;
+
+    hStdout = load->hStdout;
+    memcpy(screens, load->screens, sizeof(screens));
+    screenActive = load->screenActive;
+    screenTarget = load->screenTarget;
+    encoder = load->encoder;
+
+    terminal = t;
+}
+
+/*****************************************************************************
+ * terminal_push
+ *
+ * Description:
+ *
+ *   Adds a key press to the input queue of a terminal. Key presses beyond
+ *   TERMINAL_KEYS_MAX unread ones are dropped.
+ *
+ * Parameters:
+ *
+ *   t  - terminal
+ *   vk - virtual key code, or 0 if the character has no key
+ *   ch - character of the key, or 0
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void terminal_push(Terminal *t, WORD vk, Tcl_UniChar ch) {
+    INPUT_RECORD *rec;
+
+    if (t->keyCount - t->keyFirst >= TERMINAL_KEYS_MAX) return;
+
+    if (t->keyCount == t->keyCap) {
+        if (t->keyFirst > 0) {
+            memmove(t->keys, t->keys + t->keyFirst,
+                    (t->keyCount - t->keyFirst) * sizeof(INPUT_RECORD));
+            t->keyCount -= t->keyFirst;
+            t->keyFirst = 0;
+        }
+        else {
+            t->keyCap = t->keyCap > 0 ? t->keyCap * 2 : 16;
+            t->keys = (INPUT_RECORD *) ckrealloc((char *) t->keys,
+                t->keyCap * sizeof(INPUT_RECORD));
+        }
+    }
+
+    rec = t->keys + t->keyCount++;
+    memset(rec, 0, sizeof(INPUT_RECORD));
+    rec->EventType = KEY_EVENT;
+    rec->Event.KeyEvent.bKeyDown = TRUE;
+    rec->Event.KeyEvent.wRepeatCount = 1;
+    rec->Event.KeyEvent.wVirtualKeyCode = vk;
+    rec->Event.KeyEvent.wVirtualScanCode = (WORD) MapVirtualKeyW(vk, 0);
+    rec->Event.KeyEvent.uChar.UnicodeChar = (WCHAR) ch;
+}
+
+/*****************************************************************************
+ * terminal_csi_key
+ *
+ * Description:
+ *
+ *   Maps a control sequence sent by a terminal, ESC [ param final or
+ *   ESC O final, to a virtual key code.
+ *
+ * Parameters:
+ *
+ *   final - final character of the sequence
+ *   param - first numeric parameter, or 0
+ *
+ * Results:
+ *
+ *   Virtual key code, or 0 for unknown sequences.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static WORD terminal_csi_key(int final, int param) {
+    switch (final) {
+        case 'A': return VK_UP;
+        case 'B': return VK_DOWN;
+        case 'C': return VK_RIGHT;
+        case 'D': return VK_LEFT;
+        case 'H': return VK_HOME;
+        case 'F': return VK_END;
+        case 'Z': return VK_TAB;
+        case 'P': case 'Q': case 'R': case 'S':
+            return (WORD) (VK_F1 + final - 'P');
+        case '~':
+            switch (param) {
+                case 1: case 7: return VK_HOME;
+                case 2: return VK_INSERT;
+                case 3: return VK_DELETE;
+                case 4: case 8: return VK_END;
+                case 5: return VK_PRIOR;
+                case 6: return VK_NEXT;
+            }
+            if (param >= 11 && param <= 15) return (WORD) (VK_F1 + param - 11);
+            if (param >= 17 && param <= 21) return (WORD) (VK_F1 + param - 12);
+            if (param >= 23 && param <= 24) return (WORD) (VK_F1 + param - 13);
+            break;
+    }
+
+    return 0;
+}
+
+/*****************************************************************************
+ * terminal_parse
+ *
+ * Description:
+ *
+ *   Turns the bytes received from a terminal into key presses. Text is
+ *   decoded as UTF-8, and the escape sequences of the cursor, editing and
+ *   function keys are mapped to virtual key codes. Incomplete sequences
+ *   are kept until the rest arrives. An escape character at the end of
+ *   the input may be the Escape key or the start of a sequence split
+ *   between reads, so it waits TERMINAL_ESC_WAIT milliseconds for the
+ *   rest before terminal_escape takes it as the Escape key.
+ *
+ * Parameters:
+ *
+ *   t - terminal
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Consumes the complete sequences of t->pending. Starts or cancels the
+ *   timer of a lone escape character.
+ *****************************************************************************/
+
+static void terminal_parse(Terminal *t) {
+    unsigned char *p = t->pending;
+    int len = t->pendingLen;
+    int i = 0, j, k, param;
+    Tcl_UniChar ch;
+    SHORT scan;
+    WORD vk;
+
+    while (i < len) {
+        if (p[i] == 0x1B) {
+            if (i + 1 < len && (p[i + 1] == '[' || p[i + 1] == 'O')) {
+                for (j = i + 2; j < len && p[j] >= 0x20 && p[j] < 0x40; j++);
+                if (j == len) break;
+                param = 0;
+                for (k = i + 2; k < j && p[k] >= '0' && p[k] <= '9'; k++) {
+                    param = param * 10 + p[k] - '0';
+                }
+                vk = terminal_csi_key(p[j], param);
+                if (vk != 0) terminal_push(t, vk, vk == VK_TAB ? '\t' : 0);
+                i = j + 1;
+            }
+            else if (i + 1 == len) {
+                break;
+            }
+            else {
+                terminal_push(t, VK_ESCAPE, 0x1B);
+                i++;
+            }
+            t->lastCr = 0;
+            continue;
+        }
+
+        if (p[i] >= 0x80) {
+            if (!Tcl_UtfCharComplete((char *) p + i, len - i)) break;
+            i += Tcl_UtfToUniChar((char *) p + i, &ch);
+            scan = VkKeyScanW((WCHAR) ch);
+            terminal_push(t, (WORD) (scan == -1 ? 0 : scan & 0xFF), ch);
+            t->lastCr = 0;
+            continue;
+        }
+
+        ch = p[i++];
+        switch (ch) {
+            case '\n':
+                if (t->lastCr) break;   /* CR LF is one Enter */
+                /* fall through */
+            case '\r':
+                terminal_push(t, VK_RETURN, '\r');
+                break;
+            case 0x08:
+            case 0x7F:
+                terminal_push(t, VK_BACK, 0x08);
+                break;
+            case '\t':
+                terminal_push(t, VK_TAB, '\t');
+                break;
+            case 0:
+                break;
+            default:
+                if (ch < 0x20) {
+                    terminal_push(t, (WORD) ('A' + ch - 1), ch);
+                }
+                else {
+                    scan = VkKeyScanW((WCHAR) ch);
+                    terminal_push(t, (WORD) (scan == -1 ? 0 : scan & 0xFF),
+                                  ch);
+                }
+                break;
+        }
+        t->lastCr = (ch == '\r');
+    }
+
+    /* Drop a sequence too long to be a key */
+
+    if (i == 0 && len == TERMINAL_READ_MAX) i = len;
+
+    memmove(p, p + i, len - i);
+    t->pendingLen = len - i;
+
+    if (t->pendingLen == 1 && p[0] == 0x1B) {
+        if (t->escape == NULL) {
+            t->escape = Tcl_CreateTimerHandler(TERMINAL_ESC_WAIT,
+                                               terminal_escape, t);
+        }
+    }
+    else if (t->escape != NULL) {
+        Tcl_DeleteTimerHandler(t->escape);
+        t->escape = NULL;
+    }
+}
+
+/*****************************************************************************
+ * terminal_readable
+ *
+ * Description:
+ *
+ *   Channel handler reading the input of a terminal from the event loop.
+ *
+ * Parameters:
+ *
+ *   clientData - terminal
+ *   mask       - not used
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Queues the key presses and resumes the coroutines waiting for them.
+ *   At the end of the input, stops reading and marks the terminal as
+ *   closed for input.
+ *****************************************************************************/
+
+static void terminal_readable(ClientData clientData, int mask) {
+    Terminal *t = (Terminal *) clientData;
+    int num;
+
+    num = Tcl_Read(t->channel, (char *) t->pending + t->pendingLen,
+                   TERMINAL_READ_MAX - t->pendingLen);
+    if (num > 0) {
+        t->pendingLen += num;
+        terminal_parse(t);
+    }
+    else if (num < 0 || Tcl_Eof(t->channel)) {
+        Tcl_DeleteChannelHandler(t->channel, terminal_readable, t);
+        t->eof = 1;
+        if (t->escape != NULL) {
+            Tcl_DeleteTimerHandler(t->escape);
+            terminal_escape(t);
+            return;
+        }
+    }
+
+#ifdef CONSIO_NRE
+    terminal_dispatch(t);
+#endif /*CONSIO_NRE*/
+}
+
+/*****************************************************************************
+ * terminal_escape
+ *
+ * Description:
+ *
+ *   Timer handler taking an escape character left at the end of the input
+ *   of a terminal as the Escape key, as the rest of an escape sequence has
+ *   not arrived in time.
+ *
+ * Parameters:
+ *
+ *   clientData - terminal
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Queues the key press and resumes the coroutines waiting for it.
+ *****************************************************************************/
+
+static void terminal_escape(ClientData clientData) {
+    Terminal *t = (Terminal *) clientData;
+
+    t->escape = NULL;
+    if (t->pendingLen == 1 && t->pending[0] == 0x1B) {
+        terminal_push(t, VK_ESCAPE, 0x1B);
+        t->pendingLen = 0;
+        t->lastCr = 0;
+    }
+
+#ifdef CONSIO_NRE
+    terminal_dispatch(t);
+#endif /*CONSIO_NRE*/
+}
+
+/*****************************************************************************
+ * terminal_key
+ *
+ * Description:
+ *
+ *   Takes the next key press of a terminal, running the event loop until
+ *   one arrives. Coroutines do not get here before their key presses
+ *   have arrived, see input_nr.
+ *
+ * Parameters:
+ *
+ *   interp  - interpreter for error messages, or NULL
+ *   t       - terminal
+ *   rec     - receives the key press
+ *   timeout - milliseconds to wait, or -1 to wait forever
+ *
+ * Results:
+ *
+ *    1 - a key was taken
+ *    0 - timeout
+ *   -1 - the input of the terminal has ended (an error message is left
+ *        in the interpreter)
+ *
+ * Side effects:
+ *
+ *   Processes events while waiting.
+ *****************************************************************************/
+
+static int terminal_key(Tcl_Interp *interp,
+                        Terminal *t,
+                        INPUT_RECORD *rec,
+                        int timeout) {
+    Tcl_TimerToken timer = NULL;
+    int expired = 0;
+
+    if (timeout >= 0) {
+        timer = Tcl_CreateTimerHandler(timeout, find_wake,
+                                       (ClientData) &expired);
+    }
+    Tcl_Preserve((ClientData) t);
+    while (t->keyFirst == t->keyCount && !t->eof && !t->closed &&
+           !expired) {
+        Tcl_DoOneEvent(TCL_ALL_EVENTS);
+    }
+    Tcl_Release((ClientData) t);
+    if (timer != NULL) Tcl_DeleteTimerHandler(timer);
+
+    if (t->keyFirst < t->keyCount) {
+        *rec = t->keys[t->keyFirst++];
+        return 1;
+    }
+    if (expired) return 0;
+
+    if (interp != NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "terminal \"%s\" has closed", t->name));
+    }
+    return -1;
+}
+
+/*****************************************************************************
+ * terminal_input
+ *
+ * Description:
+ *
+ *   Serves an input command from the current terminal opened with
+ *   Consio::open, in the same form as replay_input. Lines are edited with
+ *   Backspace only, and are echoed by Consio::cgetse when Enter is
+ *   pressed.
+ *
+ * Parameters:
+ *
+ *   interp  - Tcl interpreter used for error messages
+ *   type    - kind of input (REC_IN_CHAR, REC_IN_KEY, REC_IN_KEY2,
+ *             REC_IN_LINE or REC_IN_EVENT)
+ *   timeout - milliseconds to wait for an event, or -1 to wait forever
+ *   result  - receives the input as a new Tcl object
+ *
+ * Results:
+ *
+ *    1 - the input was taken from the terminal
+ *    0 - the current terminal is the console; the caller should read it
+ *   -1 - the input of the terminal has ended (an error message is left
+ *        in the interpreter)
+ *
+ * Side effects:
+ *
+ *   Processes events while waiting.
+ *****************************************************************************/
+
+static int terminal_input(Tcl_Interp *interp,
+                          int type,
+                          int timeout,
+                          Tcl_Obj **result) {
+    Terminal *t = terminal;
+    INPUT_RECORD rec;
+    KEY_EVENT_RECORD *key = &rec.Event.KeyEvent;
+    Tcl_UniChar line[INPUT_LINE_MAX];
+    Tcl_UniChar ch;
+    int rc, len;
+
+    if (t == NULL) return 0;
+
+    switch (type) {
+        case REC_IN_CHAR:
+            do {
+                if ((rc = terminal_key(interp, t, &rec, -1)) < 0) return rc;
+            } while (key->uChar.UnicodeChar == 0);
+            ch = key->uChar.UnicodeChar;
+            *result = Tcl_NewUnicodeObj(&ch, 1);
+            break;
+
+        case REC_IN_KEY:
+        case REC_IN_KEY2:
+            if ((rc = terminal_key(interp, t, &rec, -1)) < 0) return rc;
+            if (type == REC_IN_KEY) {
+                *result = Tcl_NewIntObj(key->wVirtualKeyCode);
+            }
+            else {
+                *result = Tcl_NewIntObj(key->uChar.UnicodeChar != 0 ?
+                                        key->uChar.UnicodeChar :
+                                        0x100 + key->wVirtualScanCode);
+            }
+            break;
+
+        case REC_IN_LINE:
+            len = 0;
+            for (;;) {
+                if ((rc = terminal_key(interp, t, &rec, -1)) < 0) return rc;
+                ch = key->uChar.UnicodeChar;
+                if (key->wVirtualKeyCode == VK_RETURN) break;
+                if (key->wVirtualKeyCode == VK_BACK) {
+                    if (len > 0) len--;
+                }
+                else if (ch >= 0x20 && len < INPUT_LINE_MAX) {
+                    line[len++] = ch;
+                }
+            }
+            *result = Tcl_NewUnicodeObj(line, len);
+            break;
+
+        case REC_IN_EVENT:
+            *result = Tcl_NewObj();
+            rc = terminal_key(interp, t, &rec, timeout);
+            if (rc < 0) {
+                Tcl_DecrRefCount(*result);
+                return rc;
+            }
+            if (rc > 0) {
+                ch = key->uChar.UnicodeChar;
+                Tcl_ListObjAppendElement(NULL, *result,
+                                         Tcl_NewStringObj("key", -1));
+                Tcl_ListObjAppendElement(NULL, *result,
+                    Tcl_NewIntObj(key->wVirtualKeyCode));
+                Tcl_ListObjAppendElement(NULL, *result,
+                    Tcl_NewUnicodeObj(&ch, ch != 0 ? 1 : 0));
+            }
+            break;
+    }
+
+    /* The frame is sent after the caller has echoed the input */
+
+    export_touch();
+
+    return 1;
+}
+
+/*****************************************************************************
+ * input_source
+ *
+ * Description:
+ *
+ *   Serves an input command from the active input replay or from the
+ *   current terminal, whichever applies.
+ *
+ * Parameters:
+ *
+ *   interp  - Tcl interpreter used for error messages, or NULL
+ *   type    - kind of input, see replay_input
+ *   timeout - milliseconds to wait for an event, or -1 to wait forever
+ *   result  - receives the input as a new Tcl object
+ *
+ * Results:
+ *
+ *   As replay_input; 0 when the caller should read the console.
+ *
+ * Side effects:
+ *
+ *   See replay_input and terminal_input.
+ *****************************************************************************/
+
+static int input_source(Tcl_Interp *interp,
+                        int type,
+                        int timeout,
+                        Tcl_Obj **result) {
+    int rc = replay_input(interp, type, result);
+
+    if (rc != 0) return rc;
+
+    return terminal_input(interp, type, timeout, result);
+}
+
+/*****************************************************************************
+ * input_hit
+ *
+ * Description:
+ *
+ *   Tells whether the active input replay or the current terminal has
+ *   input waiting, for Consio::kbhit and Consio_KbHit. Recorded input is
+ *   waiting once its recorded time has come.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *    1 - input is waiting
+ *    0 - no input is waiting
+ *   -1 - neither a replay nor a terminal is active; the caller should
+ *        check the console
+ *
+ * Side effects:
+ *
+ *   Processes pending file events, which may read from the terminal.
+ *****************************************************************************/
+
+static int input_hit(void) {
+    unsigned char *data;
+    int len, pos;
+
+    if (replay_next_input(&pos)) {
+        data = Tcl_GetByteArrayFromObj(replayObj, &len);
+        return replayFast ||
+               get_u32(data + pos) <= GetTickCount() - replayStart;
+    }
+
+    if (terminal != NULL) {
+        while (Tcl_DoOneEvent(TCL_FILE_EVENTS | TCL_DONT_WAIT));
+        return terminal->keyFirst < terminal->keyCount;
+    }
+
+    return -1;
+}
+
+/*****************************************************************************
+ * terminal_buffer
+ *
+ * Description:
+ *
+ *   Creates the screen buffer of a terminal. The whole buffer is its
+ *   window, as the encoder sends the window.
+ *
+ * Parameters:
+ *
+ *   width  - columns of the terminal
+ *   height - rows of the terminal
+ *
+ * Results:
+ *
+ *   Handle of the screen buffer, or NULL if the console does not allow a
+ *   window of that size.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static HANDLE terminal_buffer(int width, int height) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    CONSOLE_CURSOR_INFO cursor;
+    SMALL_RECT rect;
+    COORD size;
+    HANDLE handle;
+
+    handle = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                       NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return NULL;
+
+    /* The window must fit in the buffer while the buffer is resized */
+
+    GetConsoleScreenBufferInfo(handle, &info);
+    rect.Left = 0;
+    rect.Top = 0;
+    rect.Right = (SHORT) (info.srWindow.Right - info.srWindow.Left);
+    rect.Bottom = (SHORT) (info.srWindow.Bottom - info.srWindow.Top);
+    if (rect.Right > width - 1) rect.Right = (SHORT) (width - 1);
+    if (rect.Bottom > height - 1) rect.Bottom = (SHORT) (height - 1);
+    SetConsoleWindowInfo(handle, TRUE, &rect);
+
+    size.X = (SHORT) width;
+    size.Y = (SHORT) height;
+    rect.Right = (SHORT) (width - 1);
+    rect.Bottom = (SHORT) (height - 1);
+    if (!SetConsoleScreenBufferSize(handle, size) ||
+        !SetConsoleWindowInfo(handle, TRUE, &rect)) {
+        CloseHandle(handle);
+        return NULL;
+    }
+
+    SetConsoleTextAttribute(handle, 0x07);
+    cursor.dwSize = 25;
+    cursor.bVisible = TRUE;
+    SetConsoleCursorInfo(handle, &cursor);
+
+    return handle;
+}
+
+/*****************************************************************************
+ * terminal_free, terminal_release
+ *
+ * Description:
+ *
+ *   Closes a terminal when its command is deleted. The memory is released
+ *   by terminal_release once no command is using the terminal any more.
+ *
+ * Parameters:
+ *
+ *   clientData - terminal
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Closes the screen buffers of the terminal and releases its channel,
+ *   which is closed unless the script still has it open. Coroutines
+ *   waiting for its input are resumed later with an error.
+ *****************************************************************************/
+
+static void terminal_free(ClientData clientData) {
+    Terminal *t = (Terminal *) clientData;
+    Terminal *saved = terminal;
+    int i;
+
+    terminal_select(t);
+    encoder_close();
+    terminal_select(saved == t ? NULL : saved);
+
+    for (i = 0; i < SCREEN_MAX; i++) {
+        if (t->screens[i] != NULL) CloseHandle(t->screens[i]);
+    }
+    if (!t->eof) {
+        Tcl_DeleteChannelHandler(t->channel, terminal_readable, t);
+    }
+    if (t->escape != NULL) {
+        Tcl_DeleteTimerHandler(t->escape);
+        t->escape = NULL;
+    }
+    Tcl_UnregisterChannel(NULL, t->channel);
+    t->closed = 1;
+
+#ifdef CONSIO_NRE
+
+    /* The coroutines still waiting get an error, but not from here */
+
+    if (t->waiters != NULL) {
+        Tcl_Preserve(clientData);
+        Tcl_DoWhenIdle(terminal_wake, clientData);
+    }
+
+#endif /*CONSIO_NRE*/
+
+    Tcl_EventuallyFree(clientData, terminal_release);
+}
+
+static void terminal_release(char *clientData) {
+    Terminal *t = (Terminal *) clientData;
+
+    if (t->keys != NULL) ckfree((char *) t->keys);
+    ckfree((char *) t);
+}
+
+/*****************************************************************************
+ * template_item
+ *
+ * Description:
+ *
+ *   Draws one item of a Consio::template layout on the static cells of
+ *   the template, or adds a field:
+ *
+ *     text x y string ?fg bg?
+ *     fill x y width height char ?fg bg?
+ *     box x y width height ?fg bg?
+ *     field name x y width ?align? ?fg bg?
+ *
+ *   Items are clipped at the right and bottom edges of the template.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter
+ *   t      - template
+ *   item   - layout item
+ *   attr   - attributes for items without colors
+ *
+ * Results:
+ *
+ *   TCL_OK or TCL_ERROR.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int template_item(Tcl_Interp *interp,
+                         Template *t,
+                         Tcl_Obj *item,
+                         WORD attr) {
+    CONST char *kinds[] = {"box", "field", "fill", "text", (char *) NULL};
+    enum {ITEM_BOX, ITEM_FIELD, ITEM_FILL, ITEM_TEXT};
+    CONST char *aligns[] = {"left", "right", (char *) NULL};
+    static const int fixed[] = {5, 5, 6, 4};
+    TemplateField *f;
+    Tcl_HashEntry *entry;
+    Tcl_Obj **objv;
+    Tcl_UniChar ch;
+    CHAR_INFO *cell;
+    char *str;
+    int objc, kind, num[4], right = 0, isNew;
+    int i, x, y, w, h, len;
+
+    if (Tcl_ListObjGetElements(interp, item, &objc, &objv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc < 1 || Tcl_GetIndexFromObj(interp, objv[0], kinds, "item", 0,
+                                        &kind) != TCL_OK) {
+        if (objc < 1) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("empty layout item",
+                                                      -1));
+        }
+        return TCL_ERROR;
+    }
+
+    /* Trailing colors, and the alignment of a field */
+
+    len = objc - fixed[kind];
+    if (len < 0 || len > (kind == ITEM_FIELD ? 3 : 2) ||
+        (kind != ITEM_FIELD && len == 1)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "wrong # args in layout item \"%s\"", Tcl_GetString(item)));
+        return TCL_ERROR;
+    }
+    if (len >= 2 && get_color_attr(interp, objv[objc - 2], objv[objc - 1],
+                                   &attr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (kind == ITEM_FIELD && len % 2 == 1 &&
+        Tcl_GetIndexFromObj(interp, objv[5], aligns, "alignment", 0,
+                            &right) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    for (i = 0; i < 4; i++) {
+        num[i] = 1;
+        if (i < (kind == ITEM_TEXT ? 2 : kind == ITEM_FIELD ? 3 : 4) &&
+            Tcl_GetIntFromObj(interp, objv[(kind == ITEM_FIELD ? 2 : 1) + i],
+                              &num[i]) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+    x = num[0];
+    y = num[1];
+    if (x < 0 || y < 0 || x >= t->width || y >= t->height) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "layout item \"%s\" is outside the template",
+            Tcl_GetString(item)));
+        return TCL_ERROR;
+    }
+    w = num[2] < t->width - x ? num[2] : t->width - x;
+    h = num[3] < t->height - y ? num[3] : t->height - y;
+    if (w < 0) w = 0;
+    if (h < 0) h = 0;
+    cell = t->cells + y * t->width + x;
+
+    switch (kind) {
+        case ITEM_TEXT:
+            str = Tcl_GetStringFromObj(objv[3], &len);
+            w = text_width((unsigned char *) str, len);
+            if (w > t->width - x) w = t->width - x;
+            cells_from_utf8(cell, w, str, len, attr);
+            break;
+
+        case ITEM_FILL:
+            str = Tcl_GetStringFromObj(objv[5], &len);
+            ch = ' ';
+            if (len > 0) Tcl_UtfToUniChar(str, &ch);
+            for (y = 0; y < h; y++) {
+                for (x = 0; x < w; x++) {
+                    cell[y * t->width + x].Char.UnicodeChar = (WCHAR) ch;
+                    cell[y * t->width + x].Attributes = attr;
+                }
+            }
+            break;
+
+        case ITEM_BOX:
+            for (y = 0; y < h; y++) {
+                for (x = 0; x < w; x++) {
+                    if (y == 0 || y == num[3] - 1) {
+                        ch = x == 0 ? (y == 0 ? 0x250C : 0x2514) :
+                             x == num[2] - 1 ? (y == 0 ? 0x2510 : 0x2518) :
+                             0x2500;
+                    }
+                    else if (x == 0 || x == num[2] - 1) {
+                        ch = 0x2502;
+                    }
+                    else {
+                        continue;
+                    }
+                    cell[y * t->width + x].Char.UnicodeChar = (WCHAR) ch;
+                    cell[y * t->width + x].Attributes = attr;
+                }
+            }
+            break;
+
+        case ITEM_FIELD:
+            if (num[2] < 1) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "bad width in layout item \"%s\"", Tcl_GetString(item)));
+                return TCL_ERROR;
+            }
+            entry = Tcl_CreateHashEntry(&t->names, Tcl_GetString(objv[1]),
+                                        &isNew);
+            if (!isNew) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "duplicate field \"%s\"", Tcl_GetString(objv[1])));
+                return TCL_ERROR;
+            }
+            if (t->numFields == t->capFields) {
+                t->capFields = t->capFields > 0 ? t->capFields * 2 : 8;
+                t->fields = (TemplateField *) ckrealloc((char *) t->fields,
+                    t->capFields * sizeof(TemplateField));
+            }
+            Tcl_SetHashValue(entry, (ClientData) (size_t) t->numFields);
+            f = t->fields + t->numFields++;
+            f->name = objv[1];
+            Tcl_IncrRefCount(f->name);
+            f->value = Tcl_NewObj();
+            Tcl_IncrRefCount(f->value);
+            f->x = x;
+            f->y = y;
+            f->width = w;
+            f->right = right;
+            f->attr = attr;
+            template_field(t, f, cell);
+            break;
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * template_field
+ *
+ * Description:
+ *
+ *   Converts the value of a template field to cells. The value is clipped
+ *   to the width of the field, and the rest of the field is blank.
+ *
+ * Parameters:
+ *
+ *   t     - template
+ *   f     - field
+ *   cells - f->width cells to fill
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void template_field(Template *t, TemplateField *f, CHAR_INFO *cells) {
+    char *str;
+    int len, pad = 0, i;
+
+    str = Tcl_GetStringFromObj(f->value, &len);
+    if (f->right) {
+        pad = f->width - text_width((unsigned char *) str, len);
+        if (pad < 0) pad = 0;
+    }
+    for (i = 0; i < pad; i++) {
+        cells[i].Char.UnicodeChar = ' ';
+        cells[i].Attributes = f->attr;
+    }
+    cells_from_utf8(cells + pad, f->width - pad, str, len, f->attr);
+}
+
+/*****************************************************************************
+ * template_update
+ *
+ * Description:
+ *
+ *   Sets the value of a template field. If the template is on the screen
+ *   and the value has changed, only the cells of the field are written.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter
+ *   t      - template
+ *   name   - field name
+ *   value  - new value
+ *
+ * Results:
+ *
+ *   TCL_OK or TCL_ERROR if there is no such field.
+ *
+ * Side effects:
+ *
+ *   May write to the console.
+ *****************************************************************************/
+
+static int template_update(Tcl_Interp *interp,
+                           Template *t,
+                           Tcl_Obj *name,
+                           Tcl_Obj *value) {
+    Tcl_HashEntry *entry;
+    TemplateField *f;
+    CHAR_INFO *cells;
+
+    entry = Tcl_FindHashEntry(&t->names, Tcl_GetString(name));
+    if (entry == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("no such field \"%s\"",
+                                               Tcl_GetString(name)));
+        return TCL_ERROR;
+    }
+    f = t->fields + (size_t) Tcl_GetHashValue(entry);
+    if (strcmp(Tcl_GetString(f->value), Tcl_GetString(value)) == 0) {
+        return TCL_OK;
+    }
+
+    Tcl_IncrRefCount(value);
+    Tcl_DecrRefCount(f->value);
+    f->value = value;
+
+    cells = t->cells + f->y * t->width + f->x;
+    template_field(t, f, cells);
+    if (t->shown) {
+        console_write_cells(hStdout, cells, t->x + f->x, t->y + f->y,
+                            f->width, 1);
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * template_check
+ *
+ * Description:
+ *
+ *   Checks that all the names of a list of field names and values are
+ *   fields of a template, so the fields can be set without failing half
+ *   way through.
+ *
+ * Parameters:
+ *
+ *   interp - interpreter
+ *   t      - template
+ *   objs   - field names and values
+ *   count  - number of elements of objs
+ *
+ * Results:
+ *
+ *   TCL_OK or TCL_ERROR if a name is not a field.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int template_check(Tcl_Interp *interp,
+                          Template *t,
+                          Tcl_Obj * CONST objs[],
+                          int count) {
+    int i;
+
+    for (i = 0; i < count; i += 2) {
+        if (Tcl_FindHashEntry(&t->names, Tcl_GetString(objs[i])) == NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("no such field \"%s\"",
+                                                   Tcl_GetString(objs[i])));
+            return TCL_ERROR;
+        }
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * template_free
+ *
+ * Description:
+ *
+ *   Frees a template when its command is deleted.
+ *
+ * Parameters:
+ *
+ *   clientData - template
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void template_free(ClientData clientData) {
+    Template *t = (Template *) clientData;
+    int i;
+
+    for (i = 0; i < t->numFields; i++) {
+        Tcl_DecrRefCount(t->fields[i].name);
+        Tcl_DecrRefCount(t->fields[i].value);
+    }
+    if (t->fields != NULL) ckfree((char *) t->fields);
+    Tcl_DeleteHashTable(&t->names);
+    ckfree((char *) t->cells);
+    ckfree((char *) t);
+}
+
+/*****************************************************************************
+ * resize_note
+ *
+ * Description:
+ *
+ *   Notes that the console window may have changed size. The handler of
+ *   Consio::onresize runs RESIZE_DEBOUNCE milliseconds after the last
+ *   change, so dragging the border of the window gives one event instead
+ *   of a burst.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Restarts the debounce timer.
+ *****************************************************************************/
+
+static void resize_note(void) {
+    if (resizeScript == NULL) return;
+
+    Tcl_DeleteTimerHandler(resizeDebounce);
+    resizeDebounce = Tcl_CreateTimerHandler(RESIZE_DEBOUNCE, resize_fire,
+                                            NULL);
+}
+
+/*****************************************************************************
+ * resize_size
+ *
+ * Description:
+ *
+ *   Gets the window of the console, also while a terminal opened with
+ *   Consio::open is current.
+ *
+ * Parameters:
+ *
+ *   window - receives the window in buffer coordinates
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void resize_size(SMALL_RECT *window) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    HANDLE handle;
+
+    handle = terminal != NULL ?
+        terminalConsole.screens[terminalConsole.screenActive] :
+        screens[screenActive];
+    memset(&info, 0, sizeof(info));
+    GetConsoleScreenBufferInfo(handle, &info);
+    *window = info.srWindow;
+}
+
+/*****************************************************************************
+ * resize_poll
+ *
+ * Description:
+ *
+ *   Checks the size of the console window every RESIZE_POLL milliseconds
+ *   while Consio::onresize has a handler. The console reports a new buffer
+ *   size with WINDOW_BUFFER_SIZE_EVENT only in window input mode, and a
+ *   window resized within its buffer not at all, so it is polled too.
+ *   While the size stays the same, the window is followed as it scrolls,
+ *   so the exposed area of the next resize is computed from where the
+ *   window was just before it.
+ *
+ * Parameters:
+ *
+ *   clientData - not used
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Reschedules itself.
+ *****************************************************************************/
+
+static void resize_poll(ClientData clientData) {
+    SMALL_RECT window;
+    int width, height;
+
+    resize_size(&window);
+    width = window.Right - window.Left + 1;
+    height = window.Bottom - window.Top + 1;
+    if (width != resizeSeenWidth || height != resizeSeenHeight) {
+        resizeSeenWidth = width;
+        resizeSeenHeight = height;
+        resize_note();
+    }
+    else if (resizeDebounce == NULL &&
+             width == resizeWindow.Right - resizeWindow.Left + 1 &&
+             height == resizeWindow.Bottom - resizeWindow.Top + 1) {
+        resizeWindow = window;
+    }
+
+    resizePoll = Tcl_CreateTimerHandler(RESIZE_POLL, resize_poll, NULL);
+}
+
+/*****************************************************************************
+ * resize_exposed
+ *
+ * Description:
+ *
+ *   Lists the parts of the new console window which were not in the old
+ *   one, as rectangles {x y width height} in buffer coordinates: the rows
+ *   above and below the old window, and the columns left and right of it
+ *   on the rows they share. Both the size and the position of the windows
+ *   are compared, so a window that has also scrolled in the buffer is
+ *   covered.
+ *
+ * Parameters:
+ *
+ *   from - old window
+ *   to   - new window
+ *   list - list to append the rectangles to
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static void resize_exposed(const SMALL_RECT *from,
+                           const SMALL_RECT *to,
+                           Tcl_Obj *list) {
+    int rect[4][4];
+    int top, bottom, i;
+
+    /* Rows above and below the old window, then the sides between */
+
+    top = from->Top > to->Top ? from->Top : to->Top;
+    bottom = from->Bottom < to->Bottom ? from->Bottom : to->Bottom;
+
+    rect[0][0] = to->Left;
+    rect[0][1] = to->Top;
+    rect[0][2] = to->Right;
+    rect[0][3] = from->Top - 1 < to->Bottom ? from->Top - 1 : to->Bottom;
+
+    rect[1][0] = to->Left;
+    rect[1][1] = from->Bottom + 1 > to->Top ? from->Bottom + 1 : to->Top;
+    rect[1][2] = to->Right;
+    rect[1][3] = to->Bottom;
+
+    rect[2][0] = to->Left;
+    rect[2][1] = top;
+    rect[2][2] = from->Left - 1 < to->Right ? from->Left - 1 : to->Right;
+    rect[2][3] = bottom;
+
+    rect[3][0] = from->Right + 1 > to->Left ? from->Right + 1 : to->Left;
+    rect[3][1] = top;
+    rect[3][2] = to->Right;
+    rect[3][3] = bottom;
+
+    for (i = 0; i < 4; i++) {
+        if (rect[i][2] < rect[i][0] || rect[i][3] < rect[i][1]) continue;
+        Tcl_ListObjAppendElement(NULL, list, Tcl_ObjPrintf("%d %d %d %d",
+            rect[i][0], rect[i][1], rect[i][2] - rect[i][0] + 1,
+            rect[i][3] - rect[i][1] + 1));
+    }
+}
+
+/*****************************************************************************
+ * resize_forget
+ *
+ * Description:
+ *
+ *   Removes the handler of Consio::onresize and stops checking the window
+ *   size. Also called when the interpreter of the handler is deleted.
+ *
+ * Parameters:
+ *
+ *   clientData - not used
+ *   interp     - interpreter of the handler
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Cancels the timers of the handler.
+ *****************************************************************************/
+
+static void resize_forget(ClientData clientData, Tcl_Interp *interp) {
+    if (resizeScript != NULL) {
+        Tcl_DecrRefCount(resizeScript);
+        resizeScript = NULL;
+    }
+    Tcl_DeleteTimerHandler(resizePoll);
+    Tcl_DeleteTimerHandler(resizeDebounce);
+    resizePoll = resizeDebounce = NULL;
+    resizeInterp = NULL;
+}
+
+/*****************************************************************************
+ * resize_fire
+ *
+ * Description:
+ *
+ *   Runs the handler of Consio::onresize once the size has settled. The
+ *   console keeps the contents of its buffer, so the handler only needs to
+ *   draw the parts of the window that it did not show before. They are
+ *   passed as a list of rectangles {x y width height} in buffer
+ *   coordinates, see resize_exposed. The encoder sends the new size to its
+ *   terminal the same way, see encoder_resize.
+ *
+ * Parameters:
+ *
+ *   clientData - not used
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Evaluates the handler at global level. Errors are reported with
+ *   bgerror.
+ *****************************************************************************/
+
+static void resize_fire(ClientData clientData) {
+    SMALL_RECT window;
+    Terminal *saved = terminal;
+    Tcl_Interp *interp = resizeInterp;
+    Tcl_Obj *cmd, *exposed;
+    int width, height;
+
+    resizeDebounce = NULL;
+    resize_size(&window);
+    width = window.Right - window.Left + 1;
+    height = window.Bottom - window.Top + 1;
+    resizeSeenWidth = width;
+    resizeSeenHeight = height;
+    if (width == resizeWindow.Right - resizeWindow.Left + 1 &&
+        height == resizeWindow.Bottom - resizeWindow.Top + 1) {
+        resizeWindow = window;
+        return;
+    }
+
+    exposed = Tcl_NewListObj(0, NULL);
+    resize_exposed(&resizeWindow, &window, exposed);
+    resizeWindow = window;
+
+    cmd = Tcl_DuplicateObj(resizeScript);
+    Tcl_IncrRefCount(cmd);
+    Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewIntObj(width));
+    Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewIntObj(height));
+    Tcl_ListObjAppendElement(NULL, cmd, exposed);
+
+    /* The handler draws on the console, whichever terminal is current */
+
+    Tcl_Preserve((ClientData) interp);
+    if (saved != NULL) Tcl_Preserve((ClientData) saved);
+    terminal_select(NULL);
+    export_touch();
+    if (Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL) != TCL_OK) {
+        Tcl_BackgroundError(interp);
+    }
+    terminal_select(saved);
+    if (saved != NULL) Tcl_Release((ClientData) saved);
+    Tcl_Release((ClientData) interp);
+    Tcl_DecrRefCount(cmd);
+}
+
+/*****************************************************************************
+ * get_color_attr
+ *
+ * Description:
+ *
+ *   Converts foreground and background color names to console attributes.
+ *   The available color names are: black, blue, green, cyan, red, magenta,
+ *   brown, lightgray, darkgray, lightblue, lightgreen, lightcyan, lightred,
+ *   lightmagenta, yellow and white.
+ *
+ * Parameters:
+ *
+ *   interp - Tcl interpreter used for error messages
+ *   fg     - foreground color name
+ *   bg     - background color name
+ *   attr   - receives the attributes
+ *
+ * Results:
+ *
+ *   TCL_OK    - the color names were valid
+ *   TCL_ERROR - an unknown color name was given
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int get_color_attr(Tcl_Interp *interp,
+                          Tcl_Obj *fg,
+                          Tcl_Obj *bg,
+                          WORD *attr) {
+    CONST char *colors[] = {"black",     "blue",        "green",
+                            "cyan",      "red",         "magenta",
+                            "brown",     "lightgray",   "darkgray",
+                            "lightblue", "lightgreen",  "lightcyan",
+                            "lightred",  "lightmagenta", "yellow",
+                            "white", (char *) NULL};
+    int index;
+
+    *attr = 0;
+
+    if (Tcl_GetIndexFromObj(interp,
+                            fg,
+                            colors,
+                            "foreground color",
+                            0,
+                            &index) == TCL_OK) {
+        switch (index) {
+            case BLACK       : *attr = *attr | FG_BLACK;        break;
+            case BLUE        : *attr = *attr | FG_BLUE;         break;
+            case GREEN       : *attr = *attr | FG_GREEN;        break;
+            case CYAN        : *attr = *attr | FG_CYAN;         break;
+            case RED         : *attr = *attr | FG_RED;          break;
+            case MAGENTA     : *attr = *attr | FG_MAGENTA;      break;
+            case BROWN       : *attr = *attr | FG_BROWN;        break;
+            case LIGHTGRAY   : *attr = *attr | FG_LIGHTGRAY;    break;
+            case DARKGRAY    : *attr = *attr | FG_DARKGRAY;     break;
+            case LIGHTBLUE   : *attr = *attr | FG_LIGHTBLUE;    break;
+            case LIGHTGREEN  : *attr = *attr | FG_LIGHTGREEN;   break;
+            case LIGHTCYAN   : *attr = *attr | FG_LIGHTCYAN;    break;
+            case LIGHTRED    : *attr = *attr | FG_LIGHTRED;     break;
+            case LIGHTMAGENTA: *attr = *attr | FG_LIGHTMAGENTA; break;
+            case YELLOW      : *attr = *attr | FG_YELLOW;       break;
+            case WHITE       : *attr = *attr | FG_WHITE;        break;
+            default: return TCL_ERROR;
+        }
+    }
+    else {
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp,
+                            bg,
+                            colors,
+                            "background color",
+                            0,
+                            &index) == TCL_OK) {
+        switch (index) {
+            case BLACK       : *attr = *attr | BG_BLACK;        break;
+            case BLUE        : *attr = *attr | BG_BLUE;         break;
+            case GREEN       : *attr = *attr | BG_GREEN;        break;
+            case CYAN        : *attr = *attr | BG_CYAN;         break;
+            case RED         : *attr = *attr | BG_RED;          break;
+            case MAGENTA     : *attr = *attr | BG_MAGENTA;      break;
+            case BROWN       : *attr = *attr | BG_BROWN;        break;
+            case LIGHTGRAY   : *attr = *attr | BG_LIGHTGRAY;    break;
+            case DARKGRAY    : *attr = *attr | BG_DARKGRAY;     break;
+            case LIGHTBLUE   : *attr = *attr | BG_LIGHTBLUE;    break;
+            case LIGHTGREEN  : *attr = *attr | BG_LIGHTGREEN;   break;
+            case LIGHTCYAN   : *attr = *attr | BG_LIGHTCYAN;    break;
+            case LIGHTRED    : *attr = *attr | BG_LIGHTRED;     break;
+            case LIGHTMAGENTA: *attr = *attr | BG_LIGHTMAGENTA; break;
+            case YELLOW      : *attr = *attr | BG_YELLOW;       break;
+            case WHITE       : *attr = *attr | BG_WHITE;        break;
+            default: return TCL_ERROR;
+        }
+    }
+    else {
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio_PutCell
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Writes one character with the
+ *   given attributes to the given console cell. The cursor is not moved.
+ *
+ * Parameters:
+ *
+ *   x, y - cell
+ *   ch   - UTF-16 character
+ *   attr - attributes
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+void Consio_PutCell(int x, int y, int ch, int attr) {
+    CHAR_INFO cell;
+
+    cell.Char.UnicodeChar = (WCHAR) ch;
+    cell.Attributes = (WORD) attr;
+    console_write_cells(hStdout, &cell, x, y, 1, 1);
+}
+
+/*****************************************************************************
+ * Consio_PutSpan
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Writes a row of UTF-8 text with
+ *   the given attributes starting at the given cell, using the display
+ *   widths of Consio::width. The text should not contain control
+ *   characters. The cursor is not moved.
+ *
+ * Parameters:
+ *
+ *   x, y - first cell
+ *   str  - UTF-8 text
+ *   len  - length of the text in bytes, or -1 if it is null-terminated
+ *   attr - attributes
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+void Consio_PutSpan(int x, int y, const char *str, int len, int attr) {
+    CHAR_INFO *cells;
+    int width;
+
+    if (len < 0) len = strlen(str);
+    width = text_width((const unsigned char *) str, len);
+    if (width <= 0) return;
+
+    cells = (CHAR_INFO *) ckalloc(width * sizeof(CHAR_INFO));
+    cells_from_utf8(cells, width, str, len, (WORD) attr);
+    console_write_cells(hStdout, cells, x, y, width, 1);
+    ckfree((char *) cells);
+}
+
+/*****************************************************************************
+ * Consio_PutRect
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Writes a rectangular block of
+ *   cells with a single console call. The cursor is not moved.
+ *
+ * Parameters:
+ *
+ *   x, y   - upper left corner of the block
+ *   width  - width of the block
+ *   height - height of the block
+ *   cells  - width * height cells, row by row
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+void Consio_PutRect(int x, int y, int width, int height,
+                    const ConsioCell *cells) {
+    console_write_cells(hStdout, (CHAR_INFO *) cells, x, y, width, height);
+}
+
+/*****************************************************************************
+ * Consio_FillRect
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Fills a rectangle with one
+ *   character and attributes. The cursor is not moved.
+ *
+ * Parameters:
+ *
+ *   x, y   - upper left corner of the rectangle
+ *   width  - width of the rectangle
+ *   height - height of the rectangle
+ *   ch     - UTF-16 character
+ *   attr   - attributes
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Writes to the console.
+ *****************************************************************************/
+
+void Consio_FillRect(int x, int y, int width, int height, int ch, int attr) {
+    CHAR_INFO *cells;
+    int i;
+
+    if (width <= 0 || height <= 0) return;
+
+    cells = (CHAR_INFO *) ckalloc(width * height * sizeof(CHAR_INFO));
+    for (i = 0; i < width * height; i++) {
+        cells[i].Char.UnicodeChar = (WCHAR) ch;
+        cells[i].Attributes = (WORD) attr;
+    }
+    console_write_cells(hStdout, cells, x, y, width, height);
+    ckfree((char *) cells);
+}
+
+/*****************************************************************************
+ * Consio_ScrollRect
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Scrolls the contents of a
+ *   rectangle by dy rows; positive values move the contents up. Exposed
+ *   cells are filled with spaces.
+ *
+ * Parameters:
+ *
+ *   x, y   - upper left corner of the rectangle
+ *   width  - width of the rectangle
+ *   height - height of the rectangle
+ *   dy     - number of rows to scroll
+ *   attr   - attributes for the exposed cells
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Modifies the console.
+ *****************************************************************************/
+
+void Consio_ScrollRect(int x, int y, int width, int height, int dy, int attr) {
+    console_scroll(hStdout, x, y, width, height, dy, (WORD) attr);
+}
+
+/*****************************************************************************
+ * Consio_GetAttr
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Returns the current text
+ *   attributes.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Current attributes.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+int Consio_GetAttr(void) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+
+    return info.wAttributes;
+}
+
+/*****************************************************************************
+ * Consio_SetAttr
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Sets the text attributes, like
+ *   Consio::textattr.
+ *
+ * Parameters:
+ *
+ *   attr - attributes
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Changes the console text attributes.
+ *****************************************************************************/
+
+void Consio_SetAttr(int attr) {
+    SetConsoleTextAttribute(hStdout, (WORD) attr);
+    record_int(REC_OUT_ATTR, attr);
+}
+
+/*****************************************************************************
+ * Consio_GotoXY
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Moves the cursor, like
+ *   Consio::gotoxy.
+ *
+ * Parameters:
+ *
+ *   x, y - new cursor position
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Moves the cursor.
+ *****************************************************************************/
+
+void Consio_GotoXY(int x, int y) {
+    COORD coord;
+
+    coord.X = (SHORT) x;
+    coord.Y = (SHORT) y;
+    SetConsoleCursorPosition(hStdout, coord);
+    record_goto(x, y);
+}
+
+/*****************************************************************************
+ * Consio_WhereXY
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Returns the cursor position.
+ *
+ * Parameters:
+ *
+ *   x, y - pointers to the cursor position
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+void Consio_WhereXY(int *x, int *y) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    *x = info.dwCursorPosition.X;
+    *y = info.dwCursorPosition.Y;
+}
+
+/*****************************************************************************
+ * Consio_GetWindow
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Returns the position and size
+ *   of the visible console window within the console buffer.
+ *
+ * Parameters:
+ *
+ *   x, y   - pointers to the upper left corner
+ *   width  - pointer to the width
+ *   height - pointer to the height
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+void Consio_GetWindow(int *x, int *y, int *width, int *height) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    *x = info.srWindow.Left;
+    *y = info.srWindow.Top;
+    *width = info.srWindow.Right - info.srWindow.Left + 1;
+    *height = info.srWindow.Bottom - info.srWindow.Top + 1;
+}
+
+/*****************************************************************************
+ * Consio_KbHit
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Tells whether a key press is
+ *   waiting to be read by Consio_ReadKey, from the input replay, the
+ *   current terminal, a paste being returned key by key or the console.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   1 if a key press is waiting, 0 otherwise.
+ *
+ * Side effects:
+ *
+ *   None. Console input events are only peeked at, so resize events stay
+ *   in the input buffer for the input commands.
+ *****************************************************************************/
+
+int Consio_KbHit(void) {
+    INPUT_RECORD *buffer;
+    DWORD count, num, i;
+    int hit;
+
+    if (keyPos < keyLen) return 1;
+
+    if ((hit = input_hit()) >= 0) return hit;
+
+    if (!GetNumberOfConsoleInputEvents(hStdin, &count) || count == 0) {
+        return 0;
+    }
+    buffer = (INPUT_RECORD *) ckalloc(count * sizeof(INPUT_RECORD));
+    if (!PeekConsoleInputW(hStdin, buffer, count, &num)) num = 0;
+    for (i = 0, hit = 0; i < num && !hit; i++) {
+        hit = buffer[i].EventType == KEY_EVENT &&
+              buffer[i].Event.KeyEvent.bKeyDown;
+    }
+    ckfree((char *) buffer);
+
+    return hit;
+}
+
+/*****************************************************************************
+ * Consio_ReadKey
+ *
+ * Description:
+ *
+ *   Public C interface, see ConsioDecls.h. Waits for a key press and
+ *   returns its virtual key code, like Consio::getchex, and optionally the
+ *   character it produced. The key is read the same way as by
+ *   Consio::getevent: from the input replay, the current terminal or the
+ *   console. Pasted text is returned one character at a time, with line
+ *   breaks as Enter.
+ *
+ * Parameters:
+ *
+ *   timeout - maximum time to wait in milliseconds, or -1 to wait forever
+ *   ch      - pointer to the UTF-16 character produced by the key (0 for
+ *             keys that produce none), or NULL
+ *
+ * Results:
+ *
+ *   Virtual key code, or -1 if the time ran out, the input of the terminal
+ *   has ended or the replay is out of sync.
+ *
+ * Side effects:
+ *
+ *   Reads from the input. The key or paste is recorded like the events
+ *   read by Consio::getevent.
+ *****************************************************************************/
+
+int Consio_ReadKey(int timeout, int *ch) {
+    INPUT_RECORD rec;
+    KEY_EVENT_RECORD *key = &rec.Event.KeyEvent;
+    DWORD oldMode;
+    Tcl_Obj *event;
+    char *str;
+    int type, len, rc;
+
+    if (keyPos == keyLen) {
+        rc = input_source(NULL, REC_IN_EVENT, timeout, &event);
+        if (rc < 0) return -1;
+        if (rc > 0) {
+            type = input_event_rec(event, &rec);
+        }
+        else {
+            GetConsoleMode(hStdin, &oldMode);
+            SetConsoleMode(hStdin, input_mode());
+            type = input_next(&rec, timeout);
+            SetConsoleMode(hStdin, oldMode);
+
+            if (type != INPUT_NONE) {
+                event = input_event_obj(type, &rec);
+                Tcl_IncrRefCount(event);
+                str = Tcl_GetStringFromObj(event, &len);
+                record_event(REC_IN_EVENT, str, len);
+                Tcl_DecrRefCount(event);
+            }
+        }
+
+        if (type == INPUT_KEY) {
+            if (ch != NULL) *ch = key->uChar.UnicodeChar;
+            return key->wVirtualKeyCode;
+        }
+        if (type != INPUT_PASTE || pasteLen == 0) return -1;
+
+        /* The paste is kept to be returned one character per call */
+
+        editor_reserve(&keyText, &keyCap, pasteLen);
+        memcpy(keyText, pasteText, pasteLen * sizeof(Tcl_UniChar));
+        keyLen = pasteLen;
+        keyPos = 0;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.EventType = KEY_EVENT;
+    key->bKeyDown = TRUE;
+    key->wRepeatCount = 1;
+    key->uChar.UnicodeChar = keyText[keyPos] == '\n' ? '\r' :
+                             (WCHAR) keyText[keyPos];
+    keyPos++;
+    input_vt_key(&rec);
+    if (ch != NULL) *ch = key->uChar.UnicodeChar;
+
+    return key->wVirtualKeyCode;
+}
+
+/* Stubs table published to other extensions, see ConsioDecls.h */
+
+static const ConsioStubs consioStubs = {
+    CONSIO_STUBS_MAGIC,
+    NULL,
+    Consio_PutCell,
+    Consio_PutSpan,
+    Consio_PutRect,
+    Consio_FillRect,
+    Consio_ScrollRect,
+    Consio_GetAttr,
+    Consio_SetAttr,
+    Consio_GotoXY,
+    Consio_WhereXY,
+    Consio_GetWindow,
+    Consio_KbHit,
+    Consio_ReadKey
+};
+
+/*****************************************************************************
+ * Consio_Init
+ *
+ * Description:
+ *
+ *   This function initializes all commands provided by Consio package.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   TCL_OK    - initialization was successful
+ *   TCL_ERROR - an error message if the initialization procedure was not able
+ *               to get console input and output handles
+ *
+ * Side effects:
+ *   Creates a set of new commands for Tcl interpreter under Consio namespace
+ *   and provides the Consio package together with the stubs table of the
+ *   C interface (see ConsioDecls.h).
+ *****************************************************************************/
+
+int Consio_Init(Tcl_Interp *interp) {
+    Tcl_Obj *obj_str;
+    char *error_message_text = "Can't get standard input or output handle.";
+
+#ifdef USE_TCL_STUBS
+    if (Tcl_InitStubs(interp, TCLVERSION, 0) == NULL) {
+        return TCL_ERROR;
+    }
+#endif /*USE_TCL_STUBS*/
+
+    Tcl_CreateObjCommand(interp, "Consio::about", cmd_about, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::clrscr", cmd_clrscr, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::gotoxy", cmd_gotoxy, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::wherex", cmd_wherex, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::wherey", cmd_wherey, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::bufferwidth", cmd_bufferwidth, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::bufferheight", cmd_bufferheight, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::getch", cmd_getch, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::getche", cmd_getche, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::putch", cmd_putch, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::kbhit", cmd_kbhit, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::textattr", cmd_textattr, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::cputs", cmd_cputs, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::cgets", cmd_cgets, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::cgetse", cmd_cgetse, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::getchex", cmd_getchex, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::getkeystate", cmd_getkeystate, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::getch2", cmd_getch2, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::record", cmd_record, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::replay", cmd_replay, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::readline", cmd_readline, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::history", cmd_history, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::pager", cmd_pager, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::width", cmd_width, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::truncate", cmd_truncate, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::wrap", cmd_wrap, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::table", cmd_table, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::export", cmd_export, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::caps", cmd_caps, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::getevent", cmd_getevent, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::paste", cmd_paste, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::image", cmd_image, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::canvas", cmd_canvas, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::scrollback", cmd_scrollback, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::screen", cmd_screen, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::encoder", cmd_encoder, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::find", cmd_find, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::waitfor", cmd_waitfor, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::open", cmd_open, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::terminal", cmd_terminal, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::template", cmd_template, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "Consio::onresize", cmd_onresize, NULL, NULL);
+
+#ifdef CONSIO_NRE
+    /* In coroutines, the input commands yield instead of blocking */
+
+    Tcl_NRCreateCommand(interp, "Consio::getch", cmd_getch, input_nr,
+                        (ClientData) INPUT_WAIT_CHAR, NULL);
+    Tcl_NRCreateCommand(interp, "Consio::getche", cmd_getche, input_nr,
+                        (ClientData) INPUT_WAIT_CHAR_ECHO, NULL);
+    Tcl_NRCreateCommand(interp, "Consio::getchex", cmd_getchex, input_nr,
+                        (ClientData) INPUT_WAIT_KEY, NULL);
+    Tcl_NRCreateCommand(interp, "Consio::cgets", cmd_cgets, input_nr,
+                        (ClientData) INPUT_WAIT_LINE, NULL);
+    Tcl_NRCreateCommand(interp, "Consio::cgetse", cmd_cgetse, input_nr,
+                        (ClientData) INPUT_WAIT_LINE_ECHO, NULL);
+#endif /*CONSIO_NRE*/
+
+    hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    if (hStdin == INVALID_HANDLE_VALUE || hStdout == INVALID_HANDLE_VALUE) {
+        obj_str = Tcl_NewStringObj(error_message_text,
+                                   strlen(error_message_text));
+        Tcl_SetObjResult(interp, obj_str);
+        return TCL_ERROR;
+    }
+
+    screens[0] = hStdout;
+
+    return Tcl_PkgProvideEx(interp, "Consio", CONSIO_VERSION,
+                            (ClientData) &consioStubs);
+}
+
+/*****************************************************************************
+ * Consio::about
+ *
+ * Description:
+ *
+ *   Returns information about the author and the library version.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   None.
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns a string of information.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_about(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    Tcl_Obj *obj_str;
+
+    obj_str = Tcl_NewStringObj(ABOUT_STRING, strlen(ABOUT_STRING));
+    Tcl_SetObjResult(interp, obj_str);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::clrscr
+ *
+ * Description:
+ *
+ *   Clears the console using the currently active text attributes.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *   - FillConsoleOutputCharacter
+ *   - FillConsoleOutputAttribute
+ *   - SetConsoleCursorPosition
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Clears screen i.e. fills console buffer with space character (' ') using
+ *   currently selected text attributes (for more information about attributes,
+ *   see cmd_textattr function).
+ *****************************************************************************/
+
+static int cmd_clrscr(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    console_clear(hStdout);
+    record_event(REC_OUT_CLEAR, NULL, 0);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::gotoxy
+ *
+ * Description:
+ *
+ *    Moves cursor to a new location. The location is given as two separate
+ *    integer arguments: x and y. 0 0 is the upper left corner of the buffer.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - SetConsoleCursorPosition
+ *
+ * Parameters:
+ *
+ *   x - X coordinate for cursor
+ *   y - Y coordinate for cursor
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Moves the cursor to new location (x;y).
+ *****************************************************************************/
+
+static int cmd_gotoxy(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    COORD coord;
+    int x, y;
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "x y");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &x) == TCL_OK &&
+        Tcl_GetIntFromObj(interp, objv[2], &y) == TCL_OK) {
+        coord.X = x;
+        coord.Y = y;
+        SetConsoleCursorPosition(hStdout, coord);
+        record_goto(x, y);
+    }
+    else {
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::wherex
+ *
+ * Description:
+ *
+ *   This command returns the current cursor X coordinate in the console
+ *   buffer. This means that the coordinate does not represent the position
+ *   of the cursor in the visible area of the console.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ * Returns the current cursor X coordinate as an integer.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_wherex(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Tcl_Obj *obj_int;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    obj_int = Tcl_NewIntObj(info.dwCursorPosition.X);
+    Tcl_SetObjResult(interp, obj_int);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::wherey
+ *
+ * Description:
+ *
+ *   This command returns the current cursor Y coordinate in the console
+ *   buffer. This means that the coordinate does not represent the position
+ *   of the cursor in the visible area of the console.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ * Returns the current cursor Y coordinate as an integer.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_wherey(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Tcl_Obj *obj_int;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    obj_int = Tcl_NewIntObj(info.dwCursorPosition.Y);
+    Tcl_SetObjResult(interp, obj_int);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::bufferwidth
+ *
+ * Description:
+ *
+ *   Returns the width of the console buffer. This is not the width of the
+ *   console window.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns buffer width as an integer.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_bufferwidth(ClientData clientData,
+                           Tcl_Interp *interp,
+                           int objc,
+                           Tcl_Obj * CONST objv[]) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Tcl_Obj *obj_int;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    obj_int = Tcl_NewIntObj(info.dwSize.X);
+    Tcl_SetObjResult(interp, obj_int);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::bufferheight
+ *
+ * Description:
+ *
+ *   Returns the height of the console buffer. This is not the height of the
+ *   console window.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns buffer height as an integer.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_bufferheight(ClientData clientData,
+                            Tcl_Interp *interp,
+                            int objc,
+                            Tcl_Obj * CONST objv[]) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Tcl_Obj *obj_int;
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
     obj_int = Tcl_NewIntObj(info.dwSize.Y);
     Tcl_SetObjResult(interp, obj_int);
 
@@ -373,652 +9418,4531 @@ static int cmd_bufferheight(ClientData clientData,
 }
 
 /*****************************************************************************
- * Consio::getch
+ * Consio::getch
+ *
+ * Description:
+ *
+ *   Waits for a keypress. Doesn't echo it to the console.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - ReadConsole
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns the first character from the input buffer.
+ *
+ * Side effects:
+ *
+ *   If there are no characters available in the input buffer, the function
+ *   will block and wait until user presses a key. The pressed key will not
+ *   be echoed back to the console.
+ *****************************************************************************/
+
+static int cmd_getch(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    DWORD oldMode, newMode;
+    TCHAR buffer[1];
+    DWORD num;
+    Tcl_Obj *obj_str;
+
+    switch (input_source(interp, REC_IN_CHAR, -1, &obj_str)) {
+        case 1:
+            Tcl_SetObjResult(interp, obj_str);
+            return TCL_OK;
+        case -1:
+            return TCL_ERROR;
+    }
+
+    newMode = 0;
+
+    GetConsoleMode(hStdin, &oldMode);
+    SetConsoleMode(hStdin, newMode);
+    ReadConsole(hStdin, buffer, 1, &num, NULL);
+    SetConsoleMode(hStdin, oldMode);
+
+    if (num > 0) {
+        record_event(REC_IN_CHAR, buffer, 1);
+        obj_str = Tcl_NewStringObj(buffer, 1);
+        Tcl_SetObjResult(interp, obj_str);
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::getche
+ *
+ * Description:
+ *
+ *   Waits for a keypress. The character received from the keyboard will be
+ *   echoed back to the console.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - ReadConsole
+ *   - WriteConsole
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns the first character from the input buffer.
+ *
+ * Side effects:
+ *
+ *   If there are no characters available in the input buffer, the function
+ *   will block and wait until user presses a key. The pressed key will be
+ *   echoed back to the console.
+ *****************************************************************************/
+
+static int cmd_getche(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    DWORD oldMode, newMode;
+    TCHAR buffer[1];
+    DWORD num;
+    Tcl_Obj *obj_str;
+
+    switch (input_source(interp, REC_IN_CHAR, -1, &obj_str)) {
+        case 1:
+            console_write_unicode(hStdout, Tcl_GetUnicode(obj_str), 1);
+            Tcl_SetObjResult(interp, obj_str);
+            return TCL_OK;
+        case -1:
+            return TCL_ERROR;
+    }
+
+    newMode = 0;
+
+    GetConsoleMode(hStdin, &oldMode);
+    SetConsoleMode(hStdin, newMode);
+    ReadConsole(hStdin, buffer, 1, &num, NULL);
+    SetConsoleMode(hStdin, oldMode);
+
+    if (num > 0) {
+        record_event(REC_IN_CHAR, buffer, 1);
+        WriteConsole(hStdout, buffer, 1, &num, NULL);
+        record_event(REC_OUT_TEXT, buffer, 1);
+
+        obj_str = Tcl_NewStringObj(buffer, 1);
+        Tcl_SetObjResult(interp, obj_str);
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::putch
+ *
+ * Description:
+ *
+ *    Prints the given character to the current cursor location.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - WriteConsole
+ *
+ * Parameters:
+ *
+ *   chr - character to be displayed.
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Given character will be displayed at the cursor location.
+ *****************************************************************************/
+
+static int cmd_putch(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    DWORD num;
+    char *str;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "char");
+
+        return TCL_ERROR;
+    }
+
+    str = Tcl_GetString(objv[1]);
+    WriteConsole(hStdout, str, 1, &num, NULL);
+    record_event(REC_OUT_TEXT, str, 1);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::kbhit
+ *
+ * Description:
+ *
+ *    With this command it's possible to check if the user has pressed any
+ *    keys. This command will not block, so it's possible to poll for
+ *    keys in a while loop like this: while {[Consio::kbhit] == 0} {}.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - PeekConsoleInput
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   1 - if there is at least one character waiting in the input buffer
+ *   0 - if there is nothing waiting in the input buffer
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_kbhit(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    INPUT_RECORD buffer[1 * sizeof(TCHAR)];
+    DWORD num;
+    Tcl_Obj *obj_int;
+    int hit;
+
+    if ((hit = input_hit()) >= 0) {
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(hit));
+        return TCL_OK;
+    }
+
+    PeekConsoleInput(hStdin, buffer, 1, &num);
+
+    if (num == 0) {
+        obj_int = Tcl_NewIntObj(0);
+    }
+    else {
+        obj_int = Tcl_NewIntObj(1);
+    }
+
+    Tcl_SetObjResult(interp, obj_int);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::textattr
+ *
+ * Description:
+ *
+ *   This command will change the console attributes, which will be
+ *   used for all output. The command has two parameters: foreground
+ *   color name and background color name. The available color names
+ *   are: black, blue, green, cyan, red, magenta, brown, lightgray,
+ *   darkgray, lightblue, lightgreen, lightcyan, lightred, lightmagenta,
+ *   yellow and white.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - SetConsoleTextAttribute
+ *
+ * Parameters:
+ *
+ *   foreground - a new foreground color to be used
+ *   background - a new background color to be used
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Nothing visible until the first character is printed to the console.
+ *   New attributes are used for everything until the console is destroyed
+ *   or something will call the SetConsoleTextAttribute Win API function
+ *   with new attributes. In other words, the new attributes will stay in
+ *   effect even after the Tcl application has terminated and the Consio
+ *   library is not used anymore.
+ *****************************************************************************/
+
+static int cmd_textattr(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    WORD attr;
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "foreground background");
+        return TCL_ERROR;
+    }
+
+    if (get_color_attr(interp, objv[1], objv[2], &attr) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    SetConsoleTextAttribute(hStdout, attr);
+    record_int(REC_OUT_ATTR, attr);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::cputs
+ *
+ * Description:
+ *
+ *   This command is just a reimplementation of the Tcl puts command. This will
+ *   print the given string to the console. If -nonewline parameter has been
+ *   specified, then the newline will not be appended at the end of the string.
+ *   At the moment this command has 65534 character limit. It's better to use
+ *   puts istead, if there is a need to print more charactes.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - WriteConsole
+ *
+ * Parameters:
+ *
+ *   -nonewline - (optional) prevents the newline
+ *   string     - string to be printed
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   The given string will be printed to the console.
+ *****************************************************************************/
+
+static int cmd_cputs(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    TCHAR *str;
+    TCHAR *param;
+    TCHAR *newline;
+    int len;
+    DWORD num;
+    char *errstring = "?-nonewline? string";
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, objc, objv, errstring);
+        return TCL_ERROR;
+    }
+
+    if (objc > 2) {
+        param = Tcl_GetStringFromObj(objv[1], &len);
+        str = Tcl_GetStringFromObj(objv[2], &len);
+        if (strcmp(param, "-nonewline") == 0) {
+            newline = NULL;
+        }
+        else {
+            Tcl_WrongNumArgs(interp, 1, objv, errstring);
+            return TCL_ERROR;
+        }
+    }
+    else {
+        str = Tcl_GetStringFromObj(objv[1], &len);
+        newline = "\r\n";
+    }
+
+    if (len > 65534) len = 65534;
+    WriteConsole(hStdout, str, len, &num, NULL);
+    record_event(REC_OUT_TEXT, str, len);
+    if (newline != NULL) {
+        WriteConsole(hStdout, newline, 2, &num, NULL);
+        record_event(REC_OUT_TEXT, newline, 2);
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::cgets
+ *
+ * Description:
+ *
+ *   This command reads user input until the Enter key has been pressed. This
+ *   command will not echo anything to the console. The maximum input size at
+ *   the moment is 4095 characters.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - ReadConsole
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns a string. Newline character will not be included.
+ *
+ * Side effects:
+ *
+ *   The command will block until the Enter key has been pressed.
+ *****************************************************************************/
+
+static int cmd_cgets(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    DWORD oldMode, newMode;
+    TCHAR buffer[4096];
+    DWORD num;
+    Tcl_Obj *obj_str;
+
+    switch (input_source(interp, REC_IN_LINE, -1, &obj_str)) {
+        case 1:
+            Tcl_SetObjResult(interp, obj_str);
+            return TCL_OK;
+        case -1:
+            return TCL_ERROR;
+    }
+
+    newMode = ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT;
+    GetConsoleMode(hStdin, &oldMode);
+    SetConsoleMode(hStdin, newMode);
+    ReadConsole(hStdin, buffer, 4095, &num, NULL);
+    SetConsoleMode(hStdin, oldMode);
+
+    if (buffer[num - 1] == '\r' || buffer[num - 1] == '\n') num--;
+    if (buffer[num - 1] == '\r' || buffer[num - 1] == '\n') num--;
+
+    record_event(REC_IN_LINE, buffer, num);
+    obj_str = Tcl_NewStringObj(buffer, num);
+    Tcl_SetObjResult(interp, obj_str);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::cgetse
+ *
+ * Description:
+ *
+ *   This command reads user input until the Enter key has been pressed. This
+ *   command will echo everything back to the console. The maximum input size
+ *   at the moment is 4095 characters.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - ReadConsole
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns a string. Newline character will not be included.
+ *
+ * Side effects:
+ *
+ *   The command will block until the Enter key has been pressed. The user
+ *   input will be echoed to the console.
+ *****************************************************************************/
+
+static int cmd_cgetse(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    DWORD oldMode, newMode;
+    TCHAR buffer[4096];
+    DWORD num;
+    Tcl_Obj *obj_str;
+    char *str;
+    int len;
+
+    switch (input_source(interp, REC_IN_LINE, -1, &obj_str)) {
+        case 1:
+            str = Tcl_GetStringFromObj(obj_str, &len);
+            WriteConsole(hStdout, str, len, &num, NULL);
+            WriteConsole(hStdout, "\r\n", 2, &num, NULL);
+            Tcl_SetObjResult(interp, obj_str);
+            return TCL_OK;
+        case -1:
+            return TCL_ERROR;
+    }
+
+    newMode = ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT;
+    GetConsoleMode(hStdin, &oldMode);
+    SetConsoleMode(hStdin, newMode);
+    ReadConsole(hStdin, buffer, 4095, &num, NULL);
+    SetConsoleMode(hStdin, oldMode);
+
+    if (buffer[num - 1] == '\r' || buffer[num - 1] == '\n') num--;
+    if (buffer[num - 1] == '\r' || buffer[num - 1] == '\n') num--;
+
+    record_event(REC_IN_LINE, buffer, num);
+    record_event(REC_OUT_TEXT, buffer, num);
+    record_event(REC_OUT_TEXT, "\r\n", 2);
+    obj_str = Tcl_NewStringObj(buffer, num);
+    Tcl_SetObjResult(interp, obj_str);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::getchex
+ *
+ * Description:
+ *
+ *   Extended getch will wait for key press from the keyboard and returns it
+ *   as a device-independent integer code. This function will react to any
+ *   key.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - ReadConsoleInput
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns integer value of the key. The value is device-independent as
+ *   opposed to scan code.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_getchex(ClientData clientData,
+                       Tcl_Interp *interp,
+                       int objc,
+                       Tcl_Obj * CONST objv[]) {
+    DWORD oldMode, newMode;
+    INPUT_RECORD buffer[1];
+    DWORD num;
+    WORD code;
+    Tcl_Obj *obj_str;
+
+    switch (input_source(interp, REC_IN_KEY, -1, &obj_str)) {
+        case 1:
+            Tcl_SetObjResult(interp, obj_str);
+            return TCL_OK;
+        case -1:
+            return TCL_ERROR;
+    }
+
+    newMode = 0;
+
+    GetConsoleMode(hStdin, &oldMode);
+    SetConsoleMode(hStdin, newMode);
+
+    do {
+        ReadConsoleInput(hStdin, buffer, 1, &num);
+    } while (num == 0 || buffer[0].EventType != KEY_EVENT ||
+             buffer[0].Event.KeyEvent.bKeyDown == FALSE);
+
+    SetConsoleMode(hStdin, oldMode);
+
+    code = buffer[0].Event.KeyEvent.wVirtualKeyCode;
+    record_int(REC_IN_KEY, code);
+    obj_str = Tcl_NewIntObj(code);
+    Tcl_SetObjResult(interp, obj_str);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::getkeystate
+ *
+ * Description:
+ *
+ * See GetAsyncKeyState from MSDN:
+ * https://msdn.microsoft.com/en-us/library/windows/desktop/ms646293(v=vs.85).aspx
+ * https://msdn.microsoft.com/en-us/library/windows/desktop/dd375731(v=vs.85).aspx
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetAsyncKeyState
+ *
+ * Parameters:
+ *
+ *   id - virtual-key code
+ *
+ * Results:
+ *
+ * Returns key state. The most significant bit tells if the key is up (bit not
+ * set) or down (sit set). The lease significant bit tells, if the key was
+ * pressed after previous call of getkeystate.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_getkeystate(ClientData clientData,
+                           Tcl_Interp *interp,
+                           int objc,
+                           Tcl_Obj * CONST objv[]) {
+    int id;
+    int state;
+    Tcl_Obj *obj_int;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "id");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &id) == TCL_OK) {
+        state = GetAsyncKeyState(id);
+    }
+    else {
+        return TCL_ERROR;
+    }
+
+    obj_int = Tcl_NewIntObj(state);
+    Tcl_SetObjResult(interp, obj_int);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::getch2
+ *
+ * Description:
+ *
+ *   Waits for a keypress. Doesn't echo it to the console.
+ *   This is based on MSVCRT implementation. See more information here:
+ *   https://docs.microsoft.com/en-us/cpp/c-runtime-library/reference/getch-getwch
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - _getch
+ *
+ * Parameters:
+ *
+ *   None.
+ *
+ * Results:
+ *
+ *   Returns the first character from the input buffer. If the value is larger
+ *   than 255, then the key was a special key (arrow, function key, etc.)
+ *
+ * Side effects:
+ *
+ *
+ *
+ *****************************************************************************/
+
+static int cmd_getch2(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    int key;
+    Tcl_Obj *obj_int;
+
+    switch (input_source(interp, REC_IN_KEY2, -1, &obj_int)) {
+        case 1:
+            Tcl_SetObjResult(interp, obj_int);
+            return TCL_OK;
+        case -1:
+            return TCL_ERROR;
+    }
+
+    key = _getch();
+    if (key == 0 || key == 0xE0) {
+        key = _getch() + 0x100;
+    }
+    record_int(REC_IN_KEY2, key);
+
+    obj_int = Tcl_NewIntObj(key);
+    Tcl_SetObjResult(interp, obj_int);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::record
+ *
+ * Description:
+ *
+ *   Starts or stops session recording. While a recording is active, every
+ *   output operation (text, cursor movement, attribute change and screen
+ *   clear) and every input received by getch, getche, getchex, getch2,
+ *   cgets, cgetse, readline and getevent is appended to the recording file
+ *   together with a timestamp. The file can be played back with
+ *   Consio::replay. See Consio.txt for the description of the file format.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetTickCount
+ *
+ * Parameters:
+ *
+ *   start filename - starts a new recording to the given file
+ *   stop           - stops the active recording
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Creates or truncates the recording file. A recording started earlier is
+ *   closed when a new one is started.
+ *****************************************************************************/
+
+static int cmd_record(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"start", "stop", (char *) NULL};
+    enum {RECORD_START, RECORD_STOP};
+    Tcl_Channel channel;
+    int index;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "start filename | stop");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (recChannel != NULL) {
+        channel = recChannel;
+        recChannel = NULL;
+        if (Tcl_Close(interp, channel) != TCL_OK) return TCL_ERROR;
+    }
+
+    if (index == RECORD_STOP) return TCL_OK;
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "filename");
+        return TCL_ERROR;
+    }
+
+    channel = Tcl_FSOpenFileChannel(interp, objv[2], "w", 0666);
+    if (channel == NULL) return TCL_ERROR;
+
+    Tcl_SetChannelOption(interp, channel, "-translation", "binary");
+    Tcl_SetChannelOption(interp, channel, "-buffering", "full");
+    Tcl_SetChannelOption(interp, channel, "-buffersize", "65536");
+    Tcl_Write(channel, REC_MAGIC, REC_MAGIC_LEN);
+
+    recStart = GetTickCount();
+    recChannel = channel;
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::replay
+ *
+ * Description:
+ *
+ *   Plays back a session recording made with Consio::record. There are two
+ *   modes:
+ *
+ *   render - The recorded output operations are performed again on the
+ *            console. Recorded input is ignored. The command returns when
+ *            the whole recording has been rendered.
+ *
+ *   input  - The recorded input is fed back to getch, getche, getchex,
+ *            getch2, cgets, cgetse, readline and getevent, so the
+ *            application can be run again with exactly the same keystrokes.
+ *            The command returns immediately. When the recording runs out
+ *            of input, the input commands go back to reading the console.
+ *
+ *   By default the original timing is reproduced. With -fast everything is
+ *   replayed as fast as possible, which is useful for measuring rendering
+ *   performance.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetTickCount
+ *   - Sleep
+ *   - WriteConsole
+ *   - SetConsoleCursorPosition
+ *   - SetConsoleTextAttribute
+ *
+ * Parameters:
+ *
+ *   render filename ?-fast? - renders the recorded output
+ *   input filename ?-fast?  - replays the recorded input
+ *   stop                    - stops an active input replay
+ *
+ * Results:
+ *
+ *   The render mode returns the time used for rendering in milliseconds.
+ *
+ * Side effects:
+ *
+ *   See description.
+ *****************************************************************************/
+
+static int cmd_replay(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"input", "render", "stop", (char *) NULL};
+    enum {REPLAY_INPUT, REPLAY_RENDER, REPLAY_STOP};
+    char *errstring = "input|render filename ?-fast? | stop";
+    Tcl_Obj *data;
+    unsigned char *bytes;
+    unsigned char *payload;
+    int index, len, pos, fast, i;
+    int values[6];
+    DWORD t, n, now, start, num;
+    COORD coord;
+    CHAR_INFO *cells;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, errstring);
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (replayObj != NULL) {
+        Tcl_DecrRefCount(replayObj);
+        replayObj = NULL;
+    }
+
+    if (index == REPLAY_STOP) return TCL_OK;
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, errstring);
+        return TCL_ERROR;
+    }
+
+    fast = 0;
+    if (objc > 3) {
+        if (strcmp(Tcl_GetString(objv[3]), "-fast") == 0) {
+            fast = 1;
+        }
+        else {
+            Tcl_WrongNumArgs(interp, 1, objv, errstring);
+            return TCL_ERROR;
+        }
+    }
+
+    data = replay_load(interp, objv[2]);
+    if (data == NULL) return TCL_ERROR;
+
+    if (index == REPLAY_INPUT) {
+        replayObj = data;
+        replayPos = REC_MAGIC_LEN;
+        replayFast = fast;
+        replayStart = GetTickCount();
+        return TCL_OK;
+    }
+
+    bytes = Tcl_GetByteArrayFromObj(data, &len);
+    start = GetTickCount();
+    pos = REC_MAGIC_LEN;
+
+    while (pos + REC_HEADER_LEN <= len) {
+        t = get_u32(bytes + pos);
+        n = get_u32(bytes + pos + 5);
+        if (n > (DWORD) (len - pos - REC_HEADER_LEN)) break;
+        payload = bytes + pos + REC_HEADER_LEN;
+
+        if (!fast) {
+            now = GetTickCount() - start;
+            if (t > now) Sleep(t - now);
+        }
+
+        switch (bytes[pos + 4]) {
+            case REC_OUT_TEXT:
+                WriteConsole(hStdout, payload, n, &num, NULL);
+                break;
+            case REC_OUT_GOTO:
+                if (n < 4) break;
+                coord.X = (SHORT) (payload[0] | (payload[1] << 8));
+                coord.Y = (SHORT) (payload[2] | (payload[3] << 8));
+                SetConsoleCursorPosition(hStdout, coord);
+                break;
+            case REC_OUT_ATTR:
+                if (n < 4) break;
+                SetConsoleTextAttribute(hStdout, (WORD) get_u32(payload));
+                break;
+            case REC_OUT_CLEAR:
+                console_clear(hStdout);
+                break;
+            case REC_OUT_CELLS:
+                if (n < 8) break;
+                for (i = 0; i < 4; i++) {
+                    values[i] = payload[i * 2] | (payload[i * 2 + 1] << 8);
+                }
+                if (n - 8 < (DWORD) (values[2] * values[3]) * sizeof(CHAR_INFO)) {
+                    break;
+                }
+                cells = (CHAR_INFO *) ckalloc(n - 8);
+                memcpy(cells, payload + 8, n - 8);
+                console_write_cells(hStdout, cells, values[0], values[1],
+                                    values[2], values[3]);
+                ckfree((char *) cells);
+                break;
+            case REC_OUT_SCROLL:
+                if (n < 12) break;
+                for (i = 0; i < 6; i++) {
+                    values[i] = payload[i * 2] | (payload[i * 2 + 1] << 8);
+                }
+                console_scroll(hStdout, values[0], values[1], values[2],
+                               values[3], (SHORT) values[4], (WORD) values[5]);
+                break;
+        }
+
+        pos += REC_HEADER_LEN + n;
+    }
+
+    export_touch();
+    Tcl_DecrRefCount(data);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(GetTickCount() - start));
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::readline
+ *
+ * Description:
+ *
+ *   Reads a line from the console using a native line editor. Unlike
+ *   cgetse, which relies on the cooked mode of the console, this command
+ *   has no length limit and supports history, cursor movement, kill and
+ *   yank and an optional completion command. On every keystroke only the
+ *   changed end of the line is redrawn.
+ *
+ *   The following keys are supported:
+ *
+ *     Left, Ctrl-B         - move one character left
+ *     Right, Ctrl-F        - move one character right
+ *     Ctrl-Left, Ctrl-Right - move one word left or right
+ *     Home, Ctrl-A         - move to the beginning of the line
+ *     End, Ctrl-E          - move to the end of the line
+ *     Up, Ctrl-P           - previous history entry
+ *     Down, Ctrl-N         - next history entry
+ *     Backspace, Ctrl-H    - delete the character before the cursor
+ *     Delete, Ctrl-D       - delete the character under the cursor
+ *     Ctrl-K               - kill to the end of the line
+ *     Ctrl-U               - kill to the beginning of the line
+ *     Ctrl-W               - kill the word before the cursor
+ *     Ctrl-Y               - yank the last killed text
+ *     Tab                  - complete the word before the cursor
+ *     Escape               - clear the line
+ *     Ctrl-C               - abort with an error
+ *     Enter                - accept the line
+ *
+ *   A character here is a grapheme cluster as measured by Consio::width,
+ *   so surrogate pairs, combining marks and emoji sequences are moved
+ *   over and deleted as a whole. Keys are read from the current terminal
+ *   when there is one.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - ReadConsoleInputW
+ *   - WriteConsoleW
+ *   - GetConsoleScreenBufferInfo
+ *   - SetConsoleCursorPosition
+ *
+ * Parameters:
+ *
+ *   -prompt text      - (optional) prompt to be shown before the line
+ *   -complete command - (optional) completion command, called with the
+ *                       word before the cursor as an extra argument
+ *   -nohistory        - (optional) don't add the line to the history
+ *
+ * Results:
+ *
+ *   Returns the line. Newline character will not be included.
+ *
+ * Side effects:
+ *
+ *   The command will block until the Enter key has been pressed. The line
+ *   is added to the history (see Consio::history).
+ *****************************************************************************/
+
+static int cmd_readline(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"-complete", "-nohistory", "-prompt",
+                             (char *) NULL};
+    enum {OPT_COMPLETE, OPT_NOHISTORY, OPT_PROMPT};
+    enum {ED_NONE, ED_INSERT, ED_ACCEPT, ED_LEFT, ED_RIGHT, ED_WORDLEFT,
+          ED_WORDRIGHT, ED_HOME, ED_END, ED_PREV, ED_NEXT, ED_DELETE,
+          ED_BACKSPACE, ED_KILLEND, ED_KILLSTART, ED_KILLWORD, ED_YANK,
+          ED_CLEAR, ED_COMPLETE, ED_INTERRUPT};
+    static const Tcl_UniChar crlf[2] = {'\r', '\n'};
+    char *errstring = "?-prompt text? ?-complete command? ?-nohistory?";
+    LineEditor ed;
+    Tcl_DString prompt;
+    Tcl_Obj *complete = NULL;
+    Tcl_Obj *draft = NULL;
+    Tcl_Obj *obj_str;
+    Tcl_Obj *entry;
+    Tcl_Obj *event;
+    Tcl_UniChar ch;
+    Tcl_UniChar *yank;
+    INPUT_RECORD rec;
+    DWORD oldMode, num, state;
+    char *prompt_str = "";
+    char *str;
+    int nohistory = 0;
+    int index, i, action, repeat, count, hpos, len, rc, prev, next;
+    int code = TCL_OK;
+    int done = 0;
+
+    for (i = 1; i < objc; i++) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0,
+                                &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (index == OPT_NOHISTORY) {
+            nohistory = 1;
+            continue;
+        }
+        if (i + 1 >= objc) {
+            Tcl_WrongNumArgs(interp, 1, objv, errstring);
+            return TCL_ERROR;
+        }
+        i++;
+        if (index == OPT_PROMPT) {
+            prompt_str = Tcl_GetString(objv[i]);
+        }
+        else {
+            complete = objv[i];
+        }
+    }
+
+    Tcl_DStringInit(&prompt);
+    Tcl_UtfToUniCharDString(prompt_str, -1, &prompt);
+
+    /* A replay gives whole lines; keys from a terminal are edited here
+       like keys from the console */
+
+    switch (replay_input(interp, REC_IN_LINE, &obj_str)) {
+        case 1:
+            WriteConsole(hStdout, prompt_str, strlen(prompt_str), &num, NULL);
+            str = Tcl_GetStringFromObj(obj_str, &len);
+            WriteConsole(hStdout, str, len, &num, NULL);
+            WriteConsole(hStdout, "\r\n", 2, &num, NULL);
+            if (!nohistory) history_add(obj_str);
+            Tcl_DStringFree(&prompt);
+            Tcl_SetObjResult(interp, obj_str);
+            return TCL_OK;
+        case -1:
+            Tcl_DStringFree(&prompt);
+            return TCL_ERROR;
+    }
+
+    memset(&ed, 0, sizeof(ed));
+    ed.prompt = (Tcl_UniChar *) Tcl_DStringValue(&prompt);
+    ed.promptLen = Tcl_DStringLength(&prompt) / sizeof(Tcl_UniChar);
+    console_write_unicode(hStdout, ed.prompt, ed.promptLen);
+    editor_start(&ed);
+
+    hpos = -1;
+
+    GetConsoleMode(hStdin, &oldMode);
+    SetConsoleMode(hStdin, input_mode());
+
+    while (!done) {
+        rc = input_source(interp, REC_IN_EVENT, -1, &event);
+        if (rc < 0) {
+            code = TCL_ERROR;
+            break;
+        }
+        if ((rc > 0 ? input_event_rec(event, &rec) : input_next(&rec, -1)) ==
+            INPUT_PASTE) {
+            while (pasteLen > 0 && pasteText[pasteLen - 1] == '\n') pasteLen--;
+            for (i = 0; i < pasteLen; i++) {
+                if (pasteText[i] < 32) pasteText[i] = ' ';
+            }
+            editor_insert(&ed, pasteText, pasteLen);
+            editor_refresh(&ed);
+            continue;
+        }
+
+        ch = rec.Event.KeyEvent.uChar.UnicodeChar;
+        state = rec.Event.KeyEvent.dwControlKeyState;
+        repeat = rec.Event.KeyEvent.wRepeatCount;
+        if (repeat < 1) repeat = 1;
+
+        switch (rec.Event.KeyEvent.wVirtualKeyCode) {
+            case VK_LEFT:
+                action = (state & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) ?
+                         ED_WORDLEFT : ED_LEFT;
+                break;
+            case VK_RIGHT:
+                action = (state & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) ?
+                         ED_WORDRIGHT : ED_RIGHT;
+                break;
+            case VK_HOME:   action = ED_HOME;   break;
+            case VK_END:    action = ED_END;    break;
+            case VK_UP:     action = ED_PREV;   break;
+            case VK_DOWN:   action = ED_NEXT;   break;
+            case VK_DELETE: action = ED_DELETE; break;
+            default:
+                switch (ch) {
+                    case 1:  action = ED_HOME;      break;
+                    case 2:  action = ED_LEFT;      break;
+                    case 3:  action = ED_INTERRUPT; break;
+                    case 4:  action = ED_DELETE;    break;
+                    case 5:  action = ED_END;       break;
+                    case 6:  action = ED_RIGHT;     break;
+                    case 8:  action = ED_BACKSPACE; break;
+                    case 9:  action = ED_COMPLETE;  break;
+                    case 11: action = ED_KILLEND;   break;
+                    case 13: action = ED_ACCEPT;    break;
+                    case 14: action = ED_NEXT;      break;
+                    case 16: action = ED_PREV;      break;
+                    case 21: action = ED_KILLSTART; break;
+                    case 23: action = ED_KILLWORD;  break;
+                    case 25: action = ED_YANK;      break;
+                    case 27: action = ED_CLEAR;     break;
+                    default:
+                        action = ch >= 32 ? ED_INSERT : ED_NONE;
+                }
+        }
+
+        for (i = 0; i < repeat && !done; i++) {
+            switch (action) {
+                case ED_INSERT:
+                    editor_insert(&ed, &ch, 1);
+                    break;
+                case ED_ACCEPT:
+                    done = 1;
+                    break;
+                case ED_LEFT:
+                    editor_cluster(&ed, ed.pos, &prev, &next);
+                    ed.pos = prev;
+                    break;
+                case ED_RIGHT:
+                    editor_cluster(&ed, ed.pos, &prev, &next);
+                    ed.pos = next;
+                    break;
+                case ED_WORDLEFT:
+                    while (ed.pos > 0 && ed.line[ed.pos - 1] == ' ') ed.pos--;
+                    while (ed.pos > 0 && ed.line[ed.pos - 1] != ' ') ed.pos--;
+                    break;
+                case ED_WORDRIGHT:
+                    while (ed.pos < ed.len && ed.line[ed.pos] == ' ') ed.pos++;
+                    while (ed.pos < ed.len && ed.line[ed.pos] != ' ') ed.pos++;
+                    break;
+                case ED_HOME:
+                    ed.pos = 0;
+                    break;
+                case ED_END:
+                    ed.pos = ed.len;
+                    break;
+                case ED_PREV:
+                case ED_NEXT:
+                    count = 0;
+                    if (historyObj != NULL) {
+                        Tcl_ListObjLength(NULL, historyObj, &count);
+                    }
+                    if (hpos < 0 || hpos > count) hpos = count;
+                    if (action == ED_PREV && hpos > 0) {
+                        if (hpos == count) {
+                            if (draft != NULL) Tcl_DecrRefCount(draft);
+                            draft = Tcl_NewUnicodeObj(ed.line, ed.len);
+                            Tcl_IncrRefCount(draft);
+                        }
+                        hpos--;
+                        Tcl_ListObjIndex(NULL, historyObj, hpos, &entry);
+                        editor_set(&ed, entry);
+                    }
+                    else if (action == ED_NEXT && hpos < count) {
+                        hpos++;
+                        if (hpos < count) {
+                            Tcl_ListObjIndex(NULL, historyObj, hpos, &entry);
+                            editor_set(&ed, entry);
+                        }
+                        else if (draft != NULL) {
+                            editor_set(&ed, draft);
+                        }
+                    }
+                    break;
+                case ED_DELETE:
+                    editor_cluster(&ed, ed.pos, &prev, &next);
+                    editor_delete(&ed, ed.pos, next, 0);
+                    break;
+                case ED_BACKSPACE:
+                    editor_cluster(&ed, ed.pos, &prev, &next);
+                    editor_delete(&ed, prev, ed.pos, 0);
+                    break;
+                case ED_KILLEND:
+                    editor_delete(&ed, ed.pos, ed.len, 1);
+                    break;
+                case ED_KILLSTART:
+                    editor_delete(&ed, 0, ed.pos, 1);
+                    break;
+                case ED_KILLWORD:
+                    index = ed.pos;
+                    while (index > 0 && ed.line[index - 1] == ' ') index--;
+                    while (index > 0 && ed.line[index - 1] != ' ') index--;
+                    editor_delete(&ed, index, ed.pos, 1);
+                    break;
+                case ED_YANK:
+                    if (killObj != NULL) {
+                        yank = Tcl_GetUnicodeFromObj(killObj, &len);
+                        editor_insert(&ed, yank, len);
+                    }
+                    break;
+                case ED_CLEAR:
+                    editor_delete(&ed, 0, ed.len, 0);
+                    break;
+                case ED_COMPLETE:
+                    if (complete != NULL) {
+                        code = editor_complete(interp, &ed, complete);
+                        if (code != TCL_OK) done = 1;
+                    }
+                    break;
+                case ED_INTERRUPT:
+                    Tcl_SetObjResult(interp,
+                                     Tcl_NewStringObj("interrupted", -1));
+                    code = TCL_ERROR;
+                    done = 1;
+                    break;
+            }
+        }
+
+        editor_refresh(&ed);
+    }
+
+    SetConsoleMode(hStdin, oldMode);
+    editor_goto(&ed, ed.len);
+    console_write_unicode(hStdout, crlf, 2);
+
+    if (code == TCL_OK) {
+        obj_str = Tcl_NewUnicodeObj(ed.line, ed.len);
+        str = Tcl_GetStringFromObj(obj_str, &len);
+        record_event(REC_IN_LINE, str, len);
+        record_event(REC_OUT_TEXT, prompt_str, strlen(prompt_str));
+        record_event(REC_OUT_TEXT, str, len);
+        record_event(REC_OUT_TEXT, "\r\n", 2);
+        if (!nohistory) history_add(obj_str);
+        Tcl_SetObjResult(interp, obj_str);
+    }
+
+    if (draft != NULL) Tcl_DecrRefCount(draft);
+    if (ed.line != NULL) ckfree((char *) ed.line);
+    if (ed.shown != NULL) ckfree((char *) ed.shown);
+    Tcl_DStringFree(&prompt);
+
+    return code;
+}
+
+/*****************************************************************************
+ * Consio::history
+ *
+ * Description:
+ *
+ *   Manages the line history used by Consio::readline. Without arguments
+ *   the command returns the history as a list, the oldest entry first.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   None.
+ *
+ * Parameters:
+ *
+ *   add line   - appends a line to the history
+ *   clear      - removes all entries
+ *   limit ?n?  - returns or sets the maximum number of entries
+ *
+ * Results:
+ *
+ *   Returns the history list or the history limit.
+ *
+ * Side effects:
+ *
+ *   See parameters.
+ *****************************************************************************/
+
+static int cmd_history(ClientData clientData,
+                       Tcl_Interp *interp,
+                       int objc,
+                       Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"add", "clear", "limit", (char *) NULL};
+    enum {HISTORY_ADD, HISTORY_CLEAR, HISTORY_LIMIT};
+    Tcl_Obj *copy;
+    int index, limit, count;
+
+    if (objc < 2) {
+        if (historyObj != NULL) Tcl_SetObjResult(interp, historyObj);
+        return TCL_OK;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch (index) {
+        case HISTORY_ADD:
+            if (objc < 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "line");
+                return TCL_ERROR;
+            }
+            history_add(objv[2]);
+            break;
+        case HISTORY_CLEAR:
+            if (historyObj != NULL) {
+                Tcl_DecrRefCount(historyObj);
+                historyObj = NULL;
+            }
+            break;
+        case HISTORY_LIMIT:
+            if (objc > 2) {
+                if (Tcl_GetIntFromObj(interp, objv[2], &limit) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (limit < 1) limit = 1;
+                historyLimit = limit;
+                if (historyObj != NULL) {
+                    if (Tcl_IsShared(historyObj)) {
+                        copy = Tcl_DuplicateObj(historyObj);
+                        Tcl_IncrRefCount(copy);
+                        Tcl_DecrRefCount(historyObj);
+                        historyObj = copy;
+                    }
+                    Tcl_ListObjLength(NULL, historyObj, &count);
+                    if (count > limit) {
+                        Tcl_ListObjReplace(NULL, historyObj, 0,
+                                           count - limit, 0, NULL);
+                    }
+                }
+            }
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(historyLimit));
+            break;
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::pager
+ *
+ * Description:
+ *
+ *   Opens a file for browsing in a viewport on the console. The file is
+ *   memory-mapped a window at a time and a sparse line index is built only
+ *   as far as the file is browsed, so the memory use stays roughly
+ *   constant and opening is instant regardless of the file size. Only the
+ *   visible rows are ever read and drawn.
+ *
+ *   The command returns the name of a new command, which is used to control
+ *   the viewport:
+ *
+ *     pager render            - draws the whole viewport
+ *     pager scroll n          - scrolls n lines down (negative n scrolls up)
+ *     pager goto line         - shows the given line (1 is the first line)
+ *                               at the top of the viewport
+ *     pager search ?-backward? string
+ *                             - finds the next (or the previous) line
+ *                               containing the string and shows it at the
+ *                               top of the viewport; returns the line
+ *                               number or 0 if there was no match
+ *     pager top               - returns the line number of the first
+ *                               visible line
+ *     pager lines             - returns the number of lines in the file;
+ *                               this reads through the whole file once
+ *     pager close             - closes the file and deletes the command
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - CreateFileW
+ *   - GetFileSizeEx
+ *   - CreateFileMapping
+ *   - GetConsoleScreenBufferInfo
+ *
+ * Parameters:
+ *
+ *   filename - file to be browsed
+ *   x y      - (optional) upper left corner of the viewport
+ *   width    - (optional) width of the viewport
+ *   height   - (optional) height of the viewport
+ *
+ *   By default the viewport covers the visible console window.
+ *
+ * Results:
+ *
+ *   Returns the name of the pager command.
+ *
+ * Side effects:
+ *
+ *   Opens the file. Nothing is drawn until the render subcommand is
+ *   called.
+ *****************************************************************************/
+
+static int cmd_pager(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    LARGE_INTEGER size;
+    Tcl_DString path, native;
+    Pager *p;
+    HANDLE file, mapping;
+    char name[32];
+    int rect[4];
+    int i;
+
+    if (objc != 2 && objc != 6) {
+        Tcl_WrongNumArgs(interp, 1, objv, "filename ?x y width height?");
+        return TCL_ERROR;
+    }
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    rect[0] = info.srWindow.Left;
+    rect[1] = info.srWindow.Top;
+    rect[2] = info.srWindow.Right - info.srWindow.Left + 1;
+    rect[3] = info.srWindow.Bottom - info.srWindow.Top + 1;
+
+    for (i = 2; i < objc; i++) {
+        if (Tcl_GetIntFromObj(interp, objv[i], &rect[i - 2]) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+
+    if (Tcl_TranslateFileName(interp, Tcl_GetString(objv[1]), &path) == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_DStringInit(&native);
+    Tcl_UtfToUniCharDString(Tcl_DStringValue(&path),
+                            Tcl_DStringLength(&path), &native);
+    file = CreateFileW((LPCWSTR) Tcl_DStringValue(&native), GENERIC_READ,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    Tcl_DStringFree(&native);
+    Tcl_DStringFree(&path);
+
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\"",
+                                               Tcl_GetString(objv[1])));
+        return TCL_ERROR;
+    }
+
+    mapping = NULL;
+    if (size.QuadPart > 0) {
+        mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            CloseHandle(file);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't map \"%s\"",
+                                                   Tcl_GetString(objv[1])));
+            return TCL_ERROR;
+        }
+    }
+
+    p = (Pager *) ckalloc(sizeof(Pager));
+    memset(p, 0, sizeof(Pager));
+    p->file = file;
+    p->mapping = mapping;
+    p->size = size.QuadPart;
+    p->maxCheckpoints = 64;
+    p->checkpoints = (Tcl_WideInt *) ckalloc(64 * sizeof(Tcl_WideInt));
+    p->checkpoints[0] = 0;
+    p->numCheckpoints = 1;
+    p->lineCount = p->size == 0 ? 0 : -1;
+    p->x = rect[0];
+    p->y = rect[1];
+    p->width = rect[2] > 0 ? rect[2] : 0;
+    p->height = rect[3] > 0 ? rect[3] : 0;
+
+    sprintf(name, "Consio::pager%d", ++pagerCounter);
+    p->token = Tcl_CreateObjCommand(interp, name, pager_cmd, p, pager_free);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * pager command
+ *
+ * Description:
+ *
+ *   Implements the subcommands of a pager created by Consio::pager.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - WriteConsoleOutputW
+ *   - ScrollConsoleScreenBufferW
+ *   - MapViewOfFile
+ *   - UnmapViewOfFile
+ *
+ * Parameters:
+ *
+ *   See Consio::pager.
+ *
+ * Results:
+ *
+ *   See Consio::pager.
+ *
+ * Side effects:
+ *
+ *   See Consio::pager.
+ *****************************************************************************/
+
+static int pager_cmd(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"close", "goto", "lines", "render", "scroll",
+                             "search", "top", (char *) NULL};
+    enum {PAGER_CLOSE, PAGER_GOTO, PAGER_LINES, PAGER_RENDER, PAGER_SCROLL,
+          PAGER_SEARCH, PAGER_TOP};
+    Pager *p = (Pager *) clientData;
+    Tcl_WideInt value, offset, match;
+    char *pattern;
+    int index, len, backward;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch (index) {
+        case PAGER_CLOSE:
+            Tcl_DeleteCommandFromToken(interp, p->token);
+            break;
+
+        case PAGER_GOTO:
+        case PAGER_SCROLL:
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv,
+                                 index == PAGER_GOTO ? "line" : "lines");
+                return TCL_ERROR;
+            }
+            if (Tcl_GetWideIntFromObj(interp, objv[2], &value) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (index == PAGER_GOTO) value = value - 1 - p->top;
+            pager_scroll(p, value);
+            break;
+
+        case PAGER_LINES:
+            while (p->lineCount < 0) pager_index_next(p);
+            Tcl_SetObjResult(interp, Tcl_NewWideIntObj(p->lineCount));
+            break;
+
+        case PAGER_RENDER:
+            pager_render_rows(p, 0, p->height);
+            break;
+
+        case PAGER_SEARCH:
+            backward = objc == 4 &&
+                       strcmp(Tcl_GetString(objv[2]), "-backward") == 0;
+            if (objc != 3 && !backward) {
+                Tcl_WrongNumArgs(interp, 2, objv, "?-backward? string");
+                return TCL_ERROR;
+            }
+            pattern = Tcl_GetStringFromObj(objv[objc - 1], &len);
+            match = -1;
+            if (backward) {
+                if (pager_line_offset(p, p->top, &offset)) {
+                    match = pager_search(p, pattern, len, 0, offset, 1);
+                }
+            }
+            else if (pager_line_offset(p, p->top + 1, &offset)) {
+                match = pager_search(p, pattern, len, offset, p->size, 0);
+            }
+            if (match < 0) {
+                Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+                break;
+            }
+            value = pager_line_of_offset(p, match);
+            pager_scroll(p, value - p->top);
+            Tcl_SetObjResult(interp, Tcl_NewWideIntObj(value + 1));
+            break;
+
+        case PAGER_TOP:
+            Tcl_SetObjResult(interp, Tcl_NewWideIntObj(p->top + 1));
+            break;
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::width
+ *
+ * Description:
+ *
+ *   Returns the number of console columns needed to display a string. Wide
+ *   East Asian characters and emoji take two columns, combining marks and
+ *   other zero-width characters none, and grapheme clusters such as emoji
+ *   sequences and flags are measured as a whole. The console is not
+ *   touched, so this is much cheaper than printing and asking the cursor
+ *   position with wherex.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   None.
+ *
+ * Parameters:
+ *
+ *   string - string to be measured
+ *
+ * Results:
+ *
+ *   Returns the width in columns as an integer.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_width(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    char *str;
+    int len;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "string");
+        return TCL_ERROR;
+    }
+
+    str = Tcl_GetStringFromObj(objv[1], &len);
+    Tcl_SetObjResult(interp,
+                     Tcl_NewIntObj(text_width((unsigned char *) str, len)));
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::truncate
+ *
+ * Description:
+ *
+ *   Shortens a string to fit the given number of console columns. The
+ *   string is cut between grapheme clusters, so combining marks and emoji
+ *   sequences are never split. If the string has to be shortened and an
+ *   ellipsis is given, the ellipsis is appended and the string is cut so
+ *   that the result still fits.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   None.
+ *
+ * Parameters:
+ *
+ *   string   - string to be truncated
+ *   width    - maximum width in columns
+ *   ellipsis - (optional) string appended when the string is truncated
+ *
+ * Results:
+ *
+ *   Returns the truncated string.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_truncate(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    const unsigned char *p, *end, *next;
+    Tcl_Obj *result;
+    char *str;
+    char *ellipsis = "";
+    int len, ellipsisLen = 0;
+    int width, target, col, w;
+
+    if (objc != 3 && objc != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, "string width ?ellipsis?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[2], &width) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    str = Tcl_GetStringFromObj(objv[1], &len);
+    if (text_width((unsigned char *) str, len) <= width) {
+        Tcl_SetObjResult(interp, objv[1]);
+        return TCL_OK;
+    }
+
+    if (objc == 4) {
+        ellipsis = Tcl_GetStringFromObj(objv[3], &ellipsisLen);
+    }
+    target = width - text_width((unsigned char *) ellipsis, ellipsisLen);
+    if (target < 0) {
+        target = width;
+        ellipsisLen = 0;
+    }
+
+    p = (unsigned char *) str;
+    end = p + len;
+    col = 0;
+    while (p < end) {
+        next = grapheme_next(p, end, &w);
+        if (col + w > target) break;
+        col += w;
+        p = next;
+    }
+
+    result = Tcl_NewStringObj(str, (int) (p - (unsigned char *) str));
+    Tcl_AppendToObj(result, ellipsis, ellipsisLen);
+    Tcl_SetObjResult(interp, result);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::wrap
+ *
+ * Description:
+ *
+ *   Word-wraps a string to lines of at most the given number of console
+ *   columns. Lines are broken at spaces; the spaces at a break are dropped.
+ *   Words longer than a line are broken between grapheme clusters. Newline
+ *   characters in the string always start a new line.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   None.
+ *
+ * Parameters:
+ *
+ *   string - string to be wrapped
+ *   width  - maximum line width in columns
+ *
+ * Results:
+ *
+ *   Returns a list of lines.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_wrap(ClientData clientData,
+                    Tcl_Interp *interp,
+                    int objc,
+                    Tcl_Obj * CONST objv[]) {
+    const unsigned char *p, *end, *next, *line, *brk, *brkEnd, *stop;
+    Tcl_Obj *result;
+    char *str;
+    int len, width, col, brkCol, w;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "string width");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[2], &width) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (width < 1) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewStringObj("width must be at least 1", -1));
+        return TCL_ERROR;
+    }
+
+    str = Tcl_GetStringFromObj(objv[1], &len);
+    p = (unsigned char *) str;
+    end = p + len;
+    result = Tcl_NewObj();
+
+    do {
+        stop = (unsigned char *) memchr(p, '\n', end - p);
+        if (stop == NULL) stop = end;
+
+        line = p;
+        brk = NULL;
+        brkEnd = NULL;
+        brkCol = 0;
+        col = 0;
+
+        while (p < stop) {
+            next = grapheme_next(p, stop, &w);
+
+            if (*p == ' ') {
+                if (brkEnd != p) brk = p;
+                brkEnd = next;
+                col += w;
+                brkCol = col;
+                p = next;
+                continue;
+            }
+
+            if (col + w > width && col > 0) {
+                if (brk != NULL && brk > line) {
+                    Tcl_ListObjAppendElement(NULL, result,
+                        Tcl_NewStringObj((char *) line, (int) (brk - line)));
+                    line = brkEnd;
+                    col -= brkCol;
+                    brk = NULL;
+                    brkEnd = NULL;
+                }
+                if (col + w > width && col > 0) {
+                    Tcl_ListObjAppendElement(NULL, result,
+                        Tcl_NewStringObj((char *) line, (int) (p - line)));
+                    line = p;
+                    col = 0;
+                    brk = NULL;
+                    brkEnd = NULL;
+                }
+            }
+
+            col += w;
+            p = next;
+        }
+
+        len = (int) (stop - line);
+        if (len > 0 && line[len - 1] == '\r') len--;
+        Tcl_ListObjAppendElement(NULL, result,
+                                 Tcl_NewStringObj((char *) line, len));
+        p = stop + 1;
+    } while (stop < end);
+
+    Tcl_SetObjResult(interp, result);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::table
+ *
+ * Description:
+ *
+ *   Creates a table widget drawn to the given rectangle of the console.
+ *   The first row of the rectangle is the header and the rest shows the
+ *   rows of the table. Column widths are computed natively once and
+ *   cached, only the visible rows are ever drawn, and scrolling moves the
+ *   existing rows with the console so only the exposed rows are drawn.
+ *
+ *   The command returns the name of a new command, which is used to control
+ *   the table:
+ *
+ *     table columns ?definitions?
+ *                             - sets or returns the columns; each definition
+ *                               is a list {title ?width? ?left|right?},
+ *                               where width 0 means automatic
+ *     table rows list         - sets the rows as a list of lists
+ *     table fetch command count
+ *                             - gets count rows on demand from a command,
+ *                               which is called with the index of the
+ *                               first row and the number of rows wanted and
+ *                               returns a list of rows
+ *     table render            - draws the whole table
+ *     table scroll n          - scrolls n rows down (negative n scrolls up)
+ *     table select ?row?      - sets or returns the selected row; -1 means
+ *                               no selection
+ *     table sortcolumn ?col?  - sets or returns the highlighted sort column;
+ *                               -1 means no highlighting
+ *     table top               - returns the index of the first visible row
+ *     table attr element foreground background
+ *                             - sets the colors of body, header, selection
+ *                               or sort
+ *     table destroy           - deletes the table command
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *
+ * Parameters:
+ *
+ *   x y    - upper left corner of the table
+ *   width  - width of the table
+ *   height - height of the table including the header
+ *
+ * Results:
+ *
+ *   Returns the name of the table command.
+ *
+ * Side effects:
+ *
+ *   Nothing is drawn until the render subcommand is called.
+ *****************************************************************************/
+
+static int cmd_table(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Table *t;
+    char name[32];
+    int rect[4];
+    int i;
+
+    if (objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "x y width height");
+        return TCL_ERROR;
+    }
+
+    for (i = 1; i < 5; i++) {
+        if (Tcl_GetIntFromObj(interp, objv[i], &rect[i - 1]) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+
+    t = (Table *) ckalloc(sizeof(Table));
+    memset(t, 0, sizeof(Table));
+    t->x = rect[0];
+    t->y = rect[1];
+    t->width = rect[2] > 0 ? rect[2] : 0;
+    t->height = rect[3] > 0 ? rect[3] : 0;
+    t->selected = -1;
+    t->sortColumn = -1;
+    t->attrBody = info.wAttributes & 0xFF;
+    t->attrHeader = (t->attrBody & 0xF0) | FG_YELLOW;
+    t->attrSelected = ((t->attrBody & 0x0F) << 4) | ((t->attrBody & 0xF0) >> 4);
+    t->attrSort = (t->attrBody & 0xF0) | FG_LIGHTCYAN;
+    t->interp = interp;
+
+    sprintf(name, "Consio::table%d", ++tableCounter);
+    t->token = Tcl_CreateObjCommand(interp, name, table_cmd, t, table_free);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * table command
+ *
+ * Description:
+ *
+ *   Implements the subcommands of a table created by Consio::table.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - WriteConsoleOutputW
+ *   - ScrollConsoleScreenBufferW
+ *
+ * Parameters:
+ *
+ *   See Consio::table.
+ *
+ * Results:
+ *
+ *   See Consio::table.
+ *
+ * Side effects:
+ *
+ *   See Consio::table.
+ *****************************************************************************/
+
+static int table_cmd(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"attr", "columns", "destroy", "fetch", "render",
+                             "rows", "scroll", "select", "sortcolumn", "top",
+                             (char *) NULL};
+    enum {TABLE_ATTR, TABLE_COLUMNS, TABLE_DESTROY, TABLE_FETCH, TABLE_RENDER,
+          TABLE_ROWS, TABLE_SCROLL, TABLE_SELECT, TABLE_SORTCOLUMN,
+          TABLE_TOP};
+    CONST char *elements[] = {"body", "header", "selection", "sort",
+                              (char *) NULL};
+    CONST char *aligns[] = {"left", "right", (char *) NULL};
+    Table *t = (Table *) clientData;
+    Tcl_Obj **defs, **parts;
+    Tcl_Obj *result, *def;
+    WORD attr;
+    int index, count, num, i, value, old, body;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    t->interp = interp;
+    body = t->height - 1;
+
+    switch (index) {
+        case TABLE_ATTR:
+            if (objc != 5) {
+                Tcl_WrongNumArgs(interp, 2, objv,
+                                 "element foreground background");
+                return TCL_ERROR;
+            }
+            if (Tcl_GetIndexFromObj(interp, objv[2], elements, "element", 0,
+                                    &value) != TCL_OK ||
+                get_color_attr(interp, objv[3], objv[4], &attr) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            switch (value) {
+                case 0: t->attrBody = attr;     break;
+                case 1: t->attrHeader = attr;   break;
+                case 2: t->attrSelected = attr; break;
+                case 3: t->attrSort = attr;     break;
+            }
+            break;
+
+        case TABLE_COLUMNS:
+            if (objc == 2) {
+                result = Tcl_NewObj();
+                for (i = 0; i < t->numColumns; i++) {
+                    def = Tcl_NewObj();
+                    Tcl_ListObjAppendElement(NULL, def, t->titles[i]);
+                    Tcl_ListObjAppendElement(NULL, def,
+                                             Tcl_NewIntObj(t->fixed[i]));
+                    Tcl_ListObjAppendElement(NULL, def,
+                        Tcl_NewStringObj(aligns[t->right[i]], -1));
+                    Tcl_ListObjAppendElement(NULL, result, def);
+                }
+                Tcl_SetObjResult(interp, result);
+                break;
+            }
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "?definitions?");
+                return TCL_ERROR;
+            }
+            if (Tcl_ListObjGetElements(interp, objv[2], &count,
+                                       &defs) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            for (i = 0; i < count; i++) {
+                if (Tcl_ListObjGetElements(interp, defs[i], &num,
+                                           &parts) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (num < 1 || num > 3) {
+                    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                        "bad column definition \"%s\"",
+                        Tcl_GetString(defs[i])));
+                    return TCL_ERROR;
+                }
+                if ((num > 1 &&
+                     Tcl_GetIntFromObj(interp, parts[1], &value) != TCL_OK) ||
+                    (num > 2 &&
+                     Tcl_GetIndexFromObj(interp, parts[2], aligns,
+                                         "alignment", 0, &value) != TCL_OK)) {
+                    return TCL_ERROR;
+                }
+            }
+            table_clear_columns(t);
+            t->changes++;
+            t->titles = (Tcl_Obj **) ckalloc((count + 1) * sizeof(Tcl_Obj *));
+            t->fixed = (int *) ckalloc((count + 1) * sizeof(int));
+            t->right = (int *) ckalloc((count + 1) * sizeof(int));
+            t->widths = (int *) ckalloc((count + 1) * sizeof(int));
+            for (i = 0; i < count; i++) {
+                Tcl_ListObjGetElements(NULL, defs[i], &num, &parts);
+                t->titles[i] = parts[0];
+                Tcl_IncrRefCount(parts[0]);
+                t->fixed[i] = 0;
+                t->right[i] = 0;
+                if (num > 1) Tcl_GetIntFromObj(NULL, parts[1], &t->fixed[i]);
+                if (num > 2) {
+                    Tcl_GetIndexFromObj(NULL, parts[2], aligns, "alignment",
+                                        0, &t->right[i]);
+                }
+            }
+            t->numColumns = count;
+            break;
+
+        case TABLE_DESTROY:
+            Tcl_DeleteCommandFromToken(interp, t->token);
+            break;
+
+        case TABLE_FETCH:
+            if (objc != 4) {
+                Tcl_WrongNumArgs(interp, 2, objv, "command count");
+                return TCL_ERROR;
+            }
+            if (Tcl_GetIntFromObj(interp, objv[3], &count) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (t->rows != NULL) Tcl_DecrRefCount(t->rows);
+            if (t->fetch != NULL) Tcl_DecrRefCount(t->fetch);
+            if (t->cache != NULL) Tcl_DecrRefCount(t->cache);
+            t->rows = NULL;
+            t->cache = NULL;
+            t->fetch = objv[2];
+            Tcl_IncrRefCount(t->fetch);
+            t->rowCount = count > 0 ? count : 0;
+            t->widthsValid = 0;
+            t->changes++;
+            if (t->top > t->rowCount) t->top = 0;
+            if (t->selected >= t->rowCount) t->selected = -1;
+            break;
+
+        case TABLE_RENDER:
+            if (table_render_header(t) != TCL_OK ||
+                table_render_rows(t, 0, body) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            break;
+
+        case TABLE_ROWS:
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "list");
+                return TCL_ERROR;
+            }
+            if (Tcl_ListObjLength(interp, objv[2], &count) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (t->rows != NULL) Tcl_DecrRefCount(t->rows);
+            if (t->fetch != NULL) Tcl_DecrRefCount(t->fetch);
+            if (t->cache != NULL) Tcl_DecrRefCount(t->cache);
+            t->fetch = NULL;
+            t->cache = NULL;
+            t->rows = objv[2];
+            Tcl_IncrRefCount(t->rows);
+            t->rowCount = count;
+            t->widthsValid = 0;
+            t->changes++;
+            if (t->top > t->rowCount) t->top = 0;
+            if (t->selected >= t->rowCount) t->selected = -1;
+            break;
+
+        case TABLE_SCROLL:
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "rows");
+                return TCL_ERROR;
+            }
+            if (Tcl_GetIntFromObj(interp, objv[2], &value) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            return table_scroll(t, value);
+
+        case TABLE_SELECT:
+            if (objc == 3) {
+                if (Tcl_GetIntFromObj(interp, objv[2], &value) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (value >= t->rowCount) value = t->rowCount - 1;
+                if (value < -1) value = -1;
+
+                old = t->selected;
+                t->selected = value;
+                if (value >= 0 && value < t->top) {
+                    if (table_scroll(t, value - t->top) != TCL_OK) {
+                        return TCL_ERROR;
+                    }
+                }
+                else if (value >= 0 && value >= t->top + body) {
+                    if (table_scroll(t, value - t->top - body + 1) != TCL_OK) {
+                        return TCL_ERROR;
+                    }
+                }
+                if (old != value && old >= t->top && old < t->top + body) {
+                    if (table_render_rows(t, old - t->top, 1) != TCL_OK) {
+                        return TCL_ERROR;
+                    }
+                }
+                if (value >= t->top && value < t->top + body) {
+                    if (table_render_rows(t, value - t->top, 1) != TCL_OK) {
+                        return TCL_ERROR;
+                    }
+                }
+            }
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(t->selected));
+            break;
+
+        case TABLE_SORTCOLUMN:
+            if (objc == 3) {
+                if (Tcl_GetIntFromObj(interp, objv[2], &value) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                old = t->sortColumn;
+                t->sortColumn = value < t->numColumns ? value : -1;
+                if (old != t->sortColumn &&
+                    (table_render_header(t) != TCL_OK ||
+                     table_render_rows(t, 0, body) != TCL_OK)) {
+                    return TCL_ERROR;
+                }
+            }
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(t->sortColumn));
+            break;
+
+        case TABLE_TOP:
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(t->top));
+            break;
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::export
+ *
+ * Description:
+ *
+ *   Mirrors the visible console window into a memory-mapped file, so that
+ *   other processes can watch the screen by mapping the same file instead
+ *   of attaching to the console. The file contains the characters and
+ *   attributes of every cell, the cursor position and a frame counter. See
+ *   Consio.txt for the layout and for the protocol readers must follow.
+ *
+ *   The file is updated when the event loop is idle after output, and only
+ *   the rows that changed are written. Scripts that do not enter the event
+ *   loop can call "Consio::export update" after drawing.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - CreateFileW
+ *   - CreateFileMapping
+ *   - MapViewOfFile
+ *   - GetLargestConsoleWindowSize
+ *   - ReadConsoleOutputW
+ *
+ * Parameters:
+ *
+ *   open filename ?width height? - starts exporting to the given file; the
+ *                                  cell grid holds width * height cells,
+ *                                  by default the largest possible console
+ *                                  window
+ *   update                       - updates the file immediately and
+ *                                  returns the number of rows written
+ *   frame                        - returns the current frame number
+ *   close                        - stops exporting
+ *
+ * Results:
+ *
+ *   See parameters.
+ *
+ * Side effects:
+ *
+ *   Creates or truncates the export file. An export started earlier is
+ *   closed when a new one is opened.
+ *****************************************************************************/
+
+static int cmd_export(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"close", "frame", "open", "update",
+                             (char *) NULL};
+    enum {EXPORT_CLOSE, EXPORT_FRAME, EXPORT_OPEN, EXPORT_UPDATE};
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Tcl_DString path, native;
+    ExportHeader *h;
+    HANDLE file, mapping;
+    COORD largest;
+    DWORD cellsOffset, rowsOffset, total;
+    int index, maxWidth, maxHeight;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch (index) {
+        case EXPORT_CLOSE:
+            export_close();
+            return TCL_OK;
+
+        case EXPORT_FRAME:
+            Tcl_SetObjResult(interp, Tcl_NewWideIntObj(
+                exportView != NULL ? (Tcl_WideInt) exportView->frame : 0));
+            return TCL_OK;
+
+        case EXPORT_UPDATE:
+            if (exportView == NULL) {
+                Tcl_SetObjResult(interp,
+                                 Tcl_NewStringObj("no export is open", -1));
+                return TCL_ERROR;
+            }
+            if (exportPending) {
+                Tcl_CancelIdleCall(export_idle, NULL);
+                exportPending = 0;
+            }
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(export_sync()));
+            return TCL_OK;
+    }
+
+    if (objc != 3 && objc != 5) {
+        Tcl_WrongNumArgs(interp, 2, objv, "filename ?width height?");
+        return TCL_ERROR;
+    }
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    largest = GetLargestConsoleWindowSize(hStdout);
+    maxWidth = largest.X;
+    maxHeight = largest.Y;
+    if (maxWidth < info.srWindow.Right - info.srWindow.Left + 1) {
+        maxWidth = info.srWindow.Right - info.srWindow.Left + 1;
+    }
+    if (maxHeight < info.srWindow.Bottom - info.srWindow.Top + 1) {
+        maxHeight = info.srWindow.Bottom - info.srWindow.Top + 1;
+    }
+
+    if (objc == 5) {
+        if (Tcl_GetIntFromObj(interp, objv[3], &maxWidth) != TCL_OK ||
+            Tcl_GetIntFromObj(interp, objv[4], &maxHeight) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+
+    if (maxWidth < 1 || maxHeight < 1 || maxWidth > 32767 ||
+        maxHeight > 32767) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("bad grid size", -1));
+        return TCL_ERROR;
+    }
+
+    export_close();
+
+    cellsOffset = sizeof(ExportHeader);
+    rowsOffset = cellsOffset + maxWidth * maxHeight * sizeof(CHAR_INFO);
+    total = rowsOffset + maxHeight * sizeof(DWORD);
+
+    if (Tcl_TranslateFileName(interp, Tcl_GetString(objv[2]), &path) == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_DStringInit(&native);
+    Tcl_UtfToUniCharDString(Tcl_DStringValue(&path),
+                            Tcl_DStringLength(&path), &native);
+    file = CreateFileW((LPCWSTR) Tcl_DStringValue(&native),
+                       GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    Tcl_DStringFree(&native);
+    Tcl_DStringFree(&path);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't open \"%s\"",
+                                               Tcl_GetString(objv[2])));
+        return TCL_ERROR;
+    }
+
+    mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, 0, total, NULL);
+    h = NULL;
+    if (mapping != NULL) {
+        h = (ExportHeader *) MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0,
+                                           total);
+    }
+    if (h == NULL) {
+        if (mapping != NULL) CloseHandle(mapping);
+        CloseHandle(file);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't map \"%s\"",
+                                               Tcl_GetString(objv[2])));
+        return TCL_ERROR;
+    }
+
+    /* A new file is zero-filled; the magic is written last */
+
+    h->version = EXPORT_VERSION;
+    h->headerSize = sizeof(ExportHeader);
+    h->maxWidth = maxWidth;
+    h->maxHeight = maxHeight;
+    h->cellsOffset = cellsOffset;
+    h->rowsOffset = rowsOffset;
+    MemoryBarrier();
+    memcpy(h->magic, EXPORT_MAGIC, sizeof(h->magic));
+
+    exportFile = file;
+    exportMapping = mapping;
+    exportView = h;
+    exportBuffer = (CHAR_INFO *) ckalloc(maxWidth * maxHeight *
+                                         sizeof(CHAR_INFO));
+    export_sync();
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::caps
+ *
+ * Description:
+ *
+ *   Returns the capabilities of the terminal: whether it understands
+ *   virtual terminal sequences, the number of colors, truecolor, mouse,
+ *   bracketed paste and synchronized output support, the version the
+ *   terminal reports and the Windows build.
+ *
+ *   Probing the terminal takes a round trip, so the results are cached in
+ *   a file per terminal identity (the terminal-related environment
+ *   variables and the Windows build) and the terminal is only probed when
+ *   it is seen for the first time. Nothing is done before the first call.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - WriteConsole
+ *   - ReadConsoleInputW
+ *   - WriteConsoleInputW
+ *   - GetNumberOfConsoleMouseButtons
+ *   - RtlGetVersion
+ *
+ * Parameters:
+ *
+ *   -refresh - (optional) ignores the cache and probes the terminal again
+ *   name     - (optional) name of a single capability
+ *
+ * Results:
+ *
+ *   Returns the capabilities as a dictionary, or the value of the named
+ *   capability.
+ *
+ * Side effects:
+ *
+ *   May write capability queries to the console and update the cache file.
+ *****************************************************************************/
+
+static int cmd_caps(ClientData clientData,
+                    Tcl_Interp *interp,
+                    int objc,
+                    Tcl_Obj * CONST objv[]) {
+    Tcl_Obj *caps, *value;
+    int refresh = 0;
+
+    if (objc > 1 && strcmp(Tcl_GetString(objv[1]), "-refresh") == 0) {
+        refresh = 1;
+        objc--;
+        objv++;
+    }
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?-refresh? ?name?");
+        return TCL_ERROR;
+    }
+
+    caps = caps_get(interp, refresh);
+
+    if (objc == 1) {
+        Tcl_SetObjResult(interp, caps);
+        return TCL_OK;
+    }
+
+    if (Tcl_DictObjGet(interp, caps, objv[1], &value) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (value == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("unknown capability \"%s\"",
+                                               Tcl_GetString(objv[1])));
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, value);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::getevent
+ *
+ * Description:
+ *
+ *   Waits for a key press or a paste. Unlike getchex, pasted text is not
+ *   returned one key at a time: it is collected natively and returned as a
+ *   single event, so pasting a large block of text neither takes a
+ *   dispatch per character nor triggers key bindings on the pasted
+ *   content. Pastes are recognized by the bracketed paste markers (see
+ *   Consio::paste) or, when the console delivers pasted text as ordinary
+ *   key events, by the burst of input a paste produces.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - ReadConsoleInputW
+ *   - PeekConsoleInputW
+ *   - GetNumberOfConsoleInputEvents
+ *
+ * Parameters:
+ *
+ *   timeout - (optional) maximum time to wait in milliseconds; by default
+ *             the command waits forever
+ *
+ * Results:
+ *
+ *   Returns {key code char} for a key press, where code is the virtual key
+ *   code as in getchex and char the character produced by the key (empty
+ *   for keys like the arrows), {paste text} for pasted text, with line
+ *   breaks as newlines, or an empty string if the time ran out.
+ *
+ * Side effects:
+ *
+ *   None.
+ *****************************************************************************/
+
+static int cmd_getevent(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    INPUT_RECORD rec;
+    DWORD oldMode;
+    Tcl_Obj *event;
+    char *str;
+    int timeout = -1;
+    int type, len;
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?timeout?");
+        return TCL_ERROR;
+    }
+
+    if (objc == 2 && Tcl_GetIntFromObj(interp, objv[1], &timeout) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch (input_source(interp, REC_IN_EVENT, timeout, &event)) {
+        case 1:
+            Tcl_SetObjResult(interp, event);
+            return TCL_OK;
+        case -1:
+            return TCL_ERROR;
+    }
+
+    GetConsoleMode(hStdin, &oldMode);
+    SetConsoleMode(hStdin, input_mode());
+    type = input_next(&rec, timeout);
+    SetConsoleMode(hStdin, oldMode);
+
+    event = input_event_obj(type, &rec);
+    if (type != INPUT_NONE) {
+        str = Tcl_GetStringFromObj(event, &len);
+        record_event(REC_IN_EVENT, str, len);
+    }
+    Tcl_SetObjResult(interp, event);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::paste
+ *
+ * Description:
+ *
+ *   Enables or disables bracketed paste mode. In this mode terminals that
+ *   support it (see Consio::caps) mark pasted text, so getevent and
+ *   readline can recognize a paste reliably. Without it pastes are still
+ *   recognized by the burst of input they cause. The mode should be
+ *   disabled before the application exits.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleMode
+ *   - SetConsoleMode
+ *   - WriteConsole
+ *
+ * Parameters:
+ *
+ *   enable - (optional) boolean
+ *
+ * Results:
+ *
+ *   Returns 1 if bracketed paste mode is enabled, 0 otherwise. The mode
+ *   cannot be enabled on consoles without virtual terminal support.
+ *
+ * Side effects:
+ *
+ *   Writes the mode sequence to the console.
+ *****************************************************************************/
+
+static int cmd_paste(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    DWORD mode, num;
+    int enable;
+
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?enable?");
+        return TCL_ERROR;
+    }
+
+    if (objc == 2) {
+        if (Tcl_GetBooleanFromObj(interp, objv[1], &enable) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        pasteBracketed = 0;
+        if (GetConsoleMode(hStdout, &mode) &&
+            SetConsoleMode(hStdout, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING)) {
+            WriteConsole(hStdout, enable ? "\033[?2004h" : "\033[?2004l", 8,
+                         &num, NULL);
+            SetConsoleMode(hStdout, mode);
+            pasteBracketed = enable;
+        }
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(pasteBracketed));
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::image
+ *
+ * Description:
+ *
+ *   Draws an RGB or RGBA image into a rectangle of the console. Each cell
+ *   shows two pixels, one above the other, as an upper half block whose
+ *   foreground is the upper and background the lower pixel. The image is
+ *   scaled to fit the rectangle by averaging and mapped to the 16 console
+ *   colors, optionally with dithering, and drawn with a single call. With
+ *   -truecolor, terminals supporting 24-bit colors (see Consio::caps) get
+ *   the exact colors instead.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *   - WriteConsoleOutputW
+ *   - WriteConsoleW
+ *
+ * Parameters:
+ *
+ *   data          - pixels as a byte array, 3 (RGB) or 4 (RGBA) bytes per
+ *                   pixel, row by row
+ *   width height  - size of the image in pixels
+ *   x y           - upper left corner on the console
+ *   cols rows     - size of the rectangle in cells; the image is scaled
+ *                   to cols * (2 * rows) pixels
+ *   -dither       - (optional) uses Floyd-Steinberg dithering
+ *   -truecolor    - (optional) uses 24-bit colors if the terminal
+ *                   supports them
+ *
+ * Results:
+ *
+ *   None.
+ *
+ * Side effects:
+ *
+ *   Draws to the console. Transparent pixels of RGBA images are blended
+ *   with the current background color. The cursor is not moved.
+ *****************************************************************************/
+
+static int cmd_image(ClientData clientData,
+                     Tcl_Interp *interp,
+                     int objc,
+                     Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"-dither", "-truecolor", (char *) NULL};
+    enum {IMAGE_DITHER, IMAGE_TRUECOLOR};
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    unsigned char *data, *colors;
+    CHAR_INFO *cells;
+    Tcl_Obj *key, *value;
+    int *pixels;
+    int args[6];
+    int len, channels, index, i, dither, truecolor, drawn;
+    Tcl_WideInt area;
+
+    if (objc < 8) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+            "data width height x y cols rows ?-dither? ?-truecolor?");
+        return TCL_ERROR;
+    }
+
+    data = Tcl_GetByteArrayFromObj(objv[1], &len);
+    for (i = 0; i < 6; i++) {
+        if (Tcl_GetIntFromObj(interp, objv[i + 2], &args[i]) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+
+    dither = truecolor = 0;
+    for (i = 8; i < objc; i++) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0,
+                                &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (index == IMAGE_DITHER) dither = 1;
+        else truecolor = 1;
+    }
+
+    area = (Tcl_WideInt) args[0] * args[1];
+    if (args[0] <= 0 || args[1] <= 0 ||
+        (area * 3 != len && area * 4 != len)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "image data doesn't match the image size", -1));
+        return TCL_ERROR;
+    }
+    channels = area * 3 == len ? 3 : 4;
+
+    /* The image can't be larger than the screen buffer */
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+    if (args[4] > info.dwSize.X) args[4] = info.dwSize.X;
+    if (args[5] > info.dwSize.Y) args[5] = info.dwSize.Y;
+    if (args[4] > 0x7FFF) args[4] = 0x7FFF;
+    if (args[5] > 0x7FFF) args[5] = 0x7FFF;
+    if (args[4] <= 0 || args[5] <= 0) return TCL_OK;
+    if ((Tcl_WideInt) args[4] * args[5] * 2 * 3 * sizeof(int) > 0x7FFFFFFF) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("image too large", -1));
+        return TCL_ERROR;
+    }
+
+    if (truecolor) {
+        value = NULL;
+        key = Tcl_NewStringObj("truecolor", -1);
+        Tcl_IncrRefCount(key);
+        Tcl_DictObjGet(NULL, caps_get(interp, 0), key, &value);
+        Tcl_DecrRefCount(key);
+        if (value == NULL ||
+            Tcl_GetBooleanFromObj(NULL, value, &truecolor) != TCL_OK) {
+            truecolor = 0;
+        }
+    }
+
+    pixels = (int *) ckalloc(args[4] * args[5] * 2 * 3 * sizeof(int));
+    image_scale(data, args[0], args[1], channels, args[4], args[5] * 2,
+                imagePalette[(info.wAttributes >> 4) & 15], pixels);
+
+    drawn = truecolor &&
+            image_write_truecolor(pixels, args[2], args[3], args[4], args[5]);
+
+    /* The 16-color version is also what a recording gets */
+
+    if (!drawn || recChannel != NULL) {
+        colors = (unsigned char *) ckalloc(args[4] * args[5] * 2);
+        image_quantize(pixels, args[4], args[5] * 2, dither && !drawn,
+                       colors);
+        cells = (CHAR_INFO *) ckalloc(args[4] * args[5] * sizeof(CHAR_INFO));
+        for (i = 0; i < args[4] * args[5]; i++) {
+            cells[i].Char.UnicodeChar = 0x2580;
+            cells[i].Attributes = colors[(i / args[4]) * 2 * args[4] +
+                                         i % args[4]] |
+                                  (colors[((i / args[4]) * 2 + 1) * args[4] +
+                                          i % args[4]] << 4);
+        }
+        if (drawn) {
+            record_cells(cells, args[2], args[3], args[4], args[5]);
+        }
+        else {
+            console_write_cells(hStdout, cells, args[2], args[3], args[4],
+                                args[5]);
+        }
+        ckfree((char *) cells);
+        ckfree((char *) colors);
+    }
+
+    ckfree((char *) pixels);
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::canvas
+ *
+ * Description:
+ *
+ *   Creates a plotting canvas in the given rectangle of the console. Each
+ *   cell is a braille character showing 2 x 4 dots, so a canvas of cols x
+ *   rows cells has 2*cols x 4*rows dots. Dots are set natively and
+ *   nothing is drawn until the canvas is flushed, which writes the changed
+ *   rows with a single call. Each cell has one color, the color in effect
+ *   when a dot of the cell was last set.
+ *
+ *   Coordinates are given in a coordinate system set with the range
+ *   subcommand, with the y axis pointing up. By default the coordinates
+ *   are dot positions counted from the lower left corner.
+ *
+ *   The command returns the name of a new command, which is used to control
+ *   the canvas:
+ *
+ *     canvas range xmin ymin xmax ymax
+ *                             - sets the coordinate system
+ *     canvas point x y        - sets a dot
+ *     canvas points xs ys ?-doubles?
+ *                             - sets a dot for each pair of coordinates
+ *     canvas line x0 y0 x1 y1 - draws a line
+ *     canvas series values ?-min y? ?-max y? ?-doubles?
+ *                             - plots the values as a line across the whole
+ *                               width; by default the vertical scale fits
+ *                               the values
+ *     canvas axes ?xstep ystep?
+ *                             - draws the axes, with tick marks every xstep
+ *                               and ystep units
+ *     canvas color foreground background
+ *                             - sets the color for the following drawing
+ *     canvas clear            - clears the canvas
+ *     canvas flush            - draws the changed rows to the console
+ *     canvas destroy          - deletes the canvas command
+ *
+ *   With -doubles, the values are given as a byte array of native double
+ *   precision numbers (binary format d*) instead of a list.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *
+ * Parameters:
+ *
+ *   x y  - upper left corner of the canvas
+ *   cols - width of the canvas in cells
+ *   rows - height of the canvas in cells
+ *
+ * Results:
+ *
+ *   Returns the name of the canvas command.
+ *
+ * Side effects:
+ *
+ *   None. The canvas is blank, in the current text attributes.
+ *****************************************************************************/
+
+static int cmd_canvas(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Canvas *c;
+    char name[32];
+    int rect[4];
+    int i;
+
+    if (objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "x y cols rows");
+        return TCL_ERROR;
+    }
+
+    for (i = 1; i < 5; i++) {
+        if (Tcl_GetIntFromObj(interp, objv[i], &rect[i - 1]) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+
+    if (rect[2] > 0x7FFF || rect[3] > 0x7FFF) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("bad canvas size", -1));
+        return TCL_ERROR;
+    }
+    if ((Tcl_WideInt) rect[2] * rect[3] * sizeof(WORD) > 0x7FFFFFFF) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("canvas too large", -1));
+        return TCL_ERROR;
+    }
+
+    GetConsoleScreenBufferInfo(hStdout, &info);
+
+    c = (Canvas *) ckalloc(sizeof(Canvas));
+    memset(c, 0, sizeof(Canvas));
+    c->x = rect[0];
+    c->y = rect[1];
+    c->cols = rect[2] > 0 ? rect[2] : 0;
+    c->rows = rect[3] > 0 ? rect[3] : 0;
+    c->dots = (unsigned char *) ckalloc(c->cols * c->rows + 1);
+    c->attrs = (WORD *) ckalloc((c->cols * c->rows + 1) * sizeof(WORD));
+    c->attr = info.wAttributes;
+    c->xmin = 0.0;
+    c->ymin = 0.0;
+    c->xmax = c->cols * 2 - 1;
+    c->ymax = c->rows * 4 - 1;
+    canvas_clear(c);
+
+    sprintf(name, "Consio::canvas%d", ++canvasCounter);
+    c->token = Tcl_CreateObjCommand(interp, name, canvas_cmd, c, canvas_free);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * canvas command
+ *
+ * Description:
+ *
+ *   Implements the subcommands of a canvas created by Consio::canvas.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - WriteConsoleOutputW
+ *
+ * Parameters:
+ *
+ *   See Consio::canvas.
+ *
+ * Results:
+ *
+ *   See Consio::canvas.
+ *
+ * Side effects:
+ *
+ *   See Consio::canvas.
+ *****************************************************************************/
+
+static int canvas_cmd(ClientData clientData,
+                      Tcl_Interp *interp,
+                      int objc,
+                      Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"axes", "clear", "color", "destroy", "flush",
+                             "line", "point", "points", "range", "series",
+                             (char *) NULL};
+    enum {CANVAS_AXES, CANVAS_CLEAR, CANVAS_COLOR, CANVAS_DESTROY,
+          CANVAS_FLUSH, CANVAS_LINE, CANVAS_POINT, CANVAS_POINTS,
+          CANVAS_RANGE, CANVAS_SERIES};
+    CONST char *pointsOptions[] = {"-doubles", (char *) NULL};
+    CONST char *seriesOptions[] = {"-doubles", "-max", "-min",
+                                   (char *) NULL};
+    enum {SERIES_DOUBLES, SERIES_MAX, SERIES_MIN};
+    Canvas *c = (Canvas *) clientData;
+    double coords[4];
+    double *xs, *ys;
+    double min, max, v, start, step[2];
+    int w = c->cols * 2;
+    int h = c->rows * 4;
+    int index, option, i, n, m, doubles, haveMin, haveMax, ax, ay;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch (index) {
+        case CANVAS_AXES:
+            if (objc != 2 && objc != 4) {
+                Tcl_WrongNumArgs(interp, 2, objv, "?xstep ystep?");
+                return TCL_ERROR;
+            }
+            step[0] = step[1] = 0.0;
+            for (i = 2; i < objc; i++) {
+                if (Tcl_GetDoubleFromObj(interp, objv[i],
+                                         &step[i - 2]) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            }
+
+            /* The axes cross at the origin if it is visible */
+
+            ax = canvas_map(0.0, c->xmin, c->xmax, w, 0);
+            ay = canvas_map(0.0, c->ymin, c->ymax, h, 1);
+            if (ax < 0 || ax >= w) ax = 0;
+            if (ay < 0 || ay >= h) ay = h - 1;
+            canvas_line(c, 0, ay, w - 1, ay);
+            canvas_line(c, ax, 0, ax, h - 1);
+
+            /*
+             * Ticks are counted from the first multiple of the step below
+             * the range, never more than the dots of the axis, so a step
+             * too small to change a large coordinate cannot hang the loop.
+             */
+
+            if (step[0] > 0.0 && fabs(c->xmax - c->xmin) / step[0] <= w) {
+                min = c->xmin < c->xmax ? c->xmin : c->xmax;
+                max = c->xmin < c->xmax ? c->xmax : c->xmin;
+                start = floor(min / step[0]) * step[0];
+                for (i = 0; i <= w + 1; i++) {
+                    v = start + i * step[0];
+                    if (v > max) break;
+                    if (v < min) continue;
+                    canvas_set(c, canvas_map(v, c->xmin, c->xmax, w, 0),
+                               ay + (ay > 0 ? -1 : 1));
+                }
+            }
+            if (step[1] > 0.0 && fabs(c->ymax - c->ymin) / step[1] <= h) {
+                min = c->ymin < c->ymax ? c->ymin : c->ymax;
+                max = c->ymin < c->ymax ? c->ymax : c->ymin;
+                start = floor(min / step[1]) * step[1];
+                for (i = 0; i <= h + 1; i++) {
+                    v = start + i * step[1];
+                    if (v > max) break;
+                    if (v < min) continue;
+                    canvas_set(c, ax + (ax < w - 1 ? 1 : -1),
+                               canvas_map(v, c->ymin, c->ymax, h, 1));
+                }
+            }
+            break;
+
+        case CANVAS_CLEAR:
+            canvas_clear(c);
+            break;
+
+        case CANVAS_COLOR:
+            if (objc != 4) {
+                Tcl_WrongNumArgs(interp, 2, objv, "foreground background");
+                return TCL_ERROR;
+            }
+            if (get_color_attr(interp, objv[2], objv[3], &c->attr) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            break;
+
+        case CANVAS_DESTROY:
+            Tcl_DeleteCommandFromToken(interp, c->token);
+            break;
+
+        case CANVAS_FLUSH:
+            canvas_flush(c);
+            break;
+
+        case CANVAS_LINE:
+        case CANVAS_POINT:
+        case CANVAS_RANGE:
+            n = index == CANVAS_POINT ? 2 : 4;
+            if (objc != n + 2) {
+                Tcl_WrongNumArgs(interp, 2, objv, index == CANVAS_POINT ?
+                                 "x y" : index == CANVAS_LINE ?
+                                 "x0 y0 x1 y1" : "xmin ymin xmax ymax");
+                return TCL_ERROR;
+            }
+            for (i = 0; i < n; i++) {
+                if (Tcl_GetDoubleFromObj(interp, objv[i + 2],
+                                         &coords[i]) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            }
+            if (index == CANVAS_RANGE) {
+                c->xmin = coords[0];
+                c->ymin = coords[1];
+                c->xmax = coords[2];
+                c->ymax = coords[3];
+            }
+            else if (index == CANVAS_POINT) {
+                canvas_set(c, canvas_map(coords[0], c->xmin, c->xmax, w, 0),
+                           canvas_map(coords[1], c->ymin, c->ymax, h, 1));
+            }
+            else {
+                canvas_line(c, canvas_map(coords[0], c->xmin, c->xmax, w, 0),
+                            canvas_map(coords[1], c->ymin, c->ymax, h, 1),
+                            canvas_map(coords[2], c->xmin, c->xmax, w, 0),
+                            canvas_map(coords[3], c->ymin, c->ymax, h, 1));
+            }
+            break;
+
+        case CANVAS_POINTS:
+            if (objc != 4 && objc != 5) {
+                Tcl_WrongNumArgs(interp, 2, objv, "xs ys ?-doubles?");
+                return TCL_ERROR;
+            }
+            if (objc == 5 &&
+                Tcl_GetIndexFromObj(interp, objv[4], pointsOptions, "option",
+                                    0, &option) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            doubles = objc == 5;
+            if (canvas_values(interp, objv[2], doubles, &xs, &n) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (canvas_values(interp, objv[3], doubles, &ys, &m) != TCL_OK) {
+                ckfree((char *) xs);
+                return TCL_ERROR;
+            }
+            if (m < n) n = m;
+            for (i = 0; i < n; i++) {
+                if (!canvas_finite(xs[i]) || !canvas_finite(ys[i])) continue;
+                canvas_set(c, canvas_map(xs[i], c->xmin, c->xmax, w, 0),
+                           canvas_map(ys[i], c->ymin, c->ymax, h, 1));
+            }
+            ckfree((char *) xs);
+            ckfree((char *) ys);
+            break;
+
+        case CANVAS_SERIES:
+            if (objc < 3) {
+                Tcl_WrongNumArgs(interp, 2, objv,
+                                 "values ?-min y? ?-max y? ?-doubles?");
+                return TCL_ERROR;
+            }
+            doubles = haveMin = haveMax = 0;
+            min = max = 0.0;
+            for (i = 3; i < objc; i++) {
+                if (Tcl_GetIndexFromObj(interp, objv[i], seriesOptions,
+                                        "option", 0, &option) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (option == SERIES_DOUBLES) {
+                    doubles = 1;
+                    continue;
+                }
+                if (i + 1 >= objc) {
+                    Tcl_WrongNumArgs(interp, 2, objv,
+                                     "values ?-min y? ?-max y? ?-doubles?");
+                    return TCL_ERROR;
+                }
+                if (Tcl_GetDoubleFromObj(interp, objv[++i],
+                                         option == SERIES_MIN ? &min : &max)
+                    != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (option == SERIES_MIN) haveMin = 1;
+                else haveMax = 1;
+            }
+            if (canvas_values(interp, objv[2], doubles, &ys, &n) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            for (i = m = 0; i < n; i++) {
+                if (!canvas_finite(ys[i])) continue;
+                if (!haveMin && (m == 0 || ys[i] < min)) min = ys[i];
+                if (!haveMax && (m == 0 || ys[i] > max)) max = ys[i];
+                m++;
+            }
+            canvas_series(c, ys, n, min, max);
+            ckfree((char *) ys);
+            break;
+    }
+
+    return TCL_OK;
+}
+
+/*****************************************************************************
+ * Consio::scrollback
  *
  * Description:
  *
- *   Waits for a keypress. Doesn't echo it to the console.
+ *   Manages a compact store of console lines, used to keep the contents of
+ *   the screen buffer for reading back or redrawing after it has scrolled
+ *   away. Text attributes are interned into a table of at most 256 styles,
+ *   each line keeps its attributes as runs of style indexes, and lines of
+ *   plain ASCII text take one byte per character. Trailing spaces are not
+ *   stored. Lines are kept in blocks of SCROLL_BLOCK_LINES lines; all but
+ *   the newest SCROLL_HOT_BLOCKS blocks are compressed. Any line can be
+ *   found directly from its index, and only its block is decompressed.
  *
  * This command calls the following Windows API functions:
  *
- *   - GetConsoleMode
- *   - SetConsoleMode
- *   - ReadConsole
+ *   - GetConsoleScreenBufferInfo
+ *   - ReadConsoleOutputW
+ *   - WriteConsoleOutputW
  *
  * Parameters:
  *
- *   None.
+ *   capture ?top ?bottom??   - appends the rows top to bottom of the screen
+ *                              buffer, by default the visible rows
+ *   clear                    - removes all lines
+ *   draw index y ?count?     - draws count lines (default 1) starting
+ *                              with the line index at row y of the screen
+ *                              buffer
+ *   get index ?-attributes?  - returns the text of a line
+ *   limit ?n?                - returns or sets the maximum number of lines
+ *   size                     - returns the number of lines
+ *   stats                    - returns memory statistics
  *
  * Results:
  *
- *   Returns the first character from the input buffer.
+ *   capture returns the number of lines in the store. get returns the
+ *   text of the line without trailing spaces, or with -attributes a list
+ *   of the text and the attribute runs as a flat list of cell counts and
+ *   attributes. stats returns a dictionary with the keys lines, blocks,
+ *   packed (compressed blocks), styles, cells and bytes (memory used by
+ *   the blocks).
  *
  * Side effects:
  *
- *   If there are no characters available in the input buffer, the function
- *   will block and wait until user presses a key. The pressed key will not
- *   be echoed back to the console.
+ *   See parameters.
  *****************************************************************************/
 
-static int cmd_getch(ClientData clientData,
-                     Tcl_Interp *interp,
-                     int objc,
-                     Tcl_Obj * CONST objv[]) {
-    DWORD oldMode, newMode;
-    TCHAR buffer[1];
-    DWORD num;
-    Tcl_Obj *obj_str;
+static int cmd_scrollback(ClientData clientData,
+                          Tcl_Interp *interp,
+                          int objc,
+                          Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"capture", "clear", "draw", "get", "limit",
+                             "size", "stats", (char *) NULL};
+    enum {SCROLL_CAPTURE, SCROLL_CLEAR, SCROLL_DRAW, SCROLL_GET,
+          SCROLL_LIMIT, SCROLL_SIZE, SCROLL_STATS};
+    CONST char *statNames[] = {"lines", "blocks", "packed", "styles",
+                               "cells", "bytes"};
+    Tcl_WideInt stats[6];
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    CHAR_INFO *cells;
+    Tcl_UniChar *text;
+    Tcl_Obj *result, *runs;
+    const unsigned char *line;
+    int index, top, bottom, width, band, count, length, run, i, y;
+    Tcl_WideInt cellCount, bytes;
+    int packed;
 
-    newMode = 0;
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+        return TCL_ERROR;
+    }
 
-    GetConsoleMode(hStdin, &oldMode);
-    SetConsoleMode(hStdin, newMode);
-    ReadConsole(hStdin, buffer, 1, &num, NULL);
-    SetConsoleMode(hStdin, oldMode);
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-    if (num > 0) {
-        obj_str = Tcl_NewStringObj(buffer, 1);
-        Tcl_SetObjResult(interp, obj_str);
+    switch (index) {
+        case SCROLL_CAPTURE:
+            if (objc > 4) {
+                Tcl_WrongNumArgs(interp, 2, objv, "?top ?bottom??");
+                return TCL_ERROR;
+            }
+            GetConsoleScreenBufferInfo(hStdout, &info);
+            top = info.srWindow.Top;
+            bottom = info.srWindow.Bottom;
+            if (objc > 2 &&
+                Tcl_GetIntFromObj(interp, objv[2], &top) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (objc > 3 &&
+                Tcl_GetIntFromObj(interp, objv[3], &bottom) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (top < 0) top = 0;
+            if (bottom >= info.dwSize.Y) bottom = info.dwSize.Y - 1;
+            width = info.dwSize.X;
+
+            /* Read a band at a time instead of the whole buffer */
+
+            band = CONSOLE_READ_MAX / (width * sizeof(CHAR_INFO));
+            if (band < 1) band = 1;
+            cells = (CHAR_INFO *) ckalloc(band * width * sizeof(CHAR_INFO));
+            for (y = top; y <= bottom; y += band) {
+                if (y + band > bottom + 1) band = bottom + 1 - y;
+                console_read_cells(hStdout, cells, 0, y, width, band);
+                for (i = 0; i < band; i++) {
+                    scroll_append(cells + i * width, width);
+                }
+            }
+            ckfree((char *) cells);
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(scrollLines));
+            break;
+
+        case SCROLL_CLEAR:
+            scroll_clear();
+            break;
+
+        case SCROLL_DRAW:
+            if (objc != 4 && objc != 5) {
+                Tcl_WrongNumArgs(interp, 2, objv, "index y ?count?");
+                return TCL_ERROR;
+            }
+            count = 1;
+            if (Tcl_GetIntFromObj(interp, objv[2], &index) != TCL_OK ||
+                Tcl_GetIntFromObj(interp, objv[3], &y) != TCL_OK ||
+                (objc == 5 &&
+                 Tcl_GetIntFromObj(interp, objv[4], &count) != TCL_OK)) {
+                return TCL_ERROR;
+            }
+            if (index < 0 || index >= scrollLines) {
+                Tcl_SetObjResult(interp,
+                                 Tcl_NewStringObj("index out of range", -1));
+                return TCL_ERROR;
+            }
+            if (count > scrollLines - index) count = scrollLines - index;
+            if (count <= 0) break;
+            GetConsoleScreenBufferInfo(hStdout, &info);
+            width = info.dwSize.X;
+            cells = (CHAR_INFO *) ckalloc(count * width * sizeof(CHAR_INFO));
+            for (i = 0; i < count; i++) {
+                line = scroll_line(index + i);
+                if (line == NULL) {
+                    ckfree((char *) cells);
+                    Tcl_SetObjResult(interp,
+                        Tcl_NewStringObj("scrollback block is corrupt", -1));
+                    return TCL_ERROR;
+                }
+                scroll_decode(line, cells + i * width, width, NULL, NULL);
+            }
+            console_write_cells(hStdout, cells, 0, y, width, count);
+            ckfree((char *) cells);
+            break;
+
+        case SCROLL_GET:
+            if ((objc != 3 && objc != 4) ||
+                (objc == 4 &&
+                 strcmp(Tcl_GetString(objv[3]), "-attributes") != 0)) {
+                Tcl_WrongNumArgs(interp, 2, objv, "index ?-attributes?");
+                return TCL_ERROR;
+            }
+            if (Tcl_GetIntFromObj(interp, objv[2], &index) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (index < 0 || index >= scrollLines) {
+                Tcl_SetObjResult(interp,
+                                 Tcl_NewStringObj("index out of range", -1));
+                return TCL_ERROR;
+            }
+            line = scroll_line(index);
+            if (line == NULL) {
+                Tcl_SetObjResult(interp,
+                    Tcl_NewStringObj("scrollback block is corrupt", -1));
+                return TCL_ERROR;
+            }
+
+            /* The stored length is the second varint of the line */
+
+            scroll_get_varint(scroll_get_varint(line + 1, &width), &length);
+            text = (Tcl_UniChar *) ckalloc((length + 1) * sizeof(Tcl_UniChar));
+            scroll_decode(line, NULL, 0, text, &length);
+            result = Tcl_NewUnicodeObj(text, length);
+            ckfree((char *) text);
+
+            if (objc == 4) {
+                line = scroll_get_varint(line + 1, &width);
+                line = scroll_get_varint(line, &length);
+                line = scroll_get_varint(line, &count);
+                runs = Tcl_NewListObj(0, NULL);
+                for (i = 0; i < count; i++) {
+                    line = scroll_get_varint(line, &run);
+                    Tcl_ListObjAppendElement(NULL, runs, Tcl_NewIntObj(run));
+                    Tcl_ListObjAppendElement(NULL, runs,
+                        Tcl_NewIntObj(scrollStyles[*line++]));
+                }
+                result = Tcl_NewListObj(1, &result);
+                Tcl_ListObjAppendElement(NULL, result, runs);
+            }
+            Tcl_SetObjResult(interp, result);
+            break;
+
+        case SCROLL_LIMIT:
+            if (objc > 2) {
+                if (Tcl_GetIntFromObj(interp, objv[2], &count) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (count < 1) count = 1;
+                scrollLimit = count;
+                scroll_trim();
+            }
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(scrollLimit));
+            break;
+
+        case SCROLL_SIZE:
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(scrollLines));
+            break;
+
+        case SCROLL_STATS:
+            cellCount = bytes = 0;
+            packed = 0;
+            for (i = 0; i < scrollBlockCount; i++) {
+                cellCount += scrollBlocks[i]->cells;
+                bytes += sizeof(ScrollBlock) + scrollBlocks[i]->capacity;
+                if (scrollBlocks[i]->packed) packed++;
+            }
+            stats[0] = scrollLines;
+            stats[1] = scrollBlockCount;
+            stats[2] = packed;
+            stats[3] = scrollStyleCount;
+            stats[4] = cellCount;
+            stats[5] = bytes;
+            result = Tcl_NewListObj(0, NULL);
+            for (i = 0; i < 6; i++) {
+                Tcl_ListObjAppendElement(NULL, result,
+                                         Tcl_NewStringObj(statNames[i], -1));
+                Tcl_ListObjAppendElement(NULL, result,
+                                         Tcl_NewWideIntObj(stats[i]));
+            }
+            Tcl_SetObjResult(interp, result);
+            break;
     }
 
     return TCL_OK;
 }
 
 /*****************************************************************************
- * Consio::getche
+ * Consio::screen
  *
  * Description:
  *
- *   Waits for a keypress. The character received from the keyboard will be
- *   echoed back to the console.
+ *   Manages console screen buffers for drawing without flicker. One screen
+ *   is shown (the active screen) while drawing commands go to the selected
+ *   screen. Drawing into a hidden screen and swapping it to the front
+ *   presents a whole frame at once. The standard output buffer is screen0.
+ *
+ *   Tcl's own stdout channel always writes to screen0.
  *
  * This command calls the following Windows API functions:
  *
+ *   - CreateConsoleScreenBuffer
+ *   - SetConsoleActiveScreenBuffer
+ *   - GetConsoleScreenBufferInfo
+ *   - SetConsoleScreenBufferSize
+ *   - SetConsoleWindowInfo
+ *   - GetConsoleCursorInfo
+ *   - SetConsoleCursorInfo
  *   - GetConsoleMode
  *   - SetConsoleMode
- *   - ReadConsole
- *   - WriteConsole
+ *   - SetConsoleTextAttribute
+ *   - ReadConsoleOutputW
+ *   - WriteConsoleOutputW
+ *   - CloseHandle
  *
  * Parameters:
  *
- *   None.
+ *   create        - creates a hidden screen with the size, window, mode,
+ *                   text attributes and cursor of the selected screen
+ *   select ?name? - returns or sets the screen drawn to
+ *   show ?name?   - returns or sets the screen shown
+ *   swap ?-copy?  - shows the selected screen and selects the screen that
+ *                   was shown; with -copy, the newly shown contents are
+ *                   copied to the newly selected screen
+ *   delete name   - deletes a screen, which must not be shown or selected
+ *   list          - returns the names of the screens
  *
  * Results:
  *
- *   Returns the first character from the input buffer.
+ *   create returns the name of the new screen. select and show return the
+ *   name of the selected or shown screen. swap returns the name of the
+ *   newly selected screen.
  *
  * Side effects:
  *
- *   If there are no characters available in the input buffer, the function
- *   will block and wait until user presses a key. The pressed key will be
- *   echoed back to the console.
+ *   See parameters.
  *****************************************************************************/
 
-static int cmd_getche(ClientData clientData,
+static int cmd_screen(ClientData clientData,
                       Tcl_Interp *interp,
                       int objc,
                       Tcl_Obj * CONST objv[]) {
-    DWORD oldMode, newMode;
-    TCHAR buffer[1];
-    DWORD num;
-    Tcl_Obj *obj_str;
+    CONST char *options[] = {"create", "delete", "list", "select", "show",
+                             "swap", (char *) NULL};
+    enum {SCREEN_CREATE, SCREEN_DELETE, SCREEN_LIST, SCREEN_SELECT,
+          SCREEN_SHOW, SCREEN_SWAP};
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    CONSOLE_CURSOR_INFO cursor;
+    HANDLE handle;
+    Tcl_Obj *list;
+    DWORD mode;
+    int index, screen, i;
 
-    newMode = 0;
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+        return TCL_ERROR;
+    }
 
-    GetConsoleMode(hStdin, &oldMode);
-    SetConsoleMode(hStdin, newMode);
-    ReadConsole(hStdin, buffer, 1, &num, NULL);
-    SetConsoleMode(hStdin, oldMode);
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-    if (num > 0) {
-        WriteConsole(hStdout, buffer, 1, &num, NULL);
+    switch (index) {
+        case SCREEN_CREATE:
+            for (screen = 1; screen < SCREEN_MAX; screen++) {
+                if (screens[screen] == NULL) break;
+            }
+            if (screen == SCREEN_MAX) {
+                Tcl_SetObjResult(interp,
+                                 Tcl_NewStringObj("too many screens", -1));
+                return TCL_ERROR;
+            }
+            handle = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE,
+                                               FILE_SHARE_READ |
+                                               FILE_SHARE_WRITE,
+                                               NULL, CONSOLE_TEXTMODE_BUFFER,
+                                               NULL);
+            if (handle == INVALID_HANDLE_VALUE) {
+                Tcl_SetObjResult(interp,
+                    Tcl_NewStringObj("can't create screen buffer", -1));
+                return TCL_ERROR;
+            }
 
-        obj_str = Tcl_NewStringObj(buffer, 1);
-        Tcl_SetObjResult(interp, obj_str);
+            GetConsoleScreenBufferInfo(hStdout, &info);
+            SetConsoleScreenBufferSize(handle, info.dwSize);
+            SetConsoleWindowInfo(handle, TRUE, &info.srWindow);
+            SetConsoleTextAttribute(handle, info.wAttributes);
+            if (GetConsoleCursorInfo(hStdout, &cursor)) {
+                SetConsoleCursorInfo(handle, &cursor);
+            }
+            if (GetConsoleMode(hStdout, &mode)) {
+                SetConsoleMode(handle, mode);
+            }
+
+            screens[screen] = handle;
+            Tcl_SetObjResult(interp, screen_name(screen));
+            break;
+
+        case SCREEN_DELETE:
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "name");
+                return TCL_ERROR;
+            }
+            if (screen_get(interp, objv[2], &screen) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (screen == 0 || screen == screenActive ||
+                screen == screenTarget) {
+                Tcl_SetObjResult(interp,
+                    Tcl_NewStringObj("screen is in use", -1));
+                return TCL_ERROR;
+            }
+            CloseHandle(screens[screen]);
+            screens[screen] = NULL;
+            break;
+
+        case SCREEN_LIST:
+            list = Tcl_NewListObj(0, NULL);
+            for (i = 0; i < SCREEN_MAX; i++) {
+                if (screens[i] != NULL) {
+                    Tcl_ListObjAppendElement(NULL, list, screen_name(i));
+                }
+            }
+            Tcl_SetObjResult(interp, list);
+            break;
+
+        case SCREEN_SELECT:
+            if (objc > 2) {
+                if (screen_get(interp, objv[2], &screen) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                screenTarget = screen;
+                hStdout = screens[screen];
+            }
+            Tcl_SetObjResult(interp, screen_name(screenTarget));
+            break;
+
+        case SCREEN_SHOW:
+            if (objc > 2) {
+                if (screen_get(interp, objv[2], &screen) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (terminal == NULL) {
+                    SetConsoleActiveScreenBuffer(screens[screen]);
+                }
+                screenActive = screen;
+                export_touch();
+            }
+            Tcl_SetObjResult(interp, screen_name(screenActive));
+            break;
+
+        case SCREEN_SWAP:
+            if (objc > 3 || (objc == 3 &&
+                strcmp(Tcl_GetString(objv[2]), "-copy") != 0)) {
+                Tcl_WrongNumArgs(interp, 2, objv, "?-copy?");
+                return TCL_ERROR;
+            }
+            if (screenTarget != screenActive) {
+                if (terminal == NULL) {
+                    SetConsoleActiveScreenBuffer(screens[screenTarget]);
+                }
+                screen = screenActive;
+                screenActive = screenTarget;
+                screenTarget = screen;
+                hStdout = screens[screenTarget];
+                if (objc == 3) {
+                    screen_copy(screens[screenActive], hStdout);
+                }
+                export_touch();
+            }
+            Tcl_SetObjResult(interp, screen_name(screenTarget));
+            break;
     }
 
     return TCL_OK;
 }
 
 /*****************************************************************************
- * Consio::putch
+ * Consio::encoder
  *
  * Description:
  *
- *    Prints the given character to the current cursor location.
+ *   Mirrors the visible console window to a channel as VT escape
+ *   sequences, for terminals on the other end of an SSH session, socket or
+ *   serial line. The encoder remembers what the remote terminal shows and
+ *   sends only the changes, picking the shortest way to express each one:
+ *   absolute or relative cursor moves, REP for repeated characters, ECH
+ *   and EL for blanks, SU for scrolled text, and SGR sequences that only
+ *   change the attributes that differ. Output is collected and sent as one
+ *   frame when the event loop is next idle.
  *
  * This command calls the following Windows API functions:
  *
- *   - WriteConsole
+ *   - GetConsoleScreenBufferInfo
+ *   - GetConsoleCursorInfo
+ *   - ReadConsoleOutputW
  *
  * Parameters:
  *
- *   chr - character to be displayed.
+ *   open channel ?-rep boolean?
+ *           - starts sending to the channel, which is set to binary
+ *             translation. -rep 0 avoids REP for terminals without it.
+ *   flush   - sends the pending changes now
+ *   refresh - repaints the whole screen with the next frame
+ *   stats   - returns statistics
+ *   close   - stops sending
  *
  * Results:
  *
- *   None.
+ *   flush returns the number of bytes sent. stats returns a dictionary
+ *   with the number of frames, bytes and cells sent, and the bytes of the
+ *   last frame.
  *
  * Side effects:
  *
- *   Given character will be displayed at the cursor location.
+ *   See parameters.
  *****************************************************************************/
 
-static int cmd_putch(ClientData clientData,
-                     Tcl_Interp *interp,
-                     int objc,
-                     Tcl_Obj * CONST objv[]) {
-    DWORD num;
-    char *str;
+static int cmd_encoder(ClientData clientData,
+                       Tcl_Interp *interp,
+                       int objc,
+                       Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"close", "flush", "open", "refresh", "stats",
+                             (char *) NULL};
+    enum {ENCODER_CLOSE, ENCODER_FLUSH, ENCODER_OPEN, ENCODER_REFRESH,
+          ENCODER_STATS};
+    CONST char *statNames[] = {"frames", "bytes", "cells", "last"};
+    Tcl_WideInt stats[4];
+    Tcl_Channel channel;
+    Tcl_Obj *result;
+    int index, mode, rep, i;
 
     if (objc < 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, "char");
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
+        return TCL_ERROR;
+    }
 
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
         return TCL_ERROR;
     }
 
-    str = Tcl_GetString(objv[1]);
-    WriteConsole(hStdout, str, 1, &num, NULL);
+    switch (index) {
+        case ENCODER_CLOSE:
+            encoder_close();
+            break;
+
+        case ENCODER_FLUSH:
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(encoder_frame()));
+            break;
+
+        case ENCODER_OPEN:
+            rep = 1;
+            if ((objc != 3 && objc != 5) ||
+                (objc == 5 && strcmp(Tcl_GetString(objv[3]), "-rep") != 0)) {
+                Tcl_WrongNumArgs(interp, 2, objv, "channel ?-rep boolean?");
+                return TCL_ERROR;
+            }
+            if (objc == 5 &&
+                Tcl_GetBooleanFromObj(interp, objv[4], &rep) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            channel = Tcl_GetChannel(interp, Tcl_GetString(objv[2]), &mode);
+            if (channel == NULL) return TCL_ERROR;
+            if (!(mode & TCL_WRITABLE)) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "channel \"%s\" wasn't opened for writing",
+                    Tcl_GetString(objv[2])));
+                return TCL_ERROR;
+            }
+
+            encoder_open(interp, channel, rep);
+            break;
+
+        case ENCODER_REFRESH:
+            if (encoder != NULL) {
+                encoder->valid = 0;
+                encoder_touch();
+            }
+            break;
+
+        case ENCODER_STATS:
+            memset(stats, 0, sizeof(stats));
+            if (encoder != NULL) {
+                stats[0] = encoder->frames;
+                stats[1] = encoder->bytes;
+                stats[2] = encoder->cells;
+                stats[3] = encoder->lastBytes;
+            }
+            result = Tcl_NewListObj(0, NULL);
+            for (i = 0; i < 4; i++) {
+                Tcl_ListObjAppendElement(NULL, result,
+                                         Tcl_NewStringObj(statNames[i], -1));
+                Tcl_ListObjAppendElement(NULL, result,
+                                         Tcl_NewWideIntObj(stats[i]));
+            }
+            Tcl_SetObjResult(interp, result);
+            break;
+    }
 
     return TCL_OK;
 }
 
 /*****************************************************************************
- * Consio::kbhit
+ * Consio::find
  *
  * Description:
  *
- *    With this command it's possible to check if the user has pressed any
- *    keys. This command will not block, so it's possible to poll for
- *    keys in a while loop like this: while {[Consio::kbhit] == 0} {}.
+ *   Searches the text on the screen, for example to check what a program
+ *   running in the console has printed. The cells of the rectangle are read
+ *   in bands of rows and searched row by row, so a match never spans two
+ *   rows. Literal patterns are scanned for their first character eight
+ *   cells at a time with SSE2 before the rest is compared.
  *
  * This command calls the following Windows API functions:
  *
- *   - PeekConsoleInput
+ *   - GetConsoleScreenBufferInfo
+ *   - ReadConsoleOutputW
  *
  * Parameters:
  *
- *   None.
+ *   -regexp - the pattern is a regular expression
+ *   -nocase - ignore case
+ *   -all    - return all matches
+ *   pattern - text to find
+ *   x y width height
+ *           - rectangle to search, by default the visible window of the
+ *             active screen
  *
  * Results:
  *
- *   1 - if there is at least one character waiting in the input buffer
- *   0 - if there is nothing waiting in the input buffer
+ *   Returns the position {x y} of the first match in buffer coordinates,
+ *   or an empty string if the pattern was not found. With -all, returns a
+ *   list of positions.
  *
  * Side effects:
  *
  *   None.
  *****************************************************************************/
 
-static int cmd_kbhit(ClientData clientData,
-                     Tcl_Interp *interp,
-                     int objc,
-                     Tcl_Obj * CONST objv[]) {
-    INPUT_RECORD buffer[1 * sizeof(TCHAR)];
-    DWORD num;
-    Tcl_Obj *obj_int;
+static int cmd_find(ClientData clientData,
+                    Tcl_Interp *interp,
+                    int objc,
+                    Tcl_Obj * CONST objv[]) {
+    FindSpec spec;
+    CHAR_INFO *cells;
+    Tcl_Obj *result, *point;
+    int all, row, rc = 0;
 
-    PeekConsoleInput(hStdin, buffer, 1, &num);
+    if (find_parse(interp, objc, objv, &spec, &all, NULL) != TCL_OK) {
+        find_free(&spec);
+        return TCL_ERROR;
+    }
 
-    if (num == 0) {
-        obj_int = Tcl_NewIntObj(0);
+    cells = (CHAR_INFO *) ckalloc((spec.width * spec.height + 1) *
+                                  sizeof(CHAR_INFO));
+    console_read_cells(screens[screenActive], cells, spec.x, spec.y,
+                       spec.width, spec.height);
+
+    result = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(result);
+    for (row = 0; row < spec.height; row++) {
+        rc = find_scan(interp, &spec, cells, row, all, result);
+        if (rc < 0 || (rc > 0 && !all)) break;
     }
-    else {
-        obj_int = Tcl_NewIntObj(1);
+
+    ckfree((char *) cells);
+    find_free(&spec);
+
+    if (rc >= 0) {
+        if (all) {
+            Tcl_SetObjResult(interp, result);
+        }
+        else if (rc > 0) {
+            Tcl_ListObjIndex(NULL, result, 0, &point);
+            Tcl_SetObjResult(interp, point);
+        }
     }
+    Tcl_DecrRefCount(result);
 
-    Tcl_SetObjResult(interp, obj_int);
+    return rc < 0 ? TCL_ERROR : TCL_OK;
+}
 
-    return TCL_OK;
+/*****************************************************************************
+ * Consio::waitfor
+ *
+ * Description:
+ *
+ *   Waits until a pattern appears on the screen, for expect-style
+ *   automation of programs running in the console. The screen is searched
+ *   once, and after that only the rows whose cells have changed are
+ *   searched again. The event loop keeps running while waiting. The screen
+ *   is checked right after Consio itself writes to the console, and every
+ *   FIND_POLL milliseconds for output written by other processes, which the
+ *   console does not report.
+ *
+ * This command calls the following Windows API functions:
+ *
+ *   - GetConsoleScreenBufferInfo
+ *   - ReadConsoleOutputW
+ *
+ * Parameters:
+ *
+ *   -regexp     - the pattern is a regular expression
+ *   -nocase     - ignore case
+ *   -timeout ms - give up after ms milliseconds, by default wait forever
+ *   pattern     - text to wait for
+ *   x y width height
+ *               - rectangle to search, by default the visible window of
+ *                 the active screen
+ *
+ * Results:
+ *
+ *   Returns the position {x y} of the match in buffer coordinates, or an
+ *   empty string on timeout.
+ *
+ * Side effects:
+ *
+ *   Processes events while waiting.
+ *****************************************************************************/
+
+static int cmd_waitfor(ClientData clientData,
+                       Tcl_Interp *interp,
+                       int objc,
+                       Tcl_Obj * CONST objv[]) {
+    FindSpec spec;
+    CHAR_INFO *cells, *snapshot, *swap;
+    Tcl_TimerToken timer;
+    Tcl_Time start, now;
+    Tcl_Obj *result, *point;
+    long elapsed;
+    int timeout, row, size, wait, woke, rc = 0;
+
+    if (find_parse(interp, objc, objv, &spec, NULL, &timeout) != TCL_OK) {
+        find_free(&spec);
+        return TCL_ERROR;
+    }
+
+    size = spec.width * spec.height;
+    cells = (CHAR_INFO *) ckalloc((size + 1) * sizeof(CHAR_INFO));
+    snapshot = (CHAR_INFO *) ckalloc((size + 1) * sizeof(CHAR_INFO));
+    result = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(result);
+
+    Tcl_GetTime(&start);
+    console_read_cells(screens[screenActive], cells, spec.x, spec.y,
+                       spec.width, spec.height);
+    for (row = 0; row < spec.height && rc == 0; row++) {
+        rc = find_scan(interp, &spec, cells, row, 0, result);
+    }
+
+    while (rc == 0) {
+        wait = FIND_POLL;
+        if (timeout >= 0) {
+            Tcl_GetTime(&now);
+            elapsed = (now.sec - start.sec) * 1000 +
+                      (now.usec - start.usec) / 1000;
+            if (elapsed >= timeout) break;
+            if (timeout - elapsed < wait) wait = (int) (timeout - elapsed);
+        }
+
+        woke = 0;
+        findDirty = 0;
+        timer = Tcl_CreateTimerHandler(wait, find_wake, (ClientData) &woke);
+        while (!woke && !findDirty) {
+            Tcl_DoOneEvent(TCL_ALL_EVENTS);
+        }
+        Tcl_DeleteTimerHandler(timer);
+
+        swap = snapshot;
+        snapshot = cells;
+        cells = swap;
+        console_read_cells(screens[screenActive], cells, spec.x, spec.y,
+                           spec.width, spec.height);
+        for (row = 0; row < spec.height && rc == 0; row++) {
+            if (memcmp(cells + row * spec.width,
+                       snapshot + row * spec.width,
+                       spec.width * sizeof(CHAR_INFO)) != 0) {
+                rc = find_scan(interp, &spec, cells, row, 0, result);
+            }
+        }
+    }
+
+    ckfree((char *) cells);
+    ckfree((char *) snapshot);
+    find_free(&spec);
+
+    if (rc > 0) {
+        Tcl_ListObjIndex(NULL, result, 0, &point);
+        Tcl_SetObjResult(interp, point);
+    }
+    Tcl_DecrRefCount(result);
+
+    return rc < 0 ? TCL_ERROR : TCL_OK;
 }
 
 /*****************************************************************************
- * Consio::textattr
+ * Consio::open
  *
  * Description:
  *
- *   This command will change the console attributes, which will be
- *   used for all output. The command has two parameters: foreground
- *   color name and background color name. The available color names
- *   are: black, blue, green, cyan, red, magenta, brown, lightgray,
- *   darkgray, lightblue, lightgreen, lightcyan, lightred, lightmagenta,
- *   yellow and white.
+ *   Opens a terminal on a serial port, pipe, socket or other channel, so
+ *   one process can serve many terminals. A console process has only one
+ *   console, so each terminal gets a screen buffer of its own which is
+ *   never shown on the console. The commands draw on it as usual and the
+ *   escape sequence encoder sends the changes to the terminal, while the
+ *   bytes received from the terminal are read in the event loop and
+ *   turned into key presses for the input commands.
+ *
+ *   The command returns the name of a new command, which runs Consio
+ *   commands on the terminal:
+ *
+ *     terminal command ?arg ...?
+ *                       - runs Consio::command with the terminal current
+ *     terminal close    - closes the terminal
  *
  * This command calls the following Windows API functions:
  *
+ *   - CreateConsoleScreenBuffer
+ *   - SetConsoleScreenBufferSize
+ *   - SetConsoleWindowInfo
  *   - SetConsoleTextAttribute
+ *   - SetConsoleCursorInfo
  *
  * Parameters:
  *
- *   foreground - a new foreground color to be used
- *   background - a new background color to be used
+ *   device - name of an open channel, or a device or file to open
+ *   -width cols
+ *   -height rows
+ *          - size of the terminal, by default 80 by 24
+ *   -rep boolean
+ *          - see Consio::encoder
  *
  * Results:
  *
- *   None.
+ *   Returns the name of the terminal command.
  *
  * Side effects:
  *
- *   Nothing visible until the first character is printed to the console.
- *   New attributes are used for everything until the console is destroyed
- *   or something will call the SetConsoleTextAttribute Win API function
- *   with new attributes. In other words, the new attributes will stay in
- *   effect even after the Tcl application has terminated and the Consio
- *   library is not used anymore.
+ *   Opens the device unless it is an open channel, and makes the channel
+ *   non-blocking with binary translation.
  *****************************************************************************/
 
-static int cmd_textattr(ClientData clientData,
-                        Tcl_Interp *interp,
-                        int objc,
-                        Tcl_Obj * CONST objv[]) {
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    WORD attr = 0;
-    int f, b;
-    CONST char *colors[] = {"black",     "blue",        "green",
-                            "cyan",      "red",         "magenta",
-                            "brown",     "lightgray",   "darkgray",
-                            "lightblue", "lightgreen",  "lightcyan",
-                            "lightred",  "lightmagenta", "yellow",
-                            "white", (char *) NULL};
-    int index;
+static int cmd_open(ClientData clientData,
+                    Tcl_Interp *interp,
+                    int objc,
+                    Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"-height", "-rep", "-width", (char *) NULL};
+    enum {OPEN_HEIGHT, OPEN_REP, OPEN_WIDTH};
+    Tcl_Channel channel;
+    Terminal *t, *saved;
+    HANDLE handle;
+    int width = 80, height = 24, rep = 1;
+    int index, mode, i;
 
-    if (objc < 3) {
-        Tcl_WrongNumArgs(interp, 1, objv, "foreground background");
+    if (objc < 2 || objc % 2 != 0) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+            "device ?-width cols? ?-height rows? ?-rep boolean?");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIndexFromObj(interp,
-                            objv[1],
-                            colors,
-                            "foreground color",
-                            0,
-                            &index) == TCL_OK) {
-        switch (index) {
-            case BLACK       : attr = attr | FG_BLACK;        break;
-            case BLUE        : attr = attr | FG_BLUE;         break;
-            case GREEN       : attr = attr | FG_GREEN;        break;
-            case CYAN        : attr = attr | FG_CYAN;         break;
-            case RED         : attr = attr | FG_RED;          break;
-            case MAGENTA     : attr = attr | FG_MAGENTA;      break;
-            case BROWN       : attr = attr | FG_BROWN;        break;
-            case LIGHTGRAY   : attr = attr | FG_LIGHTGRAY;    break;
-            case DARKGRAY    : attr = attr | FG_DARKGRAY;     break;
-            case LIGHTBLUE   : attr = attr | FG_LIGHTBLUE;    break;
-            case LIGHTGREEN  : attr = attr | FG_LIGHTGREEN;   break;
-            case LIGHTCYAN   : attr = attr | FG_LIGHTCYAN;    break;
-            case LIGHTRED    : attr = attr | FG_LIGHTRED;     break;
-            case LIGHTMAGENTA: attr = attr | FG_LIGHTMAGENTA; break;
-            case YELLOW      : attr = attr | FG_YELLOW;       break;
-            case WHITE       : attr = attr | FG_WHITE;        break;
-            default: return TCL_OK;
+    for (i = 2; i < objc; i += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], options, "option", 0,
+                                &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (index == OPEN_REP) {
+            if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &rep) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        }
+        else if (Tcl_GetIntFromObj(interp, objv[i + 1],
+                                   index == OPEN_WIDTH ? &width : &height)
+                 != TCL_OK) {
+            return TCL_ERROR;
         }
     }
-    else {
+    if (width < 1 || height < 1 || width > 0x7FFF || height > 0x7FFF) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("bad terminal size", -1));
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIndexFromObj(interp,
-                            objv[2],
-                            colors,
-                            "background color",
-                            0,
-                            &index) == TCL_OK) {
-        switch (index) {
-            case BLACK       : attr = attr | BG_BLACK;        break;
-            case BLUE        : attr = attr | BG_BLUE;         break;
-            case GREEN       : attr = attr | BG_GREEN;        break;
-            case CYAN        : attr = attr | BG_CYAN;         break;
-            case RED         : attr = attr | BG_RED;          break;
-            case MAGENTA     : attr = attr | BG_MAGENTA;      break;
-            case BROWN       : attr = attr | BG_BROWN;        break;
-            case LIGHTGRAY   : attr = attr | BG_LIGHTGRAY;    break;
-            case DARKGRAY    : attr = attr | BG_DARKGRAY;     break;
-            case LIGHTBLUE   : attr = attr | BG_LIGHTBLUE;    break;
-            case LIGHTGREEN  : attr = attr | BG_LIGHTGREEN;   break;
-            case LIGHTCYAN   : attr = attr | BG_LIGHTCYAN;    break;
-            case LIGHTRED    : attr = attr | BG_LIGHTRED;     break;
-            case LIGHTMAGENTA: attr = attr | BG_LIGHTMAGENTA; break;
-            case YELLOW      : attr = attr | BG_YELLOW;       break;
-            case WHITE       : attr = attr | BG_WHITE;        break;
-            default: return TCL_OK;
-        }
+    channel = Tcl_GetChannel(interp, Tcl_GetString(objv[1]), &mode);
+    if (channel == NULL) {
+        Tcl_ResetResult(interp);
+        channel = Tcl_OpenFileChannel(interp, Tcl_GetString(objv[1]),
+                                      "r+", 0);
+        if (channel == NULL) return TCL_ERROR;
     }
-    else {
+    else if ((mode & (TCL_READABLE | TCL_WRITABLE)) !=
+             (TCL_READABLE | TCL_WRITABLE)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "channel \"%s\" wasn't opened for reading and writing",
+            Tcl_GetString(objv[1])));
         return TCL_ERROR;
     }
+    Tcl_RegisterChannel(NULL, channel);
 
-    SetConsoleTextAttribute(hStdout, attr);
+    handle = terminal_buffer(width, height);
+    if (handle == NULL) {
+        Tcl_UnregisterChannel(NULL, channel);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "can't create a %dx%d screen buffer", width, height));
+        return TCL_ERROR;
+    }
+
+    t = (Terminal *) ckalloc(sizeof(Terminal));
+    memset(t, 0, sizeof(Terminal));
+    t->channel = channel;
+    t->hStdout = handle;
+    t->screens[0] = handle;
+    sprintf(t->name, "Consio::terminal%d", ++terminalCounter);
+
+    Tcl_SetChannelOption(interp, channel, "-blocking", "0");
+    Tcl_CreateChannelHandler(channel, TCL_READABLE, terminal_readable, t);
+
+    saved = terminal;
+    terminal_select(t);
+    encoder_open(interp, channel, rep);
+    terminal_select(saved);
+
+#ifdef CONSIO_NRE
+    t->command = Tcl_NRCreateCommand(interp, t->name, terminal_cmd,
+                                     terminal_nr, t, terminal_free);
+#else
+    t->command = Tcl_CreateObjCommand(interp, t->name, terminal_cmd, t,
+                                      terminal_free);
+#endif /*CONSIO_NRE*/
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(t->name, -1));
 
     return TCL_OK;
 }
 
 /*****************************************************************************
- * Consio::cputs
- *
- * Description:
- *
- *   This command is just a reimplementation of the Tcl puts command. This will
- *   print the given string to the console. If -nonewline parameter has been
- *   specified, then the newline will not be appended at the end of the string.
- *   At the moment this command has 65534 character limit. It's better to use
- *   puts istead, if there is a need to print more charactes.
+ * terminal command
  *
- * This command calls the following Windows API functions:
+ * Description:
  *
- *   - WriteConsole
+ *   Implements the command of a terminal opened by Consio::open.
  *
  * Parameters:
  *
- *   -nonewline - (optional) prevents the newline
- *   string     - string to be printed
+ *   See Consio::open.
  *
  * Results:
  *
- *   None.
+ *   The result of the Consio command.
  *
  * Side effects:
  *
- *   The given string will be printed to the console.
+ *   See Consio::open.
  *****************************************************************************/
 
-static int cmd_cputs(ClientData clientData,
-                     Tcl_Interp *interp,
-                     int objc,
-                     Tcl_Obj * CONST objv[]) {
-    TCHAR *str;
-    TCHAR *param;
-    TCHAR *newline;
-    int len;
-    DWORD num;
-    char *errstring = "?-nonewline? string";
+static int terminal_cmd(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    Terminal *t = (Terminal *) clientData;
+    Terminal *saved = terminal;
+    Tcl_Obj **args;
+    int result, i;
 
     if (objc < 2) {
-        Tcl_WrongNumArgs(interp, objc, objv, errstring);
+        Tcl_WrongNumArgs(interp, 1, objv, "command ?arg ...?");
         return TCL_ERROR;
     }
 
-    if (objc > 2) {
-        param = Tcl_GetStringFromObj(objv[1], &len);
-        str = Tcl_GetStringFromObj(objv[2], &len);
-        if (strcmp(param, "-nonewline") == 0) {
-            newline = NULL;
-        }
-        else {
-            Tcl_WrongNumArgs(interp, 1, objv, errstring);
-            return TCL_ERROR;
-        }
-    }
-    else {
-        str = Tcl_GetStringFromObj(objv[1], &len);
-        newline = "\r\n";
+    if (objc == 2 && strcmp(Tcl_GetString(objv[1]), "close") == 0) {
+        Tcl_DeleteCommandFromToken(interp, t->command);
+        return TCL_OK;
     }
 
-    if (len > 65534) len = 65534;
-    WriteConsole(hStdout, str, len, &num, NULL);
-    if (newline != NULL) WriteConsole(hStdout, newline, 2, &num, NULL);
+    args = (Tcl_Obj **) ckalloc((objc - 1) * sizeof(Tcl_Obj *));
+    args[0] = Tcl_ObjPrintf("Consio::%s", Tcl_GetString(objv[1]));
+    Tcl_IncrRefCount(args[0]);
+    for (i = 2; i < objc; i++) args[i - 1] = objv[i];
 
-    return TCL_OK;
+    Tcl_Preserve((ClientData) t);
+    if (saved != NULL) Tcl_Preserve((ClientData) saved);
+    terminal_select(t);
+    result = Tcl_EvalObjv(interp, objc - 1, args, 0);
+    terminal_select(saved);
+    if (saved != NULL) Tcl_Release((ClientData) saved);
+    Tcl_Release((ClientData) t);
+
+    Tcl_DecrRefCount(args[0]);
+    ckfree((char *) args);
+
+    return result;
 }
 
+#ifdef CONSIO_NRE
+
 /*****************************************************************************
- * Consio::cgets
+ * terminal_nr, terminal_done
  *
  * Description:
  *
- *   This command reads user input until the Enter key has been pressed. This
- *   command will not echo anything to the console. The maximum input size at
- *   the moment is 4095 characters.
- *
- * This command calls the following Windows API functions:
- *
- *   - GetConsoleMode
- *   - SetConsoleMode
- *   - ReadConsole
+ *   NRE implementation of the command of a terminal, so the input
+ *   commands run through it can yield their coroutine while they wait
+ *   (see input_nr). The terminal is current while the Consio command
+ *   runs, and terminal_done makes the previous terminal current again
+ *   when it has finished.
  *
  * Parameters:
  *
- *   None.
+ *   See Consio::open. data[0] of terminal_done is the frame of the
+ *   command.
  *
  * Results:
  *
- *   Returns a string. Newline character will not be included.
+ *   The result of the Consio command.
  *
  * Side effects:
  *
- *   The command will block until the Enter key has been pressed.
+ *   See Consio::open.
  *****************************************************************************/
 
-static int cmd_cgets(ClientData clientData,
-                     Tcl_Interp *interp,
-                     int objc,
-                     Tcl_Obj * CONST objv[]) {
-    DWORD oldMode, newMode;
-    TCHAR buffer[4096];
-    DWORD num;
-    Tcl_Obj *obj_str;
+static int terminal_nr(ClientData clientData,
+                       Tcl_Interp *interp,
+                       int objc,
+                       Tcl_Obj * CONST objv[]) {
+    Terminal *t = (Terminal *) clientData;
+    TerminalFrame *f;
+    Tcl_Obj *command;
+    int i;
 
-    newMode = ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT;
-    GetConsoleMode(hStdin, &oldMode);
-    SetConsoleMode(hStdin, newMode);
-    ReadConsole(hStdin, buffer, 4095, &num, NULL);
-    SetConsoleMode(hStdin, oldMode);
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "command ?arg ...?");
+        return TCL_ERROR;
+    }
 
-    if (buffer[num - 1] == '\r' || buffer[num - 1] == '\n') num--;
-    if (buffer[num - 1] == '\r' || buffer[num - 1] == '\n') num--;
+    if (objc == 2 && strcmp(Tcl_GetString(objv[1]), "close") == 0) {
+        Tcl_DeleteCommandFromToken(interp, t->command);
+        return TCL_OK;
+    }
 
-    obj_str = Tcl_NewStringObj(buffer, num);
-    Tcl_SetObjResult(interp, obj_str);
+    command = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, command,
+        Tcl_ObjPrintf("Consio::%s", Tcl_GetString(objv[1])));
+    for (i = 2; i < objc; i++) {
+        Tcl_ListObjAppendElement(NULL, command, objv[i]);
+    }
 
-    return TCL_OK;
+    f = (TerminalFrame *) ckalloc(sizeof(TerminalFrame));
+    f->terminal = t;
+    f->saved = terminal;
+    f->prev = terminalFrames;
+    terminalFrames = f;
+
+    Tcl_Preserve((ClientData) t);
+    if (f->saved != NULL) Tcl_Preserve((ClientData) f->saved);
+    terminal_select(t);
+
+    Tcl_NRAddCallback(interp, terminal_done, f, NULL, NULL, NULL);
+    return Tcl_NREvalObj(interp, command, 0);
+}
+
+static int terminal_done(ClientData data[], Tcl_Interp *interp,
+                         int result) {
+    TerminalFrame *f = (TerminalFrame *) data[0];
+    TerminalFrame **p;
+
+    for (p = &terminalFrames; *p != NULL; p = &(*p)->prev) {
+        if (*p == f) {
+            *p = f->prev;
+            break;
+        }
+    }
+
+    terminal_select(f->saved);
+    if (f->saved != NULL) Tcl_Release((ClientData) f->saved);
+    Tcl_Release((ClientData) f->terminal);
+    ckfree((char *) f);
+
+    return result;
 }
 
+#endif /*CONSIO_NRE*/
+
 /*****************************************************************************
- * Consio::cgetse
+ * Consio::terminal
  *
  * Description:
  *
- *   This command reads user input until the Enter key has been pressed. This
- *   command will echo everything back to the console. The maximum input size
- *   at the moment is 4095 characters.
- *
- * This command calls the following Windows API functions:
- *
- *   - GetConsoleMode
- *   - SetConsoleMode
- *   - ReadConsole
+ *   Gets or sets the current terminal, which the Consio commands use
+ *   when they are not run through the command of a terminal.
  *
  * Parameters:
  *
- *   None.
+ *   name - command of a terminal opened by Consio::open, or "console" for
+ *          the console of the process
  *
  * Results:
  *
- *   Returns a string. Newline character will not be included.
+ *   Returns the name of the current terminal.
  *
  * Side effects:
  *
- *   The command will block until the Enter key has been pressed. The user
- *   input will be echoed to the console.
+ *   None.
  *****************************************************************************/
 
-static int cmd_cgetse(ClientData clientData,
-                      Tcl_Interp *interp,
-                      int objc,
-                      Tcl_Obj * CONST objv[]) {
-    DWORD oldMode, newMode;
-    TCHAR buffer[4096];
-    DWORD num;
-    Tcl_Obj *obj_str;
+static int cmd_terminal(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    Tcl_CmdInfo info;
+    char *name;
 
-    newMode = ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT;
-    GetConsoleMode(hStdin, &oldMode);
-    SetConsoleMode(hStdin, newMode);
-    ReadConsole(hStdin, buffer, 4095, &num, NULL);
-    SetConsoleMode(hStdin, oldMode);
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?name?");
+        return TCL_ERROR;
+    }
 
-    if (buffer[num - 1] == '\r' || buffer[num - 1] == '\n') num--;
-    if (buffer[num - 1] == '\r' || buffer[num - 1] == '\n') num--;
+    if (objc == 2) {
+        name = Tcl_GetString(objv[1]);
+        if (strcmp(name, "console") == 0) {
+            terminal_select(NULL);
+        }
+        else if (Tcl_GetCommandInfo(interp, name, &info) &&
+                 info.objProc == terminal_cmd) {
+            terminal_select((Terminal *) info.objClientData);
+        }
+        else {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "no such terminal \"%s\"", name));
+            return TCL_ERROR;
+        }
+    }
 
-    obj_str = Tcl_NewStringObj(buffer, num);
-    Tcl_SetObjResult(interp, obj_str);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(
+        terminal != NULL ? terminal->name : "console", -1));
 
     return TCL_OK;
 }
 
 /*****************************************************************************
- * Consio::getchex
+ * Consio::template
  *
  * Description:
  *
- *   Extended getch will wait for key press from the keyboard and returns it
- *   as a device-independent integer code. This function will react to any
- *   key.
+ *   Compiles a mostly static screen layout, such as a form, into a block
+ *   of cells once. Rendering writes the whole block with one call instead
+ *   of replaying the gotoxy, textattr and cputs calls that drew it, and
+ *   setting a field writes only the cells of that field, so repainting
+ *   costs as much as the fields that change rather than the whole layout.
+ *
+ *   The layout is a list of items, drawn in order:
+ *
+ *     text x y string ?fg bg?
+ *                       - text on one row
+ *     fill x y width height char ?fg bg?
+ *                       - rectangle filled with a character
+ *     box x y width height ?fg bg?
+ *                       - frame drawn with box drawing characters
+ *     field name x y width ?align? ?fg bg?
+ *                       - field for a value; align is left (the default)
+ *                         or right
+ *
+ *   Positions are relative to the upper left corner of the template.
+ *   Items without colors use the text attributes current when the
+ *   template is created.
+ *
+ *   The command returns the name of a new command, which is used to
+ *   control the template:
+ *
+ *     template render x y ?values?
+ *                       - sets the fields from a dictionary and writes
+ *                         the template to the console
+ *     template set name value ?name value ...?
+ *                       - sets fields, writing them to the console if the
+ *                         template has been rendered
+ *     template get name - returns the value of a field
+ *     template fields   - returns the names of the fields
+ *     template destroy  - deletes the template command
  *
  * This command calls the following Windows API functions:
  *
- *   - GetConsoleMode
- *   - SetConsoleMode
- *   - ReadConsoleInput
+ *   - GetConsoleScreenBufferInfo
  *
  * Parameters:
  *
- *   None.
+ *   width  - width of the template
+ *   height - height of the template
+ *   layout - list of items
  *
  * Results:
  *
- *   Returns integer value of the key. The value is device-independent as
- *   opposed to scan code.
+ *   Returns the name of the template command.
  *
  * Side effects:
  *
  *   None.
  *****************************************************************************/
 
-static int cmd_getchex(ClientData clientData,
-                       Tcl_Interp *interp,
-                       int objc,
-                       Tcl_Obj * CONST objv[]) {
-    DWORD oldMode, newMode;
-    INPUT_RECORD buffer[1];
-    DWORD num;
-    WORD code;
-    Tcl_Obj *obj_str;
+static int cmd_template(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    Template *t;
+    Tcl_Obj **items;
+    char name[32];
+    int size[2];
+    int i, numItems;
 
-    newMode = 0;
+    if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, "width height layout");
+        return TCL_ERROR;
+    }
 
-    GetConsoleMode(hStdin, &oldMode);
-    SetConsoleMode(hStdin, newMode);
+    for (i = 0; i < 2; i++) {
+        if (Tcl_GetIntFromObj(interp, objv[i + 1], &size[i]) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+    if (size[0] < 1 || size[1] < 1 ||
+        size[0] > 0x7FFF || size[1] > 0x7FFF) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("bad template size", -1));
+        return TCL_ERROR;
+    }
+    if ((Tcl_WideInt) size[0] * size[1] * sizeof(CHAR_INFO) > 0x7FFFFFFF) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("template too large", -1));
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, objv[3], &numItems,
+                               &items) != TCL_OK) {
+        return TCL_ERROR;
+    }
 
-    do {
-        ReadConsoleInput(hStdin, buffer, 1, &num);
-    } while (num == 0 || buffer[0].EventType != KEY_EVENT ||
-             buffer[0].Event.KeyEvent.bKeyDown == FALSE);
+    GetConsoleScreenBufferInfo(hStdout, &info);
 
-    SetConsoleMode(hStdin, oldMode);
+    t = (Template *) ckalloc(sizeof(Template));
+    memset(t, 0, sizeof(Template));
+    t->width = size[0];
+    t->height = size[1];
+    t->cells = (CHAR_INFO *) ckalloc(t->width * t->height *
+                                     sizeof(CHAR_INFO));
+    for (i = 0; i < t->width * t->height; i++) {
+        t->cells[i].Char.UnicodeChar = ' ';
+        t->cells[i].Attributes = info.wAttributes;
+    }
+    Tcl_InitHashTable(&t->names, TCL_STRING_KEYS);
 
-    code = buffer[0].Event.KeyEvent.wVirtualKeyCode;
-    obj_str = Tcl_NewIntObj(code);
-    Tcl_SetObjResult(interp, obj_str);
+    for (i = 0; i < numItems; i++) {
+        if (template_item(interp, t, items[i], info.wAttributes) != TCL_OK) {
+            template_free((ClientData) t);
+            return TCL_ERROR;
+        }
+    }
+
+    sprintf(name, "Consio::template%d", ++templateCounter);
+    t->token = Tcl_CreateObjCommand(interp, name, template_cmd, t,
+                                    template_free);
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
 
     return TCL_OK;
 }
 
 /*****************************************************************************
- * Consio::getkeystate
+ * template command
  *
  * Description:
  *
- * See GetAsyncKeyState from MSDN:
- * https://msdn.microsoft.com/en-us/library/windows/desktop/ms646293(v=vs.85).aspx
- * https://msdn.microsoft.com/en-us/library/windows/desktop/dd375731(v=vs.85).aspx
+ *   Implements the subcommands of a template created by Consio::template.
  *
  * This command calls the following Windows API functions:
  *
- *   - GetAsyncKeyState
+ *   - WriteConsoleOutputW
  *
  * Parameters:
  *
- *   id - virtual-key code
+ *   See Consio::template.
  *
  * Results:
  *
- * Returns key state. The most significant bit tells if the key is up (bit not
- * set) or down (sit set). The lease significant bit tells, if the key was
- * pressed after previous call of getkeystate.
+ *   See Consio::template.
  *
  * Side effects:
  *
- *   None.
+ *   See Consio::template.
  *****************************************************************************/
 
-static int cmd_getkeystate(ClientData clientData,
-                           Tcl_Interp *interp,
-                           int objc,
-                           Tcl_Obj * CONST objv[]) {
-    int id;
-    int state;
-    Tcl_Obj *obj_int;
+static int template_cmd(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    CONST char *options[] = {"destroy", "fields", "get", "render", "set",
+                             (char *) NULL};
+    enum {TEMPLATE_DESTROY, TEMPLATE_FIELDS, TEMPLATE_GET, TEMPLATE_RENDER,
+          TEMPLATE_SET};
+    Template *t = (Template *) clientData;
+    Tcl_HashEntry *entry;
+    Tcl_Obj **values;
+    Tcl_Obj *list;
+    int index, pos[2], numValues, shown, i;
 
     if (objc < 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, "id");
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg ...?");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &id) == TCL_OK) {
-        state = GetAsyncKeyState(id);
-    }
-    else {
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "option", 0,
+                            &index) != TCL_OK) {
         return TCL_ERROR;
     }
 
-    obj_int = Tcl_NewIntObj(state);
-    Tcl_SetObjResult(interp, obj_int);
+    switch (index) {
+        case TEMPLATE_DESTROY:
+            Tcl_DeleteCommandFromToken(interp, t->token);
+            break;
+
+        case TEMPLATE_FIELDS:
+            list = Tcl_NewListObj(0, NULL);
+            for (i = 0; i < t->numFields; i++) {
+                Tcl_ListObjAppendElement(NULL, list, t->fields[i].name);
+            }
+            Tcl_SetObjResult(interp, list);
+            break;
+
+        case TEMPLATE_GET:
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "name");
+                return TCL_ERROR;
+            }
+            entry = Tcl_FindHashEntry(&t->names, Tcl_GetString(objv[2]));
+            if (entry == NULL) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "no such field \"%s\"", Tcl_GetString(objv[2])));
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp,
+                t->fields[(size_t) Tcl_GetHashValue(entry)].value);
+            break;
+
+        case TEMPLATE_RENDER:
+            if (objc != 4 && objc != 5) {
+                Tcl_WrongNumArgs(interp, 2, objv, "x y ?values?");
+                return TCL_ERROR;
+            }
+            for (i = 0; i < 2; i++) {
+                if (Tcl_GetIntFromObj(interp, objv[i + 2],
+                                      &pos[i]) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            }
+            numValues = 0;
+            if (objc == 5 && Tcl_ListObjGetElements(interp, objv[4],
+                                 &numValues, &values) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (numValues % 2 != 0) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                    "missing value to go with field", -1));
+                return TCL_ERROR;
+            }
+
+            if (template_check(interp, t, values, numValues) != TCL_OK) {
+                return TCL_ERROR;
+            }
+
+            /* Update the cells only; the whole block is written below */
+
+            shown = t->shown;
+            t->shown = 0;
+            for (i = 0; i < numValues; i += 2) {
+                if (template_update(interp, t, values[i],
+                                    values[i + 1]) != TCL_OK) {
+                    t->shown = shown;
+                    return TCL_ERROR;
+                }
+            }
+            t->x = pos[0];
+            t->y = pos[1];
+            t->shown = 1;
+            console_write_cells(hStdout, t->cells, t->x, t->y,
+                                t->width, t->height);
+            break;
+
+        case TEMPLATE_SET:
+            if (objc < 4 || objc % 2 != 0) {
+                Tcl_WrongNumArgs(interp, 2, objv,
+                                 "name value ?name value ...?");
+                return TCL_ERROR;
+            }
+            if (template_check(interp, t, objv + 2, objc - 2) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            for (i = 2; i < objc; i += 2) {
+                if (template_update(interp, t, objv[i],
+                                    objv[i + 1]) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            }
+            break;
+    }
 
     return TCL_OK;
 }
 
 /*****************************************************************************
- * Consio::getch2
+ * Consio::onresize
  *
  * Description:
  *
- *   Waits for a keypress. Doesn't echo it to the console.
- *   This is based on MSVCRT implementation. See more information here:
- *   https://docs.microsoft.com/en-us/cpp/c-runtime-library/reference/getch-getwch
+ *   Sets a handler which runs when the console window changes size, so a
+ *   program does not have to poll Consio::bufferwidth and redraw
+ *   everything. A burst of changes while the window is being resized
+ *   gives one call once the size has not changed for RESIZE_DEBOUNCE
+ *   milliseconds. The handler is called from the event loop with three
+ *   arguments appended:
+ *
+ *     width height exposed
+ *
+ *   where width and height are the new size of the window and exposed is
+ *   a list of rectangles {x y width height}, in buffer coordinates, which
+ *   were not in the window before, whether it grew or moved in the
+ *   buffer. The console keeps the rest of the
+ *   buffer, so redrawing only the exposed rectangles is enough unless the
+ *   layout depends on the size.
  *
  * This command calls the following Windows API functions:
  *
- *   - _getch
+ *   - GetConsoleScreenBufferInfo
  *
  * Parameters:
  *
- *   None.
+ *   script - command prefix to call, or an empty string to remove the
+ *            handler
  *
  * Results:
  *
- *   Returns the first character from the input buffer. If the value is larger
- *   than 255, then the key was a special key (arrow, function key, etc.)
+ *   Returns the current handler.
  *
  * Side effects:
  *
- *
- *
+ *   Checks the window size every RESIZE_POLL milliseconds while a handler
+ *   is set. The handler is removed when its interpreter is deleted.
  *****************************************************************************/
 
-static int cmd_getch2(ClientData clientData,
-                      Tcl_Interp *interp,
-                      int objc,
-                      Tcl_Obj * CONST objv[]) {
-    int key;
-    Tcl_Obj *obj_int;
+static int cmd_onresize(ClientData clientData,
+                        Tcl_Interp *interp,
+                        int objc,
+                        Tcl_Obj * CONST objv[]) {
+    int len;
 
-    key = _getch();
-    if (key == 0 || key == 0xE0) {
-        key = _getch() + 0x100;
+    if (objc > 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "?script?");
+        return TCL_ERROR;
     }
 
-    obj_int = Tcl_NewIntObj(key);
-    Tcl_SetObjResult(interp, obj_int);
+    if (objc == 2) {
+        if (resizeInterp != NULL) {
+            Tcl_DontCallWhenDeleted(resizeInterp, resize_forget, NULL);
+            resize_forget(NULL, resizeInterp);
+        }
+
+        Tcl_GetStringFromObj(objv[1], &len);
+        if (len > 0) {
+            resizeScript = objv[1];
+            Tcl_IncrRefCount(resizeScript);
+            resizeInterp = interp;
+            Tcl_CallWhenDeleted(interp, resize_forget, NULL);
+
+            resize_size(&resizeWindow);
+            resizeSeenWidth = resizeWindow.Right - resizeWindow.Left + 1;
+            resizeSeenHeight = resizeWindow.Bottom - resizeWindow.Top + 1;
+            resizePoll = Tcl_CreateTimerHandler(RESIZE_POLL, resize_poll,
+                                                NULL);
+        }
+    }
+
+    if (resizeScript != NULL) Tcl_SetObjResult(interp, resizeScript);
 
     return TCL_OK;
 }
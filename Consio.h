@@ -88,4 +88,547 @@ static int cmd_cgetse(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_O
 static int cmd_getchex(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
 static int cmd_getkeystate(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
 static int cmd_getch2(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_record(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_replay(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_readline(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_history(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_pager(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int pager_cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_width(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_truncate(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_wrap(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_table(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int table_cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_export(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_caps(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_getevent(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_paste(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_image(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_canvas(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int canvas_cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_scrollback(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_screen(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_encoder(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_find(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_waitfor(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_open(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_terminal(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_template(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int cmd_onresize(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+
+/* Session recording record types */
+
+#define REC_MAGIC       "CONSIOR1"
+#define REC_MAGIC_LEN   8
+#define REC_HEADER_LEN  9
+
+#define REC_OUT_TEXT    'T'
+#define REC_OUT_GOTO    'G'
+#define REC_OUT_ATTR    'A'
+#define REC_OUT_CLEAR   'C'
+#define REC_OUT_CELLS   'B'
+#define REC_OUT_SCROLL  'S'
+#define REC_IN_CHAR     'c'
+#define REC_IN_KEY      'k'
+#define REC_IN_KEY2     '2'
+#define REC_IN_LINE     'l'
+#define REC_IN_EVENT    'e'
+
+/* Display width classes, see ConsioWidth.h */
+
+#define WIDTH_ZERO    0
+#define WIDTH_NARROW  1
+#define WIDTH_WIDE    2
+#define WIDTH_CONTROL 3
+
+/* Largest console read in bytes that works on all versions of Windows */
+
+#define CONSOLE_READ_MAX 8192
+
+/* Line editor state used by Consio::readline */
+
+typedef struct LineEditor {
+    Tcl_UniChar *line;      /* text being edited */
+    int len;                /* length of the text */
+    int cap;                /* allocated size of line */
+    int pos;                /* cursor position within the text */
+    Tcl_UniChar *shown;     /* text currently visible on the console */
+    int shownLen;           /* length of the visible text */
+    int shownCap;           /* allocated size of shown */
+    Tcl_UniChar *prompt;    /* prompt, redrawn after listing completions */
+    int promptLen;          /* length of the prompt */
+    int x0, y0;             /* console cell where the text starts */
+    int width;              /* console buffer width */
+} LineEditor;
+
+#define HISTORY_DEFAULT_LIMIT 100
+
+/* Memory-mapped file viewer used by Consio::pager */
+
+typedef struct Pager {
+    HANDLE file;                /* file handle */
+    HANDLE mapping;             /* file mapping, NULL for an empty file */
+    Tcl_WideInt size;           /* file size in bytes */
+    unsigned char *view;        /* currently mapped part of the file */
+    Tcl_WideInt viewOffset;     /* file offset of the mapped part */
+    Tcl_WideInt viewLen;        /* length of the mapped part */
+    Tcl_WideInt *checkpoints;   /* offset of every PAGER_CHECKPOINT:th line */
+    int numCheckpoints;         /* number of known checkpoints */
+    int maxCheckpoints;         /* allocated size of checkpoints */
+    Tcl_WideInt indexedLine;    /* last line with a known offset */
+    Tcl_WideInt indexedOffset;  /* offset of that line */
+    Tcl_WideInt lineCount;      /* number of lines, -1 until known */
+    Tcl_WideInt top;            /* first visible line */
+    int x, y;                   /* upper left corner of the viewport */
+    int width, height;          /* size of the viewport */
+    Tcl_Command token;          /* pager command */
+} Pager;
+
+#define PAGER_CHECKPOINT 1024
+#define PAGER_VIEW_SIZE  (4 * 1024 * 1024)
+#define PAGER_LINE_MAX   4096
+#define PAGER_TAB_WIDTH  8
+
+/* Virtual-scrolling table used by Consio::table */
+
+typedef struct Table {
+    int x, y;                   /* upper left corner of the table */
+    int width, height;          /* size of the table including the header */
+    int numColumns;             /* number of columns */
+    Tcl_Obj **titles;           /* column titles */
+    int *fixed;                 /* requested column widths, 0 for automatic */
+    int *right;                 /* non-zero for right-aligned columns */
+    int *widths;                /* computed column widths */
+    int widthsValid;            /* non-zero when widths are up to date */
+    Tcl_Obj *rows;              /* row data as a list of lists, or NULL */
+    Tcl_Obj *fetch;             /* command fetching rows, or NULL */
+    int rowCount;               /* number of rows */
+    Tcl_Obj *cache;             /* rows returned by the last fetch */
+    int cacheFirst;             /* index of the first cached row */
+    int top;                    /* first visible row */
+    int selected;               /* selected row, -1 for none */
+    int sortColumn;             /* highlighted sort column, -1 for none */
+    WORD attrBody;              /* attributes of the rows */
+    WORD attrHeader;            /* attributes of the header */
+    WORD attrSelected;          /* attributes of the selection bar */
+    WORD attrSort;              /* attributes of the sort column */
+    Tcl_Interp *interp;         /* interpreter for the fetch command */
+    Tcl_Command token;          /* table command */
+    int changes;                /* counts changes of the columns and rows */
+    int deleted;                /* set when the table command is deleted */
+} Table;
+
+#define TABLE_FETCH_PAGES 3
+
+/*
+ * Shared-memory screen export used by Consio::export. The file starts with
+ * this header, followed by the cell grid (maxHeight rows of maxWidth
+ * CHAR_INFO cells, UTF-16 character and attributes) and an array of
+ * maxHeight 32-bit frame numbers telling when each row last changed. The
+ * layout is described in Consio.txt; fields are only ever added to the end
+ * of the header, and headerSize tells readers where it ends.
+ */
+
+typedef struct ExportHeader {
+    char magic[8];              /* EXPORT_MAGIC */
+    DWORD version;              /* EXPORT_VERSION */
+    DWORD headerSize;           /* size of this header in bytes */
+    volatile LONG sequence;     /* odd while an update is in progress */
+    DWORD frame;                /* number of updates so far */
+    DWORD maxWidth;             /* row stride of the cell grid */
+    DWORD maxHeight;            /* number of rows in the cell grid */
+    DWORD width;                /* width of the mirrored window */
+    DWORD height;               /* height of the mirrored window */
+    DWORD cursorX;              /* cursor column within the window */
+    DWORD cursorY;              /* cursor row within the window */
+    DWORD cursorVisible;        /* non-zero if the cursor is visible */
+    DWORD attributes;           /* current text attributes */
+    DWORD cellsOffset;          /* file offset of the cell grid */
+    DWORD rowsOffset;           /* file offset of the row frame numbers */
+} ExportHeader;
+
+#define EXPORT_MAGIC    "CONSIOX1"
+#define EXPORT_VERSION  1
+
+/* Terminal capability probing used by Consio::caps */
+
+#define CAPS_MAGIC      "CONSIOCAPS2"
+#define CAPS_CACHE_NAME "caps.cache"
+#define CAPS_TIMEOUT    250
+#define CAPS_REPLY_MAX  512
+#define CAPS_KEEP_CHUNK 64
+
+/* Paste detection used by Consio::getevent and Consio::readline */
+
+#define INPUT_NONE          0
+#define INPUT_KEY           1
+#define INPUT_PASTE         2
+
+#define PASTE_BURST_CHARS   32
+#define PASTE_BATCH         256
+#define PASTE_MARK_PEEK     16
+#define PASTE_GAP           10
+#define PASTE_WAIT          1000
+
+/* Source rows summed in 32 bits by image_scale before 64-bit sums */
+
+#define IMAGE_SUM_ROWS      65536
+
+/* Braille plotting canvas used by Consio::canvas */
+
+typedef struct Canvas {
+    int x, y;                   /* upper left corner of the canvas */
+    int cols, rows;             /* size of the canvas in cells */
+    unsigned char *dots;        /* braille dot pattern of each cell */
+    WORD *attrs;                /* attributes of each cell */
+    WORD attr;                  /* attributes for new dots */
+    double xmin, ymin;          /* coordinates of the lower left dot */
+    double xmax, ymax;          /* coordinates of the upper right dot */
+    int dirtyTop, dirtyBottom;  /* rows changed since the last flush */
+    Tcl_Command token;          /* canvas command */
+} Canvas;
+
+#define CANVAS_CLAMP 1000000.0
+
+/* Scrollback store used by Consio::scrollback */
+
+#define SCROLL_DEFAULT_LIMIT 10000
+#define SCROLL_BLOCK_LINES   64
+#define SCROLL_HOT_BLOCKS    2
+#define SCROLL_STYLES_MAX    256
+#define SCROLL_VARINT_MAX    5
+#define SCROLL_MIN_MATCH     4
+#define SCROLL_HASH_BITS     12
+#define SCROLL_HASH_SIZE     (1 << SCROLL_HASH_BITS)
+#define SCROLL_LINE_MAX(width) \
+    (1 + 3 * SCROLL_VARINT_MAX + (width) * (SCROLL_VARINT_MAX + 3))
+
+typedef struct ScrollBlock {
+    int count;                  /* number of lines */
+    int size;                   /* bytes of encoded lines */
+    int packed;                 /* compressed size, 0 if not compressed */
+    int capacity;               /* bytes allocated for data */
+    int cells;                  /* number of cells in the lines */
+    unsigned char *data;        /* encoded or compressed lines */
+    int offsets[SCROLL_BLOCK_LINES]; /* start of each encoded line */
+} ScrollBlock;
+
+/* Screen buffers managed by Consio::screen */
+
+#define SCREEN_MAX 8
+
+/* Escape sequence encoder used by Consio::encoder */
+
+typedef struct Encoder {
+    Tcl_Channel channel;        /* channel receiving the sequences */
+    int width, height;          /* size of the remote screen */
+    CHAR_INFO *screen;          /* cells shown by the remote terminal */
+    CHAR_INFO *frame;           /* console window read for a frame */
+    int valid;                  /* 0 until the remote screen is known */
+    int cursorX, cursorY;       /* remote cursor, cursorX -1 if unknown */
+    int cursorVisible;          /* remote cursor visibility, -1 if unknown */
+    WORD attr;                  /* remote text attributes */
+    int attrValid;              /* 0 if the attributes are unknown */
+    int rep;                    /* non-zero to use REP */
+    int pending;                /* non-zero when a frame is scheduled */
+    Tcl_DString out;            /* frame being built */
+    Tcl_WideInt frames;         /* frames sent */
+    Tcl_WideInt bytes;          /* bytes sent */
+    Tcl_WideInt cells;          /* cells sent */
+    int lastBytes;              /* bytes of the last frame */
+} Encoder;
+
+#define ENCODER_ATTR_FLAGS  (COMMON_LVB_REVERSE_VIDEO | COMMON_LVB_UNDERSCORE)
+#define ENCODER_ATTR_MASK   (0xFF | ENCODER_ATTR_FLAGS)
+#define ENCODER_GAP         4
+#define ENCODER_SCROLL_GAIN 2
+
+/* Screen search used by Consio::find and Consio::waitfor */
+
+typedef struct FindSpec {
+    int x, y;                   /* upper left corner of the rectangle */
+    int width, height;          /* size of the rectangle */
+    int nocase;                 /* ignore case */
+    Tcl_RegExp regexp;          /* regular expression, or NULL */
+    Tcl_Obj *pattern;           /* private copy owning the regexp */
+    Tcl_UniChar *literal;       /* literal pattern, lower case with nocase */
+    int literalLen;             /* length of the literal pattern */
+    Tcl_UniChar *text;          /* text of the row being searched */
+    int *cols;                  /* cell of each character of text */
+} FindSpec;
+
+#define FIND_POLL 50
+
+/* Terminal opened with Consio::open. The console of the process keeps its
+   state in one too while a terminal is current. */
+
+#define TERMINAL_READ_MAX 256
+#define TERMINAL_KEYS_MAX 4096
+
+/* Milliseconds an escape character at the end of the input waits for the
+   rest of an escape sequence before it is taken as the Escape key */
+
+#define TERMINAL_ESC_WAIT 50
+
+typedef struct Terminal {
+    char name[32];              /* name of the terminal command */
+    Tcl_Command command;        /* terminal command */
+    Tcl_Channel channel;        /* channel to the terminal */
+    HANDLE hStdout;             /* screen buffer written by the commands */
+    HANDLE screens[SCREEN_MAX]; /* screen buffers of the terminal */
+    int screenActive;           /* screen shown on the terminal */
+    int screenTarget;           /* screen written by the commands */
+    Encoder *encoder;           /* encoder sending the shown screen */
+    INPUT_RECORD *keys;         /* key presses received */
+    int keyFirst;               /* first unread key press */
+    int keyCount;               /* end of the key presses */
+    int keyCap;                 /* allocated key presses */
+    unsigned char pending[TERMINAL_READ_MAX]; /* bytes not yet parsed */
+    int pendingLen;             /* number of bytes not yet parsed */
+    int lastCr;                 /* the last byte parsed was CR */
+    int eof;                    /* the input has ended */
+    int closed;                 /* the terminal has been closed */
+    Tcl_TimerToken escape;      /* timer ending a lone escape character */
+    struct InputWaiter *waiters; /* coroutines waiting for input */
+} Terminal;
+
+/* Screen template used by Consio::template */
+
+typedef struct TemplateField {
+    Tcl_Obj *name;              /* name of the field */
+    Tcl_Obj *value;             /* value shown in the field */
+    int x, y;                   /* position in the template */
+    int width;                  /* width in cells */
+    int right;                  /* 1 if the value is right-aligned */
+    WORD attr;                  /* attributes of the field */
+} TemplateField;
+
+typedef struct Template {
+    int width, height;          /* size of the template */
+    CHAR_INFO *cells;           /* static cells with the field values */
+    TemplateField *fields;      /* fields in layout order */
+    int numFields;              /* number of fields */
+    int capFields;              /* allocated fields */
+    Tcl_HashTable names;        /* field index by name */
+    int x, y;                   /* position where last rendered */
+    int shown;                  /* 1 once rendered */
+    Tcl_Command token;          /* template command */
+} Template;
+
+/* Window size polling and debouncing of Consio::onresize, in
+   milliseconds */
+
+#define RESIZE_POLL     100
+#define RESIZE_DEBOUNCE 150
+
+/* Coroutine input, available with Tcl 8.6 and later */
+
+#if TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION >= 6)
+#define CONSIO_NRE
+#endif
+
+#define INPUT_WAIT_CHAR      1
+#define INPUT_WAIT_CHAR_ECHO 2
+#define INPUT_WAIT_KEY       3
+#define INPUT_WAIT_LINE      4
+#define INPUT_WAIT_LINE_ECHO 5
+#define INPUT_LINE_MAX       4095
+
+#ifdef CONSIO_NRE
+typedef struct InputWaiter {
+    int kind;                   /* what to wait for, INPUT_WAIT_ */
+    int done;                   /* set when the input has arrived */
+    Tcl_Interp *interp;         /* interpreter of the coroutine */
+    Tcl_Obj *coroutine;         /* name of the waiting coroutine */
+    INPUT_RECORD record;        /* key press for key and character waits */
+    Tcl_DString line;           /* line being entered for line waits */
+    Terminal *terminal;         /* terminal read, or NULL for the console */
+    struct TerminalFrame *frame; /* terminal command that was running */
+    Terminal *resumer;          /* terminal current when resumed */
+    int resumed;                /* resumer is set */
+    struct InputWaiter *next;   /* next waiter in the queue */
+} InputWaiter;
+
+/* Terminal command running Consio commands with its terminal current. A
+   coroutine waiting for input inside it takes the frame along, so the
+   terminal is current only while the coroutine runs. */
+
+typedef struct TerminalFrame {
+    Terminal *terminal;         /* terminal of the command */
+    Terminal *saved;            /* terminal to make current when leaving */
+    struct TerminalFrame *prev; /* enclosing terminal command */
+} TerminalFrame;
+#endif /*CONSIO_NRE*/
+
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+#ifndef ENABLE_VIRTUAL_TERMINAL_INPUT
+#define ENABLE_VIRTUAL_TERMINAL_INPUT 0x0200
+#endif
+
+/* Internal helper functions */
+
+static void console_clear(HANDLE handle);
+static int get_color_attr(Tcl_Interp *interp, Tcl_Obj *fg, Tcl_Obj *bg, WORD *attr);
+static void record_event(int type, const void *data, int len);
+static void record_int(int type, int value);
+static void record_goto(int x, int y);
+static DWORD get_u32(const unsigned char *p);
+static Tcl_Obj *replay_load(Tcl_Interp *interp, Tcl_Obj *filename);
+static int replay_next_input(int *pos);
+static int replay_input(Tcl_Interp *interp, int type, Tcl_Obj **result);
+static void console_write_unicode(HANDLE handle, const Tcl_UniChar *str, int len);
+static void editor_reserve(Tcl_UniChar **buffer, int *cap, int need);
+static void editor_insert(LineEditor *ed, const Tcl_UniChar *str, int len);
+static void editor_delete(LineEditor *ed, int from, int to, int kill);
+static void editor_set(LineEditor *ed, Tcl_Obj *text);
+static int editor_offset(LineEditor *ed, const Tcl_UniChar *text, int index);
+static void editor_cluster(LineEditor *ed, int index, int *prev, int *next);
+static void editor_goto(LineEditor *ed, int index);
+static void editor_start(LineEditor *ed);
+static void editor_refresh(LineEditor *ed);
+static int editor_complete(Tcl_Interp *interp, LineEditor *ed, Tcl_Obj *command);
+static void history_add(Tcl_Obj *line);
+static void console_read_cells(HANDLE handle, CHAR_INFO *cells, int x, int y, int width, int height);
+static void console_write_cells(HANDLE handle, CHAR_INFO *cells, int x, int y, int width, int height);
+static void record_cells(const CHAR_INFO *cells, int x, int y, int width, int height);
+static void console_scroll(HANDLE handle, int x, int y, int width, int height, int dy, WORD attr);
+static void cells_from_utf8(CHAR_INFO *cells, int width, const char *str, int len, WORD attr);
+static int width_class(int cp);
+static const unsigned char *utf8_next(const unsigned char *p, const unsigned char *end, int *cp);
+static int ascii_run(const unsigned char *p, const unsigned char *end);
+static const unsigned char *grapheme_next(const unsigned char *p, const unsigned char *end, int *width);
+static int text_width(const unsigned char *p, int len);
+static unsigned char *pager_map(Pager *p, Tcl_WideInt offset, Tcl_WideInt *avail);
+static Tcl_WideInt pager_next_line(Pager *p, Tcl_WideInt offset);
+static void pager_index_next(Pager *p);
+static int pager_line_offset(Pager *p, Tcl_WideInt line, Tcl_WideInt *offset);
+static Tcl_WideInt pager_line_of_offset(Pager *p, Tcl_WideInt offset);
+static int pager_read_line(Pager *p, Tcl_WideInt offset, char *buffer, int size, Tcl_WideInt *next);
+static void pager_render_rows(Pager *p, int first, int count);
+static void pager_scroll(Pager *p, Tcl_WideInt lines);
+static Tcl_WideInt pager_search(Pager *p, const char *pattern, int len, Tcl_WideInt from, Tcl_WideInt to, int last);
+static void pager_free(ClientData clientData);
+static int table_get_row(Table *t, int index, Tcl_Obj **row);
+static int table_layout(Table *t);
+static int table_fill_row(Table *t, int index, CHAR_INFO *cells);
+static int table_render_rows(Table *t, int first, int count);
+static int table_render_header(Table *t);
+static int table_scroll(Table *t, int rows);
+static void table_clear_columns(Table *t);
+static void table_free(ClientData clientData);
+static void table_release(char *clientData);
+static void export_touch(void);
+static void export_idle(ClientData clientData);
+static int export_sync(void);
+static void export_close(void);
+static int caps_build(void);
+static Tcl_Obj *caps_identity(Tcl_Interp *interp);
+static Tcl_Obj *caps_cache_path(Tcl_Interp *interp);
+static Tcl_Obj *caps_load(Tcl_Obj *path);
+static void caps_store(Tcl_Obj *path, Tcl_Obj *key, Tcl_Obj *caps);
+static int caps_query(char *reply, int size);
+static int caps_mode(const char *reply, int mode);
+static Tcl_Obj *caps_probe(Tcl_Interp *interp);
+static Tcl_Obj *caps_get(Tcl_Interp *interp, int refresh);
+static void paste_append(int ch);
+static void paste_gather(int bracketed);
+static DWORD input_mode(void);
+static void input_vt_key(INPUT_RECORD *rec);
+static int input_next(INPUT_RECORD *rec, int timeout);
+static Tcl_Obj *input_event_obj(int type, INPUT_RECORD *rec);
+static int input_event_rec(Tcl_Obj *event, INPUT_RECORD *rec);
+static void image_accumulate(int *sum, const unsigned char *row, int n);
+static void image_scale(const unsigned char *data, int sw, int sh, int channels, int dw, int dh, const unsigned char *bg, int *out);
+static int image_nearest(int r, int g, int b);
+static void image_quantize(int *pixels, int w, int h, int dither, unsigned char *colors);
+static int image_write_truecolor(const int *pixels, int x, int y, int cols, int rows);
+static void canvas_set(Canvas *c, int px, int py);
+static void canvas_line(Canvas *c, int x0, int y0, int x1, int y1);
+static int canvas_finite(double value);
+static int canvas_map(double value, double min, double max, int dots, int flip);
+static int canvas_values(Tcl_Interp *interp, Tcl_Obj *obj, int doubles, double **values, int *count);
+static void canvas_series(Canvas *c, const double *values, int n, double min, double max);
+static void canvas_flush(Canvas *c);
+static void canvas_clear(Canvas *c);
+static void canvas_free(ClientData clientData);
+static int scroll_style(WORD attr);
+static unsigned char *scroll_put_varint(unsigned char *p, int value);
+static const unsigned char *scroll_get_varint(const unsigned char *p, int *value);
+static int scroll_encode(const CHAR_INFO *cells, int width, unsigned char *out);
+static void scroll_decode(const unsigned char *p, CHAR_INFO *cells, int width, Tcl_UniChar *text, int *length);
+static int scroll_pack(const unsigned char *src, int n, unsigned char *dst);
+static int scroll_pack_sequence(unsigned char *dst, int out, int max, const unsigned char *literals, int count, int offset, int match);
+static int scroll_unpack(const unsigned char *src, int n, unsigned char *dst, int size);
+static const unsigned char *scroll_line(int index);
+static void scroll_append(const CHAR_INFO *cells, int width);
+static void scroll_trim(void);
+static void scroll_clear(void);
+static int screen_get(Tcl_Interp *interp, Tcl_Obj *obj, int *index);
+static Tcl_Obj *screen_name(int index);
+static void screen_copy(HANDLE from, HANDLE to);
+static void encoder_touch(void);
+static void encoder_idle(ClientData clientData);
+static int encoder_same(const CHAR_INFO *a, const CHAR_INFO *b);
+static void encoder_attr(Encoder *e, WORD attr);
+static int encoder_csi(char *buf, int n, char final);
+static void encoder_move(Encoder *e, int x, int y);
+static void encoder_span(Encoder *e, int y, int start, int end);
+static void encoder_scroll(Encoder *e);
+static int encoder_row_same(const CHAR_INFO *a, const CHAR_INFO *b, int width);
+static void encoder_resize(Encoder *e, int width, int height);
+static int encoder_frame(void);
+static void encoder_open(Tcl_Interp *interp, Tcl_Channel channel, int rep);
+static void encoder_close(void);
+static void find_touch(void);
+static void find_wake(ClientData clientData);
+static int find_parse(Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[], FindSpec *spec, int *all, int *timeout);
+static void find_free(FindSpec *spec);
+static int find_char(const Tcl_UniChar *text, int start, int len, Tcl_UniChar ch);
+static int find_row(Tcl_Interp *interp, FindSpec *spec, const CHAR_INFO *cells, int start, int *col);
+static int find_scan(Tcl_Interp *interp, FindSpec *spec, const CHAR_INFO *cells, int row, int all, Tcl_Obj *list);
+static void terminal_select(Terminal *t);
+static void terminal_push(Terminal *t, WORD vk, Tcl_UniChar ch);
+static WORD terminal_csi_key(int final, int param);
+static void terminal_parse(Terminal *t);
+static void terminal_readable(ClientData clientData, int mask);
+static void terminal_escape(ClientData clientData);
+static int terminal_key(Tcl_Interp *interp, Terminal *t, INPUT_RECORD *rec, int timeout);
+static int terminal_input(Tcl_Interp *interp, int type, int timeout, Tcl_Obj **result);
+static int input_source(Tcl_Interp *interp, int type, int timeout, Tcl_Obj **result);
+static int input_hit(void);
+static HANDLE terminal_buffer(int width, int height);
+static void terminal_free(ClientData clientData);
+static void terminal_release(char *clientData);
+static int terminal_cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int template_item(Tcl_Interp *interp, Template *t, Tcl_Obj *item, WORD attr);
+static void template_field(Template *t, TemplateField *f, CHAR_INFO *cells);
+static int template_update(Tcl_Interp *interp, Template *t, Tcl_Obj *name, Tcl_Obj *value);
+static int template_check(Tcl_Interp *interp, Template *t, Tcl_Obj * CONST objs[], int count);
+static void template_free(ClientData clientData);
+static int template_cmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static void resize_note(void);
+static void resize_size(SMALL_RECT *window);
+static void resize_poll(ClientData clientData);
+static void resize_exposed(const SMALL_RECT *from, const SMALL_RECT *to, Tcl_Obj *list);
+static void resize_forget(ClientData clientData, Tcl_Interp *interp);
+static void resize_fire(ClientData clientData);
+#ifdef CONSIO_NRE
+static Tcl_ThreadCreateType input_watch(ClientData clientData);
+static int input_event(Tcl_Event *event, int flags);
+static void input_dispatch(void);
+static int input_offer(InputWaiter *w, INPUT_RECORD *record);
+static int input_nr(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int input_resume(ClientData data[], Tcl_Interp *interp, int result);
+static void input_wake(InputWaiter *w);
+static int input_blocking(int kind, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static void input_park(InputWaiter *w);
+static void input_unpark(InputWaiter *w);
+static int terminal_ready(Terminal *t, int kind);
+static void terminal_dispatch(Terminal *t);
+static void terminal_wake(ClientData clientData);
+static int terminal_nr(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]);
+static int terminal_done(ClientData data[], Tcl_Interp *interp, int result);
+#endif /*CONSIO_NRE*/
 #endif /*__Consio_H__*/
@@ -0,0 +1,99 @@
+/*
+ * Title:   Consio - Windows console library, public C interface
+ * Author:  Matti J. Kärki
+ * Date:    2017-06-09
+ * Version: 0.3
+ * Notes:   Other extensions draw through this interface without going
+ *          through the Tcl commands. Compile with USE_CONSIO_STUBS
+ *          defined, link with ConsioStubLib.c and call Consio_InitStubs
+ *          from the extension's own init function:
+ *
+ *            if (Consio_InitStubs(interp, "0.3", 0) == NULL) {
+ *                return TCL_ERROR;
+ *            }
+ *
+ *          All coordinates are console buffer coordinates, as in
+ *          Consio::gotoxy, and attributes are combinations of the FG_*
+ *          and BG_* values of Consio.h. The functions operate on the same
+ *          console as the Consio commands, so output is also recorded by
+ *          Consio::record and exported by Consio::export.
+ */
+
+#ifndef __ConsioDecls_H__
+#define __ConsioDecls_H__
+
+#include <tcl.h>
+
+#define CONSIO_VERSION     "0.3"
+#define CONSIO_STUBS_MAGIC 0xC0510003
+
+/*
+ * A character cell: a UTF-16 character and its attributes. The layout is
+ * the same as the CHAR_INFO structure of the Windows console API.
+ */
+
+typedef struct ConsioCell {
+    unsigned short ch;
+    unsigned short attr;
+} ConsioCell;
+
+/* Functions */
+
+void Consio_PutCell(int x, int y, int ch, int attr);
+void Consio_PutSpan(int x, int y, const char *str, int len, int attr);
+void Consio_PutRect(int x, int y, int width, int height, const ConsioCell *cells);
+void Consio_FillRect(int x, int y, int width, int height, int ch, int attr);
+void Consio_ScrollRect(int x, int y, int width, int height, int dy, int attr);
+int Consio_GetAttr(void);
+void Consio_SetAttr(int attr);
+void Consio_GotoXY(int x, int y);
+void Consio_WhereXY(int *x, int *y);
+void Consio_GetWindow(int *x, int *y, int *width, int *height);
+int Consio_KbHit(void);
+int Consio_ReadKey(int timeout, int *ch);
+
+/*
+ * Stubs table. New entries are only ever added to the end, so extensions
+ * built against an older table keep working.
+ */
+
+typedef struct ConsioStubs {
+    int magic;
+    void *hooks;
+
+    void (*consio_PutCell)(int x, int y, int ch, int attr);
+    void (*consio_PutSpan)(int x, int y, const char *str, int len, int attr);
+    void (*consio_PutRect)(int x, int y, int width, int height, const ConsioCell *cells);
+    void (*consio_FillRect)(int x, int y, int width, int height, int ch, int attr);
+    void (*consio_ScrollRect)(int x, int y, int width, int height, int dy, int attr);
+    int (*consio_GetAttr)(void);
+    void (*consio_SetAttr)(int attr);
+    void (*consio_GotoXY)(int x, int y);
+    void (*consio_WhereXY)(int *x, int *y);
+    void (*consio_GetWindow)(int *x, int *y, int *width, int *height);
+    int (*consio_KbHit)(void);
+    int (*consio_ReadKey)(int timeout, int *ch);
+} ConsioStubs;
+
+#ifdef USE_CONSIO_STUBS
+
+extern const ConsioStubs *consioStubsPtr;
+
+const char *Consio_InitStubs(Tcl_Interp *interp, const char *version, int exact);
+
+#define Consio_PutCell    (consioStubsPtr->consio_PutCell)
+#define Consio_PutSpan    (consioStubsPtr->consio_PutSpan)
+#define Consio_PutRect    (consioStubsPtr->consio_PutRect)
+#define Consio_FillRect   (consioStubsPtr->consio_FillRect)
+#define Consio_ScrollRect (consioStubsPtr->consio_ScrollRect)
+#define Consio_GetAttr    (consioStubsPtr->consio_GetAttr)
+#define Consio_SetAttr    (consioStubsPtr->consio_SetAttr)
+#define Consio_GotoXY     (consioStubsPtr->consio_GotoXY)
+#define Consio_WhereXY    (consioStubsPtr->consio_WhereXY)
+#define Consio_GetWindow  (consioStubsPtr->consio_GetWindow)
+#define Consio_KbHit      (consioStubsPtr->consio_KbHit)
+#define Consio_ReadKey    (consioStubsPtr->consio_ReadKey)
+
+#endif /*USE_CONSIO_STUBS*/
+
+#endif /*__ConsioDecls_H__*/
@@ -0,0 +1,66 @@
+/*
+ * Title:   Consio - Windows console library, stubs library
+ * Author:  Matti J. Kärki
+ * Date:    2017-06-09
+ * Version: 0.3
+ * Notes:   Linked into extensions that use the C interface of Consio.
+ *          See ConsioDecls.h.
+ */
+
+#ifndef USE_TCL_STUBS
+#define USE_TCL_STUBS
+#endif
+#ifndef USE_CONSIO_STUBS
+#define USE_CONSIO_STUBS
+#endif
+
+#include <tcl.h>
+#include "ConsioDecls.h"
+
+const ConsioStubs *consioStubsPtr = NULL;
+
+/*****************************************************************************
+ * Consio_InitStubs
+ *
+ * Description:
+ *
+ *   Loads the Consio package and sets up the stubs table, so that the
+ *   Consio_* functions of ConsioDecls.h can be called. Tcl_InitStubs must
+ *   have been called before this.
+ *
+ * Parameters:
+ *
+ *   interp  - interpreter
+ *   version - required version of Consio
+ *   exact   - non-zero if exactly that version is required
+ *
+ * Results:
+ *
+ *   Returns the version of Consio actually loaded, or NULL with an error
+ *   message in the interpreter result.
+ *
+ * Side effects:
+ *
+ *   Loads the Consio package into the interpreter.
+ *****************************************************************************/
+
+const char *Consio_InitStubs(Tcl_Interp *interp,
+                             const char *version,
+                             int exact) {
+    const char *actual;
+    ClientData clientData = NULL;
+
+    actual = Tcl_PkgRequireEx(interp, "Consio", version, exact, &clientData);
+    if (actual == NULL) return NULL;
+
+    if (clientData == NULL ||
+        ((const ConsioStubs *) clientData)->magic != CONSIO_STUBS_MAGIC) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "This implementation of Consio does not support stubs", -1));
+        return NULL;
+    }
+
+    consioStubsPtr = (const ConsioStubs *) clientData;
+
+    return actual;
+}